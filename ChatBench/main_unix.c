@@ -0,0 +1,1745 @@
+/******************************************************************************/
+/*                                                                            */
+/* Application: chatbench                                                     */
+/*                                                                            */
+/* File:        main_unix.c                                                   */
+/*                                                                            */
+/* Purpose:     Load generator for the chat servers (PollServer and           */
+/*              SelectServer).  Opens a number of idle connections, then      */
+/*              times how long a message takes to go from one client through  */
+/*              the server to another.  Running it at 100, 1000 and 10000     */
+/*              idle connections shows what a wakeup costs the server as the  */
+/*              number of mostly idle sockets grows.                          */
+/*                                                                            */
+/*              -f sends every message as a length-prefixed frame, for        */
+/*              servers started with -f, which allows messages above 256      */
+/*              bytes.                                                        */
+/*                                                                            */
+/*              -r spreads the idle connections over that many chat rooms     */
+/*              and times PUBLISHes to a room of its own, for PollServer -r.  */
+/*              A server with a subscriber index should show the same         */
+/*              latency however many idle connections there are.              */
+/*                                                                            */
+/*              -z skips the server and measures, over loopback, when         */
+/*              MSG_ZEROCOPY beats copying for the same message sent to       */
+/*              several sockets, as PollServer -z does.  It sweeps message    */
+/*              sizes from 1 KB to 1 MB and prints the threshold to give -z.  */
+/*                                                                            */
+/*              -c is a reconnect storm: -n connections all started at once,  */
+/*              timed until the server has accepted every one of them.        */
+/*                                                                            */
+/*              -u connects over a Unix domain socket at that path instead of */
+/*              TCP, for PollServer -l, so the two can be compared.           */
+/*                                                                            */
+/*              -M (with -u and -r) has the timed receiver MAP the bench      */
+/*              room instead of joining it, for PollServer -M, and read the   */
+/*              timed messages from the room's ring in shared memory rather   */
+/*              than from its socket.                                         */
+/*                                                                            */
+/*              -b times bursts instead of single messages: that many         */
+/*              senders each send a message at once and the receiver waits    */
+/*              for all of them, which is the load PollServer coalesces into  */
+/*              one write per client.                                         */
+/*                                                                            */
+/*              -S adds that many stalled readers: connections that are sent  */
+/*              every broadcast but never read, so their socket buffers fill  */
+/*              and the server has to hold or block on what they are sent.    */
+/*                                                                            */
+/*              -g times Server instead of a chat server: that many client    */
+/*              threads each connect, read the greeting until the server      */
+/*              closes and go again, -m connections in all, and the latency   */
+/*              tail is printed.                                              */
+/*                                                                            */
+/* Usage:       chatbench [-h host] [-p port] [-u path] [-n idle]             */
+/*                        [-m messages] [-s size] [-f] [-r rooms] [-M] [-z]   */
+/*                        [-c] [-b burst] [-S stalled] [-g clients]           */
+/*                                                                            */
+/* Modifications:                                                             */
+/*                                                                            */
+/*           Name           Date                     Reason                   */
+/*    ------------------ ---------- ----------------------------------------- */
+/*    Steven C. Mitchell 2026-10-17 Orignal creation                          */
+/*    Steven C. Mitchell 2026-10-17 Framed messages (-f)                      */
+/*    Steven C. Mitchell 2026-10-17 Chat room mode (-r)                       */
+/*    Steven C. Mitchell 2026-10-17 Zero-copy threshold sweep (-z)            */
+/*    Steven C. Mitchell 2026-10-17 Reconnect storm (-c)                      */
+/*    Steven C. Mitchell 2026-10-17 Unix domain socket client (-u)            */
+/*    Steven C. Mitchell 2026-10-17 Read a mapped room ring (-M)              */
+/*    Steven C. Mitchell 2026-10-17 Bursts from several senders (-b)          */
+/*    Steven C. Mitchell 2026-10-17 Stalled readers (-S)                      */
+/*    Steven C. Mitchell 2026-10-17 Greeting bench for Server (-g)            */
+/*                                                                            */
+/******************************************************************************/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <linux/errqueue.h>
+#include <linux/futex.h>
+
+#define PORT "9034"     // Port the chat server listens on
+#define MAX_EVENTS 256  // Ready descriptors returned by one epoll_wait
+#define FRAME_HEADER 4  // Big-endian payload length before a frame
+#define FRAME_MAX (1 << 20) // Largest payload sent with -f
+#define BENCH_ROOM "PUBLISH bench " // Start of every timed message with -r
+#define ZC_RECEIVERS 8          // Sockets each message goes to in the sweep
+#define ZC_MIN_SIZE  1024       // Smallest message in the sweep
+#define ZC_MAX_SIZE  (1 << 20)  // Largest
+#define ZC_BYTES     (64 << 20) // Bytes sent to each socket per size and mode
+#define HISTORY_BYTES (1 << 20) // Ring size, as in PollServer
+#define HISTORY_INDEX 1024      // Frame positions kept, as in PollServer
+#define RING_SPINS    100000    // Looks at an idle ring before sleeping (SMP)
+/*                                                                            */
+/* Idle clients still receive every broadcast.  A thread reads and throws     */
+/* the data away so their receive buffers never fill and stall the server:    */
+/*                                                                            */
+struct drain_info
+{
+    int           i_epfd;     // epoll instance holding the idle clients
+    volatile int  i_stop;     // Set to ask the thread to finish
+};
+/*                                                                            */
+/* One client thread of the greeting bench (-g) and the connections it times: */
+/*                                                                            */
+struct greet_info
+{
+    struct addrinfo *ps_ai;      // Server address
+    double          *nd_latency; // Connect to close, one per connection
+    int               i_count;   // Connections to make
+    int               i_failed;  // Connections without the whole greeting
+    pthread_t         t_thread;
+};
+
+/*                                                                            */
+/* A room's ring as PollServer lays it out (see PollServer/main_unix.c).  The */
+/* bench only reads it:                                                       */
+/*                                                                            */
+struct history
+{
+    char      ac_magic[8];
+    uint32_t  u32_size;
+    uint32_t  u32_index;
+    uint64_t  u64_count;    // Frames ever appended
+    uint64_t  u64_end;      // Position after the newest frame
+    uint32_t  u32_seq;      // Futex word, bumped on every append once mapped
+    uint32_t  u32_mapped;
+    uint64_t  au64_index[HISTORY_INDEX]; // [n % HISTORY_INDEX] frame n starts
+};
+
+#define HISTORY_DATA ((sizeof(struct history) + 4095) & ~(size_t)4095)
+
+int    compare_doubles(const void*, const void*);
+int    connect_to_server(char*, char*);
+void  *drain_thread(void*);
+int    greet_run(char*, char*, int, int);
+void  *greet_thread(void*);
+double now_usec(void);
+void   raise_fd_limit(void);
+int    receive_exactly(int, char*, int, int);
+void   report_error(char*, int);
+struct history *ring_map(int);
+int    ring_read(struct history*, uint64_t*, char*, int, int);
+int    send_frame(int, char*);
+int    storm_run(char*, char*, int, char*, int);
+int    zerocopy_reap(int, unsigned*, long*);
+double zerocopy_run(int*, unsigned*, char*, int, int, long*);
+int    zerocopy_sweep(void);
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+int main
+(
+    int    argc,
+    char  *argv[]
+)
+{
+    char               ac_command[32];
+    char              *nc_buf;
+    double            *nd_latency;
+    double              d_start;
+    double              d_total;
+    struct drain_info   s_drain;
+    struct epoll_event  s_event;
+    char              *nc_host;
+    int                 i_burst;
+    int                 i_burst_lc;
+    int                 i_framed;
+    int                 i_greet;
+    int                 i_idle;
+    int                *ni_idle_fds;
+    int                 i_lc;
+    int                 i_messages;
+    int                 i_opt;
+    char              *nc_port;
+    struct history    *ps_ring;
+    int                 i_mapped;
+    int                 i_receiver;
+    int                 i_rooms;
+    int                 i_sender;
+    int                 i_size;
+    int                 i_stalled;
+    int                *ni_stalled_fds;
+    int                 i_storm;
+    int                 i_wire;
+    pthread_t           t_drain;
+    uint64_t            u64_next;
+
+    nc_host = "127.0.0.1";
+    nc_port = PORT;
+    i_idle = 100;
+    i_messages = 10000;
+    i_size = 64;
+    i_framed = 0;
+    i_rooms = 0;
+    i_storm = 0;
+    i_mapped = 0;
+    i_burst = 1;
+    i_stalled = 0;
+    i_greet = 0;
+    ps_ring = NULL;
+    u64_next = 0;
+
+    while ((i_opt = getopt(argc, argv, "b:cg:h:p:u:n:m:s:S:fr:Mz")) != -1)
+    {
+        switch (i_opt)
+        {
+        case 'b': i_burst = atoi(optarg); break;
+        case 'c': i_storm = 1; break;
+        case 'g': i_greet = atoi(optarg); break;
+        case 'h': nc_host = optarg; break;
+        case 'p': nc_port = optarg; break;
+        case 'u': nc_host = optarg; nc_port = NULL; break;
+        case 'n': i_idle = atoi(optarg); break;
+        case 'm': i_messages = atoi(optarg); break;
+        case 's': i_size = atoi(optarg); break;
+        case 'S': i_stalled = atoi(optarg); break;
+        case 'f': i_framed = 1; break;
+        case 'r': i_rooms = atoi(optarg); break;
+        case 'M': i_mapped = 1; break;
+        case 'z': return zerocopy_sweep();
+        default:
+            fprintf(stderr, "usage: chatbench [-h host] [-p port] [-u path] "
+                "[-n idle] [-m messages] [-s size]\n"
+                "                 [-f] [-r rooms] [-M] [-z] [-c] "
+                "[-b burst] [-S stalled]\n"
+                "                 [-g clients]\n");
+
+            return 1;
+        }
+    }
+/*                                                                            */
+/* The chat servers read at most 256 bytes at a time unless they reassemble   */
+/* frames:                                                                    */
+/*                                                                            */
+    if (i_size < 1 || i_size > (i_framed ? FRAME_MAX : 256) ||
+        i_messages < 1 || i_idle < 0 || i_burst < 1 || i_stalled < 0)
+    {
+        fprintf(stderr, "chatbench: size must be 1-%d and counts positive.\n",
+            i_framed ? FRAME_MAX : 256);
+
+        return 1;
+    }
+/*                                                                            */
+/* Room commands are frames, and every timed message starts with the PUBLISH  */
+/* command for the bench room:                                                */
+/*                                                                            */
+    if (i_storm && (i_rooms > 0 || i_burst > 1))
+    {
+        fprintf(stderr, "chatbench: -c cannot be used with -r or -b.\n");
+
+        return 1;
+    }
+/*                                                                            */
+/* The storm connects with TCP addresses of its own:                          */
+/*                                                                            */
+    if (i_storm && nc_port == NULL)
+    {
+        fprintf(stderr, "chatbench: -c and -u cannot be used together.\n");
+
+        return 1;
+    }
+
+    if (nc_port == NULL &&
+        strlen(nc_host) >= sizeof(((struct sockaddr_un*)0)->sun_path))
+    {
+        fprintf(stderr, "chatbench: -u path too long.\n");
+
+        return 1;
+    }
+
+    if (i_rooms < 0 || (i_rooms > 0 && (!i_framed ||
+        i_size <= (int)strlen(BENCH_ROOM))))
+    {
+        fprintf(stderr, "chatbench: -r needs -f and a size over %d.\n",
+            (int)strlen(BENCH_ROOM));
+
+        return 1;
+    }
+
+/*                                                                            */
+/* Rings are handed out over the Unix socket, and PollServer leaves messages  */
+/* over a quarter of the ring out of it:                                      */
+/*                                                                            */
+    if (i_mapped && (i_rooms == 0 || nc_port != NULL ||
+        FRAME_HEADER + i_size > HISTORY_BYTES / 4))
+    {
+        fprintf(stderr, "chatbench: -M needs -u, -r and a size up to %d.\n",
+            HISTORY_BYTES / 4 - FRAME_HEADER);
+
+        return 1;
+    }
+
+/*                                                                            */
+/* The greeting bench times Server's connections instead of chat messages:    */
+/*                                                                            */
+    if (i_greet != 0)
+    {
+        if (i_greet < 0 || nc_port == NULL)
+        {
+            fprintf(stderr, "chatbench: -g needs a positive count and TCP.\n");
+
+            return 1;
+        }
+
+        return greet_run(nc_host, nc_port, i_greet, i_messages);
+    }
+
+    raise_fd_limit();
+
+    i_wire = i_framed ? FRAME_HEADER + i_size : i_size;
+    nc_buf = malloc(i_wire);
+    nd_latency = malloc(sizeof(double) * i_messages);
+    ni_idle_fds = malloc(sizeof(int) * (i_idle + i_burst));
+    ni_stalled_fds = malloc(sizeof(int) * (i_stalled + 1));
+
+    if (nc_buf == NULL || nd_latency == NULL || ni_idle_fds == NULL ||
+        ni_stalled_fds == NULL)
+    {
+        fprintf(stderr, "chatbench: out of memory.\n");
+
+        return 2;
+    }
+
+    memset(nc_buf, 'x', i_wire);
+
+    if (i_framed)
+    {
+        nc_buf[0] = (char)(i_size >> 24);
+        nc_buf[1] = (char)(i_size >> 16);
+        nc_buf[2] = (char)(i_size >> 8);
+        nc_buf[3] = (char)i_size;
+    }
+
+    if (i_rooms > 0)
+    {
+        memcpy(nc_buf + FRAME_HEADER, BENCH_ROOM, strlen(BENCH_ROOM));
+    }
+/*                                                                            */
+/* A reconnect storm times the server's accepts instead of its messages:      */
+/*                                                                            */
+    if (i_storm)
+    {
+        i_lc = storm_run(nc_host, nc_port, i_idle, nc_buf, i_wire);
+
+        free(nc_buf);
+        free(nd_latency);
+        free(ni_idle_fds);
+        free(ni_stalled_fds);
+
+        return i_lc;
+    }
+/*                                                                            */
+/* Open the idle connections and hand them to the drain thread:               */
+/*                                                                            */
+    s_drain.i_epfd = epoll_create1(0);
+    s_drain.i_stop = 0;
+
+    if (s_drain.i_epfd == -1)
+    {
+        report_error("epoll_create1", errno);
+
+        return 2;
+    }
+
+    for (i_lc = 0; i_lc < i_idle; i_lc++)
+    {
+        ni_idle_fds[i_lc] = connect_to_server(nc_host, nc_port);
+
+        if (ni_idle_fds[i_lc] == -1)
+        {
+            fprintf(stderr, "chatbench: only %d idle connections opened.\n",
+                i_lc);
+
+            return 3;
+        }
+/*                                                                            */
+/* With -r the idle connections share out the other rooms, so none of them    */
+/* is sent the timed messages:                                                */
+/*                                                                            */
+        if (i_rooms > 0)
+        {
+            snprintf(ac_command, sizeof(ac_command), "JOIN idle%d",
+                i_lc % i_rooms);
+
+            if (send_frame(ni_idle_fds[i_lc], ac_command) == -1)
+            {
+                return 3;
+            }
+        }
+
+        memset(&s_event, 0, sizeof(s_event));
+        s_event.events = EPOLLIN;
+        s_event.data.fd = ni_idle_fds[i_lc];
+        epoll_ctl(s_drain.i_epfd, EPOLL_CTL_ADD, ni_idle_fds[i_lc], &s_event);
+    }
+
+/*                                                                            */
+/* Stalled readers are sent every broadcast too but never read, and are left  */
+/* out of the drain thread.  A small receive buffer fills them sooner; after  */
+/* that everything sent to them waits in the server:                          */
+/*                                                                            */
+    for (i_lc = 0; i_lc < i_stalled; i_lc++)
+    {
+        ni_stalled_fds[i_lc] = connect_to_server(nc_host, nc_port);
+
+        if (ni_stalled_fds[i_lc] == -1)
+        {
+            fprintf(stderr, "chatbench: only %d stalled connections "
+                "opened.\n", i_lc);
+
+            return 3;
+        }
+
+        i_opt = 4096;
+        setsockopt(ni_stalled_fds[i_lc], SOL_SOCKET, SO_RCVBUF, &i_opt,
+            sizeof(i_opt));
+    }
+
+    if (pthread_create(&t_drain, NULL, drain_thread, &s_drain) != 0)
+    {
+        fprintf(stderr, "chatbench: unable to start the drain thread.\n");
+
+        return 2;
+    }
+/*                                                                            */
+/* The two clients being timed:                                               */
+/*                                                                            */
+    i_sender = connect_to_server(nc_host, nc_port);
+    i_receiver = connect_to_server(nc_host, nc_port);
+
+    if (i_sender == -1 || i_receiver == -1)
+    {
+        return 3;
+    }
+/*                                                                            */
+/* With -b the other senders of a burst follow the idle connections in        */
+/* ni_idle_fds.  Every sender is sent the others' messages, so the drain      */
+/* thread reads them all:                                                     */
+/*                                                                            */
+    for (i_lc = i_idle; i_lc < i_idle + i_burst && i_burst > 1; i_lc++)
+    {
+        ni_idle_fds[i_lc] = i_lc == i_idle ? i_sender :
+            connect_to_server(nc_host, nc_port);
+
+        if (ni_idle_fds[i_lc] == -1)
+        {
+            return 3;
+        }
+
+        memset(&s_event, 0, sizeof(s_event));
+        s_event.events = EPOLLIN;
+        s_event.data.fd = ni_idle_fds[i_lc];
+        epoll_ctl(s_drain.i_epfd, EPOLL_CTL_ADD, ni_idle_fds[i_lc], &s_event);
+    }
+
+    if (i_mapped)
+    {
+        ps_ring = ring_map(i_receiver);
+
+        if (ps_ring == NULL)
+        {
+            return 3;
+        }
+
+        u64_next = __atomic_load_n(&ps_ring->u64_count, __ATOMIC_ACQUIRE);
+    }
+    else if (i_rooms > 0 && send_frame(i_receiver, "JOIN bench") == -1)
+    {
+        return 3;
+    }
+/*                                                                            */
+/* Keep sending until the receiver hears something.  That proves the server   */
+/* has accepted every connection before the clock starts:                     */
+/*                                                                            */
+    for (;;)
+    {
+        send(i_sender, nc_buf, i_wire, MSG_NOSIGNAL);
+
+        if (ps_ring != NULL ?
+            ring_read(ps_ring, &u64_next, nc_buf, i_wire, 200) == 0 :
+            receive_exactly(i_receiver, nc_buf, i_wire, 200) == 0)
+        {
+            break;
+        }
+    }
+
+    while (ps_ring != NULL ?
+        ring_read(ps_ring, &u64_next, nc_buf, i_wire, 200) == 0 :
+        receive_exactly(i_receiver, nc_buf, i_wire, 200) == 0)
+    {
+        ; // Throw away anything left over from the warm up
+    }
+/*                                                                            */
+/* Time each message from send to the receiver having all of it:              */
+/*                                                                            */
+    printf("chatbench: %d idle connections", i_idle);
+
+    if (i_stalled > 0)
+    {
+        printf(", %d stalled", i_stalled);
+    }
+
+    if (i_rooms > 0)
+    {
+        printf(" in %d rooms", i_rooms);
+    }
+
+    if (ps_ring != NULL)
+    {
+        printf(", read from the mapped ring");
+    }
+
+    printf(", %d %s%smessages of %d bytes", i_messages,
+        i_burst > 1 ? "bursts of " : "", i_framed ? "framed " : "", i_size);
+
+    if (i_burst > 1)
+    {
+        printf(" from %d senders", i_burst);
+    }
+
+    printf("\n");
+/*                                                                            */
+/* A burst is timed from its first send to the receiver having all of it:     */
+/*                                                                            */
+    d_total = now_usec();
+
+    for (i_lc = 0; i_lc < i_messages; i_lc++)
+    {
+        d_start = now_usec();
+
+        for (i_burst_lc = 0; i_burst_lc < i_burst; i_burst_lc++)
+        {
+            if (send(i_burst > 1 ? ni_idle_fds[i_idle + i_burst_lc] :
+                i_sender, nc_buf, i_wire, MSG_NOSIGNAL) != i_wire)
+            {
+                fprintf(stderr, "chatbench: message %d was not sent.\n",
+                    i_lc);
+
+                return 4;
+            }
+        }
+
+        for (i_burst_lc = 0; i_burst_lc < i_burst; i_burst_lc++)
+        {
+            if ((ps_ring != NULL ?
+                ring_read(ps_ring, &u64_next, nc_buf, i_wire, 5000) :
+                receive_exactly(i_receiver, nc_buf, i_wire, 5000)) != 0)
+            {
+                fprintf(stderr, "chatbench: message %d was lost.\n", i_lc);
+
+                return 4;
+            }
+        }
+
+        nd_latency[i_lc] = now_usec() - d_start;
+    }
+
+    d_total = now_usec() - d_total;
+/*                                                                            */
+/* Report:                                                                    */
+/*                                                                            */
+    qsort(nd_latency, i_messages, sizeof(double), compare_doubles);
+
+    printf("chatbench: %.0f messages/s, latency usec p50 %.1f p99 %.1f "
+        "max %.1f\n",
+        (double)i_messages * i_burst / (d_total / 1e6),
+        nd_latency[i_messages / 2],
+        nd_latency[(int)(i_messages * 0.99)],
+        nd_latency[i_messages - 1]);
+/*                                                                            */
+/* Cleanup:                                                                   */
+/*                                                                            */
+    s_drain.i_stop = 1;
+    pthread_join(t_drain, NULL);
+
+    for (i_lc = 0; i_lc < i_idle + (i_burst > 1 ? i_burst : 0); i_lc++)
+    {
+        if (ni_idle_fds[i_lc] != i_sender)
+        {
+            close(ni_idle_fds[i_lc]);
+        }
+    }
+
+    for (i_lc = 0; i_lc < i_stalled; i_lc++)
+    {
+        close(ni_stalled_fds[i_lc]);
+    }
+
+    if (ps_ring != NULL)
+    {
+        munmap(ps_ring, HISTORY_DATA + HISTORY_BYTES);
+    }
+
+    close(i_sender);
+    close(i_receiver);
+    close(s_drain.i_epfd);
+    free(nc_buf);
+    free(nd_latency);
+    free(ni_idle_fds);
+    free(ni_stalled_fds);
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* qsort comparison for latencies:                                            */
+/*                                                                            */
+int compare_doubles
+(
+    const void *p_a,
+    const void *p_b
+)
+{
+    double d_a;
+    double d_b;
+
+    d_a = *(const double*)p_a;
+    d_b = *(const double*)p_b;
+
+    return (d_a > d_b) - (d_a < d_b);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Connect to the chat server.  Without a port the host is the path of the    */
+/* server's Unix socket (-u).  Returns the socket or -1:                      */
+/*                                                                            */
+int connect_to_server
+(
+    char *nc_host, /* in   - Host name or address of the server, or a path    */
+    char *nc_port  /* in   - Port of the server, NULL for a Unix socket       */
+)
+{
+    struct addrinfo    *ps_address;
+    struct addrinfo    *ps_ai;
+    struct addrinfo     s_hints;
+    struct sockaddr_un  s_local;
+    int                 i_errno;
+    int                 i_sockfd;
+    int                 i_status;
+    int                 i_yes;
+
+    if (nc_port == NULL)
+    {
+        memset(&s_local, 0, sizeof(s_local));
+        s_local.sun_family = AF_UNIX;
+        strcpy(s_local.sun_path, nc_host);
+
+        errno = 0;
+        i_sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+        if (i_sockfd == -1 || connect(i_sockfd, (struct sockaddr*)&s_local,
+            sizeof(s_local)) == -1)
+        {
+            report_error("connect", errno);
+
+            if (i_sockfd != -1)
+            {
+                close(i_sockfd);
+            }
+
+            return -1;
+        }
+
+        return i_sockfd;
+    }
+
+    memset(&s_hints, 0, sizeof(s_hints));
+
+    s_hints.ai_family = AF_UNSPEC;
+    s_hints.ai_socktype = SOCK_STREAM;
+
+    i_status = getaddrinfo(nc_host, nc_port, &s_hints, &ps_ai);
+
+    if (i_status != 0)
+    {
+        fprintf(stderr, "getaddrinfo failed with code %d.\n", i_status);
+        fprintf(stderr, "%s\n", gai_strerror(i_status));
+
+        return -1;
+    }
+
+    i_sockfd = -1;
+    i_errno = 0;
+
+    for (ps_address = ps_ai;
+        ps_address != NULL;
+        ps_address = ps_address->ai_next)
+    {
+        i_sockfd = socket(ps_address->ai_family, ps_address->ai_socktype,
+            ps_address->ai_protocol);
+
+        if (i_sockfd == -1)
+        {
+            i_errno = errno;
+
+            continue;
+        }
+
+        if (connect(i_sockfd, ps_address->ai_addr,
+            ps_address->ai_addrlen) == -1)
+        {
+            i_errno = errno;
+            close(i_sockfd);
+            i_sockfd = -1;
+
+            continue;
+        }
+
+        break;
+    }
+
+    freeaddrinfo(ps_ai);
+
+    if (i_sockfd == -1)
+    {
+        report_error("connect", i_errno);
+
+        return -1;
+    }
+/*                                                                            */
+/* Small messages should leave as soon as they are written:                   */
+/*                                                                            */
+    i_yes = 1;
+    setsockopt(i_sockfd, IPPROTO_TCP, TCP_NODELAY, &i_yes, sizeof(i_yes));
+
+    return i_sockfd;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Read and discard whatever the idle clients are sent:                       */
+/*                                                                            */
+void *drain_thread
+(
+    void *p_arg /* in   - struct drain_info                                   */
+)
+{
+    char                ac_buf[65536];
+    struct epoll_event as_events[MAX_EVENTS];
+    struct drain_info *ps_drain;
+    int                 i_ready;
+    int                 i;
+
+    ps_drain = (struct drain_info*)p_arg;
+
+    while (!ps_drain->i_stop)
+    {
+        i_ready = epoll_wait(ps_drain->i_epfd, as_events, MAX_EVENTS, 100);
+
+        for (i = 0; i < i_ready; i++)
+        {
+            if (recv(as_events[i].data.fd, ac_buf, sizeof(ac_buf),
+                MSG_DONTWAIT) == 0)
+            {
+                epoll_ctl(ps_drain->i_epfd, EPOLL_CTL_DEL,
+                    as_events[i].data.fd, NULL);
+            }
+        }
+    }
+
+    return NULL;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Greeting bench (-g): i_clients threads each connect to Server, read until  */
+/* it closes and connect again, i_total connections in all; the first         */
+/* i_total % i_clients threads make one more than the rest.  Each is timed    */
+/* from connect to close, which is what a slow handler ahead of it in the     */
+/* server's queue costs.  Returns 0 or the exit status for main:              */
+/*                                                                            */
+int greet_run
+(
+    char *nc_host,    /* in   - Host name or address of the server            */
+    char *nc_port,    /* in   - Port of the server                            */
+    int    i_clients, /* in   - Client threads                                */
+    int    i_total    /* in   - Connections in all                            */
+)
+{
+    struct addrinfo   *ps_ai;
+    struct addrinfo     s_hints;
+    struct greet_info *ns_greet;
+    double            *nd_latency;
+    double              d_total;
+    int                 i_count;
+    int                 i_failed;
+    int                 i_lc;
+    int                 i_started;
+    int                 i_status;
+
+    if (i_total < i_clients)
+    {
+        fprintf(stderr, "chatbench: -m must be at least -g.\n");
+
+        return 2;
+    }
+
+    memset(&s_hints, 0, sizeof(s_hints));
+
+    s_hints.ai_family = AF_UNSPEC;
+    s_hints.ai_socktype = SOCK_STREAM;
+
+    i_status = getaddrinfo(nc_host, nc_port, &s_hints, &ps_ai);
+
+    if (i_status != 0)
+    {
+        fprintf(stderr, "getaddrinfo failed with code %d.\n", i_status);
+        fprintf(stderr, "%s\n", gai_strerror(i_status));
+
+        return 3;
+    }
+
+    ns_greet = malloc(sizeof(struct greet_info) * i_clients);
+    nd_latency = malloc(sizeof(double) * i_total);
+
+    if (ns_greet == NULL || nd_latency == NULL)
+    {
+        fprintf(stderr, "chatbench: out of memory.\n");
+        freeaddrinfo(ps_ai);
+        free(ns_greet);
+        free(nd_latency);
+
+        return 2;
+    }
+/*                                                                            */
+/* Start the clients together and wait for all of them.  If one cannot be     */
+/* started, the ones that were are still writing into nd_latency, so they are */
+/* joined before anything is freed:                                           */
+/*                                                                            */
+    d_total = now_usec();
+    i_count = 0;
+    i_status = 0;
+
+    for (i_started = 0; i_started < i_clients; i_started++)
+    {
+        ns_greet[i_started].ps_ai = ps_ai;
+        ns_greet[i_started].nd_latency = nd_latency + i_count;
+        ns_greet[i_started].i_count = i_total / i_clients +
+            (i_started < i_total % i_clients);
+        ns_greet[i_started].i_failed = 0;
+        i_count += ns_greet[i_started].i_count;
+
+        if (pthread_create(&ns_greet[i_started].t_thread, NULL, greet_thread,
+            &ns_greet[i_started]) != 0)
+        {
+            fprintf(stderr, "chatbench: unable to start client %d.\n",
+                i_started);
+            i_status = 2;
+
+            break;
+        }
+    }
+
+    i_failed = 0;
+
+    for (i_lc = 0; i_lc < i_started; i_lc++)
+    {
+        pthread_join(ns_greet[i_lc].t_thread, NULL);
+        i_failed += ns_greet[i_lc].i_failed;
+    }
+
+    d_total = now_usec() - d_total;
+
+    if (i_status != 0)
+    {
+        freeaddrinfo(ps_ai);
+        free(ns_greet);
+        free(nd_latency);
+
+        return i_status;
+    }
+/*                                                                            */
+/* Report:                                                                    */
+/*                                                                            */
+    qsort(nd_latency, i_total, sizeof(double), compare_doubles);
+
+    printf("chatbench: %d connections from %d clients, %d failed\n",
+        i_total, i_clients, i_failed);
+    printf("chatbench: %.0f connections/s, latency usec p50 %.1f p99 %.1f "
+        "p99.9 %.1f max %.1f\n",
+        i_total / (d_total / 1e6),
+        nd_latency[i_total / 2],
+        nd_latency[(int)(i_total * 0.99)],
+        nd_latency[(int)(i_total * 0.999)],
+        nd_latency[i_total - 1]);
+
+    freeaddrinfo(ps_ai);
+    free(ns_greet);
+    free(nd_latency);
+
+    return i_failed == 0 ? 0 : 4;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* One client of the greeting bench: connect, read the greeting until the     */
+/* server closes, close and go again:                                         */
+/*                                                                            */
+void *greet_thread
+(
+    void *p_arg /* both - struct greet_info                                   */
+)
+{
+    char               ac_buf[64];
+    struct greet_info *ps_greet;
+    double              d_start;
+    int                 i_lc;
+    int                 i_nbytes;
+    int                 i_rv;
+    int                 i_sockfd;
+
+    ps_greet = (struct greet_info*)p_arg;
+
+    for (i_lc = 0; i_lc < ps_greet->i_count; i_lc++)
+    {
+        d_start = now_usec();
+        i_nbytes = 0;
+        i_sockfd = socket(ps_greet->ps_ai->ai_family,
+            ps_greet->ps_ai->ai_socktype, ps_greet->ps_ai->ai_protocol);
+
+        if (i_sockfd != -1 && connect(i_sockfd, ps_greet->ps_ai->ai_addr,
+            ps_greet->ps_ai->ai_addrlen) == 0)
+        {
+            while ((i_rv = recv(i_sockfd, ac_buf + i_nbytes,
+                sizeof(ac_buf) - i_nbytes, 0)) > 0)
+            {
+                i_nbytes += i_rv;
+            }
+        }
+
+        if (i_nbytes != 13) // "Hello, world!"
+        {
+            ps_greet->i_failed++;
+        }
+
+        if (i_sockfd != -1)
+        {
+            close(i_sockfd);
+        }
+
+        ps_greet->nd_latency[i_lc] = now_usec() - d_start;
+    }
+
+    return NULL;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Current time in microseconds:                                              */
+/*                                                                            */
+double now_usec
+(
+    void
+)
+{
+    struct timespec s_ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &s_ts);
+
+    return s_ts.tv_sec * 1e6 + s_ts.tv_nsec / 1e3;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Ten thousand connections need more descriptors than the usual soft limit:  */
+/*                                                                            */
+void raise_fd_limit
+(
+    void
+)
+{
+    struct rlimit s_limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &s_limit) == 0)
+    {
+        s_limit.rlim_cur = s_limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &s_limit);
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Read exactly i_size bytes.  Returns 0 on success or -1 on timeout/error:   */
+/*                                                                            */
+int receive_exactly
+(
+    int    i_sockfd,  /* in   - Socket to read                                */
+    char *nc_buf,     /* out  - Where to put the data                         */
+    int    i_size,    /* in   - Number of bytes wanted                        */
+    int    i_timeout  /* in   - Milliseconds to wait for each piece           */
+)
+{
+    struct pollfd s_pfd;
+    int           i_got;
+    int           i_nbytes;
+
+    i_got = 0;
+
+    while (i_got < i_size)
+    {
+        s_pfd.fd = i_sockfd;
+        s_pfd.events = POLLIN;
+
+        if (poll(&s_pfd, 1, i_timeout) != 1)
+        {
+            return -1;
+        }
+
+        i_nbytes = recv(i_sockfd, nc_buf + i_got, i_size - i_got, 0);
+
+        if (i_nbytes <= 0)
+        {
+            return -1;
+        }
+
+        i_got += i_nbytes;
+    }
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Print the message for an errno value:                                      */
+/*                                                                            */
+void report_error
+(
+    char *nc_function, /* in   - Function that failed                         */
+    int    i_errno     /* in   - errno it left behind                         */
+)
+{
+    fprintf(stderr, "%s failed with code %d.\n", nc_function, i_errno);
+    fprintf(stderr, "%s\n", strerror(i_errno));
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Ask the server for the bench room's ring with MAP and map the read-only    */
+/* descriptor that comes back with the reply.  Returns the mapping or NULL:   */
+/*                                                                            */
+struct history *ring_map
+(
+    int i_sockfd /* in   - Unix socket to the server                          */
+)
+{
+    union
+    {
+        char            ac_buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr s_align;
+    }                 u_control;
+    char              ac_reply[FRAME_HEADER + 64];
+    struct iovec      s_iov;
+    struct msghdr     s_msg;
+    struct cmsghdr  *ps_cmsg;
+    struct history  *ps_ring;
+    int               i_fd;
+    int               i_nbytes;
+
+    if (send_frame(i_sockfd, "MAP bench") == -1)
+    {
+        return NULL;
+    }
+/*                                                                            */
+/* The descriptor arrives with the first byte of the reply, which is short    */
+/* enough to come in one piece:                                               */
+/*                                                                            */
+    memset(&s_msg, 0, sizeof(s_msg));
+    s_iov.iov_base = ac_reply;
+    s_iov.iov_len = sizeof(ac_reply);
+    s_msg.msg_iov = &s_iov;
+    s_msg.msg_iovlen = 1;
+    s_msg.msg_control = u_control.ac_buf;
+    s_msg.msg_controllen = sizeof(u_control.ac_buf);
+
+    errno = 0;
+    i_nbytes = recvmsg(i_sockfd, &s_msg, MSG_CMSG_CLOEXEC);
+
+    if (i_nbytes <= 0)
+    {
+        report_error("recvmsg", errno);
+
+        return NULL;
+    }
+
+    ps_cmsg = CMSG_FIRSTHDR(&s_msg);
+
+    if (i_nbytes < FRAME_HEADER + 7 ||
+        memcmp(ac_reply + FRAME_HEADER, "MAPPED ", 7) != 0 ||
+        ps_cmsg == NULL || ps_cmsg->cmsg_level != SOL_SOCKET ||
+        ps_cmsg->cmsg_type != SCM_RIGHTS)
+    {
+        fprintf(stderr, "chatbench: the server did not map the room (is it "
+            "running with -M?)\n");
+
+        return NULL;
+    }
+
+    memcpy(&i_fd, CMSG_DATA(ps_cmsg), sizeof(int));
+
+    errno = 0;
+    ps_ring = mmap(NULL, HISTORY_DATA + HISTORY_BYTES, PROT_READ, MAP_SHARED,
+        i_fd, 0);
+
+    if (ps_ring == MAP_FAILED)
+    {
+        report_error("mmap", errno);
+        close(i_fd);
+
+        return NULL;
+    }
+
+    close(i_fd); // The mapping stays
+
+    if (ps_ring->u32_size != HISTORY_BYTES ||
+        ps_ring->u32_index != HISTORY_INDEX)
+    {
+        fprintf(stderr, "chatbench: the ring is not laid out as expected\n");
+        munmap(ps_ring, HISTORY_DATA + HISTORY_BYTES);
+
+        return NULL;
+    }
+
+    return ps_ring;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Copy the next frame out of a mapped ring.  While frames keep coming this   */
+/* is only loads from shared memory; once the ring has been idle for          */
+/* RING_SPINS looks the reader sleeps on u32_seq, which the server bumps and  */
+/* wakes on every append.  On one CPU spinning only keeps the server from     */
+/* running, so there the reader sleeps straight away.  The server never       */
+/* waits for a reader, so a frame is checked again after it is copied: if the */
+/* writer has since lapped it the copy may be torn, and the reader skips to   */
+/* the newest frame instead.                                                  */
+/* Returns 0, -1 if nothing came in time or -2 if frames were lost:           */
+/*                                                                            */
+int ring_read
+(
+    struct history *ps_ring,   /* in   - Mapped ring                          */
+    uint64_t       *pu64_next, /* both - Number of the next frame to read     */
+    char           *nc_buf,    /* out  - The frame, header included           */
+    int              i_size,   /* in   - Bytes in nc_buf                      */
+    int              i_timeout /* in   - Milliseconds to wait                 */
+)
+{
+    static long      sl_spins = -1;
+    struct timespec  s_wait;
+    unsigned char  *nuc_frame;
+    double           d_deadline;
+    long             l_len;
+    uint64_t         u64_count;
+    uint64_t         u64_pos;
+    uint32_t         u32_seq;
+    int              i_spins;
+
+    if (sl_spins == -1)
+    {
+        sl_spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? RING_SPINS : 1;
+    }
+
+    d_deadline = now_usec() + i_timeout * 1000.0;
+    i_spins = 0;
+/*                                                                            */
+/* Wait for frame *pu64_next.  u32_seq is read before u64_count, so a frame   */
+/* appended after the check changes u32_seq and FUTEX_WAIT returns at once:   */
+/*                                                                            */
+    for (;;)
+    {
+        u32_seq = __atomic_load_n(&ps_ring->u32_seq, __ATOMIC_ACQUIRE);
+        u64_count = __atomic_load_n(&ps_ring->u64_count, __ATOMIC_ACQUIRE);
+
+        if (u64_count > *pu64_next)
+        {
+            break;
+        }
+
+        if (++i_spins < sl_spins)
+        {
+            continue;
+        }
+
+        if (now_usec() >= d_deadline)
+        {
+            return -1;
+        }
+
+        s_wait.tv_sec = 0;
+        s_wait.tv_nsec = 10000000; // Check the deadline every 10 ms
+        syscall(SYS_futex, &ps_ring->u32_seq, FUTEX_WAIT, u32_seq, &s_wait,
+            NULL, 0);
+    }
+
+    if (u64_count - *pu64_next >= HISTORY_INDEX / 2)
+    {
+        *pu64_next = u64_count;
+
+        return -2;
+    }
+/*                                                                            */
+/* Copy it, then make sure the writer did not overtake it meanwhile:          */
+/*                                                                            */
+    u64_pos = ps_ring->au64_index[*pu64_next % HISTORY_INDEX];
+    nuc_frame = (unsigned char*)ps_ring + HISTORY_DATA +
+        u64_pos % HISTORY_BYTES;
+    l_len = FRAME_HEADER + (long)((uint32_t)nuc_frame[0] << 24 |
+        (uint32_t)nuc_frame[1] << 16 |
+        (uint32_t)nuc_frame[2] << 8 | (uint32_t)nuc_frame[3]);
+
+    if (l_len > i_size ||
+        (long)(u64_pos % HISTORY_BYTES) + l_len > HISTORY_BYTES)
+    {
+        l_len = 0; // Torn header; caught below
+    }
+
+    memcpy(nc_buf, nuc_frame, l_len);
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+
+    if (l_len == 0 || l_len != i_size ||
+        __atomic_load_n(&ps_ring->u64_end, __ATOMIC_RELAXED) >
+        u64_pos + HISTORY_BYTES ||
+        __atomic_load_n(&ps_ring->u64_count, __ATOMIC_RELAXED) -
+        *pu64_next >= HISTORY_INDEX)
+    {
+        *pu64_next = __atomic_load_n(&ps_ring->u64_count, __ATOMIC_ACQUIRE);
+
+        return -2;
+    }
+
+    (*pu64_next)++;
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Send a text command as one frame.  Returns 0 or -1:                        */
+/*                                                                            */
+int send_frame
+(
+    int    i_sockfd, /* in   - Socket to write                                */
+    char *nc_command /* in   - Command, terminated                            */
+)
+{
+    char ac_frame[FRAME_HEADER + 64];
+    int  i_len;
+
+    i_len = (int)strlen(nc_command);
+
+    ac_frame[0] = 0;
+    ac_frame[1] = 0;
+    ac_frame[2] = 0;
+    ac_frame[3] = (char)i_len;
+    memcpy(ac_frame + FRAME_HEADER, nc_command, i_len);
+
+    if (send(i_sockfd, ac_frame, FRAME_HEADER + i_len, MSG_NOSIGNAL) !=
+        FRAME_HEADER + i_len)
+    {
+        report_error("send", errno);
+
+        return -1;
+    }
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Reconnect storm: open i_count connections at once, the way clients come    */
+/* back after a restart, and time how long the server takes to accept them    */
+/* all.  The connects are non-blocking and all started before any finishes.   */
+/* Once every one has completed, a receiver and then a sender connect and the */
+/* sender sends one message.  A single-threaded server accepts in order, so   */
+/* when the receiver has the message every connection has been accepted.      */
+/* Returns 0 or the exit status:                                              */
+/*                                                                            */
+int storm_run
+(
+    char *nc_host,  /* in   - Host name or address of the server              */
+    char *nc_port,  /* in   - Port of the server                              */
+    int    i_count, /* in   - Connections in the storm                        */
+    char *nc_buf,   /* in   - Message the sender sends                        */
+    int    i_wire   /* in   - Bytes in nc_buf                                 */
+)
+{
+    struct epoll_event  as_events[MAX_EVENTS];
+    struct addrinfo   *ps_ai;
+    struct addrinfo     s_hints;
+    struct epoll_event  s_event;
+    double              d_connected;
+    double              d_end;
+    double              d_start;
+    int                 i_epfd;
+    int                 i_lc;
+    int                 i_pending;
+    int                 i_ready;
+    int                 i_receiver;
+    int                 i_sender;
+    int                 i_status;
+    int                *ni_fds;
+    int                 i;
+
+    memset(&s_hints, 0, sizeof(s_hints));
+
+    s_hints.ai_family = AF_UNSPEC;
+    s_hints.ai_socktype = SOCK_STREAM;
+
+    i_status = getaddrinfo(nc_host, nc_port, &s_hints, &ps_ai);
+
+    if (i_status != 0)
+    {
+        fprintf(stderr, "getaddrinfo failed with code %d.\n", i_status);
+        fprintf(stderr, "%s\n", gai_strerror(i_status));
+
+        return 3;
+    }
+
+    ni_fds = malloc(sizeof(int) * i_count);
+    i_epfd = epoll_create1(0);
+
+    if (ni_fds == NULL || i_epfd == -1)
+    {
+        fprintf(stderr, "chatbench: unable to start the storm.\n");
+
+        return 2;
+    }
+/*                                                                            */
+/* Start every connect, then wait for all of them to finish.  Any the         */
+/* server's listen queue could not hold are retried by the kernel, which is   */
+/* part of what a storm costs:                                                */
+/*                                                                            */
+    d_start = now_usec();
+
+    for (i_lc = 0; i_lc < i_count; i_lc++)
+    {
+        ni_fds[i_lc] = socket(ps_ai->ai_family,
+            ps_ai->ai_socktype | SOCK_NONBLOCK, ps_ai->ai_protocol);
+
+        if (ni_fds[i_lc] == -1 || (connect(ni_fds[i_lc], ps_ai->ai_addr,
+            ps_ai->ai_addrlen) == -1 && errno != EINPROGRESS))
+        {
+            report_error("connect", errno);
+            fprintf(stderr, "chatbench: only %d connections started.\n",
+                i_lc);
+
+            return 3;
+        }
+
+        memset(&s_event, 0, sizeof(s_event));
+        s_event.events = EPOLLOUT | EPOLLONESHOT;
+        s_event.data.fd = ni_fds[i_lc];
+        epoll_ctl(i_epfd, EPOLL_CTL_ADD, ni_fds[i_lc], &s_event);
+    }
+
+    freeaddrinfo(ps_ai);
+
+    for (i_pending = i_count; i_pending > 0; i_pending -= i_ready)
+    {
+        i_ready = epoll_wait(i_epfd, as_events, MAX_EVENTS, 30000);
+
+        if (i_ready < 1)
+        {
+            fprintf(stderr, "chatbench: %d connections never completed.\n",
+                i_pending);
+
+            return 4;
+        }
+
+        for (i = 0; i < i_ready; i++)
+        {
+            if (as_events[i].events & (EPOLLERR | EPOLLHUP))
+            {
+                fprintf(stderr, "chatbench: a connection was refused.\n");
+
+                return 4;
+            }
+        }
+    }
+
+    d_connected = now_usec();
+/*                                                                            */
+/* The probe.  The receiver waits as long as the server needs:                */
+/*                                                                            */
+    i_receiver = connect_to_server(nc_host, nc_port);
+    i_sender = connect_to_server(nc_host, nc_port);
+
+    if (i_receiver == -1 || i_sender == -1)
+    {
+        return 3;
+    }
+
+    if (send(i_sender, nc_buf, i_wire, MSG_NOSIGNAL) != i_wire ||
+        receive_exactly(i_receiver, nc_buf, i_wire, 30000) != 0)
+    {
+        fprintf(stderr, "chatbench: the server never accepted the storm.\n");
+
+        return 4;
+    }
+/*                                                                            */
+/* Report and cleanup:                                                        */
+/*                                                                            */
+    d_end = now_usec();
+
+    printf("chatbench: %d connections accepted in %.1f ms (%.0f/s), "
+        "connects done after %.1f ms\n", i_count + 2,
+        (d_end - d_start) / 1e3, (i_count + 2) / ((d_end - d_start) / 1e6),
+        (d_connected - d_start) / 1e3);
+
+    for (i_lc = 0; i_lc < i_count; i_lc++)
+    {
+        close(ni_fds[i_lc]);
+    }
+
+    close(i_sender);
+    close(i_receiver);
+    close(i_epfd);
+    free(ni_fds);
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Read the zero-copy completions waiting on a socket's error queue.  Sends   */
+/* up to *pu_done are then finished; sends the kernel copied after all are    */
+/* added to *pl_copied.  Returns how many completions were read:              */
+/*                                                                            */
+int zerocopy_reap
+(
+    int        i_sockfd, /* in   - Socket that sent with MSG_ZEROCOPY         */
+    unsigned *pu_done,   /* both - Sends completed so far                     */
+    long     *pl_copied  /* both - Sends the kernel copied                    */
+)
+{
+    union
+    {
+        char            ac_buf[128];
+        struct cmsghdr s_align;
+    }                          u_control;
+    struct cmsghdr           *ps_cmsg;
+    struct sock_extended_err *ps_err;
+    struct msghdr             s_msg;
+    int                        i_done;
+
+    i_done = 0;
+
+    for (;;)
+    {
+        memset(&s_msg, 0, sizeof(s_msg));
+        s_msg.msg_control = u_control.ac_buf;
+        s_msg.msg_controllen = sizeof(u_control.ac_buf);
+
+        if (recvmsg(i_sockfd, &s_msg, MSG_ERRQUEUE | MSG_DONTWAIT) == -1)
+        {
+            return i_done;
+        }
+
+        for (ps_cmsg = CMSG_FIRSTHDR(&s_msg);
+            ps_cmsg != NULL;
+            ps_cmsg = CMSG_NXTHDR(&s_msg, ps_cmsg))
+        {
+            ps_err = (struct sock_extended_err*)CMSG_DATA(ps_cmsg);
+
+            if (ps_cmsg->cmsg_level != SOL_IP ||
+                ps_cmsg->cmsg_type != IP_RECVERR ||
+                ps_err->ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+            {
+                continue;
+            }
+
+            if (ps_err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            {
+                *pl_copied += ps_err->ee_data - ps_err->ee_info + 1;
+            }
+
+            *pu_done = ps_err->ee_data + 1;
+            i_done++;
+        }
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Send ZC_BYTES to each socket in messages of i_size bytes, each message to  */
+/* every socket in turn as a broadcast does, copying or with MSG_ZEROCOPY.    */
+/* A zero-copy run is not over until every send has completed.  Returns MB/s  */
+/* over all the sockets, or -1:                                               */
+/*                                                                            */
+double zerocopy_run
+(
+    int       *ni_fds,     /* in   - ZC_RECEIVERS connected sockets           */
+    unsigned *nu_sends,    /* both - Zero-copy sends so far on each socket    */
+    char     *nc_buf,      /* in   - Message                                  */
+    int        i_size,     /* in   - Bytes in the message                     */
+    int        i_zerocopy, /* in   - Send with MSG_ZEROCOPY                   */
+    long      *pl_copied   /* out  - Zero-copy sends the kernel copied        */
+)
+{
+    struct pollfd s_pfd;
+    double        d_start;
+    int           i_count;
+    int           i_lc;
+    int           i_off;
+    int           i_sent;
+    int           j;
+    unsigned      au_done[ZC_RECEIVERS];
+    unsigned      au_sends[ZC_RECEIVERS];
+
+    memcpy(au_done, nu_sends, sizeof(au_done));
+    memcpy(au_sends, nu_sends, sizeof(au_sends));
+    *pl_copied = 0;
+    i_count = ZC_BYTES / i_size;
+
+    d_start = now_usec();
+
+    for (i_lc = 0; i_lc < i_count; i_lc++)
+    {
+        for (j = 0; j < ZC_RECEIVERS; j++)
+        {
+            for (i_off = 0; i_off < i_size; i_off += i_sent)
+            {
+                i_sent = send(ni_fds[j], nc_buf + i_off, i_size - i_off,
+                    i_zerocopy ? MSG_ZEROCOPY : 0);
+
+                if (i_sent == -1 && errno == ENOBUFS && i_zerocopy)
+                {
+                    i_sent = 0; // Too many sends outstanding, collect some
+                }
+                else if (i_sent == -1)
+                {
+                    report_error("send", errno);
+
+                    return -1;
+                }
+                else if (i_zerocopy)
+                {
+                    au_sends[j]++;
+                }
+
+                if (i_zerocopy)
+                {
+                    zerocopy_reap(ni_fds[j], &au_done[j], pl_copied);
+                }
+            }
+        }
+    }
+/*                                                                            */
+/* Wait for the last completions:                                             */
+/*                                                                            */
+    for (j = 0; j < ZC_RECEIVERS; j++)
+    {
+        while (au_done[j] != au_sends[j])
+        {
+            s_pfd.fd = ni_fds[j];
+            s_pfd.events = 0; // POLLERR is always reported
+
+            if (poll(&s_pfd, 1, 5000) != 1)
+            {
+                fprintf(stderr, "chatbench: zero-copy completions lost.\n");
+
+                return -1;
+            }
+
+            zerocopy_reap(ni_fds[j], &au_done[j], pl_copied);
+        }
+
+        nu_sends[j] = au_sends[j];
+    }
+
+    return (double)i_size * i_count * ZC_RECEIVERS / (now_usec() - d_start);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Find the message size from which MSG_ZEROCOPY beats copying on loopback.   */
+/* ZC_RECEIVERS socket pairs are made on 127.0.0.1, the drain thread reads    */
+/* the far ends, and each size is sent both ways.  The threshold is the       */
+/* smallest size from which zero-copy wins at every size up to the largest:   */
+/*                                                                            */
+int zerocopy_sweep
+(
+    void
+)
+{
+    int                 ai_recv[ZC_RECEIVERS];
+    int                 ai_send[ZC_RECEIVERS];
+    unsigned            au_sends[ZC_RECEIVERS];
+    char              *nc_buf;
+    double              d_copy;
+    double              d_zerocopy;
+    struct drain_info   s_drain;
+    struct epoll_event  s_event;
+    struct sockaddr_in  s_addr;
+    int                 i_listener;
+    int                 i_size;
+    int                 i_threshold;
+    int                 i_yes;
+    int                 j;
+    long                l_copied;
+    socklen_t           sl_addrlen;
+    pthread_t           t_drain;
+/*                                                                            */
+/* A listener on any free port and ZC_RECEIVERS connections to it:            */
+/*                                                                            */
+    memset(&s_addr, 0, sizeof(s_addr));
+    s_addr.sin_family = AF_INET;
+    s_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    sl_addrlen = sizeof(s_addr);
+
+    i_listener = socket(AF_INET, SOCK_STREAM, 0);
+
+    if (i_listener == -1 ||
+        bind(i_listener, (struct sockaddr*)&s_addr, sizeof(s_addr)) == -1 ||
+        listen(i_listener, ZC_RECEIVERS) == -1 ||
+        getsockname(i_listener, (struct sockaddr*)&s_addr, &sl_addrlen) == -1)
+    {
+        report_error("listen", errno);
+
+        return 2;
+    }
+
+    s_drain.i_epfd = epoll_create1(0);
+    s_drain.i_stop = 0;
+    i_yes = 1;
+
+    for (j = 0; j < ZC_RECEIVERS; j++)
+    {
+        ai_recv[j] = socket(AF_INET, SOCK_STREAM, 0);
+
+        if (ai_recv[j] == -1 || connect(ai_recv[j],
+            (struct sockaddr*)&s_addr, sizeof(s_addr)) == -1)
+        {
+            report_error("connect", errno);
+
+            return 3;
+        }
+
+        ai_send[j] = accept(i_listener, NULL, NULL);
+
+        if (ai_send[j] == -1 || setsockopt(ai_send[j], SOL_SOCKET,
+            SO_ZEROCOPY, &i_yes, sizeof(i_yes)) == -1)
+        {
+            report_error("setsockopt", errno);
+
+            return 3;
+        }
+
+        memset(&s_event, 0, sizeof(s_event));
+        s_event.events = EPOLLIN;
+        s_event.data.fd = ai_recv[j];
+        epoll_ctl(s_drain.i_epfd, EPOLL_CTL_ADD, ai_recv[j], &s_event);
+    }
+
+    memset(au_sends, 0, sizeof(au_sends));
+    nc_buf = malloc(ZC_MAX_SIZE);
+
+    if (nc_buf == NULL ||
+        pthread_create(&t_drain, NULL, drain_thread, &s_drain) != 0)
+    {
+        fprintf(stderr, "chatbench: unable to start the sweep.\n");
+
+        return 2;
+    }
+
+    memset(nc_buf, 'x', ZC_MAX_SIZE);
+/*                                                                            */
+/* Sweep:                                                                     */
+/*                                                                            */
+    printf("chatbench: copy vs MSG_ZEROCOPY to %d loopback sockets\n",
+        ZC_RECEIVERS);
+    printf("chatbench:    bytes   copy MB/s   zero-copy MB/s   "
+        "kernel copied\n");
+
+    i_threshold = 0;
+
+    for (i_size = ZC_MIN_SIZE; i_size <= ZC_MAX_SIZE; i_size *= 2)
+    {
+        d_copy = zerocopy_run(ai_send, au_sends, nc_buf, i_size, 0,
+            &l_copied);
+        d_zerocopy = zerocopy_run(ai_send, au_sends, nc_buf, i_size, 1,
+            &l_copied);
+
+        if (d_copy < 0 || d_zerocopy < 0)
+        {
+            return 4;
+        }
+
+        printf("chatbench: %8d %11.0f %16.0f %14ld\n", i_size, d_copy,
+            d_zerocopy, l_copied);
+        fflush(stdout);
+
+        if (d_zerocopy <= d_copy)
+        {
+            i_threshold = 0;
+        }
+        else if (i_threshold == 0)
+        {
+            i_threshold = i_size;
+        }
+    }
+
+    if (i_threshold > 0)
+    {
+        printf("chatbench: zero-copy is faster from %d bytes "
+            "(pollserver -z %d)\n", i_threshold, i_threshold);
+    }
+    else
+    {
+        printf("chatbench: copying was as fast or faster at %d bytes; "
+            "leave -z off\n", ZC_MAX_SIZE);
+    }
+/*                                                                            */
+/* Cleanup:                                                                   */
+/*                                                                            */
+    s_drain.i_stop = 1;
+    pthread_join(t_drain, NULL);
+
+    for (j = 0; j < ZC_RECEIVERS; j++)
+    {
+        close(ai_send[j]);
+        close(ai_recv[j]);
+    }
+
+    close(i_listener);
+    close(s_drain.i_epfd);
+    free(nc_buf);
+
+    return 0;
+}
@@ -0,0 +1,8918 @@
+/******************************************************************************/
+/*                                                                            */
+/* Application: pollserver                                                    */
+/*                                                                            */
+/* File:        main_unix.c                                                   */
+/*                                                                            */
+/* Purpose:     Implement a crude, multi-person chat server to demonstrate    */
+/*              using poll on multiple servers.  This is the Unix/Linux       */
+/*              build of WSpollserver.  The main loop can be run on poll (the */
+/*              same loop as the Windows WSAPoll version), on epoll, which    */
+/*              only reports the descriptors that are ready so a wakeup does  */
+/*              not cost O(connections), or on io_uring, which accepts,       */
+/*              receives and sends without a system call per operation.       */
+/*                                                                            */
+/*              The server can run several reactors, one thread each.  Every  */
+/*              reactor has its own SO_REUSEPORT listener, connections and    */
+/*              event loop.  A message is sent to the reactor's own clients   */
+/*              and handed to the other reactors through lock-free single-    */
+/*              producer rings, one for each pair of reactors.                */
+/*                                                                            */
+/*              Clients are non-blocking and every client has an output       */
+/*              queue.  A queue is written with writev and, when the socket   */
+/*              is full, waits for POLLOUT, so a slow reader only holds up    */
+/*              itself.  SIGUSR1 prints the queue depths.                     */
+/*                                                                            */
+/*              A message is stored once, in a reference-counted buffer, and  */
+/*              every queue and shard ring it goes through holds a reference  */
+/*              instead of a copy.                                            */
+/*                                                                            */
+/*              With -f every message is a frame: a 4-byte big-endian length  */
+/*              and that many bytes.  Frames are reassembled from however     */
+/*              the reads split them and forwarded whole.                     */
+/*                                                                            */
+/*              Connections live in a fixed slab of slots that never move.    */
+/*              epoll and io_uring carry a handle (slot and generation), so   */
+/*              an event for a connection that has since closed is ignored    */
+/*              even when its slot or descriptor number is in use again.      */
+/*                                                                            */
+/*              Each reactor has a hierarchical timer wheel for idle          */
+/*              timeouts (-i), heartbeats (-k) and slow-consumer deadlines    */
+/*              (-s).  The loop sleeps until the nearest timer is due.        */
+/*                                                                            */
+/*              With -r every frame is a room command: JOIN, LEAVE or         */
+/*              PUBLISH and a room name.  Each reactor indexes its clients by */
+/*              room, so a PUBLISH only visits the room's subscribers.        */
+/*                                                                            */
+/*              -d keeps each room's newest messages in a memory-mapped ring  */
+/*              file in that directory.  A client that joins a room is sent   */
+/*              the last -n of them straight from the mapping, and the files  */
+/*              outlive the server.                                           */
+/*                                                                            */
+/*              -z sends writes of at least that many bytes with MSG_ZEROCOPY */
+/*              (poll and epoll), so a big message is not copied into the     */
+/*              kernel once per recipient.  A message stays pinned until the  */
+/*              socket's error queue reports the send done.                   */
+/*                                                                            */
+/*              The poll and epoll loops take up to ACCEPT_BATCH connections  */
+/*              per listener wakeup with accept4, already non-blocking, so a  */
+/*              reconnect storm does not cost a loop pass per client.         */
+/*                                                                            */
+/*              -m gives each client a token bucket of that many messages a   */
+/*              second (bursts of -b); messages over it are dropped.  -q      */
+/*              drops a client whose output queue would pass that many bytes. */
+/*              Both are checked on the message's way through, never by a     */
+/*              scan, and SIGUSR1 counts how often each fired.                */
+/*                                                                            */
+/*              -H listens on a Unix socket for a new server.  A new server   */
+/*              started with the same -H is handed the listeners and every    */
+/*              client, with its partial frame, unsent bytes and rooms, over  */
+/*              SCM_RIGHTS, so a restart drops no connection.                 */
+/*                                                                            */
+/*              -l also listens on a Unix domain socket at that path, for     */
+/*              clients on the same host.  Its connections are served by the  */
+/*              same loops, exactly like TCP ones, without the cost of the    */
+/*              TCP/IP loopback stack.                                        */
+/*                                                                            */
+/*              -M gives every room a ring even without -d, in a memfd.  A    */
+/*              client on the -l socket sends MAP and a room name and is      */
+/*              passed a read-only descriptor for the ring, so it reads the   */
+/*              room's messages from shared memory, without a system call     */
+/*              while they keep coming, and sleeps on a futex when they stop. */
+/*                                                                            */
+/*              -S serves metrics on that TCP port in the Prometheus text     */
+/*              format: connections, accepts, bytes, messages, send errors,   */
+/*              queue depths and a histogram of loop pass times per reactor.  */
+/*              The reactors only bump counters of their own; a thread of its */
+/*              own reads them, without a lock, when the port is scraped.     */
+/*                                                                            */
+/*              -w gives each reactor that many fan-out worker threads with   */
+/*              poll or epoll.  The reactors only read; a message is handed   */
+/*              to the workers through lock-free job queues, one push per     */
+/*              worker, and each worker writes it to its share of clients.    */
+/*                                                                            */
+/*              Messages for a client are written once per loop pass, with    */
+/*              one writev for everything it was sent during the pass.  -L    */
+/*              holds a batch up to that many microseconds for more to join   */
+/*              it; -W writes every message at once, as before.               */
+/*                                                                            */
+/*              -C and -Q set high and low watermarks on clients connected    */
+/*              and bytes queued, across the whole server.  Past a high one   */
+/*              the reactors stop watching their listeners, and past -Q the   */
+/*              clients with the deepest queues are shed; accepting starts    */
+/*              again once both are down to their low watermarks.             */
+/*                                                                            */
+/* Reference:   This function is based on pollserver.c in Brian "Beej         */
+/*              Jorgensen" Hall's excellent socket programming guide:         */
+/*                 Hall, B. (2019). "Beej's Guide to Network Programming      */
+/*                 Using Internet Sockets"                                    */
+/*                 https://beej.us/guide/bgnet/                               */
+/*                                                                            */
+/* Usage:       pollserver [-b burst] [-C clients_high[:low]]                 */
+/*                         [-d history_dir] [-e poll|epoll|uring]             */
+/*                         [-f max_frame]                                     */
+/*                         [-H handoff_path] [-i idle_secs]                   */
+/*                         [-k heartbeat_secs] [-L linger_usecs]              */
+/*                         [-l local_path] [-M] [-m messages_per_sec]         */
+/*                         [-n replay] [-Q queued_high[:low]]                 */
+/*                         [-q queue_bytes] [-r] [-S metrics_port]            */
+/*                         [-s slow_secs] [-t reactors] [-W] [-w workers]     */
+/*                         [-z zerocopy_bytes]                                */
+/*                                                                            */
+/*              On SIGINT or SIGTERM the server prints how many system calls  */
+/*              it made per message so the engines can be compared.           */
+/*                                                                            */
+/* Modifications:                                                             */
+/*                                                                            */
+/*           Name           Date                     Reason                   */
+/*    ------------------ ---------- ----------------------------------------- */
+/*    Steven C. Mitchell 2026-10-17 Linux build with poll and epoll loops     */
+/*    Steven C. Mitchell 2026-10-17 io_uring engine                           */
+/*    Steven C. Mitchell 2026-10-17 Reactor per core with SO_REUSEPORT        */
+/*    Steven C. Mitchell 2026-10-17 Per-client output queues                  */
+/*    Steven C. Mitchell 2026-10-17 Shared reference-counted messages         */
+/*    Steven C. Mitchell 2026-10-17 Length-prefixed framing (-f)              */
+/*    Steven C. Mitchell 2026-10-17 Slab connection table with handles        */
+/*    Steven C. Mitchell 2026-10-17 Timer wheel: idle, heartbeat, slow reader */
+/*    Steven C. Mitchell 2026-10-17 Chat rooms with a subscriber index (-r)   */
+/*    Steven C. Mitchell 2026-10-17 Memory-mapped room history (-d, -n)       */
+/*    Steven C. Mitchell 2026-10-17 MSG_ZEROCOPY for large writes (-z)        */
+/*    Steven C. Mitchell 2026-10-17 Batched accept4 for reconnect storms      */
+/*    Steven C. Mitchell 2026-10-17 Rate (-m, -b) and queue (-q) limits       */
+/*    Steven C. Mitchell 2026-10-17 Hot restart over a Unix socket (-H)       */
+/*    Steven C. Mitchell 2026-10-17 Unix domain socket listener (-l)          */
+/*    Steven C. Mitchell 2026-10-17 Shared-memory room rings for clients (-M) */
+/*    Steven C. Mitchell 2026-10-17 Metrics port (-S)                         */
+/*    Steven C. Mitchell 2026-10-17 Fan-out worker threads (-w)               */
+/*    Steven C. Mitchell 2026-10-17 One write per client per pass (-L, -W)    */
+/*    Steven C. Mitchell 2026-10-17 Overload watermarks (-C, -Q)              */
+/*                                                                            */
+/******************************************************************************/
+#define _GNU_SOURCE // accept4, memfd_create
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include <sys/uio.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#include <linux/errqueue.h>
+#include <linux/futex.h>
+
+#define PORT "9034"        // Port we're listening on
+#define BACKLOG SOMAXCONN  // how many pending connections queue will hold
+#define MAX_EVENTS 256     // Ready descriptors returned by one epoll_wait
+#define ACCEPT_BATCH 64    // Most connections accepted per listener wakeup
+
+#define ENGINE_POLL  0
+#define ENGINE_EPOLL 1
+#define ENGINE_URING 2
+
+#define URING_ENTRIES      1024 // Submission queue entries
+#define URING_CQ_ENTRIES   8192 // Completion queue entries (sends fan out)
+#define URING_BUFFER_COUNT 1024 // Provided receive buffers (power of 2)
+#define URING_BUFFER_SIZE  256  // Same as the poll loop's buffer
+#define URING_BUFFER_GROUP 0
+
+#define URING_OP_ACCEPT  1 // Low bits of user_data say what completed
+#define URING_OP_RECV    2
+#define URING_OP_WRITE   3
+#define URING_OP_WAKE    4
+#define URING_OP_TIMEOUT 5
+#define URING_OP_NOTIFY  6
+#define URING_OP_CANCEL  7
+#define URING_OP_MASK    7
+
+#define FIRST_CLIENT 3 // Slots 0 and 2 are the listeners, 1 the eventfd
+#define SLOT_MAX_LIMIT (1 << 24) // Most connection slots a reactor reserves
+/*                                                                            */
+/* A handle names a connection slot and the generation of the connection in   */
+/* it.  epoll data and io_uring user_data carry handles, so an event for a    */
+/* connection that has gone, whose slot now holds another one, is recognized  */
+/* and ignored.  The low 3 bits are left free for URING_OP_*:                 */
+/*                                                                            */
+#define HANDLE_MAKE(u_gen, i_slot) \
+    ((uint64_t)(u_gen) << 32 | (uint64_t)(i_slot) << 3)
+#define HANDLE_GEN(u64_handle)  ((unsigned)((u64_handle) >> 32))
+#define HANDLE_SLOT(u64_handle) ((int)(((u64_handle) & 0xffffffffu) >> 3))
+#define OUT_IOV_MAX  64 // Queued messages written by one writev
+/*                                                                            */
+/* Counters that the main and metrics threads read while the reactors run.    */
+/* Only the owning reactor writes them, so a relaxed load and store is enough */
+/* and is no dearer than a plain add:                                         */
+/*                                                                            */
+#define COUNTER_ADD(l_counter, l_amount) \
+    __atomic_store_n(&(l_counter), \
+        __atomic_load_n(&(l_counter), __ATOMIC_RELAXED) + (l_amount), \
+        __ATOMIC_RELAXED)
+#define COUNTER_GET(l_counter) __atomic_load_n(&(l_counter), __ATOMIC_RELAXED)
+
+#define MAX_REACTORS      64
+#define FANOUT_MAX        64  // Most fan-out workers per reactor (-w)
+#define SHARD_RING_SLOTS  256 // Messages in flight from one reactor to another
+#define MESSAGE_MAX       256 // Largest message read from a client at once
+#define OUT_QUEUE_INITIAL 8   // Output queue slots a client starts with
+#define ZEROCOPY_INITIAL  8   // Pinned-message slots a client starts with
+#define RATE_MAX          1000000 // Largest -m or -b
+#define COALESCE_INITIAL  64  // Clients to write a reactor's list starts with
+#define LINGER_MAX        1000000 // Largest -L, in microseconds
+
+#define FRAME_HEADER    4         // Big-endian payload length before a frame
+#define FRAME_MAX_LIMIT (16 << 20) // Largest payload -f accepts
+#define FRAME_KEEP      65536     // Input buffer kept by an idle client
+
+#define TIMER_TICK_MS 10 // Resolution of the timer wheel
+#define WHEEL_BITS    8  // Each level of the wheel has 1 << WHEEL_BITS slots
+#define WHEEL_SLOTS   (1 << WHEEL_BITS)
+#define WHEEL_LEVELS  4  // 2^32 ticks, well over a year at 10 ms
+#define TIMER_MAX_SECS 31536000 // Longest -i, -k or -s (a year)
+
+#define TIMER_IDLE 0 // Nothing received from the client for -i seconds
+#define TIMER_BEAT 1 // Nothing sent to the client for -k seconds
+#define TIMER_SLOW 2 // Output queue not drained within -s seconds
+
+#define ROOM_NAME_MAX 64  // Longest room name (-r)
+#define ROOM_JOIN_MAX 256 // Most rooms one client can be in
+#define ROOM_BUCKETS  64  // Hash buckets a reactor starts with
+
+#define HISTORY_BYTES  (1 << 20)  // Message bytes kept per room (-d)
+#define HISTORY_INDEX  1024       // Positions of the newest messages kept
+#define HISTORY_REPLAY 50         // Messages replayed on JOIN by default (-n)
+#define HISTORY_IOV    4          // Pieces one replay is sent in
+#define HISTORY_MAGIC  "CHATHST2"
+
+#define HANDOFF_LISTENERS 1 // Hand-over record: the listening sockets
+#define HANDOFF_CLIENT    2 // ...a client and what it was in the middle of
+#define HANDOFF_END       3 // ...nothing more follows
+#define HANDOFF_TIMEOUT   5 // Seconds either server waits for the other
+
+#define METRICS_BUCKETS 22 // Loop pass times: < 1 us, < 2 us ... < 1 s, more
+
+#define FANOUT_ATTACH 1 // Fan-out job: start writing to a client
+#define FANOUT_DETACH 2 // ...its reactor closed it, close our descriptor
+#define FANOUT_SEND   3 // ...queue a message for some or all clients
+/*                                                                            */
+/* With -w a reactor's clients are shared out among its fan-out workers by    */
+/* slot, and each worker keeps its share densely in a table of its own:       */
+/*                                                                            */
+#define FANOUT_WORKER(i_slot, i_workers) \
+    (((i_slot) - FIRST_CLIENT) % (i_workers))
+#define FANOUT_SLOT(i_slot, i_workers) \
+    (FIRST_CLIENT + ((i_slot) - FIRST_CLIENT) / (i_workers))
+/*                                                                            */
+/* A message read from a client.  It is stored once however many clients it   */
+/* goes to: every output queue slot, shard ring slot and backlog entry that   */
+/* holds it owns one reference and the last one to let go frees it.  The      */
+/* reactors share messages, so the count is updated atomically:               */
+/*                                                                            */
+struct message
+{
+    int   i_refs;
+    int   i_len;
+    char ac_data[];
+};
+/*                                                                            */
+/* A ring of messages on their way from one reactor to another.  Each ordered */
+/* pair of reactors has its own ring with exactly one producer and one        */
+/* consumer, so the head and tail only need acquire/release ordering, not a   */
+/* lock.  They sit on separate cache lines so the two threads do not fight    */
+/* over one:                                                                  */
+/*                                                                            */
+struct shard_ring
+{
+    unsigned        u_head __attribute__((aligned(64))); // Consumer
+    unsigned        u_tail __attribute__((aligned(64))); // Producer
+    struct message *as_slots[SHARD_RING_SLOTS] __attribute__((aligned(64)));
+};
+/*                                                                            */
+/* Messages that did not fit in a full ring wait here, in order, in the       */
+/* sending reactor until the receiver catches up:                             */
+/*                                                                            */
+struct shard_backlog
+{
+    struct shard_backlog *ps_next;
+    struct message       *ps_message;
+};
+/*                                                                            */
+/* Work for a fan-out worker (-w).  Slots are the worker's own, not the       */
+/* reactor's.  A send holds one reference to its message for the worker:      */
+/*                                                                            */
+struct fanout_job
+{
+    struct fanout_job *ps_next;    // Next in the worker's queue
+    int                 i_kind;    // FANOUT_ATTACH, _DETACH or _SEND
+    int                 i_slot;    // Client, or the sender to skip (-1)
+    int                 i_fd;      // Descriptor of the client (attach)
+    int                 i_count;   // Clients in ni_slots, -1 for all of them
+    struct message    *ps_message; // Message to send
+    int               *ni_slots;   // Clients to send it to
+};
+/*                                                                            */
+/* A fan-out worker's queue of jobs.  Any reactor may add to it and only the  */
+/* worker takes from it, so it is a linked list that producers join with one  */
+/* atomic exchange of ps_head and no lock; the consumer follows the links     */
+/* from ps_tail.  The list always holds at least one node, s_stub when it is  */
+/* empty.  A producer that has swapped ps_head but not yet linked the node in */
+/* is seen as an empty queue, and its wake-up comes after the link:           */
+/*                                                                            */
+struct fanout_queue
+{
+    struct fanout_job *ps_head __attribute__((aligned(64))); // Producers
+    struct fanout_job *ps_tail __attribute__((aligned(64))); // Consumer
+    struct fanout_job   s_stub;
+};
+/*                                                                            */
+/* A timer.  It sits in a doubly linked list in one slot of the timer wheel;  */
+/* pps_prev points at whatever points at it, so it can be taken out without   */
+/* knowing which slot it is in.  pps_prev is NULL while the timer is not      */
+/* armed:                                                                     */
+/*                                                                            */
+struct timer
+{
+    struct timer  *ps_next;
+    struct timer **pps_prev;
+    uint64_t        u64_expires; // Tick it is due
+    int             i_slot;      // Connection it belongs to
+    int             i_kind;      // TIMER_IDLE, TIMER_BEAT or TIMER_SLOW
+};
+/*                                                                            */
+/* A hierarchical timer wheel.  Level 0 has a slot per tick for the current   */
+/* WHEEL_SLOTS ticks, level 1 a slot per WHEEL_SLOTS ticks and so on.  A      */
+/* timer goes in the lowest level whose current span contains it, and when    */
+/* the wheel reaches a higher-level slot the timers in it are moved down.     */
+/* Scheduling and cancelling are O(1) whatever the number of timers, and the  */
+/* bitmaps of used slots let the wheel jump straight to the next tick that    */
+/* has any work instead of stepping through empty ones:                       */
+/*                                                                            */
+struct timer_wheel
+{
+    uint64_t      u64_now;  // Last tick processed
+    long          l_timers; // Timers armed
+    uint64_t      aau64_used[WHEEL_LEVELS][WHEEL_SLOTS / 64];
+    struct timer *aaps_slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+/*                                                                            */
+/* A chat room (-r).  Each reactor keeps its own rooms, in a hash table by    */
+/* name, holding only that reactor's clients.  The members are a dense array  */
+/* of slots so a publish walks exactly the subscribers and nothing else.      */
+/* Every member also records where the room is in its client's own list of    */
+/* rooms, and every entry in that list where the client is in the room, so    */
+/* leaving is a swap with the last entry on both sides:                       */
+/*                                                                            */
+struct room_member
+{
+    int i_slot; // Client in the room
+    int i_ref;  // Index of the room in the client's ns_rooms
+};
+
+struct room
+{
+    struct room        *ps_next;     // Next room in the same bucket
+    uint32_t             u32_hash;
+    struct history     *ps_history;  // Mapped ring (-d or -M) or NULL
+    struct room_member *ns_members;  // Subscribers, in no particular order
+    int                  i_members;
+    int                  i_size;      // Entries allocated in ns_members
+    int                  i_name_len;
+    char                ac_name[];
+};
+
+/*                                                                            */
+/* The history of a room (-d): a file that every reactor maps shared, this    */
+/* header and then a ring of HISTORY_BYTES holding the newest PUBLISH frames  */
+/* exactly as they were sent.  With -M and no -d it is a memfd instead, and   */
+/* clients on this host map it too.  A position counts every byte the ring    */
+/* has moved through, so position % u32_size is where a frame starts.  A      */
+/* frame never wraps; if it does not fit before the end of the ring the rest  */
+/* of the lap is skipped.  Only one reactor appends to a given room, so the   */
+/* writer needs no lock, and it publishes u64_end and u64_count with release  */
+/* stores after the frame is in place.  A client that mapped the ring (MAP)   */
+/* can only read it, so it cannot say when it is asleep; once u32_mapped is   */
+/* set the writer bumps u32_seq and calls FUTEX_WAKE on every append, and a   */
+/* reader with nothing to read sleeps on u32_seq with FUTEX_WAIT:             */
+/*                                                                            */
+struct history
+{
+    char      ac_magic[8];  // HISTORY_MAGIC
+    uint32_t  u32_size;     // Bytes in the ring
+    uint32_t  u32_index;    // Entries in au64_index
+    uint64_t  u64_count;    // Frames ever appended
+    uint64_t  u64_end;      // Position after the newest frame
+    uint32_t  u32_seq;      // Low 32 bits of u64_count, the futex word
+    uint32_t  u32_mapped;   // Non-zero once a client has mapped the ring
+    uint64_t  au64_index[HISTORY_INDEX]; // [n % HISTORY_INDEX] frame n starts
+};
+
+#define HISTORY_DATA ((sizeof(struct history) + 4095) & ~(size_t)4095)
+
+struct room_ref
+{
+    struct room *ps_room; // Room the client is in
+    int           i_pos;  // Index of the client in the room's ns_members
+};
+/*                                                                            */
+/* The memfd behind a room's ring with -M and no -d.  There is one per room   */
+/* for the whole server and every reactor maps it itself, as it would a       */
+/* history file, so this list is only searched when a reactor first sees a    */
+/* room or a client asks for the ring:                                        */
+/*                                                                            */
+struct ring_file
+{
+    struct ring_file *ps_next;
+    int                i_fd;       // The memfd, never closed until exit
+    int                i_name_len;
+    char              ac_name[];
+};
+/*                                                                            */
+/* Per-connection state, one slot of the connection table.  A slot keeps its  */
+/* index for as long as the connection lives; u_gen changes every time the    */
+/* slot is freed so old handles stop matching:                                */
+/*                                                                            */
+struct connection
+{
+    int                i_fd;
+    unsigned           u_gen;        // Generation of the slot
+    int                i_next_free;  // Next slot in the free list
+    struct message   **ns_queue;     // Output queue, a ring of messages
+    unsigned           u_queue_size; // Slots in ns_queue (power of 2)
+    unsigned           u_head;       // Oldest message
+    unsigned           u_tail;       // Where the next one goes
+    int                i_sent;       // Bytes of the oldest already written
+    long               l_queued;     // Bytes waiting in the queue
+    int                i_writing;    // POLLOUT armed, or a writev in flight
+    int                i_closed;     // Closed while a writev was in flight
+    long               l_inflight;   // Bytes in the writev in flight
+    char              *nc_in;        // Partial frame (framed mode)
+    int                i_in_len;     // Bytes in nc_in
+    int                i_in_size;    // Bytes allocated for nc_in
+    struct iovec      *ns_iov;       // The writev in flight (io_uring)
+    uint64_t           u64_heard;    // Tick of the last receive
+    uint64_t           u64_sent;     // Tick of the last message queued
+    struct timer       s_idle;       // Idle timeout (-i)
+    struct timer       s_beat;       // Heartbeat (-k)
+    struct timer       s_slow;       // Slow-consumer deadline (-s)
+    struct room_ref   *ns_rooms;     // Rooms joined (-r)
+    int                i_rooms;      // Entries in ns_rooms
+    int                i_rooms_size; // Entries allocated in ns_rooms
+    int                i_zerocopy;   // SO_ZEROCOPY is set (-z)
+    uint32_t           u32_zc_next;  // Number of the next zero-copy send
+    struct pinned     *ns_pinned;    // Ring of messages the kernel may use
+    unsigned           u_pin_size;   // Slots in ns_pinned (power of 2)
+    unsigned           u_pin_head;   // Oldest
+    unsigned           u_pin_tail;   // Where the next one goes
+    uint64_t           u64_tokens;   // Messages it may send, in 1/1000s (-m)
+    uint64_t           u64_refill;   // Tick the bucket was last topped up
+    int                i_evicted;    // Dropped for its queue (-q), closing
+    struct fanout_job *ps_detach;    // Tells its worker it closed (-w)
+    int                i_dirty;      // To be written at the end of the pass
+};
+/*                                                                            */
+/* A message the kernel may still be sending from (-z).  A MSG_ZEROCOPY send  */
+/* hands the kernel the message's own pages, so the message is held until the */
+/* socket's error queue says that send, by number, is done with them:         */
+/*                                                                            */
+struct pinned
+{
+    struct message *ps_message;
+    uint32_t         u32_send; // Zero-copy send it went out in
+};
+/*                                                                            */
+/* The rings shared with the kernel.  The pointers point into the mmap'ed     */
+/* submission and completion rings; pu_*_head/tail are updated with acquire/  */
+/* release ordering because the kernel reads and writes them too:             */
+/*                                                                            */
+struct uring
+{
+    int                       i_ring_fd;
+    unsigned                 *pu_sq_head;
+    unsigned                 *pu_sq_tail;
+    unsigned                   u_sq_mask;
+    unsigned                   u_sq_entries;
+    unsigned                   u_to_submit;  // SQEs filled in since last enter
+    struct io_uring_sqe     *ns_sqes;
+    unsigned                 *pu_cq_head;
+    unsigned                 *pu_cq_tail;
+    unsigned                   u_cq_mask;
+    struct io_uring_cqe     *ns_cqes;
+    void                      *p_sq_ring;
+    size_t                    st_sq_ring;
+    void                      *p_cq_ring;
+    size_t                    st_cq_ring;
+    size_t                    st_sqes;
+    struct io_uring_buf_ring *ps_buf_ring;   // Provided buffer ring
+    unsigned short            us_buf_tail;
+    char                     *nc_buffers;    // URING_BUFFER_COUNT buffers
+    uint64_t                  u64_wake;      // Read from the wake-up eventfd
+    struct __kernel_timespec  s_retry;       // Shard backlog retry interval
+    int                       i_timeout_armed;
+    unsigned                   u_accept_gen;  // Accepts armed since a pause
+};
+/*                                                                            */
+/* Everything one event loop needs.  The connection table is two arrays       */
+/* indexed by slot: the pollfds, which the poll engine hands straight to      */
+/* poll, and the state of each connection.  The listener is always slot 0,    */
+/* the wake-up eventfd slot 1 and the Unix listener (-l) slot 2; a free slot  */
+/* has a pollfd of -1, which poll skips, and so has slot 2 without -l.  Both  */
+/* arrays are reserved at their full size up front and only touched as slots  */
+/* are used, so they never move and adding or removing a connection is a free */
+/* list push or pop.  The epoll and io_uring engines use the table as the     */
+/* list of clients and find a slot from a handle.                             */
+/*                                                                            */
+/* Each reactor is run by its own thread and nothing in here is touched by    */
+/* any other thread except the shard rings and the wake-up eventfd.           */
+/*                                                                            */
+/* A fan-out worker (-w) is a reactor too, with no listener and no rooms,     */
+/* that only writes.  Its table holds a descriptor of its own for each client */
+/* in its share; the pollfds only list the ones waiting for room to write.    */
+/* Its other threads' way in is the job queue and the wake-up eventfd.        */
+/*                                                                            */
+struct reactor
+{
+    int                    i_id;           // Index in ns_reactors
+    int                    i_engine;       // ENGINE_POLL, _EPOLL or _URING
+    int                    i_listener;     // Listening socket descriptor
+    int                    i_local;        // Unix listener (-l), shared, or -1
+    int                    i_wake_fd;      // eventfd other reactors poke
+    int                    i_epfd;         // epoll instance (epoll only)
+    int                    i_frame_max;    // Largest frame payload, 0 = off
+    uint64_t               u64_idle;       // Idle timeout in ticks, 0 = off
+    uint64_t               u64_beat;       // Heartbeat interval, 0 = off
+    uint64_t               u64_slow;       // Slow-consumer deadline, 0 = off
+    struct timer_wheel     s_wheel;        // Timers of this reactor's clients
+    struct message       *ps_keepalive;    // Zero-length frame for heartbeats
+    int                    i_room_mode;    // Frames are room commands (-r)
+    struct room         **ns_rooms;       // Hash table of this reactor's rooms
+    unsigned               u_room_buckets; // Buckets in ns_rooms (power of 2)
+    long                   l_rooms;        // Rooms in ns_rooms
+    long                   l_maps;         // Rings handed to clients (-M)
+    char                 *nc_history;     // History directory (-d) or NULL
+    int                    i_rings;        // Rooms keep a ring (-d or -M)
+    int                    i_replay;       // Messages replayed on JOIN (-n)
+    int                    i_zerocopy;     // Smallest zero-copy write, 0 = off
+    uint64_t               u64_rate;       // Messages a second per client (-m)
+    uint64_t               u64_burst;      // ...or at once (-b), 0 = no limit
+    long                   l_queue_max;    // Most bytes queued per client (-q)
+    long                   l_clients_high; // Stop accepting at this many (-C)
+    long                   l_clients_low;  // ...start again at this many
+    long                   l_queued_high;  // Queued bytes that shed (-Q)
+    long                   l_queued_low;   // ...and that accepting resumes at
+    long                   l_paused;       // 1 while listeners are not watched
+    int                    i_immediate;    // Write every message at once (-W)
+    uint64_t               u64_linger;     // Nanoseconds a batch may wait (-L)
+    uint64_t              *nu64_dirty;     // Handles of clients to write
+    int                    i_dirty;        // Entries in nu64_dirty
+    int                    i_dirty_size;   // Entries allocated in nu64_dirty
+    uint64_t               u64_dirty_since; // metrics_clock of the first one
+    struct uring         *ps_uring;        // Rings (io_uring engine only)
+    struct pollfd        *ns_pfds;         // [slot] descriptor and events
+    struct connection    *ns_slots;        // [slot] connection state
+    int                    i_slot_max;     // Slots reserved in both
+    int                    i_slot_high;    // One past the highest slot used
+    int                    i_free;         // First free slot, -1 if none
+    int                    i_clients;      // Client slots in use
+    struct reactor       *ns_reactors;     // Every reactor, this one included
+    int                    i_reactors;     // Entries in ns_reactors
+    struct reactor       *ns_workers;      // Fan-out workers (-w) or NULL
+    int                    i_workers;      // Entries in ns_workers
+    char                 *nc_fanout_wake;  // Workers owed a poke, by index
+    struct reactor       *ps_owner;        // A worker's reactor, else NULL
+    struct fanout_queue  *ps_jobs;         // A worker's job queue
+    struct shard_ring   **ns_inbound;      // [from] rings into this reactor
+    struct shard_backlog *as_backlog_head[MAX_REACTORS]; // [to] overflow
+    struct shard_backlog *as_backlog_tail[MAX_REACTORS];
+    int                    i_backlog;      // Messages in all backlogs
+    char                  ac_wake[MAX_REACTORS]; // [to] needs an eventfd poke
+    long                   l_messages;     // Messages received from clients
+    long                   l_deliveries;   // Copies sent to clients
+    long                   l_syscalls;     // System calls made by the loop
+    long                   l_queued;       // Bytes in all output queues
+    long                   l_queue_peak;   // Deepest single queue seen
+    long                   l_backlogged;   // Clients with a non-empty queue
+    long                   l_stalls;       // Writes cut short by a full socket
+    long                   l_idle_drops;   // Clients closed for being idle
+    long                   l_slow_drops;   // Clients closed for reading slowly
+    long                   l_zc_sends;     // Writes sent with MSG_ZEROCOPY
+    long                   l_zc_copied;    // ...that the kernel copied anyway
+    long                   l_rate_drops;   // Messages over a client's rate
+    long                   l_evictions;    // Clients over the queue limit
+    long                   l_sheds;        // Clients dropped for overload
+    long                   l_accepts;      // Connections accepted
+    long                   l_accept_wakes; // Listener wakeups that took them
+    long                   l_bytes_in;     // Bytes received from clients
+    long                   l_bytes_out;    // Bytes written to clients
+    long                   l_send_errors;  // Clients a write failed on
+    int                    i_metrics;      // Loop passes are timed (-S)
+    long                   l_loop_usec;    // Time spent in timed passes
+    long                   al_loop_hist[METRICS_BUCKETS]; // Passes by time
+    int                    i_status;       // What the loop returned
+    pthread_t              t_thread;
+};
+/*                                                                            */
+/* A record on the hand-over connection (-H).  The two servers are the same   */
+/* program on the same host, so it goes in native byte order.  The            */
+/* descriptors ride along with it as SCM_RIGHTS and the bytes it counts       */
+/* follow it:                                                                 */
+/*                                                                            */
+struct handoff_record
+{
+    uint32_t u32_kind;    // HANDOFF_LISTENERS, _CLIENT or _END
+    uint32_t u32_fds;     // Descriptors passed with the record
+    uint32_t u32_local;   // The last of them is the Unix listener (-l)
+    uint32_t u32_reactor; // Reactor the client was on
+    uint32_t u32_zc_next; // Number of its next zero-copy send
+    uint32_t u32_in;      // Bytes of partial frame that follow
+    uint32_t u32_out;     // Bytes it is still owed that follow
+    uint32_t u32_rooms;   // Bytes of room names that follow, each ended by \0
+};
+
+/*                                                                            */
+/* A per-reactor counter shown on the metrics port (-S), found by its offset  */
+/* in struct reactor:                                                         */
+/*                                                                            */
+struct metric_field
+{
+    char   *nc_name;
+    char   *nc_type;   // "counter" or "gauge"
+    char   *nc_help;
+    size_t  st_offset; // Of a long in struct reactor
+};
+
+static const struct metric_field gas_metric_fields[] =
+{
+    { "chat_accepts_total", "counter", "Connections accepted",
+        offsetof(struct reactor, l_accepts) },
+    { "chat_bytes_in_total", "counter", "Bytes received from clients",
+        offsetof(struct reactor, l_bytes_in) },
+    { "chat_bytes_out_total", "counter", "Bytes written to clients",
+        offsetof(struct reactor, l_bytes_out) },
+    { "chat_messages_total", "counter", "Messages received from clients",
+        offsetof(struct reactor, l_messages) },
+    { "chat_deliveries_total", "counter", "Copies of messages queued for "
+        "clients", offsetof(struct reactor, l_deliveries) },
+    { "chat_send_errors_total", "counter", "Clients a write failed on",
+        offsetof(struct reactor, l_send_errors) },
+    { "chat_stalled_writes_total", "counter", "Writes cut short by a full "
+        "socket", offsetof(struct reactor, l_stalls) },
+    { "chat_syscalls_total", "counter", "System calls made by the loop",
+        offsetof(struct reactor, l_syscalls) },
+    { "chat_queued_bytes", "gauge", "Bytes in client output queues",
+        offsetof(struct reactor, l_queued) },
+    { "chat_queued_clients", "gauge", "Clients with a non-empty output queue",
+        offsetof(struct reactor, l_backlogged) },
+    { "chat_queue_peak_bytes", "gauge", "Deepest output queue seen",
+        offsetof(struct reactor, l_queue_peak) },
+    { "chat_shed_clients_total", "counter", "Clients dropped to get under "
+        "-C or -Q", offsetof(struct reactor, l_sheds) },
+    { "chat_accept_paused", "gauge", "1 while the listeners are not watched",
+        offsetof(struct reactor, l_paused) }
+};
+
+static int gi_stop; // Set once the main thread gets SIGINT/SIGTERM
+static int gi_handoff_listener = -1; // Unix socket a new server connects to
+static int gi_handoff_fd = -1;       // New server that connected to it
+static struct ring_file *gps_ring_files; // Room rings in memory (-M)
+static pthread_mutex_t    gs_ring_lock = PTHREAD_MUTEX_INITIALIZER;
+static int gi_metrics_listener = -1; // Metrics port (-S)
+static int gi_overloaded; // Past a high watermark (-C, -Q), not back down yet
+
+void  accept_new_connection(struct reactor*, int);
+int   add_to_pfds(struct reactor*, int);
+void  broadcast_message(struct reactor*, int, struct message*);
+void  close_connection(struct reactor*, int);
+void  coalesce_add(struct reactor*, struct connection*);
+void  coalesce_flush(struct reactor*);
+int   coalesce_wait(struct reactor*, int, struct timespec*);
+void  conn_consume(struct reactor*, struct connection*, long);
+void  conn_discard(struct reactor*, struct connection*);
+void  conn_enqueue(struct reactor*, struct connection*, struct message*);
+void  conn_evict(struct reactor*, struct connection*);
+void  conn_fail(struct reactor*, struct connection*, int);
+void  conn_flush(struct reactor*, struct connection*);
+void  conn_release(struct reactor*, struct connection*);
+int   conn_gather(struct connection*, struct iovec*);
+int   conn_open(struct reactor*, int);
+int   conn_pin(struct connection*, int);
+int   conn_reap(struct reactor*, struct connection*);
+int   conn_reassemble(struct reactor*, int);
+int   conn_reserve(struct connection*, int);
+int   conn_take_token(struct reactor*, struct connection*);
+void  conn_want_write(struct reactor*, struct connection*, int);
+void  del_from_pfds(struct reactor*, int);
+void  deliver_to_clients(struct reactor*, int, struct message*);
+int   fanout_add(struct reactor*, int);
+void  fanout_attach(struct reactor*, int, int);
+void  fanout_broadcast(struct reactor*, int, struct message*);
+void  fanout_close(struct reactor*);
+void  fanout_detach(struct reactor*, int);
+void  fanout_drain(struct reactor*);
+void  fanout_flush(struct reactor*);
+int   fanout_init(struct reactor*);
+struct fanout_job *fanout_job(int);
+void  fanout_link(struct fanout_queue*, struct fanout_job*);
+struct fanout_job *fanout_pop(struct fanout_queue*);
+void  fanout_push(struct reactor*, int, int, struct fanout_job*);
+void  fanout_room(struct reactor*, struct room*, int, struct message*);
+void  fanout_send(struct reactor*, int, struct message*);
+void *get_in_addr(struct sockaddr*);
+int   get_listener_socket(char*, char*, int);
+int   handle_client_data(struct reactor*, int);
+int   handoff_adopt(int, struct reactor*, int);
+int   handoff_connect(char*, int*, int*, int*);
+int   handoff_get(int, struct handoff_record*, int*, int);
+int   handoff_listen(char*);
+int   handoff_put(int, struct handoff_record*, int*, int);
+int   handoff_read(int, char*, long);
+int   handoff_send(int, struct reactor*, int);
+void *handoff_thread(void*);
+int   handoff_write(int, char*, long);
+void  history_append(struct history*, struct message*);
+void  history_close_all(void);
+int   history_file(struct reactor*, char*, int, int);
+struct history *history_open(struct reactor*, char*, int);
+void  history_replay(struct reactor*, int, struct history*);
+struct message *message_alloc(int);
+void  message_hold(struct message*, int);
+void  message_release(struct message*);
+uint64_t metrics_clock(void);
+void  metrics_loop(struct reactor*, uint64_t);
+struct reactor *metrics_reactor(struct reactor*, int, char*);
+void *metrics_thread(void*);
+void  metrics_write(FILE*, struct reactor*, long*, uint64_t*);
+void  overload_check(struct reactor*);
+int   overload_compare(const void*, const void*);
+void  overload_listen(struct reactor*, int);
+int   overload_parse(char*, long*, long*);
+void  overload_signal(struct reactor*, int);
+void  overload_shed(struct reactor*, long);
+void  overload_totals(struct reactor*, long*, long*);
+void  reactor_close(struct reactor*);
+int   reactor_init(struct reactor*);
+void *reactor_thread(void*);
+void  report_error(char*, int);
+void  report_queues(struct reactor*, int);
+int   room_command(struct reactor*, int, char*, int);
+void  room_deliver(struct reactor*, int, struct message*);
+struct room *room_find(struct reactor*, char*, int, int);
+uint32_t room_hash(char*, int);
+int   room_join(struct reactor*, int, struct room*);
+void  room_leave(struct reactor*, int, int);
+void  room_leave_all(struct reactor*, int);
+void  room_map(struct reactor*, int, char*, int);
+void  room_remove(struct reactor*, struct room*);
+int   run_epoll_loop(struct reactor*);
+int   run_fanout_loop(struct reactor*);
+int   run_poll_loop(struct reactor*);
+int   run_uring_loop(struct reactor*);
+void  shard_drain(struct reactor*);
+void  shard_flush(struct reactor*);
+void  shard_forward(struct reactor*, struct message*);
+int   shard_push(struct shard_ring*, struct message*);
+void  slot_free(struct reactor*, int);
+int   slot_lookup(struct reactor*, uint64_t);
+void  timer_advance(struct reactor*);
+void  timer_cancel(struct timer_wheel*, struct timer*);
+uint64_t timer_clock(void);
+void  timer_fire(struct reactor*, struct timer*);
+int   timer_first_used(uint64_t*, int);
+uint64_t timer_next(struct timer_wheel*);
+void  timer_schedule(struct timer_wheel*, struct timer*, uint64_t);
+int   timer_timeout(struct timer_wheel*);
+void  uring_arm_accept(struct reactor*, int);
+void  uring_arm_recv(struct reactor*, int);
+void  uring_arm_wake(struct reactor*);
+void  uring_close(struct uring*);
+struct io_uring_sqe *uring_get_sqe(struct reactor*);
+void  uring_handle_cqe(struct reactor*, struct io_uring_cqe*);
+void  uring_provide_buffer(struct uring*, unsigned short);
+int   uring_setup(struct uring*);
+int   uring_submit(struct reactor*, unsigned, int);
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+int main
+(
+    int    argc,
+    char  *argv[]
+)
+{
+    int              ai_listeners[MAX_REACTORS];
+    int              i_beat;
+    int              i_engine;
+    int              i_frame_max;
+    int              i_from;
+    int              i_handed;
+    int              i_handoff;
+    int              i_idle;
+    int              i_immediate;
+    int              i_lc;
+    int              i_listeners;
+    int              i_local;
+    int              i_opt;
+    int              i_reactors;
+    int              i_replay;
+    int              i_rings;
+    int              i_room_mode;
+    int              i_signal;
+    int              i_slow;
+    int              i_started;
+    int              i_status;
+    int              i_workers;
+    int              i_workers_started;
+    int              i_zerocopy;
+    long             l_burst;
+    long             l_clients_high;
+    long             l_clients_low;
+    long             l_deliveries;
+    long             l_linger;
+    long             l_messages;
+    long             l_queue_max;
+    long             l_queued_high;
+    long             l_queued_low;
+    long             l_rate;
+    long             l_syscalls;
+    char            *nc_handoff;
+    char            *nc_history;
+    char            *nc_local;
+    char            *nc_metrics;
+    struct reactor *ns_reactors;
+    struct reactor *ps_worker;
+    sigset_t         s_signals;
+    pthread_t        t_handoff;
+    pthread_t        t_metrics;
+    uint64_t         u64_one;
+/*                                                                            */
+/* Pick the event loop (epoll is the default on Linux), how many reactors to  */
+/* run, whether clients send length-prefixed frames and which timeouts apply: */
+/*                                                                            */
+    i_engine = ENGINE_EPOLL;
+    i_frame_max = 0;
+    i_reactors = 1;
+    i_idle = 0;
+    i_beat = 0;
+    i_slow = 0;
+    i_room_mode = 0;
+    nc_history = NULL;
+    i_rings = 0;
+    i_replay = HISTORY_REPLAY;
+    i_zerocopy = 0;
+    i_workers = 0;
+    i_immediate = 0;
+    l_linger = 0;
+    l_rate = 0;
+    l_burst = 0;
+    l_queue_max = 0;
+    l_clients_high = 0;
+    l_clients_low = 0;
+    l_queued_high = 0;
+    l_queued_low = 0;
+    nc_handoff = NULL;
+    nc_local = NULL;
+    nc_metrics = NULL;
+
+    while ((i_opt = getopt(argc, argv,
+        "b:C:d:e:f:H:i:k:L:l:m:Mn:Q:q:rS:s:t:Ww:z:")) != -1)
+    {
+        if (i_opt == 'b' && atol(optarg) > 0 && atol(optarg) <= RATE_MAX)
+        {
+            l_burst = atol(optarg);
+        }
+        else if (i_opt == 'C' && overload_parse(optarg, NULL, NULL) == 0)
+        {
+            overload_parse(optarg, &l_clients_high, &l_clients_low);
+        }
+        else if (i_opt == 'd' && strlen(optarg) < 1024)
+        {
+            nc_history = optarg;
+        }
+        else if (i_opt == 'e' && strcmp(optarg, "poll") == 0)
+        {
+            i_engine = ENGINE_POLL;
+        }
+        else if (i_opt == 'e' && strcmp(optarg, "epoll") == 0)
+        {
+            i_engine = ENGINE_EPOLL;
+        }
+        else if (i_opt == 'e' && strcmp(optarg, "uring") == 0)
+        {
+            i_engine = ENGINE_URING;
+        }
+        else if (i_opt == 'f' && atoi(optarg) > 0 &&
+            atoi(optarg) <= FRAME_MAX_LIMIT)
+        {
+            i_frame_max = atoi(optarg);
+        }
+        else if (i_opt == 'H' &&
+            strlen(optarg) < sizeof(((struct sockaddr_un*)0)->sun_path))
+        {
+            nc_handoff = optarg;
+        }
+        else if (i_opt == 'i' && atoi(optarg) > 0 &&
+            atoi(optarg) <= TIMER_MAX_SECS)
+        {
+            i_idle = atoi(optarg);
+        }
+        else if (i_opt == 'k' && atoi(optarg) > 0 &&
+            atoi(optarg) <= TIMER_MAX_SECS)
+        {
+            i_beat = atoi(optarg);
+        }
+        else if (i_opt == 'L' && atol(optarg) > 0 &&
+            atol(optarg) <= LINGER_MAX)
+        {
+            l_linger = atol(optarg);
+        }
+        else if (i_opt == 'l' &&
+            strlen(optarg) < sizeof(((struct sockaddr_un*)0)->sun_path))
+        {
+            nc_local = optarg;
+        }
+        else if (i_opt == 'm' && atol(optarg) > 0 && atol(optarg) <= RATE_MAX)
+        {
+            l_rate = atol(optarg);
+        }
+        else if (i_opt == 'M')
+        {
+            i_rings = 1;
+        }
+        else if (i_opt == 'n' && atoi(optarg) >= 0 &&
+            atoi(optarg) <= HISTORY_INDEX / 2)
+        {
+            i_replay = atoi(optarg);
+        }
+        else if (i_opt == 'Q' && overload_parse(optarg, NULL, NULL) == 0)
+        {
+            overload_parse(optarg, &l_queued_high, &l_queued_low);
+        }
+        else if (i_opt == 'q' && atol(optarg) > 0)
+        {
+            l_queue_max = atol(optarg);
+        }
+        else if (i_opt == 'r')
+        {
+            i_room_mode = 1;
+        }
+        else if (i_opt == 'S' && atoi(optarg) > 0 && atoi(optarg) < 65536)
+        {
+            nc_metrics = optarg;
+        }
+        else if (i_opt == 's' && atoi(optarg) > 0 &&
+            atoi(optarg) <= TIMER_MAX_SECS)
+        {
+            i_slow = atoi(optarg);
+        }
+        else if (i_opt == 't' && atoi(optarg) >= 0 &&
+            atoi(optarg) <= MAX_REACTORS)
+        {
+            i_reactors = atoi(optarg);
+
+            if (i_reactors == 0) // One per core
+            {
+                i_reactors = (int)sysconf(_SC_NPROCESSORS_ONLN);
+                i_reactors = i_reactors > MAX_REACTORS ? MAX_REACTORS :
+                    i_reactors < 1 ? 1 : i_reactors;
+            }
+        }
+        else if (i_opt == 'W')
+        {
+            i_immediate = 1;
+        }
+        else if (i_opt == 'w' && atoi(optarg) >= 0 &&
+            atoi(optarg) <= FANOUT_MAX)
+        {
+            i_workers = atoi(optarg);
+        }
+        else if (i_opt == 'z' && atoi(optarg) > 0)
+        {
+            i_zerocopy = atoi(optarg);
+        }
+        else
+        {
+            fprintf(stderr, "usage: pollserver [-b burst] "
+                "[-C clients_high[:low]] [-d history_dir]\n"
+                "                  [-e poll|epoll|uring] [-f max_frame] "
+                "[-H handoff_path] [-i idle_secs]\n"
+                "                  [-k heartbeat_secs] [-L linger_usecs] "
+                "[-l local_path] [-M]\n"
+                "                  [-m messages_per_sec] [-n replay] "
+                "[-Q queued_high[:low]]\n"
+                "                  [-q queue_bytes] [-r] [-S metrics_port] "
+                "[-s slow_secs] [-t reactors]\n"
+                "                  [-W] [-w workers] [-z zerocopy_bytes]\n");
+
+            return 1;
+        }
+    }
+/*                                                                            */
+/* A heartbeat is an empty frame, which only means something to framed        */
+/* clients:                                                                   */
+/*                                                                            */
+    if (i_beat > 0 && i_frame_max == 0)
+    {
+        fprintf(stderr, "pollserver: -k needs -f\n");
+
+        return 1;
+    }
+/*                                                                            */
+/* Room commands are frames too:                                              */
+/*                                                                            */
+    if (i_room_mode && i_frame_max == 0)
+    {
+        fprintf(stderr, "pollserver: -r needs -f\n");
+
+        return 1;
+    }
+/*                                                                            */
+/* Histories are kept per room:                                               */
+/*                                                                            */
+    if (nc_history != NULL && !i_room_mode)
+    {
+        fprintf(stderr, "pollserver: -d needs -r\n");
+
+        return 1;
+    }
+
+    if (nc_history != NULL && access(nc_history, W_OK | X_OK) == -1)
+    {
+        report_error("access", errno);
+
+        return 1;
+    }
+/*                                                                            */
+/* Rings are per room too, and are only handed out over the Unix socket:      */
+/*                                                                            */
+    if (i_rings && (!i_room_mode || nc_local == NULL))
+    {
+        fprintf(stderr, "pollserver: -M needs -r and -l\n");
+
+        return 1;
+    }
+/*                                                                            */
+/* A burst limits a rate; without -b a client may send a second's worth at    */
+/* once:                                                                      */
+/*                                                                            */
+    if (l_burst > 0 && l_rate == 0)
+    {
+        fprintf(stderr, "pollserver: -b needs -m\n");
+
+        return 1;
+    }
+
+    if (l_rate > 0 && l_burst == 0)
+    {
+        l_burst = l_rate;
+    }
+/*                                                                            */
+/* io_uring writes with IORING_OP_WRITEV, which has no MSG_ZEROCOPY:          */
+/*                                                                            */
+    if (i_zerocopy > 0 && i_engine == ENGINE_URING)
+    {
+        fprintf(stderr, "pollserver: -z needs -e poll or -e epoll\n");
+
+        return 1;
+    }
+/*                                                                            */
+/* A hand-over needs the loops to stop with nothing in flight, and io_uring   */
+/* can have a writev half done inside the kernel:                             */
+/*                                                                            */
+    if (nc_handoff != NULL && i_engine == ENGINE_URING)
+    {
+        fprintf(stderr, "pollserver: -H needs -e poll or -e epoll\n");
+
+        return 1;
+    }
+/*                                                                            */
+/* Fan-out workers write with writev from a poll or epoll loop of their own.  */
+/* They keep no zero-copy sends, have nothing to hand over and the client's   */
+/* reactor cannot write a ring to it behind their back:                       */
+/*                                                                            */
+    if (i_workers > 0 && i_engine == ENGINE_URING)
+    {
+        fprintf(stderr, "pollserver: -w needs -e poll or -e epoll\n");
+
+        return 1;
+    }
+
+    if (i_workers > 0 && (i_zerocopy > 0 || nc_handoff != NULL || i_rings))
+    {
+        fprintf(stderr, "pollserver: -w cannot be used with -z, -H or -M\n");
+
+        return 1;
+    }
+/*                                                                            */
+/* A lingering batch is waited for with ppoll or epoll_pwait2; io_uring waits */
+/* in milliseconds.  -W writes every message at once, so nothing lingers:     */
+/*                                                                            */
+    if (l_linger > 0 && (i_engine == ENGINE_URING || i_immediate))
+    {
+        fprintf(stderr, "pollserver: -L needs -e poll or -e epoll, and no "
+            "-W\n");
+
+        return 1;
+    }
+/*                                                                            */
+/* SIGINT, SIGTERM, SIGUSR1 and SIGUSR2 are only taken by this thread, in     */
+/* sigwait below.  The other threads inherit the blocked mask:                */
+/*                                                                            */
+    sigemptyset(&s_signals);
+    sigaddset(&s_signals, SIGINT);
+    sigaddset(&s_signals, SIGTERM);
+    sigaddset(&s_signals, SIGUSR1);
+    sigaddset(&s_signals, SIGUSR2);
+
+    if (pthread_sigmask(SIG_BLOCK, &s_signals, NULL) != 0)
+    {
+        fprintf(stderr, "pthread_sigmask failed.\n");
+
+        return 1;
+    }
+/*                                                                            */
+/* Writing to a client the server has just dropped must fail with EPIPE, not  */
+/* kill the server.  writev has no MSG_NOSIGNAL and neither has io_uring's:   */
+/*                                                                            */
+    signal(SIGPIPE, SIG_IGN);
+/*                                                                            */
+/* With -H, a server already running on the path hands over its listeners     */
+/* first, so no connection is refused while this one starts:                  */
+/*                                                                            */
+    i_handoff = -1;
+    i_listeners = 0;
+    i_local = -1;
+
+    if (nc_handoff != NULL)
+    {
+        i_handoff = handoff_connect(nc_handoff, ai_listeners, &i_listeners,
+            &i_local);
+
+        if (i_handoff == -2)
+        {
+            return 3;
+        }
+
+        while (i_listeners > i_reactors) // Its queue is lost with it
+        {
+            close(ai_listeners[--i_listeners]);
+        }
+
+        if (i_local != -1 && nc_local == NULL)
+        {
+            close(i_local);
+            i_local = -1;
+        }
+    }
+/*                                                                            */
+/* With -l, clients on this host can also connect over a Unix socket.  There  */
+/* is one listener for all the reactors; each watches it and whichever takes  */
+/* a connection serves it:                                                    */
+/*                                                                            */
+    if (nc_local != NULL && i_local == -1)
+    {
+        i_local = get_listener_socket(nc_local, NULL, 0);
+
+        if (i_local == -1)
+        {
+            while (i_listeners > 0)
+            {
+                close(ai_listeners[--i_listeners]);
+            }
+
+            return 3;
+        }
+    }
+
+    if (i_local != -1 && i_engine != ENGINE_URING &&
+        fcntl(i_local, F_SETFL, O_NONBLOCK) == -1)
+    {
+        report_error("fcntl", errno);
+
+        return 3;
+    }
+/*                                                                            */
+/* Set up the reactors.  Each gets its own listener on the same port:         */
+/*                                                                            */
+    ns_reactors = calloc(i_reactors, sizeof(struct reactor));
+
+    if (ns_reactors == NULL)
+    {
+        fprintf(stderr, "Unable to allocate the reactors.\n");
+
+        return 2;
+    }
+
+    for (i_lc = 0; i_lc < i_reactors; i_lc++)
+    {
+        ns_reactors[i_lc].i_id = i_lc;
+        ns_reactors[i_lc].i_listener = i_lc < i_listeners ?
+            ai_listeners[i_lc] : -1;
+        ns_reactors[i_lc].i_local = i_local;
+        ns_reactors[i_lc].i_engine = i_engine;
+        ns_reactors[i_lc].i_frame_max = i_frame_max;
+        ns_reactors[i_lc].i_room_mode = i_room_mode;
+        ns_reactors[i_lc].nc_history = nc_history;
+        ns_reactors[i_lc].i_rings = i_rings || nc_history != NULL;
+        ns_reactors[i_lc].i_replay = i_replay;
+        ns_reactors[i_lc].i_zerocopy = i_zerocopy;
+        ns_reactors[i_lc].u64_rate = (uint64_t)l_rate;
+        ns_reactors[i_lc].u64_burst = (uint64_t)l_burst;
+        ns_reactors[i_lc].l_queue_max = l_queue_max;
+        ns_reactors[i_lc].l_clients_high = l_clients_high;
+        ns_reactors[i_lc].l_clients_low = l_clients_low;
+        ns_reactors[i_lc].l_queued_high = l_queued_high;
+        ns_reactors[i_lc].l_queued_low = l_queued_low;
+        ns_reactors[i_lc].i_immediate = i_immediate;
+        ns_reactors[i_lc].u64_linger = (uint64_t)l_linger * 1000;
+        ns_reactors[i_lc].i_metrics = nc_metrics != NULL;
+        ns_reactors[i_lc].u64_idle = (uint64_t)i_idle * 1000 / TIMER_TICK_MS;
+        ns_reactors[i_lc].u64_beat = (uint64_t)i_beat * 1000 / TIMER_TICK_MS;
+        ns_reactors[i_lc].u64_slow = (uint64_t)i_slow * 1000 / TIMER_TICK_MS;
+        ns_reactors[i_lc].ns_reactors = ns_reactors;
+        ns_reactors[i_lc].i_reactors = i_reactors;
+        ns_reactors[i_lc].i_workers = i_workers;
+
+        if (reactor_init(&ns_reactors[i_lc]) == -1)
+        {
+            while (--i_lc >= 0)
+            {
+                reactor_close(&ns_reactors[i_lc]);
+            }
+
+            free(ns_reactors);
+
+            return 3;
+        }
+
+        if (i_workers > 0 && fanout_init(&ns_reactors[i_lc]) == -1)
+        {
+            for (i_from = 0; i_from <= i_lc; i_from++)
+            {
+                reactor_close(&ns_reactors[i_from]);
+            }
+
+            free(ns_reactors);
+
+            return 3;
+        }
+    }
+/*                                                                            */
+/* One ring for every ordered pair of reactors:                               */
+/*                                                                            */
+    for (i_lc = 0; i_lc < i_reactors; i_lc++)
+    {
+        for (i_from = 0; i_from < i_reactors && i_reactors > 1; i_from++)
+        {
+            if (i_from != i_lc)
+            {
+                ns_reactors[i_lc].ns_inbound[i_from] = aligned_alloc(64,
+                    sizeof(struct shard_ring));
+
+                if (ns_reactors[i_lc].ns_inbound[i_from] == NULL)
+                {
+                    fprintf(stderr, "Unable to allocate the shard rings.\n");
+
+                    for (i_lc = 0; i_lc < i_reactors; i_lc++)
+                    {
+                        reactor_close(&ns_reactors[i_lc]);
+                    }
+
+                    free(ns_reactors);
+
+                    return 2;
+                }
+
+                memset(ns_reactors[i_lc].ns_inbound[i_from], 0,
+                    sizeof(struct shard_ring));
+            }
+        }
+    }
+/*                                                                            */
+/* Take over the old server's clients, then listen for the next server in     */
+/* its place:                                                                 */
+/*                                                                            */
+    if (i_handoff >= 0 &&
+        handoff_adopt(i_handoff, ns_reactors, i_reactors) == -1)
+    {
+        for (i_lc = 0; i_lc < i_reactors; i_lc++)
+        {
+            reactor_close(&ns_reactors[i_lc]);
+        }
+
+        free(ns_reactors);
+
+        return 3;
+    }
+
+    if (nc_handoff != NULL)
+    {
+        gi_handoff_listener = handoff_listen(nc_handoff);
+
+        if (gi_handoff_listener == -1)
+        {
+            for (i_lc = 0; i_lc < i_reactors; i_lc++)
+            {
+                reactor_close(&ns_reactors[i_lc]);
+            }
+
+            free(ns_reactors);
+
+            return 3;
+        }
+    }
+
+/*                                                                            */
+/* With -S a thread of its own serves the metrics, so a scrape never holds up */
+/* a reactor.  The port is shared with SO_REUSEPORT so the next server can    */
+/* bind it during a hot restart (-H):                                         */
+/*                                                                            */
+    if (nc_metrics != NULL)
+    {
+        gi_metrics_listener = get_listener_socket(NULL, nc_metrics, 1);
+
+        if (gi_metrics_listener == -1 ||
+            pthread_create(&t_metrics, NULL, metrics_thread, ns_reactors) != 0)
+        {
+            fprintf(stderr, "pollserver: unable to serve metrics on port "
+                "%s\n", nc_metrics);
+
+            for (i_lc = 0; i_lc < i_reactors; i_lc++)
+            {
+                reactor_close(&ns_reactors[i_lc]);
+            }
+
+            free(ns_reactors);
+
+            return 3;
+        }
+    }
+
+    printf("pollserver: waiting for connections on port %s%s%s "
+        "(%s, %d reactor%s)\n", PORT,
+        i_local != -1 ? " and " : "", i_local != -1 ? nc_local : "",
+        i_engine == ENGINE_URING ? "io_uring" :
+        i_engine == ENGINE_EPOLL ? "epoll" : "poll",
+        i_reactors, i_reactors == 1 ? "" : "s");
+
+    if (i_workers > 0)
+    {
+        printf("pollserver: %d fan-out worker%s per reactor\n", i_workers,
+            i_workers == 1 ? "" : "s");
+    }
+
+    if (l_clients_high > 0)
+    {
+        printf("pollserver: stops accepting at %ld clients, starts again at "
+            "%ld\n", l_clients_high, l_clients_low);
+    }
+
+    if (l_queued_high > 0)
+    {
+        printf("pollserver: sheds the slowest clients over %ld queued bytes, "
+            "down to %ld\n", l_queued_high, l_queued_low);
+    }
+
+    if (nc_metrics != NULL)
+    {
+        printf("pollserver: metrics on port %s\n", nc_metrics);
+    }
+
+    fflush(stdout);
+/*                                                                            */
+/* Start the main loops.  None of them return until they are asked to stop    */
+/* or the wait itself fails.  A hand-over that falls through starts them      */
+/* again with everything as it was:                                           */
+/*                                                                            */
+    i_handed = 0;
+
+    for (;;)
+    {
+        i_started = i_reactors;
+        i_signal = 0;
+
+        for (i_lc = 0; i_lc < i_reactors; i_lc++)
+        {
+            i_status = pthread_create(&ns_reactors[i_lc].t_thread, NULL,
+                reactor_thread, &ns_reactors[i_lc]);
+
+            if (i_status != 0)
+            {
+                report_error("pthread_create", i_status);
+                __atomic_store_n(&gi_stop, 1, __ATOMIC_RELEASE);
+                i_started = i_lc;
+
+                break;
+            }
+        }
+
+        i_workers_started = 0;
+
+        for (i_lc = 0; i_lc < i_reactors * i_workers &&
+            i_started == i_reactors; i_lc++)
+        {
+            ps_worker = &ns_reactors[i_lc / i_workers].ns_workers[i_lc %
+                i_workers];
+            i_status = pthread_create(&ps_worker->t_thread, NULL,
+                reactor_thread, ps_worker);
+
+            if (i_status != 0)
+            {
+                report_error("pthread_create", i_status);
+                __atomic_store_n(&gi_stop, 1, __ATOMIC_RELEASE);
+
+                break;
+            }
+
+            i_workers_started++;
+        }
+
+        if (gi_handoff_listener != -1 &&
+            pthread_create(&t_handoff, NULL, handoff_thread, NULL) == 0)
+        {
+            pthread_detach(t_handoff);
+        }
+/*                                                                            */
+/* Wait for SIGINT or SIGTERM (a reactor that fails sends SIGTERM), or for    */
+/* SIGUSR2, which the hand-over thread raises when a new server connects.     */
+/* SIGUSR1 just prints the queue depths:                                      */
+/*                                                                            */
+        while (!__atomic_load_n(&gi_stop, __ATOMIC_ACQUIRE))
+        {
+            sigwait(&s_signals, &i_signal);
+
+            if (i_signal == SIGUSR1)
+            {
+                report_queues(ns_reactors, i_reactors);
+            }
+            else if (i_signal != SIGUSR2 ||
+                __atomic_load_n(&gi_handoff_fd, __ATOMIC_ACQUIRE) != -1)
+            {
+                break;
+            }
+        }
+/*                                                                            */
+/* Wake every reactor and worker so it sees gi_stop.  The workers go last, so */
+/* whatever the reactors hand them on the way out is freed by reactor_close:  */
+/*                                                                            */
+        __atomic_store_n(&gi_stop, 1, __ATOMIC_RELEASE);
+
+        u64_one = 1;
+
+        for (i_lc = 0; i_lc < i_started; i_lc++)
+        {
+            if (write(ns_reactors[i_lc].i_wake_fd, &u64_one,
+                sizeof(u64_one)) == -1)
+            {
+                report_error("write", errno);
+            }
+        }
+
+        for (i_lc = 0; i_lc < i_started; i_lc++)
+        {
+            pthread_join(ns_reactors[i_lc].t_thread, NULL);
+        }
+
+        for (i_lc = 0; i_lc < i_workers_started; i_lc++)
+        {
+            ps_worker = &ns_reactors[i_lc / i_workers].ns_workers[i_lc %
+                i_workers];
+
+            if (write(ps_worker->i_wake_fd, &u64_one, sizeof(u64_one)) == -1)
+            {
+                report_error("write", errno);
+            }
+
+            pthread_join(ps_worker->t_thread, NULL);
+        }
+/*                                                                            */
+/* Hand the listeners and clients to the new server.  If it does not take     */
+/* them, carry on serving them:                                               */
+/*                                                                            */
+        if (i_signal != SIGUSR2 || i_started < i_reactors)
+        {
+            break;
+        }
+
+        if (handoff_send(gi_handoff_fd, ns_reactors, i_reactors) != -1)
+        {
+            i_handed = 1;
+
+            break;
+        }
+
+        fprintf(stderr, "pollserver: hand-over failed, carrying on\n");
+        close(gi_handoff_fd);
+        __atomic_store_n(&gi_handoff_fd, -1, __ATOMIC_RELEASE);
+        __atomic_store_n(&gi_stop, 0, __ATOMIC_RELEASE);
+    }
+
+    i_status = 0;
+    l_messages = 0;
+    l_deliveries = 0;
+    l_syscalls = 0;
+
+    for (i_lc = 0; i_lc < i_reactors; i_lc++)
+    {
+        if (i_status == 0)
+        {
+            i_status = ns_reactors[i_lc].i_status;
+        }
+
+        l_messages += ns_reactors[i_lc].l_messages;
+        l_deliveries += ns_reactors[i_lc].l_deliveries;
+        l_syscalls += ns_reactors[i_lc].l_syscalls;
+
+        for (i_from = 0; i_from < ns_reactors[i_lc].i_workers; i_from++)
+        {
+            ps_worker = &ns_reactors[i_lc].ns_workers[i_from];
+
+            if (i_status == 0)
+            {
+                i_status = ps_worker->i_status;
+            }
+
+            l_deliveries += ps_worker->l_deliveries;
+            l_syscalls += ps_worker->l_syscalls;
+        }
+    }
+/*                                                                            */
+/* Report how hard the loops had to work for what they delivered:             */
+/*                                                                            */
+    printf("pollserver: %ld messages, %ld deliveries, %ld system calls",
+        l_messages, l_deliveries, l_syscalls);
+
+    if (l_messages > 0)
+    {
+        printf(" (%.2f per message)", (double)l_syscalls / l_messages);
+    }
+
+    if (l_deliveries > 0)
+    {
+        printf(", %.3f per delivery", (double)l_syscalls / l_deliveries);
+    }
+
+    printf("\n");
+
+    report_queues(ns_reactors, i_reactors);
+/*                                                                            */
+/* Cleanup and exit.  After a hand-over closing the sockets only drops this   */
+/* process's references; the new server holds its own, and the path now       */
+/* belongs to it:                                                             */
+/*                                                                            */
+    if (gi_handoff_listener != -1)
+    {
+        close(gi_handoff_listener);
+
+        if (!i_handed)
+        {
+            unlink(nc_handoff);
+        }
+    }
+
+    if (gi_handoff_fd != -1)
+    {
+        close(gi_handoff_fd);
+    }
+/*                                                                            */
+/* shutdown wakes the metrics thread out of accept; it reads the reactors, so */
+/* it has to be gone before they are:                                         */
+/*                                                                            */
+    if (gi_metrics_listener != -1)
+    {
+        shutdown(gi_metrics_listener, SHUT_RDWR);
+        pthread_join(t_metrics, NULL);
+        close(gi_metrics_listener);
+    }
+
+    for (i_lc = 0; i_lc < ns_reactors[0].i_reactors; i_lc++)
+    {
+        reactor_close(&ns_reactors[i_lc]);
+    }
+
+    if (i_local != -1)
+    {
+        close(i_local);
+
+        if (!i_handed)
+        {
+            unlink(nc_local);
+        }
+    }
+
+    history_close_all();
+    free(ns_reactors);
+
+    return i_status;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Accept the connections waiting on a listener, TCP or Unix (-l), and add    */
+/* them to the set.  A reconnect storm can leave thousands queued, so one     */
+/* wakeup takes up to ACCEPT_BATCH of them instead of one; the rest wait for  */
+/* the next pass so the clients already connected are not starved.  accept4   */
+/* hands the sockets back non-blocking, which saves an fcntl per connection.  */
+/* Every reactor watches the Unix listener, so another may have emptied it.   */
+/* At -C the rest are left in the listen queue and the listeners unwatched:   */
+/*                                                                            */
+void accept_new_connection
+(
+    struct reactor *ps_reactor, /* both - Event loop accepting the connection */
+    int              i_listener /* in   - Listener that is ready              */
+)
+{
+    int                     i_errno;
+    int                     i_lc;
+    int                     i_newfd;      // Newly accept()ed socket descriptor
+    long                    l_clients;
+    long                    l_queued;
+    char                   ac_remoteIP[INET6_ADDRSTRLEN];
+    struct sockaddr_storage s_remoteaddr; // Client address
+    socklen_t               sl_addrlen;
+
+    COUNTER_ADD(ps_reactor->l_accept_wakes, 1);
+
+    for (i_lc = 0; i_lc < ACCEPT_BATCH; i_lc++)
+    {
+        if (ps_reactor->l_clients_high > 0 && !ps_reactor->l_paused)
+        {
+            overload_totals(ps_reactor, &l_clients, &l_queued);
+
+            if (l_clients >= ps_reactor->l_clients_high)
+            {
+                overload_signal(ps_reactor, 1);
+                overload_listen(ps_reactor, 0);
+            }
+        }
+/*                                                                            */
+/* An epoll event may still say ready after the listener was taken out:       */
+/*                                                                            */
+        if (ps_reactor->l_paused)
+        {
+            break;
+        }
+
+        sl_addrlen = sizeof(s_remoteaddr);
+
+        errno = 0;
+        i_newfd = accept4(i_listener,
+            (struct sockaddr*)&s_remoteaddr, &sl_addrlen,
+            SOCK_NONBLOCK | SOCK_CLOEXEC);
+        i_errno = errno;
+        COUNTER_ADD(ps_reactor->l_syscalls, 1);
+/*                                                                            */
+/* The queue is empty, or a client gave up while it waited in it:             */
+/*                                                                            */
+        if (i_newfd == -1 && (i_errno == EAGAIN || i_errno == EWOULDBLOCK))
+        {
+            break;
+        }
+
+        if (i_newfd == -1 && (i_errno == ECONNABORTED || i_errno == EINTR))
+        {
+            continue;
+        }
+
+        if (i_newfd == -1)
+        {
+            report_error("accept4", i_errno);
+
+            break;
+        }
+
+        if (conn_open(ps_reactor, i_newfd) == -1)
+        {
+            close(i_newfd);
+
+            continue;
+        }
+
+        COUNTER_ADD(ps_reactor->l_accepts, 1);
+
+        if (s_remoteaddr.ss_family == AF_UNIX)
+        {
+            strcpy(ac_remoteIP, "the Unix socket");
+        }
+        else
+        {
+            inet_ntop(s_remoteaddr.ss_family,
+                get_in_addr((struct sockaddr*)&s_remoteaddr),
+                ac_remoteIP, INET6_ADDRSTRLEN);
+        }
+
+        printf("pollserver: new connection from %s on socket %d\n",
+            ac_remoteIP, i_newfd);
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Add a new socket descriptor to the connection table.  The most recently    */
+/* freed slot is reused first; otherwise the table extends by one slot.       */
+/* Returns the slot or -1 if the table is full:                               */
+/*                                                                            */
+int add_to_pfds
+(
+    struct reactor *ps_reactor, /* both - Event loop that owns the table      */
+    int              i_newfd    /* in   - Descriptor to add                   */
+)
+{
+    struct connection *ps_conn;
+    int                 i_slot;
+    unsigned            u_gen;
+
+    if (ps_reactor->i_free != -1)
+    {
+        i_slot = ps_reactor->i_free;
+        ps_reactor->i_free = ps_reactor->ns_slots[i_slot].i_next_free;
+    }
+    else if (ps_reactor->i_slot_high < ps_reactor->i_slot_max)
+    {
+        i_slot = ps_reactor->i_slot_high;
+    }
+    else
+    {
+        fprintf(stderr, "pollserver: connection table full (%d slots)\n",
+            ps_reactor->i_slot_max);
+
+        return -1;
+    }
+
+    if (i_slot >= ps_reactor->i_slot_high)
+    {
+        ps_reactor->i_slot_high = i_slot + 1;
+    }
+/*                                                                            */
+/* Start the slot clean, keeping its generation:                              */
+/*                                                                            */
+    ps_conn = &ps_reactor->ns_slots[i_slot];
+    u_gen = ps_conn->u_gen;
+
+    memset(ps_conn, 0, sizeof(*ps_conn));
+    ps_conn->i_fd = i_newfd;
+    ps_conn->u_gen = u_gen;
+    ps_conn->i_next_free = -1;
+
+    ps_reactor->ns_pfds[i_slot].fd = i_newfd;
+    ps_reactor->ns_pfds[i_slot].events = POLLIN; // Check ready-to-read
+    ps_reactor->ns_pfds[i_slot].revents = 0;
+
+    if (i_slot < FIRST_CLIENT)
+    {
+        return i_slot;
+    }
+
+    COUNTER_ADD(ps_reactor->i_clients, 1);
+/*                                                                            */
+/* Start the client's idle and heartbeat clocks:                              */
+/*                                                                            */
+    ps_conn->u64_heard = ps_reactor->s_wheel.u64_now;
+    ps_conn->u64_sent = ps_reactor->s_wheel.u64_now;
+    ps_conn->s_idle.i_slot = i_slot;
+    ps_conn->s_idle.i_kind = TIMER_IDLE;
+    ps_conn->s_beat.i_slot = i_slot;
+    ps_conn->s_beat.i_kind = TIMER_BEAT;
+    ps_conn->s_slow.i_slot = i_slot;
+    ps_conn->s_slow.i_kind = TIMER_SLOW;
+    ps_conn->u64_tokens = ps_reactor->u64_burst * 1000;
+    ps_conn->u64_refill = ps_reactor->s_wheel.u64_now;
+
+    if (ps_reactor->u64_idle > 0)
+    {
+        timer_schedule(&ps_reactor->s_wheel, &ps_conn->s_idle,
+            ps_reactor->s_wheel.u64_now + ps_reactor->u64_idle);
+    }
+
+    if (ps_reactor->u64_beat > 0)
+    {
+        timer_schedule(&ps_reactor->s_wheel, &ps_conn->s_beat,
+            ps_reactor->s_wheel.u64_now + ps_reactor->u64_beat);
+    }
+
+    return i_slot;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* A client sent a message.  Send it to everyone else on this reactor and     */
+/* pass it on to the other reactors for their clients:                        */
+/*                                                                            */
+void broadcast_message
+(
+    struct reactor *ps_reactor, /* both - Event loop holding the sender       */
+    int              i_sender,  /* in   - Slot the message came from          */
+    struct message *ps_message  /* in   - Message                             */
+)
+{
+    if (ps_reactor->u64_burst > 0 &&
+        !conn_take_token(ps_reactor, &ps_reactor->ns_slots[i_sender]))
+    {
+        COUNTER_ADD(ps_reactor->l_rate_drops, 1);
+
+        return;
+    }
+
+    COUNTER_ADD(ps_reactor->l_messages, 1);
+/*                                                                            */
+/* With -w every worker of every reactor gets it straight from here:          */
+/*                                                                            */
+    if (ps_reactor->i_workers > 0 && !ps_reactor->i_room_mode)
+    {
+        fanout_broadcast(ps_reactor, i_sender, ps_message);
+
+        return;
+    }
+
+    deliver_to_clients(ps_reactor, i_sender, ps_message);
+
+    if (ps_reactor->i_reactors > 1)
+    {
+        shard_forward(ps_reactor, ps_message);
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Close a client and remove it from the set:                                 */
+/*                                                                            */
+void close_connection
+(
+    struct reactor *ps_reactor, /* both - Event loop that owns the client     */
+    int              i          /* in   - Slot of the client                  */
+)
+{
+    struct connection *ps_conn;
+    struct linger      s_linger;
+    int                 i_fd;
+
+    i_fd = ps_reactor->ns_pfds[i].fd;
+/*                                                                            */
+/* io_uring may still have sends for this socket waiting to be submitted.     */
+/* Submit them first so they take their own reference on the socket; after    */
+/* close the descriptor number can be handed to a new connection.  An armed   */
+/* multishot receive holds a reference too, so close alone would leave the    */
+/* connection up when the server drops a client; shutting it down ends both:  */
+/*                                                                            */
+    if (ps_reactor->i_engine == ENGINE_URING)
+    {
+        if (ps_reactor->ps_uring->u_to_submit > 0)
+        {
+            uring_submit(ps_reactor, 0, -1);
+        }
+
+        shutdown(i_fd, SHUT_RDWR);
+        COUNTER_ADD(ps_reactor->l_syscalls, 1);
+    }
+
+/*                                                                            */
+/* Messages the kernel may still be sending zero-copy are freed once the      */
+/* connection is gone, and nothing can say when the kernel is done with them  */
+/* after close.  Collect what has finished and throw the rest of the send     */
+/* queue away with an abortive close, so none of it is sent from a buffer     */
+/* that has been reused:                                                      */
+/*                                                                            */
+    ps_conn = &ps_reactor->ns_slots[i];
+
+    if (ps_conn->u_pin_head != ps_conn->u_pin_tail)
+    {
+        conn_reap(ps_reactor, ps_conn);
+
+        if (ps_conn->u_pin_head != ps_conn->u_pin_tail)
+        {
+            s_linger.l_onoff = 1;
+            s_linger.l_linger = 0;
+            setsockopt(i_fd, SOL_SOCKET, SO_LINGER, &s_linger,
+                sizeof(s_linger));
+            COUNTER_ADD(ps_reactor->l_syscalls, 1);
+        }
+    }
+
+    close(i_fd); // Bye!  (closing also drops it from epoll)
+    COUNTER_ADD(ps_reactor->l_syscalls, 1);
+/*                                                                            */
+/* Its worker (-w) closes its own descriptor for it when it gets here:        */
+/*                                                                            */
+    if (ps_conn->ps_detach != NULL)
+    {
+        fanout_push(ps_reactor, ps_reactor->i_id,
+            FANOUT_WORKER(i, ps_reactor->i_workers), ps_conn->ps_detach);
+        ps_conn->ps_detach = NULL;
+    }
+
+    del_from_pfds(ps_reactor, i);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* A message has been queued for a client that is not waiting to write.       */
+/* Note the client so it is written once at the end of the loop pass, with    */
+/* everything else queued for it by then, instead of once per message.  With  */
+/* -W, or if the list cannot grow, it is written now:                         */
+/*                                                                            */
+void coalesce_add
+(
+    struct reactor    *ps_reactor, /* both - Event loop that owns the client  */
+    struct connection *ps_conn     /* both - Client with something queued     */
+)
+{
+    uint64_t *nu64_dirty;
+    int        i_new_size;
+
+    if (ps_conn->i_dirty)
+    {
+        return;
+    }
+
+    if (ps_reactor->i_immediate)
+    {
+        conn_flush(ps_reactor, ps_conn);
+
+        return;
+    }
+
+    if (ps_reactor->i_dirty == ps_reactor->i_dirty_size)
+    {
+        i_new_size = ps_reactor->i_dirty_size == 0 ? COALESCE_INITIAL :
+            ps_reactor->i_dirty_size * 2;
+        nu64_dirty = realloc(ps_reactor->nu64_dirty,
+            sizeof(uint64_t) * i_new_size);
+
+        if (nu64_dirty == NULL)
+        {
+            conn_flush(ps_reactor, ps_conn);
+
+            return;
+        }
+
+        ps_reactor->nu64_dirty = nu64_dirty;
+        ps_reactor->i_dirty_size = i_new_size;
+    }
+
+    if (ps_reactor->i_dirty == 0 && ps_reactor->u64_linger > 0)
+    {
+        ps_reactor->u64_dirty_since = metrics_clock();
+    }
+
+    ps_reactor->nu64_dirty[ps_reactor->i_dirty++] = HANDLE_MAKE(ps_conn->u_gen,
+        (int)(ps_conn - ps_reactor->ns_slots));
+    ps_conn->i_dirty = 1;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* End of a loop pass: write every client noted by coalesce_add, each with a  */
+/* single writev for all it was sent during the pass.  With -L the batch is   */
+/* held until its first message has waited that long, so passes close         */
+/* together share one write.  A client closed since it was noted has a new    */
+/* generation and is skipped:                                                 */
+/*                                                                            */
+void coalesce_flush
+(
+    struct reactor *ps_reactor /* both - Event loop that owns the clients     */
+)
+{
+    struct connection *ps_conn;
+    int                 i_lc;
+    int                 i_slot;
+
+    if (ps_reactor->i_dirty == 0 || (ps_reactor->u64_linger > 0 &&
+        metrics_clock() - ps_reactor->u64_dirty_since <
+        ps_reactor->u64_linger))
+    {
+        return;
+    }
+
+    for (i_lc = 0; i_lc < ps_reactor->i_dirty; i_lc++)
+    {
+        i_slot = HANDLE_SLOT(ps_reactor->nu64_dirty[i_lc]);
+        ps_conn = &ps_reactor->ns_slots[i_slot];
+
+        if (i_slot < ps_reactor->i_slot_high && ps_conn->i_dirty &&
+            ps_conn->u_gen == HANDLE_GEN(ps_reactor->nu64_dirty[i_lc]))
+        {
+            ps_conn->i_dirty = 0;
+            conn_flush(ps_reactor, ps_conn);
+        }
+    }
+
+    ps_reactor->i_dirty = 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* How long the loop may sleep when a batch is lingering (-L).  Returns 1 and */
+/* fills in ps_wait if the batch is due before i_timeout, for ppoll or        */
+/* epoll_pwait2, or 0 if the loop can wait i_timeout as usual:                */
+/*                                                                            */
+int coalesce_wait
+(
+    struct reactor  *ps_reactor, /* in   - Event loop about to wait           */
+    int               i_timeout, /* in   - Its wait in ms, -1 = no limit      */
+    struct timespec *ps_wait     /* out  - Shorter wait                       */
+)
+{
+    uint64_t u64_due;
+    uint64_t u64_left;
+    uint64_t u64_now;
+
+    if (ps_reactor->i_dirty == 0 || ps_reactor->u64_linger == 0)
+    {
+        return 0;
+    }
+
+    u64_due = ps_reactor->u64_dirty_since + ps_reactor->u64_linger;
+    u64_now = metrics_clock();
+    u64_left = u64_now < u64_due ? u64_due - u64_now : 0;
+
+    if (i_timeout >= 0 && (uint64_t)i_timeout * 1000000 <= u64_left)
+    {
+        return 0;
+    }
+
+    ps_wait->tv_sec = (time_t)(u64_left / 1000000000);
+    ps_wait->tv_nsec = (long)(u64_left % 1000000000);
+
+    return 1;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Take bytes that have been written off the front of an output queue:        */
+/*                                                                            */
+void conn_consume
+(
+    struct reactor    *ps_reactor, /* both - Event loop that owns the client  */
+    struct connection *ps_conn,    /* both - Client whose queue was written   */
+    long                l_nbytes   /* in   - Bytes written                    */
+)
+{
+    struct message *ps_message;
+    int              i_part;
+
+    COUNTER_ADD(ps_reactor->l_queued, -l_nbytes);
+    COUNTER_ADD(ps_reactor->l_bytes_out, l_nbytes);
+    ps_conn->l_queued -= l_nbytes;
+
+    while (l_nbytes > 0)
+    {
+        ps_message = ps_conn->ns_queue[ps_conn->u_head &
+            (ps_conn->u_queue_size - 1)];
+        i_part = ps_message->i_len - ps_conn->i_sent;
+
+        if (l_nbytes < i_part) // Part of this one went
+        {
+            ps_conn->i_sent += (int)l_nbytes;
+
+            break;
+        }
+
+        l_nbytes -= i_part;
+        ps_conn->i_sent = 0;
+        ps_conn->u_head++;
+        message_release(ps_message);
+    }
+
+    if (ps_conn->u_head == ps_conn->u_tail)
+    {
+        COUNTER_ADD(ps_reactor->l_backlogged, -1);
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Throw away everything in an output queue:                                  */
+/*                                                                            */
+void conn_discard
+(
+    struct reactor    *ps_reactor, /* both - Event loop that owns the client  */
+    struct connection *ps_conn     /* both - Client whose queue goes          */
+)
+{
+    if (ps_conn->u_head == ps_conn->u_tail)
+    {
+        return;
+    }
+
+    while (ps_conn->u_head != ps_conn->u_tail)
+    {
+        message_release(ps_conn->ns_queue[ps_conn->u_head &
+            (ps_conn->u_queue_size - 1)]);
+        ps_conn->u_head++;
+    }
+
+    COUNTER_ADD(ps_reactor->l_queued, -ps_conn->l_queued);
+    COUNTER_ADD(ps_reactor->l_backlogged, -1);
+
+    ps_conn->i_sent = 0;
+    ps_conn->l_queued = 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Add a message to a client's output queue.  The queue takes over one        */
+/* reference the caller holds (or drops it if the queue cannot grow).  Unless */
+/* the client is already waiting to write, it is written at the end of the    */
+/* loop pass, together with whatever else it is sent in the meantime:         */
+/*                                                                            */
+void conn_enqueue
+(
+    struct reactor    *ps_reactor, /* both - Event loop that owns the client  */
+    struct connection *ps_conn,    /* both - Client to send to                */
+    struct message    *ps_message  /* in   - Message, one reference for us    */
+)
+{
+    struct message **ns_queue;
+    unsigned          u_count;
+    unsigned          u_lc;
+    unsigned          u_new_size;
+/*                                                                            */
+/* With -w the queue is kept by the client's worker:                          */
+/*                                                                            */
+    if (ps_reactor->i_workers > 0)
+    {
+        fanout_send(ps_reactor, (int)(ps_conn - ps_reactor->ns_slots),
+            ps_message);
+
+        return;
+    }
+/*                                                                            */
+/* A client being dropped is sent nothing more.  One that has fallen so far   */
+/* behind that this message would take its queue over -q is dropped now.  A   */
+/* message on its own is always queued, whatever its size:                    */
+/*                                                                            */
+    if (ps_conn->i_evicted)
+    {
+        message_release(ps_message);
+
+        return;
+    }
+
+    if (ps_reactor->l_queue_max > 0 && ps_conn->l_queued > 0 &&
+        ps_conn->l_queued + ps_message->i_len > ps_reactor->l_queue_max)
+    {
+        fprintf(stderr, "pollserver: socket %d has %ld bytes queued, limit "
+            "is %ld; dropped\n", ps_conn->i_fd, ps_conn->l_queued,
+            ps_reactor->l_queue_max);
+
+        COUNTER_ADD(ps_reactor->l_evictions, 1);
+        message_release(ps_message);
+        conn_evict(ps_reactor, ps_conn);
+
+        return;
+    }
+/*                                                                            */
+/* If the ring is full, double it, oldest message first in the new one:       */
+/*                                                                            */
+    u_count = ps_conn->u_tail - ps_conn->u_head;
+
+    if (u_count == ps_conn->u_queue_size)
+    {
+        u_new_size = u_count == 0 ? OUT_QUEUE_INITIAL : u_count * 2;
+        ns_queue = malloc(sizeof(struct message*) * u_new_size);
+
+        if (ns_queue == NULL)
+        {
+            fprintf(stderr, "pollserver: no memory, message to socket %d "
+                "dropped\n", ps_conn->i_fd);
+            message_release(ps_message);
+
+            return;
+        }
+
+        for (u_lc = 0; u_lc < u_count; u_lc++)
+        {
+            ns_queue[u_lc] = ps_conn->ns_queue[(ps_conn->u_head + u_lc) &
+                (ps_conn->u_queue_size - 1)];
+        }
+
+        free(ps_conn->ns_queue);
+        ps_conn->ns_queue = ns_queue;
+        ps_conn->u_queue_size = u_new_size;
+        ps_conn->u_head = 0;
+        ps_conn->u_tail = u_count;
+    }
+
+    if (u_count == 0)
+    {
+        COUNTER_ADD(ps_reactor->l_backlogged, 1);
+    }
+
+    ps_conn->ns_queue[ps_conn->u_tail & (ps_conn->u_queue_size - 1)] =
+        ps_message;
+    ps_conn->u_tail++;
+    ps_conn->l_queued += ps_message->i_len;
+
+    COUNTER_ADD(ps_reactor->l_queued, ps_message->i_len);
+
+    if (ps_conn->l_queued > COUNTER_GET(ps_reactor->l_queue_peak))
+    {
+        COUNTER_ADD(ps_reactor->l_queue_peak,
+            ps_conn->l_queued - ps_reactor->l_queue_peak);
+    }
+
+    COUNTER_ADD(ps_reactor->l_deliveries, 1);
+    ps_conn->u64_sent = ps_reactor->s_wheel.u64_now;
+
+    if (!ps_conn->i_writing)
+    {
+        coalesce_add(ps_reactor, ps_conn);
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Drop a client that fell too far behind: over -q, or among the deepest      */
+/* queues while the server is over -Q.  Like conn_fail it throws the queue    */
+/* away and shuts the socket down, so the close happens on the next read and  */
+/* nothing walking the tables sees a slot disappear.  A writev io_uring still */
+/* has in flight keeps its messages until it completes.  The close is         */
+/* abortive: what the socket still holds would only go to a client that is    */
+/* not reading it:                                                            */
+/*                                                                            */
+void conn_evict
+(
+    struct reactor    *ps_reactor, /* both - Event loop that owns the client  */
+    struct connection *ps_conn     /* both - Client that fell too far behind  */
+)
+{
+    struct linger s_linger;
+
+    ps_conn->i_evicted = 1;
+
+    if (ps_reactor->i_engine != ENGINE_URING)
+    {
+        conn_discard(ps_reactor, ps_conn);
+
+        if (ps_conn->i_writing)
+        {
+            conn_want_write(ps_reactor, ps_conn, 0);
+        }
+    }
+    else if (!ps_conn->i_writing)
+    {
+        conn_discard(ps_reactor, ps_conn);
+    }
+
+    s_linger.l_onoff = 1;
+    s_linger.l_linger = 0;
+    setsockopt(ps_conn->i_fd, SOL_SOCKET, SO_LINGER, &s_linger,
+        sizeof(s_linger));
+
+    COUNTER_ADD(ps_reactor->l_syscalls, 2);
+    shutdown(ps_conn->i_fd, SHUT_RDWR);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Writing to a client failed.  Drop what it was owed and shut the socket     */
+/* down; the read side then sees the end of the connection and closes it the  */
+/* usual way, which keeps the pollfd list intact while a broadcast walks it:  */
+/*                                                                            */
+void conn_fail
+(
+    struct reactor    *ps_reactor, /* both - Event loop that owns the client  */
+    struct connection *ps_conn,    /* both - Client that could not be written */
+    int                 i_errno    /* in   - Why                              */
+)
+{
+    if (i_errno != EPIPE && i_errno != ECONNRESET)
+    {
+        report_error("writev", i_errno);
+    }
+
+    COUNTER_ADD(ps_reactor->l_send_errors, 1);
+    conn_discard(ps_reactor, ps_conn);
+
+    if (ps_conn->i_writing && ps_reactor->i_engine != ENGINE_URING)
+    {
+        conn_want_write(ps_reactor, ps_conn, 0);
+    }
+
+    COUNTER_ADD(ps_reactor->l_syscalls, 1);
+    shutdown(ps_conn->i_fd, SHUT_RDWR);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Write as much of a client's output queue as the socket will take.  What    */
+/* does not fit waits for POLLOUT.  io_uring gets one writev at a time per    */
+/* client so the messages cannot overtake each other:                         */
+/*                                                                            */
+void conn_flush
+(
+    struct reactor    *ps_reactor, /* both - Event loop that owns the client  */
+    struct connection *ps_conn     /* both - Client to write to               */
+)
+{
+    struct iovec         as_iov[OUT_IOV_MAX];
+    struct msghdr        s_msg;
+    int                   i_big;
+    int                   i_copy;
+    int                   i_errno;
+    int                   i_iovcnt;
+    int                   j;
+    ssize_t              ss_nbytes;
+    long                  l_wanted;
+    struct io_uring_sqe *ps_sqe;
+
+    if (ps_conn->u_head == ps_conn->u_tail)
+    {
+        if (ps_conn->i_writing && ps_reactor->i_engine != ENGINE_URING)
+        {
+            conn_want_write(ps_reactor, ps_conn, 0);
+        }
+
+        return;
+    }
+
+    if (ps_reactor->i_engine == ENGINE_URING)
+    {
+        if (ps_conn->i_writing)
+        {
+            return; // The completion will carry on
+        }
+
+        if (ps_conn->ns_iov == NULL)
+        {
+            ps_conn->ns_iov = malloc(sizeof(struct iovec) * OUT_IOV_MAX);
+
+            if (ps_conn->ns_iov == NULL)
+            {
+                conn_fail(ps_reactor, ps_conn, ENOMEM);
+
+                return;
+            }
+        }
+
+        i_iovcnt = conn_gather(ps_conn, ps_conn->ns_iov);
+        ps_conn->l_inflight = 0;
+
+        for (j = 0; j < i_iovcnt; j++)
+        {
+            ps_conn->l_inflight += ps_conn->ns_iov[j].iov_len;
+        }
+
+        ps_sqe = uring_get_sqe(ps_reactor);
+
+        ps_sqe->opcode = IORING_OP_WRITEV;
+        ps_sqe->fd = ps_conn->i_fd;
+        ps_sqe->addr = (uintptr_t)ps_conn->ns_iov;
+        ps_sqe->len = i_iovcnt;
+        ps_sqe->off = (uint64_t)-1;
+        ps_sqe->user_data = HANDLE_MAKE(ps_conn->u_gen,
+            ps_conn - ps_reactor->ns_slots) | URING_OP_WRITE;
+
+        ps_conn->i_writing = 1;
+
+        return;
+    }
+
+    i_copy = 0;
+
+    while (ps_conn->u_head != ps_conn->u_tail)
+    {
+        i_iovcnt = conn_gather(ps_conn, as_iov);
+/*                                                                            */
+/* With -z, messages of at least the threshold go out zero-copy and smaller   */
+/* ones are copied as usual.  Zero-copy only pays for big pieces, so a write  */
+/* takes the run of big or of small messages at the head of the queue:        */
+/*                                                                            */
+        i_big = 0;
+
+        if (ps_conn->i_zerocopy && !i_copy)
+        {
+            i_big = as_iov[0].iov_len >= (size_t)ps_reactor->i_zerocopy;
+
+            for (j = 1; j < i_iovcnt &&
+                (as_iov[j].iov_len >= (size_t)ps_reactor->i_zerocopy) == i_big;
+                j++)
+            {
+                ;
+            }
+
+            i_iovcnt = j;
+        }
+
+        l_wanted = 0;
+
+        for (j = 0; j < i_iovcnt; j++)
+        {
+            l_wanted += as_iov[j].iov_len;
+        }
+/*                                                                            */
+/* Every message in a zero-copy write is pinned first, under the number the   */
+/* send will get, and unpinned again if the send fails.  Pinning a message    */
+/* that only partly goes out is harmless; it is just held a little longer:    */
+/*                                                                            */
+        if (i_big && conn_pin(ps_conn, i_iovcnt) == 0)
+        {
+            memset(&s_msg, 0, sizeof(s_msg));
+            s_msg.msg_iov = as_iov;
+            s_msg.msg_iovlen = i_iovcnt;
+
+            errno = 0;
+            ss_nbytes = sendmsg(ps_conn->i_fd, &s_msg, MSG_ZEROCOPY);
+            i_errno = errno;
+            COUNTER_ADD(ps_reactor->l_syscalls, 1);
+
+            if (ss_nbytes == -1)
+            {
+                for (j = 0; j < i_iovcnt; j++)
+                {
+                    ps_conn->u_pin_tail--;
+                    message_release(ps_conn->ns_pinned[ps_conn->u_pin_tail &
+                        (ps_conn->u_pin_size - 1)].ps_message);
+                }
+            }
+            else
+            {
+                ps_conn->u32_zc_next++;
+                COUNTER_ADD(ps_reactor->l_zc_sends, 1);
+            }
+        }
+        else
+        {
+            errno = 0;
+            ss_nbytes = writev(ps_conn->i_fd, as_iov, i_iovcnt);
+            i_errno = errno;
+            COUNTER_ADD(ps_reactor->l_syscalls, 1);
+        }
+
+        if (ss_nbytes == -1)
+        {
+            if (i_errno == EINTR)
+            {
+                continue;
+            }
+/*                                                                            */
+/* ENOBUFS means the socket has no memory left to track zero-copy sends.      */
+/* Copy for the rest of this flush:                                           */
+/*                                                                            */
+            if (i_errno == ENOBUFS && !i_copy)
+            {
+                i_copy = 1;
+
+                continue;
+            }
+
+            if (i_errno == EAGAIN || i_errno == EWOULDBLOCK)
+            {
+                COUNTER_ADD(ps_reactor->l_stalls, 1);
+
+                break;
+            }
+
+            conn_fail(ps_reactor, ps_conn, i_errno);
+
+            return;
+        }
+
+        conn_consume(ps_reactor, ps_conn, ss_nbytes);
+/*                                                                            */
+/* A short write means the socket buffer is full.  Don't ask again until      */
+/* POLLOUT says there is room:                                                */
+/*                                                                            */
+        if (ss_nbytes < l_wanted)
+        {
+            COUNTER_ADD(ps_reactor->l_stalls, 1);
+
+            break;
+        }
+    }
+
+    if ((ps_conn->u_head != ps_conn->u_tail) != (ps_conn->i_writing != 0))
+    {
+        conn_want_write(ps_reactor, ps_conn,
+            ps_conn->u_head != ps_conn->u_tail);
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Point an iovec array at the front of an output queue.  Returns the number  */
+/* of entries filled in:                                                      */
+/*                                                                            */
+int conn_gather
+(
+    struct connection *ps_conn, /* in   - Client whose queue is written       */
+    struct iovec      *ns_iov   /* out  - OUT_IOV_MAX entries                 */
+)
+{
+    struct message *ps_message;
+    int              i_iovcnt;
+    int              i_offset;
+    unsigned         u_lc;
+
+    i_iovcnt = 0;
+    i_offset = ps_conn->i_sent;
+
+    for (u_lc = ps_conn->u_head; u_lc != ps_conn->u_tail &&
+        i_iovcnt < OUT_IOV_MAX; u_lc++)
+    {
+        ps_message = ps_conn->ns_queue[u_lc & (ps_conn->u_queue_size - 1)];
+
+        ns_iov[i_iovcnt].iov_base = ps_message->ac_data + i_offset;
+        ns_iov[i_iovcnt].iov_len = ps_message->i_len - i_offset;
+        i_iovcnt++;
+        i_offset = 0;
+    }
+
+    return i_iovcnt;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Start serving a connected socket: give it a slot and, for epoll, register  */
+/* it.  Used for accepted clients and for clients an old server handed over.  */
+/* Returns the slot or -1; the caller still owns the socket then:             */
+/*                                                                            */
+int conn_open
+(
+    struct reactor *ps_reactor, /* both - Event loop taking the client        */
+    int              i_newfd    /* in   - Connected, non-blocking socket      */
+)
+{
+    int                i_errno;
+    int                i_slot;
+    int                i_yes;
+    struct epoll_event s_event;
+
+    i_slot = add_to_pfds(ps_reactor, i_newfd);
+
+    if (i_slot == -1)
+    {
+        return -1;
+    }
+/*                                                                            */
+/* MSG_ZEROCOPY is silently ignored on a socket without SO_ZEROCOPY, and then */
+/* no completions would come, so only flag the client if the option took:     */
+/*                                                                            */
+    if (ps_reactor->i_zerocopy > 0)
+    {
+        i_yes = 1;
+        COUNTER_ADD(ps_reactor->l_syscalls, 1);
+
+        errno = 0;
+
+        if (setsockopt(i_newfd, SOL_SOCKET, SO_ZEROCOPY, &i_yes,
+            sizeof(i_yes)) == -1)
+        {
+            if (errno != EOPNOTSUPP) // A Unix socket (-l) has no zero-copy
+            {
+                report_error("setsockopt", errno);
+            }
+        }
+        else
+        {
+            ps_reactor->ns_slots[i_slot].i_zerocopy = 1;
+        }
+    }
+
+    if (ps_reactor->i_engine == ENGINE_EPOLL)
+    {
+        memset(&s_event, 0, sizeof(s_event));
+        s_event.events = EPOLLIN;
+        s_event.data.u64 = HANDLE_MAKE(ps_reactor->ns_slots[i_slot].u_gen,
+            i_slot);
+
+        errno = 0;
+        COUNTER_ADD(ps_reactor->l_syscalls, 1);
+
+        if (epoll_ctl(ps_reactor->i_epfd, EPOLL_CTL_ADD, i_newfd,
+            &s_event) == -1)
+        {
+            i_errno = errno;
+            report_error("epoll_ctl", i_errno);
+            del_from_pfds(ps_reactor, i_slot);
+
+            return -1;
+        }
+    }
+/*                                                                            */
+/* With -w the client's worker writes to it:                                  */
+/*                                                                            */
+    if (ps_reactor->i_workers > 0 && fanout_add(ps_reactor, i_slot) == -1)
+    {
+        del_from_pfds(ps_reactor, i_slot);
+
+        return -1;
+    }
+
+    return i_slot;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Pin the first i_count messages of a client's queue for the zero-copy send  */
+/* about to be made, growing the ring of pinned messages if it is full.       */
+/* Returns 0, or -1 if there is no memory (the caller then copies):           */
+/*                                                                            */
+int conn_pin
+(
+    struct connection *ps_conn, /* both - Client about to be written          */
+    int                 i_count /* in   - Messages the send covers            */
+)
+{
+    struct message *ps_message;
+    struct pinned  *ns_pinned;
+    unsigned         u_count;
+    unsigned         u_lc;
+    unsigned         u_new_size;
+
+    u_count = ps_conn->u_pin_tail - ps_conn->u_pin_head;
+
+    if (u_count + i_count > ps_conn->u_pin_size)
+    {
+        u_new_size = ps_conn->u_pin_size == 0 ? ZEROCOPY_INITIAL :
+            ps_conn->u_pin_size;
+
+        while (u_new_size < u_count + i_count)
+        {
+            u_new_size *= 2;
+        }
+
+        ns_pinned = malloc(sizeof(struct pinned) * u_new_size);
+
+        if (ns_pinned == NULL)
+        {
+            return -1;
+        }
+
+        for (u_lc = 0; u_lc < u_count; u_lc++)
+        {
+            ns_pinned[u_lc] = ps_conn->ns_pinned[(ps_conn->u_pin_head + u_lc) &
+                (ps_conn->u_pin_size - 1)];
+        }
+
+        free(ps_conn->ns_pinned);
+        ps_conn->ns_pinned = ns_pinned;
+        ps_conn->u_pin_size = u_new_size;
+        ps_conn->u_pin_head = 0;
+        ps_conn->u_pin_tail = u_count;
+    }
+
+    for (u_lc = 0; u_lc < (unsigned)i_count; u_lc++)
+    {
+        ps_message = ps_conn->ns_queue[(ps_conn->u_head + u_lc) &
+            (ps_conn->u_queue_size - 1)];
+        message_hold(ps_message, 1);
+
+        ps_conn->ns_pinned[ps_conn->u_pin_tail &
+            (ps_conn->u_pin_size - 1)].ps_message = ps_message;
+        ps_conn->ns_pinned[ps_conn->u_pin_tail &
+            (ps_conn->u_pin_size - 1)].u32_send = ps_conn->u32_zc_next;
+        ps_conn->u_pin_tail++;
+    }
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Read a client's zero-copy completions off its socket error queue and let   */
+/* go of the messages of every send they cover.  Each completion is a range   */
+/* of send numbers, and TCP completes sends in order, so everything up to the */
+/* top of the range is done.  Returns how many completions were read:         */
+/*                                                                            */
+int conn_reap
+(
+    struct reactor    *ps_reactor, /* both - Event loop that owns the client  */
+    struct connection *ps_conn     /* both - Client with pinned messages      */
+)
+{
+    union
+    {
+        char            ac_buf[128];
+        struct cmsghdr s_align;
+    }                          u_control;
+    struct cmsghdr           *ps_cmsg;
+    struct sock_extended_err *ps_err;
+    struct msghdr             s_msg;
+    struct pinned            *ps_pinned;
+    int                        i_done;
+
+    if (!ps_conn->i_zerocopy)
+    {
+        return 0;
+    }
+
+    i_done = 0;
+
+    for (;;)
+    {
+        memset(&s_msg, 0, sizeof(s_msg));
+        s_msg.msg_control = u_control.ac_buf;
+        s_msg.msg_controllen = sizeof(u_control.ac_buf);
+
+        COUNTER_ADD(ps_reactor->l_syscalls, 1);
+
+        if (recvmsg(ps_conn->i_fd, &s_msg, MSG_ERRQUEUE) == -1)
+        {
+            break; // EAGAIN once the queue is empty
+        }
+
+        for (ps_cmsg = CMSG_FIRSTHDR(&s_msg);
+            ps_cmsg != NULL;
+            ps_cmsg = CMSG_NXTHDR(&s_msg, ps_cmsg))
+        {
+            if (!((ps_cmsg->cmsg_level == SOL_IP &&
+                ps_cmsg->cmsg_type == IP_RECVERR) ||
+                (ps_cmsg->cmsg_level == SOL_IPV6 &&
+                ps_cmsg->cmsg_type == IPV6_RECVERR)))
+            {
+                continue;
+            }
+
+            ps_err = (struct sock_extended_err*)CMSG_DATA(ps_cmsg);
+
+            if (ps_err->ee_origin != SO_EE_ORIGIN_ZEROCOPY ||
+                ps_err->ee_errno != 0)
+            {
+                continue;
+            }
+/*                                                                            */
+/* On loopback, and whenever the device cannot send from user pages, the      */
+/* kernel copies after all.  Count those so -z can be judged:                 */
+/*                                                                            */
+            if (ps_err->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+            {
+                COUNTER_ADD(ps_reactor->l_zc_copied,
+                    ps_err->ee_data - ps_err->ee_info + 1);
+            }
+
+            while (ps_conn->u_pin_head != ps_conn->u_pin_tail)
+            {
+                ps_pinned = &ps_conn->ns_pinned[ps_conn->u_pin_head &
+                    (ps_conn->u_pin_size - 1)];
+
+                if ((int32_t)(ps_pinned->u32_send - ps_err->ee_data) > 0)
+                {
+                    break;
+                }
+
+                message_release(ps_pinned->ps_message);
+                ps_conn->u_pin_head++;
+            }
+
+            i_done++;
+        }
+    }
+
+    return i_done;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Framed mode: broadcast every complete frame in a client's input buffer and */
+/* keep the partial one at the end for the next read.  Each frame goes out    */
+/* whole, header included, as one message; empty frames are keep-alives and   */
+/* go nowhere.  Returns 0, or -1 if the client sent a frame larger than       */
+/* i_frame_max and has to be dropped:                                         */
+/*                                                                            */
+int conn_reassemble
+(
+    struct reactor *ps_reactor, /* both - Event loop that owns the client     */
+    int              i          /* in   - Slot of the client                  */
+)
+{
+    struct connection *ps_conn;
+    struct message    *ps_message;
+    unsigned char     *nuc_header;
+    int                 i_frame;
+    int                 i_pos;
+    uint32_t            u32_len;
+
+    ps_conn = &ps_reactor->ns_slots[i];
+    i_pos = 0;
+
+    while (ps_conn->i_in_len - i_pos >= FRAME_HEADER)
+    {
+        nuc_header = (unsigned char*)ps_conn->nc_in + i_pos;
+        u32_len = (uint32_t)nuc_header[0] << 24 |
+            (uint32_t)nuc_header[1] << 16 |
+            (uint32_t)nuc_header[2] << 8 | (uint32_t)nuc_header[3];
+
+        if (u32_len > (uint32_t)ps_reactor->i_frame_max)
+        {
+            fprintf(stderr, "pollserver: socket %d sent a %u byte frame, "
+                "limit is %d\n", ps_conn->i_fd, u32_len,
+                ps_reactor->i_frame_max);
+
+            return -1;
+        }
+
+        i_frame = FRAME_HEADER + (int)u32_len;
+
+        if (ps_conn->i_in_len - i_pos < i_frame)
+        {
+            break; // The rest has not arrived yet
+        }
+
+        if (u32_len > 0 && (!ps_reactor->i_room_mode ||
+            room_command(ps_reactor, i, ps_conn->nc_in + i_pos + FRAME_HEADER,
+            (int)u32_len)))
+        {
+            ps_message = message_alloc(i_frame);
+
+            if (ps_message == NULL)
+            {
+                fprintf(stderr, "pollserver: no memory, frame from socket "
+                    "%d dropped\n", ps_conn->i_fd);
+            }
+            else
+            {
+                ps_message->i_len = i_frame;
+                memcpy(ps_message->ac_data, ps_conn->nc_in + i_pos, i_frame);
+
+                broadcast_message(ps_reactor, i, ps_message);
+                message_release(ps_message);
+            }
+        }
+
+        i_pos += i_frame;
+    }
+/*                                                                            */
+/* Move the partial frame to the front.  A buffer that grew for a big frame   */
+/* is given back once it is empty:                                            */
+/*                                                                            */
+    ps_conn->i_in_len -= i_pos;
+
+    if (ps_conn->i_in_len > 0 && i_pos > 0)
+    {
+        memmove(ps_conn->nc_in, ps_conn->nc_in + i_pos, ps_conn->i_in_len);
+    }
+    else if (ps_conn->i_in_len == 0 && ps_conn->i_in_size > FRAME_KEEP)
+    {
+        free(ps_conn->nc_in);
+        ps_conn->nc_in = NULL;
+        ps_conn->i_in_size = 0;
+    }
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Free everything a connection holds.  The slot itself stays in the table:   */
+/*                                                                            */
+void conn_release
+(
+    struct reactor    *ps_reactor, /* both - Event loop that owned the client */
+    struct connection *ps_conn     /* both - Connection to empty              */
+)
+{
+    conn_discard(ps_reactor, ps_conn);
+
+    free(ps_conn->ns_queue);
+    free(ps_conn->nc_in);
+    free(ps_conn->ns_iov);
+    free(ps_conn->ns_rooms);
+
+    while (ps_conn->u_pin_head != ps_conn->u_pin_tail)
+    {
+        message_release(ps_conn->ns_pinned[ps_conn->u_pin_head &
+            (ps_conn->u_pin_size - 1)].ps_message);
+        ps_conn->u_pin_head++;
+    }
+
+    free(ps_conn->ns_pinned);
+    free(ps_conn->ps_detach);
+
+    ps_conn->ns_queue = NULL;
+    ps_conn->u_queue_size = 0;
+    ps_conn->nc_in = NULL;
+    ps_conn->i_in_size = 0;
+    ps_conn->ns_iov = NULL;
+    ps_conn->ns_rooms = NULL;
+    ps_conn->i_rooms = 0;
+    ps_conn->i_rooms_size = 0;
+    ps_conn->i_zerocopy = 0;
+    ps_conn->u32_zc_next = 0;
+    ps_conn->ns_pinned = NULL;
+    ps_conn->u_pin_size = 0;
+    ps_conn->u_pin_head = 0;
+    ps_conn->u_pin_tail = 0;
+    ps_conn->ps_detach = NULL;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Make sure a client's input buffer holds at least i_size bytes.  Returns 0  */
+/* or -1 if there is no memory:                                               */
+/*                                                                            */
+int conn_reserve
+(
+    struct connection *ps_conn, /* both - Client whose buffer may grow        */
+    int                 i_size  /* in   - Bytes needed                        */
+)
+{
+    char *nc_in;
+    int    i_new_size;
+
+    if (ps_conn->i_in_size >= i_size)
+    {
+        return 0;
+    }
+
+    i_new_size = ps_conn->i_in_size > 0 ? ps_conn->i_in_size : MESSAGE_MAX;
+
+    while (i_new_size < i_size)
+    {
+        i_new_size *= 2;
+    }
+
+    nc_in = realloc(ps_conn->nc_in, i_new_size);
+
+    if (nc_in == NULL)
+    {
+        fprintf(stderr, "pollserver: no memory for the input of socket %d\n",
+            ps_conn->i_fd);
+
+        return -1;
+    }
+
+    ps_conn->nc_in = nc_in;
+    ps_conn->i_in_size = i_new_size;
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Take a token from a client's bucket for one message.  The bucket is        */
+/* topped up by -m tokens a second, counted in thousandths so slow rates      */
+/* still gain something every tick, and holds at most -b.  Nothing is kept    */
+/* per second or scanned; a client costs the same however many there are.     */
+/* Returns 1 if the message may go, 0 if the client is over its rate:         */
+/*                                                                            */
+int conn_take_token
+(
+    struct reactor    *ps_reactor, /* in   - Event loop with the limits       */
+    struct connection *ps_conn     /* both - Client that sent a message       */
+)
+{
+    uint64_t u64_now;
+
+    u64_now = ps_reactor->s_wheel.u64_now;
+
+    if (u64_now > ps_conn->u64_refill)
+    {
+        ps_conn->u64_tokens += (u64_now - ps_conn->u64_refill) *
+            TIMER_TICK_MS * ps_reactor->u64_rate;
+        ps_conn->u64_refill = u64_now;
+
+        if (ps_conn->u64_tokens > ps_reactor->u64_burst * 1000)
+        {
+            ps_conn->u64_tokens = ps_reactor->u64_burst * 1000;
+        }
+    }
+
+    if (ps_conn->u64_tokens < 1000)
+    {
+        return 0;
+    }
+
+    ps_conn->u64_tokens -= 1000;
+
+    return 1;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Turn waiting for POLLOUT on a client on or off:                            */
+/*                                                                            */
+void conn_want_write
+(
+    struct reactor    *ps_reactor, /* both - Event loop that owns the client  */
+    struct connection *ps_conn,    /* both - Client                           */
+    int                 i_on       /* in   - Nonzero to wait for POLLOUT      */
+)
+{
+    int                i_slot;
+    struct epoll_event s_event;
+
+    i_slot = (int)(ps_conn - ps_reactor->ns_slots);
+    ps_conn->i_writing = i_on;
+/*                                                                            */
+/* The slow-consumer deadline runs from when the queue backs up until it has  */
+/* been drained:                                                              */
+/*                                                                            */
+    if (!i_on)
+    {
+        timer_cancel(&ps_reactor->s_wheel, &ps_conn->s_slow);
+    }
+    else if (ps_reactor->u64_slow > 0)
+    {
+        timer_schedule(&ps_reactor->s_wheel, &ps_conn->s_slow,
+            ps_reactor->s_wheel.u64_now + ps_reactor->u64_slow);
+    }
+/*                                                                            */
+/* A fan-out worker (-w) only watches a client while it waits to write:       */
+/*                                                                            */
+    if (ps_reactor->ps_owner != NULL &&
+        ps_reactor->i_engine == ENGINE_EPOLL)
+    {
+        memset(&s_event, 0, sizeof(s_event));
+        s_event.events = EPOLLOUT;
+        s_event.data.u64 = HANDLE_MAKE(ps_conn->u_gen, i_slot);
+
+        COUNTER_ADD(ps_reactor->l_syscalls, 1);
+
+        if (epoll_ctl(ps_reactor->i_epfd, i_on ? EPOLL_CTL_ADD :
+            EPOLL_CTL_DEL, ps_conn->i_fd, &s_event) == -1)
+        {
+            report_error("epoll_ctl", errno);
+        }
+    }
+    else if (ps_reactor->ps_owner != NULL)
+    {
+        ps_reactor->ns_pfds[i_slot].fd = i_on ? ps_conn->i_fd : -1;
+        ps_reactor->ns_pfds[i_slot].events = POLLOUT;
+        ps_reactor->ns_pfds[i_slot].revents = 0;
+    }
+    else if (ps_reactor->i_engine == ENGINE_EPOLL)
+    {
+        memset(&s_event, 0, sizeof(s_event));
+        s_event.events = EPOLLIN | (i_on ? EPOLLOUT : 0);
+        s_event.data.u64 = HANDLE_MAKE(ps_conn->u_gen, i_slot);
+
+        COUNTER_ADD(ps_reactor->l_syscalls, 1);
+
+        if (epoll_ctl(ps_reactor->i_epfd, EPOLL_CTL_MOD, ps_conn->i_fd,
+            &s_event) == -1)
+        {
+            report_error("epoll_ctl", errno);
+        }
+    }
+    else
+    {
+        ps_reactor->ns_pfds[i_slot].events = POLLIN | (i_on ? POLLOUT : 0);
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Remove a connection from the table.  Its slot changes generation at once,  */
+/* so events still on their way for it are ignored.  A writev io_uring still  */
+/* has in flight points into the output queue, so then the slot is only       */
+/* freed when the write completes:                                            */
+/*                                                                            */
+void del_from_pfds
+(
+    struct reactor *ps_reactor, /* both - Event loop that owns the table      */
+    int              i_slot     /* in   - Slot to free                        */
+)
+{
+    struct connection *ps_conn;
+
+    ps_conn = &ps_reactor->ns_slots[i_slot];
+    ps_conn->u_gen++;
+
+    ps_reactor->ns_pfds[i_slot].fd = -1; // poll ignores negative descriptors
+    ps_reactor->ns_pfds[i_slot].events = 0;
+    ps_reactor->ns_pfds[i_slot].revents = 0;
+
+    if (i_slot >= FIRST_CLIENT)
+    {
+        COUNTER_ADD(ps_reactor->i_clients, -1);
+    }
+
+    timer_cancel(&ps_reactor->s_wheel, &ps_conn->s_idle);
+    timer_cancel(&ps_reactor->s_wheel, &ps_conn->s_beat);
+    timer_cancel(&ps_reactor->s_wheel, &ps_conn->s_slow);
+
+    room_leave_all(ps_reactor, i_slot);
+
+    if (ps_reactor->i_engine == ENGINE_URING && ps_conn->i_writing)
+    {
+        ps_conn->i_closed = 1;
+
+        return;
+    }
+
+    slot_free(ps_reactor, i_slot);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Send a message to every client of this reactor except the sender (-1 when  */
+/* the message came from another reactor):                                    */
+/*                                                                            */
+void deliver_to_clients
+(
+    struct reactor *ps_reactor, /* both - Event loop holding the clients      */
+    int              i_sender,  /* in   - Slot the message came from or -1    */
+    struct message *ps_message  /* in   - Message                             */
+)
+{
+    int i_recipients;
+    int j;
+/*                                                                            */
+/* In room mode only the room's members get it:                               */
+/*                                                                            */
+    if (ps_reactor->i_room_mode)
+    {
+        room_deliver(ps_reactor, i_sender, ps_message);
+
+        return;
+    }
+/*                                                                            */
+/* Take the references for all the queues at once.  The caller still holds    */
+/* one, so a queue that writes and drops its reference straight away cannot   */
+/* free the message under us:                                                 */
+/*                                                                            */
+    i_recipients = ps_reactor->i_clients - (i_sender != -1);
+
+    if (i_recipients <= 0)
+    {
+        return;
+    }
+
+    message_hold(ps_message, i_recipients);
+
+    for (j = FIRST_CLIENT; j < ps_reactor->i_slot_high; j++)
+    {
+        if (ps_reactor->ns_pfds[j].fd != -1 && j != i_sender)
+        {
+            conn_enqueue(ps_reactor, &ps_reactor->ns_slots[j], ps_message);
+        }
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* A reactor with fan-out workers (-w) took a client.  The worker whose share */
+/* it falls in gets a descriptor of its own for the socket, so the reactor    */
+/* and the worker each close theirs when they are done and neither can write  */
+/* to a number the other has let go.  The job that will say the reactor has   */
+/* closed it is made now, so closing can never fail for want of memory.       */
+/* Returns 0 or -1:                                                           */
+/*                                                                            */
+int fanout_add
+(
+    struct reactor *ps_reactor, /* both - Reactor that took the client        */
+    int              i_slot     /* in   - Its slot                            */
+)
+{
+    struct connection *ps_conn;
+    struct fanout_job *ps_job;
+    int                 i_errno;
+    int                 i_fd;
+
+    ps_conn = &ps_reactor->ns_slots[i_slot];
+
+    errno = 0;
+    i_fd = fcntl(ps_conn->i_fd, F_DUPFD_CLOEXEC, 0);
+    i_errno = errno;
+    COUNTER_ADD(ps_reactor->l_syscalls, 1);
+
+    if (i_fd == -1)
+    {
+        report_error("fcntl", i_errno);
+
+        return -1;
+    }
+
+    ps_job = fanout_job(0);
+    ps_conn->ps_detach = fanout_job(0);
+
+    if (ps_job == NULL || ps_conn->ps_detach == NULL)
+    {
+        fprintf(stderr, "pollserver: no memory, socket %d not taken\n",
+            ps_conn->i_fd);
+        free(ps_job);
+        free(ps_conn->ps_detach);
+        ps_conn->ps_detach = NULL;
+        close(i_fd);
+
+        return -1;
+    }
+
+    ps_job->i_kind = FANOUT_ATTACH;
+    ps_job->i_slot = FANOUT_SLOT(i_slot, ps_reactor->i_workers);
+    ps_job->i_fd = i_fd;
+
+    ps_conn->ps_detach->i_kind = FANOUT_DETACH;
+    ps_conn->ps_detach->i_slot = ps_job->i_slot;
+
+    fanout_push(ps_reactor, ps_reactor->i_id,
+        FANOUT_WORKER(i_slot, ps_reactor->i_workers), ps_job);
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Start writing to a client in a worker's table.  The table grows to take    */
+/* the slot, the slots it skips marked unused:                                */
+/*                                                                            */
+void fanout_attach
+(
+    struct reactor *ps_worker, /* both - Worker taking the client             */
+    int              i_slot,   /* in   - Worker slot for it                   */
+    int              i_fd      /* in   - The worker's descriptor for it       */
+)
+{
+    struct connection *ps_conn;
+    unsigned            u_gen;
+
+    while (ps_worker->i_slot_high <= i_slot)
+    {
+        ps_worker->ns_slots[ps_worker->i_slot_high].i_fd = -1;
+        ps_worker->ns_pfds[ps_worker->i_slot_high].fd = -1;
+        ps_worker->ns_pfds[ps_worker->i_slot_high].revents = 0;
+        ps_worker->i_slot_high++;
+    }
+
+    ps_conn = &ps_worker->ns_slots[i_slot];
+    u_gen = ps_conn->u_gen;
+
+    memset(ps_conn, 0, sizeof(*ps_conn));
+    ps_conn->i_fd = i_fd;
+    ps_conn->u_gen = u_gen;
+    ps_conn->i_next_free = -1;
+    ps_conn->s_slow.i_slot = i_slot;
+    ps_conn->s_slow.i_kind = TIMER_SLOW;
+
+    COUNTER_ADD(ps_worker->i_clients, 1);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Hand a message from one of our clients to every worker of every reactor,   */
+/* to queue for all the clients in its share.  No other reactor has to wake   */
+/* up for it, and the sender's reactor does one push per worker however many  */
+/* clients there are.  The caller keeps its own reference:                    */
+/*                                                                            */
+void fanout_broadcast
+(
+    struct reactor *ps_reactor, /* both - Reactor the message arrived on      */
+    int              i_sender,  /* in   - Slot the message came from          */
+    struct message *ps_message  /* in   - Message                             */
+)
+{
+    struct fanout_job *ps_job;
+    int                 i_reactor;
+    int                 i_worker;
+
+    message_hold(ps_message, ps_reactor->i_reactors * ps_reactor->i_workers);
+
+    for (i_reactor = 0; i_reactor < ps_reactor->i_reactors; i_reactor++)
+    {
+        for (i_worker = 0; i_worker < ps_reactor->i_workers; i_worker++)
+        {
+            ps_job = fanout_job(0);
+
+            if (ps_job == NULL)
+            {
+                fprintf(stderr, "pollserver: no memory, message to worker "
+                    "%d.%d dropped\n", i_reactor, i_worker);
+                message_release(ps_message);
+
+                continue;
+            }
+
+            ps_job->i_kind = FANOUT_SEND;
+            ps_job->i_count = -1;
+            ps_job->ps_message = ps_message;
+
+            if (i_reactor == ps_reactor->i_id &&
+                i_worker == FANOUT_WORKER(i_sender, ps_reactor->i_workers))
+            {
+                ps_job->i_slot = FANOUT_SLOT(i_sender, ps_reactor->i_workers);
+            }
+
+            fanout_push(ps_reactor, i_reactor, i_worker, ps_job);
+        }
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Let go of everything a worker still holds once its thread has stopped:     */
+/* jobs it never got to and the descriptors of its clients:                   */
+/*                                                                            */
+void fanout_close
+(
+    struct reactor *ps_worker /* both - Worker to empty                       */
+)
+{
+    struct fanout_job *ps_job;
+    int                 i_lc;
+
+    while ((ps_job = fanout_pop(ps_worker->ps_jobs)) != NULL)
+    {
+        if (ps_job->i_kind == FANOUT_ATTACH)
+        {
+            close(ps_job->i_fd);
+        }
+        else if (ps_job->i_kind == FANOUT_SEND)
+        {
+            message_release(ps_job->ps_message);
+        }
+
+        free(ps_job);
+    }
+
+    for (i_lc = FIRST_CLIENT; i_lc < ps_worker->i_slot_high; i_lc++)
+    {
+        if (ps_worker->ns_slots[i_lc].i_fd != -1)
+        {
+            close(ps_worker->ns_slots[i_lc].i_fd);
+        }
+
+        ps_worker->ns_pfds[i_lc].fd = -1;
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* The reactor has closed a client; close the worker's descriptor, which      */
+/* closes the connection, and forget the client:                              */
+/*                                                                            */
+void fanout_detach
+(
+    struct reactor *ps_worker, /* both - Worker writing to the client         */
+    int              i_slot    /* in   - Worker slot of the client            */
+)
+{
+    struct connection *ps_conn;
+
+    ps_conn = &ps_worker->ns_slots[i_slot];
+
+    if (ps_conn->i_writing)
+    {
+        conn_want_write(ps_worker, ps_conn, 0);
+    }
+
+    close(ps_conn->i_fd);
+    COUNTER_ADD(ps_worker->l_syscalls, 1);
+
+    conn_release(ps_worker, ps_conn);
+    ps_conn->i_fd = -1;
+    ps_conn->u_gen++;
+    ps_conn->i_evicted = 0;
+
+    COUNTER_ADD(ps_worker->i_clients, -1);
+
+    while (ps_worker->i_slot_high > FIRST_CLIENT &&
+        ps_worker->ns_slots[ps_worker->i_slot_high - 1].i_fd == -1)
+    {
+        ps_worker->i_slot_high--;
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Do every job in a worker's queue, in order.  The eventfd is reset first so */
+/* a job added while the queue is being emptied always comes with another     */
+/* wake-up.  A send queues the message for each client it names, or for all   */
+/* of them but the sender, exactly as a reactor queues for its own clients:   */
+/*                                                                            */
+void fanout_drain
+(
+    struct reactor *ps_worker /* both - Worker the jobs are for               */
+)
+{
+    struct fanout_job *ps_job;
+    int                 i_lc;
+    int                 i_recipients;
+    int                 i_slot;
+    uint64_t            u64_count;
+
+    COUNTER_ADD(ps_worker->l_syscalls, 1);
+
+    if (read(ps_worker->i_wake_fd, &u64_count, sizeof(u64_count)) == -1 &&
+        errno != EAGAIN)
+    {
+        report_error("read", errno);
+    }
+
+    while ((ps_job = fanout_pop(ps_worker->ps_jobs)) != NULL)
+    {
+        if (ps_job->i_kind == FANOUT_ATTACH)
+        {
+            fanout_attach(ps_worker, ps_job->i_slot, ps_job->i_fd);
+        }
+        else if (ps_job->i_kind == FANOUT_DETACH)
+        {
+            fanout_detach(ps_worker, ps_job->i_slot);
+        }
+        else if (ps_job->i_count == -1)
+        {
+/*                                                                            */
+/* As in deliver_to_clients, take every queue's reference before the first    */
+/* queue can write the message and let go of it:                              */
+/*                                                                            */
+            i_recipients = 0;
+
+            for (i_slot = FIRST_CLIENT; i_slot < ps_worker->i_slot_high;
+                i_slot++)
+            {
+                i_recipients += ps_worker->ns_slots[i_slot].i_fd != -1 &&
+                    i_slot != ps_job->i_slot;
+            }
+
+            message_hold(ps_job->ps_message, i_recipients);
+
+            for (i_slot = FIRST_CLIENT; i_slot < ps_worker->i_slot_high;
+                i_slot++)
+            {
+                if (ps_worker->ns_slots[i_slot].i_fd != -1 &&
+                    i_slot != ps_job->i_slot)
+                {
+                    conn_enqueue(ps_worker, &ps_worker->ns_slots[i_slot],
+                        ps_job->ps_message);
+                }
+            }
+
+            message_release(ps_job->ps_message);
+        }
+        else
+        {
+            message_hold(ps_job->ps_message, ps_job->i_count);
+
+            for (i_lc = 0; i_lc < ps_job->i_count; i_lc++)
+            {
+                conn_enqueue(ps_worker,
+                    &ps_worker->ns_slots[ps_job->ni_slots[i_lc]],
+                    ps_job->ps_message);
+            }
+
+            message_release(ps_job->ps_message);
+        }
+
+        free(ps_job);
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* End of a loop pass: poke the eventfd of every worker this reactor handed   */
+/* a job, once however many it was handed:                                    */
+/*                                                                            */
+void fanout_flush
+(
+    struct reactor *ps_reactor /* both - Reactor that handed out the jobs     */
+)
+{
+    struct reactor       *ps_worker;
+    int                    i_lc;
+    static const uint64_t  u64_one = 1;
+
+    for (i_lc = 0; i_lc < ps_reactor->i_reactors * ps_reactor->i_workers;
+        i_lc++)
+    {
+        if (!ps_reactor->nc_fanout_wake[i_lc])
+        {
+            continue;
+        }
+
+        ps_reactor->nc_fanout_wake[i_lc] = 0;
+        ps_worker = &ps_reactor->ns_reactors[i_lc / ps_reactor->i_workers].
+            ns_workers[i_lc % ps_reactor->i_workers];
+
+        COUNTER_ADD(ps_reactor->l_syscalls, 1);
+
+        if (write(ps_worker->i_wake_fd, &u64_one, sizeof(u64_one)) == -1 &&
+            errno != EAGAIN)
+        {
+            report_error("write", errno);
+        }
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Set up a reactor's fan-out workers (-w).  i_workers must be filled in and  */
+/* the reactor itself set up.  Each worker takes the reactor's write limits   */
+/* and a share of its table.  Returns 0, or -1 with i_workers cut down to the */
+/* workers that reactor_close has to take down:                               */
+/*                                                                            */
+int fanout_init
+(
+    struct reactor *ps_reactor /* both - Reactor to give workers to           */
+)
+{
+    struct reactor *ps_worker;
+    int              i_lc;
+    int              i_workers;
+
+    i_workers = ps_reactor->i_workers;
+
+    ps_reactor->ns_workers = calloc(i_workers, sizeof(struct reactor));
+    ps_reactor->nc_fanout_wake = calloc(ps_reactor->i_reactors * i_workers, 1);
+
+    if (ps_reactor->ns_workers == NULL || ps_reactor->nc_fanout_wake == NULL)
+    {
+        fprintf(stderr, "Unable to allocate the fan-out workers.\n");
+        ps_reactor->i_workers = 0;
+
+        return -1;
+    }
+
+    for (i_lc = 0; i_lc < i_workers; i_lc++)
+    {
+        ps_worker = &ps_reactor->ns_workers[i_lc];
+
+        ps_worker->i_id = i_lc;
+        ps_worker->i_engine = ps_reactor->i_engine;
+        ps_worker->i_listener = -1;
+        ps_worker->i_local = -1;
+        ps_worker->l_queue_max = ps_reactor->l_queue_max;
+        ps_worker->l_queued_high = ps_reactor->l_queued_high;
+        ps_worker->l_queued_low = ps_reactor->l_queued_low;
+        ps_worker->i_immediate = ps_reactor->i_immediate;
+        ps_worker->u64_linger = ps_reactor->u64_linger;
+        ps_worker->u64_slow = ps_reactor->u64_slow;
+        ps_worker->i_metrics = ps_reactor->i_metrics;
+        ps_worker->ns_reactors = ps_worker;
+        ps_worker->i_reactors = 1;
+        ps_worker->ps_owner = ps_reactor;
+        ps_worker->ps_jobs = aligned_alloc(64, sizeof(struct fanout_queue));
+
+        if (ps_worker->ps_jobs == NULL)
+        {
+            fprintf(stderr, "Unable to allocate the fan-out workers.\n");
+            ps_reactor->i_workers = i_lc;
+
+            return -1;
+        }
+
+        memset(ps_worker->ps_jobs, 0, sizeof(struct fanout_queue));
+        ps_worker->ps_jobs->ps_head = &ps_worker->ps_jobs->s_stub;
+        ps_worker->ps_jobs->ps_tail = &ps_worker->ps_jobs->s_stub;
+/*                                                                            */
+/* reactor_init takes a worker that fails down itself:                        */
+/*                                                                            */
+        if (reactor_init(ps_worker) == -1)
+        {
+            ps_reactor->i_workers = i_lc;
+
+            return -1;
+        }
+    }
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Allocate a job with room for i_count worker slots, which a send fills in   */
+/* and counts in i_count.  Returns the job or NULL if there is no memory:     */
+/*                                                                            */
+struct fanout_job *fanout_job
+(
+    int i_count /* in   - Slots to make room for                              */
+)
+{
+    struct fanout_job *ps_job;
+
+    ps_job = malloc(sizeof(struct fanout_job) + sizeof(int) * i_count);
+
+    if (ps_job == NULL)
+    {
+        return NULL;
+    }
+
+    memset(ps_job, 0, sizeof(struct fanout_job));
+    ps_job->i_slot = -1;
+    ps_job->i_fd = -1;
+    ps_job->ni_slots = (int*)(ps_job + 1);
+
+    return ps_job;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Add a job to the end of a queue.  Swapping ps_head claims the place; the   */
+/* release store of the link then hands the job, filled in, to the consumer:  */
+/*                                                                            */
+void fanout_link
+(
+    struct fanout_queue *ps_queue, /* both - Queue to add to                  */
+    struct fanout_job   *ps_job    /* in   - Job                              */
+)
+{
+    struct fanout_job *ps_prev;
+
+    __atomic_store_n(&ps_job->ps_next, NULL, __ATOMIC_RELAXED);
+    ps_prev = __atomic_exchange_n(&ps_queue->ps_head, ps_job,
+        __ATOMIC_ACQ_REL);
+    __atomic_store_n(&ps_prev->ps_next, ps_job, __ATOMIC_RELEASE);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Take the oldest job off a queue.  Only the worker that owns the queue      */
+/* calls this.  The node at ps_tail has been taken already (or is the stub),  */
+/* so the job handed back is the one it links to... except that the last      */
+/* node can only be handed back once another is behind it, which is what the  */
+/* stub is for.  Returns NULL if the queue is empty or a producer has not     */
+/* finished linking its job in:                                               */
+/*                                                                            */
+struct fanout_job *fanout_pop
+(
+    struct fanout_queue *ps_queue /* both - Queue to take from                */
+)
+{
+    struct fanout_job *ps_next;
+    struct fanout_job *ps_tail;
+
+    ps_tail = ps_queue->ps_tail;
+    ps_next = __atomic_load_n(&ps_tail->ps_next, __ATOMIC_ACQUIRE);
+
+    if (ps_tail == &ps_queue->s_stub)
+    {
+        if (ps_next == NULL)
+        {
+            return NULL;
+        }
+
+        ps_queue->ps_tail = ps_next;
+        ps_tail = ps_next;
+        ps_next = __atomic_load_n(&ps_tail->ps_next, __ATOMIC_ACQUIRE);
+    }
+
+    if (ps_next != NULL)
+    {
+        ps_queue->ps_tail = ps_next;
+
+        return ps_tail;
+    }
+/*                                                                            */
+/* ps_tail is the last node.  Put the stub behind it so it can be taken:      */
+/*                                                                            */
+    if (ps_tail != __atomic_load_n(&ps_queue->ps_head, __ATOMIC_ACQUIRE))
+    {
+        return NULL;
+    }
+
+    fanout_link(ps_queue, &ps_queue->s_stub);
+    ps_next = __atomic_load_n(&ps_tail->ps_next, __ATOMIC_ACQUIRE);
+
+    if (ps_next == NULL)
+    {
+        return NULL;
+    }
+
+    ps_queue->ps_tail = ps_next;
+
+    return ps_tail;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Give a job to one of the workers of a reactor, this one or another, and    */
+/* note that it needs a wake-up at the end of the pass:                       */
+/*                                                                            */
+void fanout_push
+(
+    struct reactor    *ps_reactor, /* both - Reactor handing out the job      */
+    int                 i_reactor, /* in   - Reactor the worker belongs to    */
+    int                 i_worker,  /* in   - Worker of that reactor           */
+    struct fanout_job *ps_job      /* in   - Job, now the worker's            */
+)
+{
+    fanout_link(ps_reactor->ns_reactors[i_reactor].ns_workers[i_worker].ps_jobs,
+        ps_job);
+
+    ps_reactor->nc_fanout_wake[i_reactor * ps_reactor->i_workers + i_worker] =
+        1;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Hand a PUBLISH frame to the workers of the room's members on this reactor, */
+/* one job per worker naming its members.  The members' heartbeat clocks are  */
+/* moved on here, since the reactor will not see the writes:                  */
+/*                                                                            */
+void fanout_room
+(
+    struct reactor *ps_reactor, /* both - Reactor holding the members         */
+    struct room    *ps_room,    /* in   - Room                                */
+    int              i_sender,  /* in   - Slot the message came from or -1    */
+    struct message *ps_message  /* in   - PUBLISH frame                       */
+)
+{
+    struct fanout_job *aps_jobs[FANOUT_MAX];
+    struct fanout_job *ps_job;
+    int                 ai_count[FANOUT_MAX];
+    int                 i_lc;
+    int                 i_slot;
+    int                 i_worker;
+
+    memset(ai_count, 0, sizeof(ai_count));
+
+    for (i_lc = 0; i_lc < ps_room->i_members; i_lc++)
+    {
+        i_slot = ps_room->ns_members[i_lc].i_slot;
+
+        if (i_slot != i_sender)
+        {
+            ai_count[FANOUT_WORKER(i_slot, ps_reactor->i_workers)]++;
+            ps_reactor->ns_slots[i_slot].u64_sent =
+                ps_reactor->s_wheel.u64_now;
+        }
+    }
+
+    for (i_worker = 0; i_worker < ps_reactor->i_workers; i_worker++)
+    {
+        aps_jobs[i_worker] = NULL;
+
+        if (ai_count[i_worker] == 0)
+        {
+            continue;
+        }
+
+        aps_jobs[i_worker] = fanout_job(ai_count[i_worker]);
+
+        if (aps_jobs[i_worker] == NULL)
+        {
+            fprintf(stderr, "pollserver: no memory, message to %d members "
+                "of a room dropped\n", ai_count[i_worker]);
+        }
+    }
+
+    for (i_lc = 0; i_lc < ps_room->i_members; i_lc++)
+    {
+        i_slot = ps_room->ns_members[i_lc].i_slot;
+        ps_job = aps_jobs[FANOUT_WORKER(i_slot, ps_reactor->i_workers)];
+
+        if (i_slot != i_sender && ps_job != NULL)
+        {
+            ps_job->ni_slots[ps_job->i_count++] =
+                FANOUT_SLOT(i_slot, ps_reactor->i_workers);
+        }
+    }
+
+    for (i_worker = 0; i_worker < ps_reactor->i_workers; i_worker++)
+    {
+        if (aps_jobs[i_worker] != NULL)
+        {
+            message_hold(ps_message, 1);
+            aps_jobs[i_worker]->i_kind = FANOUT_SEND;
+            aps_jobs[i_worker]->ps_message = ps_message;
+            fanout_push(ps_reactor, ps_reactor->i_id, i_worker,
+                aps_jobs[i_worker]);
+        }
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Hand one client's message to its worker: a heartbeat, a history replay or  */
+/* a reply.  Takes over the reference the caller holds:                       */
+/*                                                                            */
+void fanout_send
+(
+    struct reactor *ps_reactor, /* both - Reactor that owns the client        */
+    int              i_slot,    /* in   - Slot of the client                  */
+    struct message *ps_message  /* in   - Message, one reference for us       */
+)
+{
+    struct fanout_job *ps_job;
+
+    ps_job = fanout_job(1);
+
+    if (ps_job == NULL)
+    {
+        fprintf(stderr, "pollserver: no memory, message to socket %d "
+            "dropped\n", ps_reactor->ns_slots[i_slot].i_fd);
+        message_release(ps_message);
+
+        return;
+    }
+
+    ps_job->i_kind = FANOUT_SEND;
+    ps_job->i_count = 1;
+    ps_job->ni_slots[0] = FANOUT_SLOT(i_slot, ps_reactor->i_workers);
+    ps_job->ps_message = ps_message;
+
+    ps_reactor->ns_slots[i_slot].u64_sent = ps_reactor->s_wheel.u64_now;
+
+    fanout_push(ps_reactor, ps_reactor->i_id,
+        FANOUT_WORKER(i_slot, ps_reactor->i_workers), ps_job);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Get sockaddr, IPv4 or IPv6:                                                */
+/*                                                                            */
+void *get_in_addr
+(
+    struct sockaddr *sa
+)
+{
+    if (sa->sa_family == AF_INET)
+    {
+        return &(((struct sockaddr_in*)sa)->sin_addr);
+    }
+
+    return &(((struct sockaddr_in6*)sa)->sin6_addr);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Return a listening socket.  With SO_REUSEPORT several reactors can each    */
+/* have their own listener on the same port and the kernel spreads the new    */
+/* connections across them.  Given a path, the socket is a Unix domain one    */
+/* there instead (-l), which spares clients on this host the TCP/IP stack:    */
+/*                                                                            */
+int get_listener_socket
+(
+    char *nc_path,    /* in   - Unix socket path, or NULL for TCP             */
+    char *nc_port,    /* in   - TCP port, when nc_path is NULL                */
+    int   i_reuseport /* in   - Nonzero to share the port with others         */
+)
+{
+    struct addrinfo   *ps_address;
+    struct addrinfo   *ps_ai;
+    int                i_errno;
+    struct addrinfo    s_hints;
+    struct addrinfo    s_local;    // The one address of a Unix socket
+    struct sockaddr_un s_local_addr;
+    int                i_listener; // Listening socket descriptor
+    int                i_status;
+    int                i_yes;      // For setsockopt() SO_REUSEADDR, below
+/*                                                                            */
+/* Get a list of addresses.  A Unix socket has only its path, and one left    */
+/* behind by a server that did not exit cleanly would stop bind:              */
+/*                                                                            */
+    if (nc_path != NULL)
+    {
+        memset(&s_local_addr, 0, sizeof(s_local_addr));
+        s_local_addr.sun_family = AF_UNIX;
+        strcpy(s_local_addr.sun_path, nc_path);
+
+        memset(&s_local, 0, sizeof(s_local));
+        s_local.ai_family = AF_UNIX;
+        s_local.ai_socktype = SOCK_STREAM;
+        s_local.ai_addr = (struct sockaddr*)&s_local_addr;
+        s_local.ai_addrlen = sizeof(s_local_addr);
+
+        ps_ai = &s_local;
+
+        unlink(nc_path);
+    }
+    else
+    {
+        memset(&s_hints, 0, sizeof(s_hints));
+
+        s_hints.ai_family = AF_UNSPEC;
+        s_hints.ai_socktype = SOCK_STREAM;
+        s_hints.ai_flags = AI_PASSIVE; // use my IP
+
+        i_status = getaddrinfo(NULL, nc_port, &s_hints, &ps_ai);
+
+        if (i_status != 0)
+        {
+            fprintf(stderr, "getaddrinfo failed with code %d.\n", i_status);
+            fprintf(stderr, "%s\n", gai_strerror(i_status));
+
+            return -1;
+        }
+    }
+/*                                                                            */
+/* Look for an address to which we can bind:                                  */
+/*                                                                            */
+    i_listener = -1;
+
+    for (ps_address = ps_ai;
+        ps_address != NULL;
+        ps_address = ps_address->ai_next)
+    {
+        i_listener = socket(ps_address->ai_family, ps_address->ai_socktype,
+            ps_address->ai_protocol);
+        if (i_listener == -1)
+        {
+            continue;
+        }
+        /* Allow reuse of the socket:                                                 */
+        i_yes = 1;
+        errno = 0;
+        i_status = setsockopt(i_listener, SOL_SOCKET, SO_REUSEADDR, &i_yes,
+            sizeof(i_yes));
+        i_errno = errno;
+
+        if (i_status == -1)
+        {
+            report_error("setsockopt", i_errno);
+            close(i_listener);
+
+            if (nc_path == NULL)
+            {
+                freeaddrinfo(ps_ai);
+            }
+
+            return -1;
+        }
+        /* Share the port with the other reactors:                                    */
+        if (i_reuseport)
+        {
+            errno = 0;
+            i_status = setsockopt(i_listener, SOL_SOCKET, SO_REUSEPORT, &i_yes,
+                sizeof(i_yes));
+            i_errno = errno;
+
+            if (i_status == -1)
+            {
+                report_error("setsockopt", i_errno);
+                close(i_listener);
+
+                if (nc_path == NULL)
+                {
+                    freeaddrinfo(ps_ai);
+                }
+
+                return -1;
+            }
+        }
+        /* Bind to the socket:                                                        */
+        i_status = bind(i_listener, ps_address->ai_addr,
+            ps_address->ai_addrlen);
+
+        if (i_status == -1)
+        {
+            close(i_listener);
+            i_listener = -1;
+
+            continue;
+        }
+
+        break;
+    }
+/*                                                                            */
+/* Free the list of addresses:                                                */
+/*                                                                            */
+    if (nc_path == NULL)
+    {
+        freeaddrinfo(ps_ai);
+    }
+/*                                                                            */
+/* Check for a connection:                                                    */
+/*                                                                            */
+    if (ps_address == NULL)
+    {
+        fprintf(stderr, "Failed to bind to a socket.\n");
+
+        return -1;
+    }
+/*                                                                            */
+/* Listen:                                                                    */
+/*                                                                            */
+    errno = 0;
+    i_status = listen(i_listener, BACKLOG);
+    i_errno = errno;
+
+    if (i_status == -1)
+    {
+        report_error("listen", i_errno);
+        close(i_listener);
+
+        return -1;
+    }
+/*                                                                            */
+/* Success so return the socket:                                              */
+/*                                                                            */
+    return i_listener;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Read from a client and pass what arrived on to everyone else.  Returns 1   */
+/* if the client went away and its entry was removed, otherwise 0:            */
+/*                                                                            */
+int handle_client_data
+(
+    struct reactor *ps_reactor, /* both - Event loop that owns the client     */
+    int              i          /* in   - Slot of the client                  */
+)
+{
+    struct connection *ps_conn;
+    char              *nc_buf;
+    int                 i_errno;
+    int                 i_nbytes;
+    int                 i_sender_fd;
+    int                 i_size;
+    struct message    *ps_message;
+
+    ps_conn = &ps_reactor->ns_slots[i];
+    ps_message = NULL;
+/*                                                                            */
+/* Framed mode reads onto the end of the client's input buffer.  Otherwise    */
+/* read straight into a message so the broadcast needs no copy:               */
+/*                                                                            */
+    if (ps_reactor->i_frame_max > 0)
+    {
+        if (conn_reserve(ps_conn, ps_conn->i_in_len + MESSAGE_MAX) == -1)
+        {
+            return 0;
+        }
+
+        nc_buf = ps_conn->nc_in + ps_conn->i_in_len;
+        i_size = ps_conn->i_in_size - ps_conn->i_in_len;
+    }
+    else
+    {
+        ps_message = message_alloc(MESSAGE_MAX);
+
+        if (ps_message == NULL)
+        {
+            fprintf(stderr, "pollserver: no memory to read a message\n");
+
+            return 0;
+        }
+
+        nc_buf = ps_message->ac_data;
+        i_size = MESSAGE_MAX;
+    }
+
+    i_sender_fd = ps_reactor->ns_pfds[i].fd;
+
+    errno = 0;
+    i_nbytes = recv(i_sender_fd, nc_buf, i_size, 0);
+    i_errno = errno;
+    COUNTER_ADD(ps_reactor->l_syscalls, 1);
+
+    if (i_nbytes > 0)
+    {
+        COUNTER_ADD(ps_reactor->l_bytes_in, i_nbytes);
+    }
+/*                                                                            */
+/* Got error or connection closed by client:                                  */
+/*                                                                            */
+    if (i_nbytes <= 0)
+    {
+        if (ps_message != NULL)
+        {
+            message_release(ps_message);
+        }
+
+        if (i_nbytes == 0) // Connection closed
+        {
+            fprintf(stderr, "pollserver: socket %d hung up\n", i_sender_fd);
+        }
+        else
+        {
+            report_error("recv", i_errno);
+        }
+
+        close_connection(ps_reactor, i);
+
+        return 1;
+    }
+
+    ps_conn->u64_heard = ps_reactor->s_wheel.u64_now;
+/*                                                                            */
+/* Pass on whatever frames are now complete:                                  */
+/*                                                                            */
+    if (ps_message == NULL)
+    {
+        ps_conn->i_in_len += i_nbytes;
+
+        if (conn_reassemble(ps_reactor, i) == -1)
+        {
+            close_connection(ps_reactor, i);
+
+            return 1;
+        }
+
+        return 0;
+    }
+/*                                                                            */
+/* We got some good data from a client.  Send to everyone!                    */
+/*                                                                            */
+    ps_message->i_len = i_nbytes;
+
+    broadcast_message(ps_reactor, i, ps_message);
+    message_release(ps_message);
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Take over the clients of the old server (-H).  Each record names the       */
+/* reactor the client was on and is followed by its partial frame, the bytes  */
+/* it was still owed and the rooms it was in.  The client goes on the same    */
+/* reactor here, or on one of them if there are fewer now, and is put back    */
+/* exactly as it was.  The old server exits once it gets the acknowledgement, */
+/* so it is only sent when every client is in place.  Returns the number of   */
+/* clients taken or -1:                                                       */
+/*                                                                            */
+int handoff_adopt
+(
+    int              i_sockfd,   /* in   - Connection to the old server       */
+    struct reactor *ns_reactors, /* both - Reactors to spread the clients on  */
+    int              i_reactors  /* in   - Entries in ns_reactors             */
+)
+{
+    struct handoff_record s_record;
+    struct connection    *ps_conn;
+    struct message       *ps_message;
+    struct reactor       *ps_reactor;
+    struct room          *ps_room;
+    char                 *nc_data;
+    char                 *nc_name;
+    char                   c_ack;
+    int                    i_clients;
+    int                    i_fd;
+    int                    i_len;
+    int                    i_slot;
+    long                   l_size;
+
+    i_clients = 0;
+
+    for (;;)
+    {
+        if (handoff_get(i_sockfd, &s_record, &i_fd, 1) == -1)
+        {
+            close(i_sockfd);
+
+            return -1;
+        }
+
+        if (s_record.u32_kind == HANDOFF_END)
+        {
+            break;
+        }
+
+        if (s_record.u32_kind != HANDOFF_CLIENT || s_record.u32_fds != 1)
+        {
+            fprintf(stderr, "pollserver: bad record from the old server\n");
+            close(i_sockfd);
+
+            return -1;
+        }
+
+        l_size = (long)s_record.u32_in + s_record.u32_out + s_record.u32_rooms;
+        nc_data = malloc(l_size + 1);
+
+        if (nc_data == NULL ||
+            handoff_read(i_sockfd, nc_data, l_size) == -1)
+        {
+            fprintf(stderr, "pollserver: lost the state of socket %d\n",
+                i_fd);
+            free(nc_data);
+            close(i_fd);
+            close(i_sockfd);
+
+            return -1;
+        }
+
+        nc_data[l_size] = '\0';
+
+        ps_reactor = &ns_reactors[s_record.u32_reactor % i_reactors];
+        i_slot = conn_open(ps_reactor, i_fd);
+
+        if (i_slot == -1)
+        {
+            free(nc_data);
+            close(i_fd);
+
+            continue;
+        }
+
+        ps_conn = &ps_reactor->ns_slots[i_slot];
+        ps_conn->u32_zc_next = s_record.u32_zc_next;
+/*                                                                            */
+/* The start of a frame it was half way through sending.  Without it the      */
+/* rest of that frame would be read as a new length, so a client whose frame  */
+/* cannot be kept is closed:                                                  */
+/*                                                                            */
+        if (s_record.u32_in > 0)
+        {
+            if (conn_reserve(ps_conn, (int)s_record.u32_in) == -1)
+            {
+                free(nc_data);
+                close_connection(ps_reactor, i_slot);
+
+                continue;
+            }
+
+            memcpy(ps_conn->nc_in, nc_data, s_record.u32_in);
+            ps_conn->i_in_len = (int)s_record.u32_in;
+        }
+/*                                                                            */
+/* Its rooms, each name ended by a NUL:                                       */
+/*                                                                            */
+        nc_name = nc_data + s_record.u32_in + s_record.u32_out;
+
+        while (nc_name < nc_data + l_size)
+        {
+            i_len = (int)strlen(nc_name);
+            ps_room = room_find(ps_reactor, nc_name, i_len, 1);
+
+            if (ps_room != NULL)
+            {
+                room_join(ps_reactor, i_slot, ps_room);
+            }
+
+            nc_name += i_len + 1;
+        }
+/*                                                                            */
+/* What it was still owed goes out first, as one message, from where the old  */
+/* server stopped, even in the middle of a frame:                             */
+/*                                                                            */
+        if (s_record.u32_out > 0)
+        {
+            ps_message = message_alloc((int)s_record.u32_out);
+
+            if (ps_message == NULL)
+            {
+                fprintf(stderr, "pollserver: no memory, output of socket %d "
+                    "lost\n", i_fd);
+            }
+            else
+            {
+                memcpy(ps_message->ac_data, nc_data + s_record.u32_in,
+                    s_record.u32_out);
+                ps_message->i_len = (int)s_record.u32_out;
+                conn_enqueue(ps_reactor, ps_conn, ps_message);
+            }
+        }
+
+        free(nc_data);
+        i_clients++;
+    }
+
+    c_ack = 1;
+
+    if (handoff_write(i_sockfd, &c_ack, 1) == -1)
+    {
+        close(i_sockfd);
+
+        return -1;
+    }
+
+    close(i_sockfd);
+
+    printf("pollserver: took over %d client%s\n", i_clients,
+        i_clients == 1 ? "" : "s");
+
+    return i_clients;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Connect to a server already running on the hand-over path and take its     */
+/* listeners, one per reactor it had and its Unix listener (-l) if it had     */
+/* one.  From here on it accepts nothing; the connections queue until this    */
+/* server starts its loops.  Returns the socket, -1 when no server is running */
+/* there or -2 on error:                                                      */
+/*                                                                            */
+int handoff_connect
+(
+    char *nc_path,      /* in   - Hand-over socket path (-H)                  */
+    int  *ai_listeners, /* out  - Listening sockets, MAX_REACTORS at most     */
+    int  *pi_count,     /* out  - Entries in ai_listeners                     */
+    int  *pi_local      /* out  - Unix listener (-l) or -1                    */
+)
+{
+    int                    ai_fds[MAX_REACTORS + 1];
+    struct handoff_record s_record;
+    struct sockaddr_un    s_addr;
+    struct timeval        s_timeout;
+    int                    i_errno;
+    int                    i_fds;
+    int                    i_sockfd;
+
+    *pi_count = 0;
+    *pi_local = -1;
+
+    errno = 0;
+    i_sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (i_sockfd == -1)
+    {
+        i_errno = errno;
+        report_error("socket", i_errno);
+
+        return -2;
+    }
+
+    memset(&s_addr, 0, sizeof(s_addr));
+    s_addr.sun_family = AF_UNIX;
+    strcpy(s_addr.sun_path, nc_path);
+
+    errno = 0;
+
+    if (connect(i_sockfd, (struct sockaddr*)&s_addr, sizeof(s_addr)) == -1)
+    {
+        i_errno = errno;
+        close(i_sockfd);
+
+        if (i_errno == ENOENT || i_errno == ECONNREFUSED)
+        {
+            return -1; // Nobody to take over from
+        }
+
+        report_error("connect", i_errno);
+
+        return -2;
+    }
+/*                                                                            */
+/* Neither side waits for the other for ever:                                 */
+/*                                                                            */
+    s_timeout.tv_sec = HANDOFF_TIMEOUT;
+    s_timeout.tv_usec = 0;
+
+    setsockopt(i_sockfd, SOL_SOCKET, SO_RCVTIMEO, &s_timeout,
+        sizeof(s_timeout));
+    setsockopt(i_sockfd, SOL_SOCKET, SO_SNDTIMEO, &s_timeout,
+        sizeof(s_timeout));
+
+    i_fds = handoff_get(i_sockfd, &s_record, ai_fds, MAX_REACTORS + 1);
+
+    if (i_fds == -1 || s_record.u32_kind != HANDOFF_LISTENERS ||
+        i_fds <= (s_record.u32_local ? 1 : 0))
+    {
+        fprintf(stderr, "pollserver: the server on %s sent no listeners\n",
+            nc_path);
+
+        while (i_fds > 0)
+        {
+            close(ai_fds[--i_fds]);
+        }
+
+        close(i_sockfd);
+
+        return -2;
+    }
+
+    if (s_record.u32_local)
+    {
+        *pi_local = ai_fds[--i_fds];
+    }
+
+    memcpy(ai_listeners, ai_fds, sizeof(int) * i_fds);
+    *pi_count = i_fds;
+
+    printf("pollserver: taking over from the server on %s\n", nc_path);
+
+    return i_sockfd;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Read one hand-over record and the descriptors that came with it.  They     */
+/* arrive close-on-exec; any beyond i_max are closed.  Returns the number of  */
+/* descriptors or -1:                                                         */
+/*                                                                            */
+int handoff_get
+(
+    int                     i_sockfd, /* in   - Hand-over connection          */
+    struct handoff_record *ps_record, /* out  - Record read                   */
+    int                    *ai_fds,   /* out  - Descriptors that came with it */
+    int                     i_max     /* in   - Room in ai_fds                */
+)
+{
+    union
+    {
+        char            ac_buf[CMSG_SPACE(sizeof(int) * (MAX_REACTORS + 1))];
+        struct cmsghdr s_align;
+    }                u_control;
+    struct cmsghdr *ps_cmsg;
+    struct iovec    s_iov;
+    struct msghdr   s_msg;
+    int              i_errno;
+    int              i_fds;
+    int              i_lc;
+    int              i_n;
+    int             *pi_fd;
+    ssize_t          ss_got;
+
+    memset(&s_msg, 0, sizeof(s_msg));
+    s_iov.iov_base = ps_record;
+    s_iov.iov_len = sizeof(*ps_record);
+    s_msg.msg_iov = &s_iov;
+    s_msg.msg_iovlen = 1;
+    s_msg.msg_control = u_control.ac_buf;
+    s_msg.msg_controllen = sizeof(u_control.ac_buf);
+
+    do
+    {
+        errno = 0;
+        ss_got = recvmsg(i_sockfd, &s_msg, MSG_CMSG_CLOEXEC);
+        i_errno = errno;
+    } while (ss_got == -1 && i_errno == EINTR);
+
+    if (ss_got <= 0)
+    {
+        if (ss_got == -1)
+        {
+            report_error("recvmsg", i_errno);
+        }
+
+        return -1;
+    }
+
+    i_fds = 0;
+
+    for (ps_cmsg = CMSG_FIRSTHDR(&s_msg);
+        ps_cmsg != NULL;
+        ps_cmsg = CMSG_NXTHDR(&s_msg, ps_cmsg))
+    {
+        if (ps_cmsg->cmsg_level != SOL_SOCKET ||
+            ps_cmsg->cmsg_type != SCM_RIGHTS)
+        {
+            continue;
+        }
+
+        pi_fd = (int*)CMSG_DATA(ps_cmsg);
+        i_n = (int)((ps_cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+
+        for (i_lc = 0; i_lc < i_n; i_lc++)
+        {
+            if (i_fds < i_max)
+            {
+                ai_fds[i_fds++] = pi_fd[i_lc];
+            }
+            else
+            {
+                close(pi_fd[i_lc]);
+            }
+        }
+    }
+/*                                                                            */
+/* The descriptors come with the first byte; the rest of the record may come  */
+/* in later reads:                                                            */
+/*                                                                            */
+    if ((size_t)ss_got < sizeof(*ps_record) &&
+        handoff_read(i_sockfd, (char*)ps_record + ss_got,
+        sizeof(*ps_record) - ss_got) == -1)
+    {
+        while (i_fds > 0)
+        {
+            close(ai_fds[--i_fds]);
+        }
+
+        return -1;
+    }
+
+    return i_fds;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Listen on the hand-over path for the server that will replace this one.    */
+/* A path left over from an earlier server is removed first.  Returns the     */
+/* socket or -1:                                                              */
+/*                                                                            */
+int handoff_listen
+(
+    char *nc_path /* in   - Hand-over socket path (-H)                        */
+)
+{
+    struct sockaddr_un s_addr;
+    int                 i_errno;
+    int                 i_sockfd;
+
+    errno = 0;
+    i_sockfd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+
+    if (i_sockfd == -1)
+    {
+        i_errno = errno;
+        report_error("socket", i_errno);
+
+        return -1;
+    }
+
+    memset(&s_addr, 0, sizeof(s_addr));
+    s_addr.sun_family = AF_UNIX;
+    strcpy(s_addr.sun_path, nc_path);
+
+    unlink(nc_path);
+
+    errno = 0;
+
+    if (bind(i_sockfd, (struct sockaddr*)&s_addr, sizeof(s_addr)) == -1 ||
+        listen(i_sockfd, 1) == -1)
+    {
+        i_errno = errno;
+        report_error("bind", i_errno);
+        close(i_sockfd);
+
+        return -1;
+    }
+
+    return i_sockfd;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Send one hand-over record, with descriptors if there are any.  Returns 0   */
+/* or -1:                                                                     */
+/*                                                                            */
+int handoff_put
+(
+    int                     i_sockfd, /* in   - Hand-over connection          */
+    struct handoff_record *ps_record, /* in   - Record to send                */
+    int                    *ai_fds,   /* in   - Descriptors to pass with it   */
+    int                     i_fds     /* in   - Entries in ai_fds             */
+)
+{
+    union
+    {
+        char            ac_buf[CMSG_SPACE(sizeof(int) * (MAX_REACTORS + 1))];
+        struct cmsghdr s_align;
+    }                u_control;
+    struct cmsghdr *ps_cmsg;
+    struct iovec    s_iov;
+    struct msghdr   s_msg;
+    int              i_errno;
+    ssize_t          ss_sent;
+
+    memset(&s_msg, 0, sizeof(s_msg));
+    memset(&u_control, 0, sizeof(u_control));
+    s_iov.iov_base = ps_record;
+    s_iov.iov_len = sizeof(*ps_record);
+    s_msg.msg_iov = &s_iov;
+    s_msg.msg_iovlen = 1;
+
+    if (i_fds > 0)
+    {
+        s_msg.msg_control = u_control.ac_buf;
+        s_msg.msg_controllen = CMSG_SPACE(sizeof(int) * i_fds);
+        ps_cmsg = CMSG_FIRSTHDR(&s_msg);
+        ps_cmsg->cmsg_level = SOL_SOCKET;
+        ps_cmsg->cmsg_type = SCM_RIGHTS;
+        ps_cmsg->cmsg_len = CMSG_LEN(sizeof(int) * i_fds);
+        memcpy(CMSG_DATA(ps_cmsg), ai_fds, sizeof(int) * i_fds);
+    }
+
+    do
+    {
+        errno = 0;
+        ss_sent = sendmsg(i_sockfd, &s_msg, MSG_NOSIGNAL);
+        i_errno = errno;
+    } while (ss_sent == -1 && i_errno == EINTR);
+
+    if (ss_sent == -1)
+    {
+        report_error("sendmsg", i_errno);
+
+        return -1;
+    }
+
+    if ((size_t)ss_sent < sizeof(*ps_record))
+    {
+        return handoff_write(i_sockfd, (char*)ps_record + ss_sent,
+            sizeof(*ps_record) - ss_sent);
+    }
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Read exactly l_len bytes from the hand-over connection.  Returns 0 or -1:  */
+/*                                                                            */
+int handoff_read
+(
+    int   i_sockfd, /* in   - Hand-over connection                            */
+    char *nc_buf,   /* out  - Where the bytes go                              */
+    long  l_len     /* in   - Bytes to read                                   */
+)
+{
+    int     i_errno;
+    ssize_t ss_got;
+
+    while (l_len > 0)
+    {
+        errno = 0;
+        ss_got = recv(i_sockfd, nc_buf, l_len, 0);
+        i_errno = errno;
+
+        if (ss_got == -1 && i_errno == EINTR)
+        {
+            continue;
+        }
+
+        if (ss_got <= 0)
+        {
+            if (ss_got == -1)
+            {
+                report_error("recv", i_errno);
+            }
+            else
+            {
+                fprintf(stderr, "pollserver: hand-over connection closed\n");
+            }
+
+            return -1;
+        }
+
+        nc_buf += ss_got;
+        l_len -= ss_got;
+    }
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Hand the listeners and every client to the new server (-H).  The loops     */
+/* have stopped, so nothing changes under us.  Messages still on their way    */
+/* between reactors are delivered to the output queues first, then each       */
+/* client goes across with its partial frame, the bytes it is still owed and  */
+/* the names of its rooms.  A client being dropped (-q) is left to close.     */
+/* Returns the number of clients handed over, or -1 if the new server did not */
+/* acknowledge them, in which case this server still has everything:          */
+/*                                                                            */
+int handoff_send
+(
+    int              i_sockfd,   /* in   - Connection to the new server       */
+    struct reactor *ns_reactors, /* both - Stopped reactors                   */
+    int              i_reactors  /* in   - Entries in ns_reactors             */
+)
+{
+    int                    ai_fds[MAX_REACTORS + 1];
+    struct handoff_record s_record;
+    struct connection    *ps_conn;
+    struct message       *ps_message;
+    struct reactor       *ps_reactor;
+    struct room          *ps_room;
+    char                   c_ack;
+    int                    i_backlog;
+    int                    i_clients;
+    int                    i_lc;
+    int                    i_off;
+    int                    i_pinned;
+    int                    i_ref;
+    int                    i_slot;
+    int                    i_wait;
+    unsigned               u_pos;
+
+    do
+    {
+        i_backlog = 0;
+
+        for (i_lc = 0; i_lc < i_reactors; i_lc++)
+        {
+            shard_flush(&ns_reactors[i_lc]);
+        }
+
+        for (i_lc = 0; i_lc < i_reactors; i_lc++)
+        {
+            shard_drain(&ns_reactors[i_lc]);
+            i_backlog += ns_reactors[i_lc].i_backlog;
+        }
+    } while (i_backlog > 0);
+
+/*                                                                            */
+/* Zero-copy writes the kernel has not finished with pin messages this server */
+/* would free on exit, and once the new server runs it may read their         */
+/* completions itself.  They finish as soon as the peer acknowledges the      */
+/* data, so wait for them here, a round trip at most:                         */
+/*                                                                            */
+    for (i_wait = 0; i_wait < HANDOFF_TIMEOUT * 1000; i_wait++)
+    {
+        i_pinned = 0;
+
+        for (i_lc = 0; i_lc < i_reactors; i_lc++)
+        {
+            ps_reactor = &ns_reactors[i_lc];
+
+            for (i_slot = FIRST_CLIENT; i_slot < ps_reactor->i_slot_high;
+                i_slot++)
+            {
+                ps_conn = &ps_reactor->ns_slots[i_slot];
+
+                if (ps_conn->u_pin_head != ps_conn->u_pin_tail)
+                {
+                    conn_reap(ps_reactor, ps_conn);
+                    i_pinned += ps_conn->u_pin_head != ps_conn->u_pin_tail;
+                }
+            }
+        }
+
+        if (i_pinned == 0)
+        {
+            break;
+        }
+
+        usleep(1000);
+    }
+
+    memset(&s_record, 0, sizeof(s_record));
+    s_record.u32_kind = HANDOFF_LISTENERS;
+    s_record.u32_fds = (uint32_t)i_reactors;
+
+    for (i_lc = 0; i_lc < i_reactors; i_lc++)
+    {
+        ai_fds[i_lc] = ns_reactors[i_lc].i_listener;
+    }
+
+    if (ns_reactors[0].i_local != -1)
+    {
+        ai_fds[i_lc] = ns_reactors[0].i_local;
+        s_record.u32_fds++;
+        s_record.u32_local = 1;
+    }
+
+    if (handoff_put(i_sockfd, &s_record, ai_fds,
+        (int)s_record.u32_fds) == -1)
+    {
+        return -1;
+    }
+
+    i_clients = 0;
+
+    for (i_lc = 0; i_lc < i_reactors; i_lc++)
+    {
+        ps_reactor = &ns_reactors[i_lc];
+
+        for (i_slot = FIRST_CLIENT; i_slot < ps_reactor->i_slot_high;
+            i_slot++)
+        {
+            ps_conn = &ps_reactor->ns_slots[i_slot];
+
+            if (ps_reactor->ns_pfds[i_slot].fd == -1 || ps_conn->i_evicted)
+            {
+                continue;
+            }
+
+            memset(&s_record, 0, sizeof(s_record));
+            s_record.u32_kind = HANDOFF_CLIENT;
+            s_record.u32_fds = 1;
+            s_record.u32_reactor = (uint32_t)i_lc;
+            s_record.u32_zc_next = ps_conn->u32_zc_next;
+            s_record.u32_in = (uint32_t)ps_conn->i_in_len;
+            s_record.u32_out = (uint32_t)ps_conn->l_queued;
+
+            for (i_ref = 0; i_ref < ps_conn->i_rooms; i_ref++)
+            {
+                s_record.u32_rooms +=
+                    ps_conn->ns_rooms[i_ref].ps_room->i_name_len + 1;
+            }
+
+            if (handoff_put(i_sockfd, &s_record, &ps_conn->i_fd, 1) == -1 ||
+                handoff_write(i_sockfd, ps_conn->nc_in,
+                ps_conn->i_in_len) == -1)
+            {
+                return -1;
+            }
+
+            for (u_pos = ps_conn->u_head; u_pos != ps_conn->u_tail; u_pos++)
+            {
+                ps_message = ps_conn->ns_queue[u_pos &
+                    (ps_conn->u_queue_size - 1)];
+                i_off = u_pos == ps_conn->u_head ? ps_conn->i_sent : 0;
+
+                if (handoff_write(i_sockfd, ps_message->ac_data + i_off,
+                    ps_message->i_len - i_off) == -1)
+                {
+                    return -1;
+                }
+            }
+
+            for (i_ref = 0; i_ref < ps_conn->i_rooms; i_ref++)
+            {
+                ps_room = ps_conn->ns_rooms[i_ref].ps_room;
+
+                if (handoff_write(i_sockfd, ps_room->ac_name,
+                    ps_room->i_name_len) == -1 ||
+                    handoff_write(i_sockfd, "", 1) == -1)
+                {
+                    return -1;
+                }
+            }
+
+            i_clients++;
+        }
+    }
+
+    memset(&s_record, 0, sizeof(s_record));
+    s_record.u32_kind = HANDOFF_END;
+
+    if (handoff_put(i_sockfd, &s_record, NULL, 0) == -1 ||
+        handoff_read(i_sockfd, &c_ack, 1) == -1)
+    {
+        return -1;
+    }
+    printf("pollserver: handed %d client%s to the new server\n", i_clients,
+        i_clients == 1 ? "" : "s");
+
+    return i_clients;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Wait for the next server to connect to the hand-over path, then tell the   */
+/* main thread with SIGUSR2.  One connection is taken; if the hand-over falls */
+/* through the main thread starts another of these:                           */
+/*                                                                            */
+void *handoff_thread
+(
+    void *p_arg /* in   - Not used                                            */
+)
+{
+    struct timeval s_timeout;
+    int             i_errno;
+    int             i_sockfd;
+
+    (void)p_arg;
+
+    do
+    {
+        errno = 0;
+        i_sockfd = accept4(gi_handoff_listener, NULL, NULL, SOCK_CLOEXEC);
+        i_errno = errno;
+    } while (i_sockfd == -1 && (i_errno == EINTR || i_errno == ECONNABORTED));
+
+    if (i_sockfd == -1) // Closed under us when the server exits
+    {
+        if (!__atomic_load_n(&gi_stop, __ATOMIC_ACQUIRE))
+        {
+            report_error("accept4", i_errno);
+        }
+
+        return NULL;
+    }
+
+    s_timeout.tv_sec = HANDOFF_TIMEOUT;
+    s_timeout.tv_usec = 0;
+
+    setsockopt(i_sockfd, SOL_SOCKET, SO_RCVTIMEO, &s_timeout,
+        sizeof(s_timeout));
+    setsockopt(i_sockfd, SOL_SOCKET, SO_SNDTIMEO, &s_timeout,
+        sizeof(s_timeout));
+
+    __atomic_store_n(&gi_handoff_fd, i_sockfd, __ATOMIC_RELEASE);
+    kill(getpid(), SIGUSR2);
+
+    return NULL;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Write all of a buffer to the hand-over connection.  Returns 0 or -1:       */
+/*                                                                            */
+int handoff_write
+(
+    int   i_sockfd, /* in   - Hand-over connection                            */
+    char *nc_buf,   /* in   - Bytes to write                                  */
+    long  l_len     /* in   - How many                                        */
+)
+{
+    int     i_errno;
+    ssize_t ss_sent;
+
+    while (l_len > 0)
+    {
+        errno = 0;
+        ss_sent = send(i_sockfd, nc_buf, l_len, MSG_NOSIGNAL);
+        i_errno = errno;
+
+        if (ss_sent == -1 && i_errno == EINTR)
+        {
+            continue;
+        }
+
+        if (ss_sent == -1)
+        {
+            report_error("send", i_errno);
+
+            return -1;
+        }
+
+        nc_buf += ss_sent;
+        l_len -= ss_sent;
+    }
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Add a PUBLISH frame to a room's history.  Only the room's owning reactor   */
+/* calls this, so there is one writer; readers on other reactors see the      */
+/* frame once u64_count moves.  Frames too big to be worth keeping are left   */
+/* out:                                                                       */
+/*                                                                            */
+void history_append
+(
+    struct history *ps_history, /* both - Mapped history of the room          */
+    struct message *ps_message  /* in   - PUBLISH frame                       */
+)
+{
+    char     *nc_ring;
+    uint64_t  u64_count;
+    uint64_t  u64_pos;
+    uint32_t  u32_size;
+
+    u32_size = ps_history->u32_size;
+
+    if (ps_message->i_len > (int)(u32_size / 4))
+    {
+        return;
+    }
+
+    nc_ring = (char*)ps_history + HISTORY_DATA;
+    u64_count = ps_history->u64_count;
+    u64_pos = ps_history->u64_end;
+
+    if (u64_pos % u32_size + ps_message->i_len > u32_size)
+    {
+        u64_pos += u32_size - u64_pos % u32_size; // Start the next lap
+    }
+
+    memcpy(nc_ring + u64_pos % u32_size, ps_message->ac_data,
+        ps_message->i_len);
+    ps_history->au64_index[u64_count % HISTORY_INDEX] = u64_pos;
+
+    __atomic_store_n(&ps_history->u64_end, u64_pos + ps_message->i_len,
+        __ATOMIC_RELEASE);
+    __atomic_store_n(&ps_history->u64_count, u64_count + 1,
+        __ATOMIC_RELEASE);
+/*                                                                            */
+/* Wake clients asleep on the ring (MAP).  Rooms nobody mapped skip the call. */
+/* A reader that saw the old u32_seq before FUTEX_WAIT is woken by this; one  */
+/* that looks after the store sees the new value and does not sleep:          */
+/*                                                                            */
+    if (__atomic_load_n(&ps_history->u32_mapped, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&ps_history->u32_seq, (uint32_t)(u64_count + 1),
+            __ATOMIC_RELEASE);
+        syscall(SYS_futex, &ps_history->u32_seq, FUTEX_WAKE, INT32_MAX,
+            NULL, NULL, 0);
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Close the memfds behind the room rings (-M) at exit:                       */
+/*                                                                            */
+void history_close_all
+(
+    void
+)
+{
+    struct ring_file *ps_file;
+
+    while (gps_ring_files != NULL)
+    {
+        ps_file = gps_ring_files;
+        gps_ring_files = ps_file->ps_next;
+        close(ps_file->i_fd);
+        free(ps_file);
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Open the file behind a room's ring.  With -d it is the history file,       */
+/* created if it is not there, named after the room name in hex since names   */
+/* can hold any byte but a space.  Otherwise it is a memfd kept for the life  */
+/* of the server, created and sealed at its full size the first time any      */
+/* reactor asks for the room.  A writable descriptor is for a reactor to map; */
+/* a read-only one is for a client (MAP), and a fresh open of the memfd       */
+/* through /proc is the only way to get one, as a dup keeps the access mode.  */
+/* Returns the descriptor or -1:                                              */
+/*                                                                            */
+int history_file
+(
+    struct reactor *ps_reactor, /* in   - Reactor asking for it               */
+    char           *nc_name,    /* in   - Room name, not terminated           */
+    int              i_len,     /* in   - Bytes in nc_name                    */
+    int              i_writable /* in   - Non-zero to open it read-write      */
+)
+{
+    char               ac_path[4096];
+    struct ring_file *ps_file;
+    int                i_errno;
+    int                i_fd;
+    int                i_lc;
+    int                i_path;
+
+    if (ps_reactor->nc_history != NULL)
+    {
+        i_path = snprintf(ac_path, sizeof(ac_path), "%s/",
+            ps_reactor->nc_history); // main keeps it well short of ac_path
+
+        for (i_lc = 0; i_lc < i_len; i_lc++)
+        {
+            i_path += sprintf(ac_path + i_path, "%02x",
+                (unsigned char)nc_name[i_lc]);
+        }
+
+        strcpy(ac_path + i_path, ".hist");
+
+        errno = 0;
+        i_fd = i_writable ? open(ac_path, O_RDWR | O_CREAT | O_CLOEXEC, 0644) :
+            open(ac_path, O_RDONLY | O_CLOEXEC);
+        i_errno = errno;
+
+        if (i_fd == -1)
+        {
+            report_error("open", i_errno);
+        }
+
+        return i_fd;
+    }
+
+    pthread_mutex_lock(&gs_ring_lock);
+
+    for (ps_file = gps_ring_files; ps_file != NULL; ps_file = ps_file->ps_next)
+    {
+        if (ps_file->i_name_len == i_len &&
+            memcmp(ps_file->ac_name, nc_name, i_len) == 0)
+        {
+            break;
+        }
+    }
+
+    if (ps_file == NULL)
+    {
+        ps_file = malloc(sizeof(struct ring_file) + i_len);
+
+        if (ps_file == NULL)
+        {
+            pthread_mutex_unlock(&gs_ring_lock);
+            fprintf(stderr, "out of memory for room %.*s\n", i_len, nc_name);
+
+            return -1;
+        }
+
+        errno = 0;
+        ps_file->i_fd = memfd_create("chat-ring",
+            MFD_CLOEXEC | MFD_ALLOW_SEALING);
+
+        if (ps_file->i_fd == -1 ||
+            ftruncate(ps_file->i_fd, HISTORY_DATA + HISTORY_BYTES) == -1 ||
+            fcntl(ps_file->i_fd, F_ADD_SEALS,
+            F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1)
+        {
+            i_errno = errno;
+            pthread_mutex_unlock(&gs_ring_lock);
+            report_error("memfd_create", i_errno);
+
+            if (ps_file->i_fd != -1)
+            {
+                close(ps_file->i_fd);
+            }
+
+            free(ps_file);
+
+            return -1;
+        }
+
+        ps_file->i_name_len = i_len;
+        memcpy(ps_file->ac_name, nc_name, i_len);
+        ps_file->ps_next = gps_ring_files;
+        gps_ring_files = ps_file;
+    }
+
+    errno = 0;
+
+    if (i_writable)
+    {
+        i_fd = fcntl(ps_file->i_fd, F_DUPFD_CLOEXEC, 0);
+    }
+    else
+    {
+        snprintf(ac_path, sizeof(ac_path), "/proc/self/fd/%d", ps_file->i_fd);
+        i_fd = open(ac_path, O_RDONLY | O_CLOEXEC);
+    }
+
+    i_errno = errno;
+    pthread_mutex_unlock(&gs_ring_lock);
+
+    if (i_fd == -1)
+    {
+        report_error(i_writable ? "fcntl" : "open", i_errno);
+    }
+
+    return i_fd;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Map the ring of a room, creating its file if it is not there.  Every       */
+/* reactor maps the file on its own; the lock only covers checking the        */
+/* header, so two reactors opening a new room at once do not both set it up.  */
+/* A file that does not look like a history of the right size is started      */
+/* afresh.  Returns the mapping or NULL:                                      */
+/*                                                                            */
+struct history *history_open
+(
+    struct reactor *ps_reactor, /* in   - Reactor opening the room            */
+    char           *nc_name,    /* in   - Room name, not terminated           */
+    int              i_len      /* in   - Bytes in nc_name                    */
+)
+{
+    struct history *ps_history;
+    struct stat      s_stat;
+    int              i_errno;
+    int              i_fd;
+    size_t           st_map;
+
+    st_map = HISTORY_DATA + HISTORY_BYTES;
+
+    i_fd = history_file(ps_reactor, nc_name, i_len, 1);
+
+    if (i_fd == -1)
+    {
+        return NULL;
+    }
+
+    flock(i_fd, LOCK_EX);
+
+    errno = 0;
+
+    if (fstat(i_fd, &s_stat) == -1 ||
+        ((size_t)s_stat.st_size != st_map &&
+        (ftruncate(i_fd, 0) == -1 || ftruncate(i_fd, st_map) == -1)))
+    {
+        i_errno = errno;
+        report_error("ftruncate", i_errno);
+        close(i_fd);
+
+        return NULL;
+    }
+
+    errno = 0;
+    ps_history = mmap(NULL, st_map, PROT_READ | PROT_WRITE, MAP_SHARED, i_fd,
+        0);
+    i_errno = errno;
+
+    if (ps_history == MAP_FAILED)
+    {
+        report_error("mmap", i_errno);
+        close(i_fd);
+
+        return NULL;
+    }
+
+    if (memcmp(ps_history->ac_magic, HISTORY_MAGIC, 8) != 0 ||
+        ps_history->u32_size != HISTORY_BYTES ||
+        ps_history->u32_index != HISTORY_INDEX)
+    {
+        memset(ps_history, 0, sizeof(struct history));
+        memcpy(ps_history->ac_magic, HISTORY_MAGIC, 8);
+        ps_history->u32_size = HISTORY_BYTES;
+        ps_history->u32_index = HISTORY_INDEX;
+    }
+
+    flock(i_fd, LOCK_UN);
+    close(i_fd); // The mapping stays
+
+    return ps_history;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Send a client that has just joined a room the room's newest messages.  If  */
+/* nothing else is queued for the client they are written straight out of     */
+/* the mapped ring, in at most a few pieces since consecutive frames sit next */
+/* to each other.  Whatever the socket does not take, or everything if the    */
+/* client already has a queue, is copied into one message and queued behind   */
+/* the rest.                                                                  */
+/*                                                                            */
+/* Only frames in the newer half of the ring are sent, so the owning reactor  */
+/* would have to write half a ring while this one is in writev to overtake    */
+/* it:                                                                        */
+/*                                                                            */
+void history_replay
+(
+    struct reactor *ps_reactor, /* both - Event loop that owns the client     */
+    int              i,         /* in   - Slot of the client                  */
+    struct history *ps_history  /* in   - Mapped history of the room          */
+)
+{
+    struct iovec        as_iov[HISTORY_IOV];
+    struct connection *ps_conn;
+    struct message    *ps_message;
+    unsigned char     *nuc_frame;
+    char              *nc_ring;
+    int                 i_iov;
+    int                 i_lc;
+    long                l_len;
+    long                l_skip;
+    long                l_total;
+    long                l_written;
+    uint64_t            u64_count;
+    uint64_t            u64_end;
+    uint64_t            u64_first;
+    uint64_t            u64_pos;
+    uint32_t            u32_size;
+
+    ps_conn = &ps_reactor->ns_slots[i];
+    nc_ring = (char*)ps_history + HISTORY_DATA;
+    u32_size = ps_history->u32_size;
+
+    u64_count = __atomic_load_n(&ps_history->u64_count, __ATOMIC_ACQUIRE);
+    u64_end = __atomic_load_n(&ps_history->u64_end, __ATOMIC_ACQUIRE);
+    u64_first = u64_count > (uint64_t)ps_reactor->i_replay ?
+        u64_count - ps_reactor->i_replay : 0;
+
+    while (u64_first < u64_count &&
+        ps_history->au64_index[u64_first % HISTORY_INDEX] + u32_size / 2 <
+        u64_end)
+    {
+        u64_first++;
+    }
+/*                                                                            */
+/* Gather the frames, joining each to the one before when they touch.  A      */
+/* frame that makes no sense (a file from a crash, say) ends the replay:      */
+/*                                                                            */
+    i_iov = 0;
+    l_total = 0;
+
+    for (; u64_first < u64_count; u64_first++)
+    {
+        u64_pos = ps_history->au64_index[u64_first % HISTORY_INDEX];
+        nuc_frame = (unsigned char*)nc_ring + u64_pos % u32_size;
+        l_len = FRAME_HEADER + (long)((uint32_t)nuc_frame[0] << 24 |
+            (uint32_t)nuc_frame[1] << 16 |
+            (uint32_t)nuc_frame[2] << 8 | (uint32_t)nuc_frame[3]);
+
+        if (l_len > (long)(u32_size / 4) ||
+            (long)(u64_pos % u32_size) + l_len > (long)u32_size)
+        {
+            break;
+        }
+
+        if (i_iov > 0 && (unsigned char*)as_iov[i_iov - 1].iov_base +
+            as_iov[i_iov - 1].iov_len == nuc_frame)
+        {
+            as_iov[i_iov - 1].iov_len += l_len;
+        }
+        else if (i_iov < HISTORY_IOV)
+        {
+            as_iov[i_iov].iov_base = nuc_frame;
+            as_iov[i_iov].iov_len = l_len;
+            i_iov++;
+        }
+        else
+        {
+            break;
+        }
+
+        l_total += l_len;
+    }
+
+    if (l_total == 0)
+    {
+        return;
+    }
+/*                                                                            */
+/* Straight from the map if the client's queue is empty, and it always is     */
+/* here unless a worker (-w) keeps it.  A write that fails outright is left   */
+/* for the read side to notice:                                               */
+/*                                                                            */
+    l_written = 0;
+
+    if (ps_reactor->i_workers == 0 && ps_conn->u_head == ps_conn->u_tail &&
+        !ps_conn->i_writing)
+    {
+        COUNTER_ADD(ps_reactor->l_syscalls, 1);
+
+        l_written = writev(ps_conn->i_fd, as_iov, i_iov);
+
+        if (l_written == -1)
+        {
+            if (errno != EAGAIN)
+            {
+                return;
+            }
+
+            l_written = 0;
+        }
+
+        if (l_written > 0)
+        {
+            ps_conn->u64_sent = ps_reactor->s_wheel.u64_now;
+            COUNTER_ADD(ps_reactor->l_bytes_out, l_written);
+        }
+    }
+
+    if (l_written == l_total)
+    {
+        return;
+    }
+/*                                                                            */
+/* Queue the rest:                                                            */
+/*                                                                            */
+    ps_message = message_alloc((int)(l_total - l_written));
+
+    if (ps_message == NULL)
+    {
+        fprintf(stderr, "pollserver: no memory, history for socket %d "
+            "dropped\n", ps_conn->i_fd);
+
+        return;
+    }
+
+    ps_message->i_len = 0;
+    l_skip = l_written;
+
+    for (i_lc = 0; i_lc < i_iov; i_lc++)
+    {
+        if (l_skip >= (long)as_iov[i_lc].iov_len)
+        {
+            l_skip -= as_iov[i_lc].iov_len;
+
+            continue;
+        }
+
+        memcpy(ps_message->ac_data + ps_message->i_len,
+            (char*)as_iov[i_lc].iov_base + l_skip,
+            as_iov[i_lc].iov_len - l_skip);
+        ps_message->i_len += (int)(as_iov[i_lc].iov_len - l_skip);
+        l_skip = 0;
+    }
+
+    conn_enqueue(ps_reactor, ps_conn, ps_message);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Allocate a message with room for i_size bytes.  The caller gets the first  */
+/* reference.  Returns NULL if there is no memory:                            */
+/*                                                                            */
+struct message *message_alloc
+(
+    int i_size /* in   - Bytes the message can hold                           */
+)
+{
+    struct message *ps_message;
+
+    ps_message = malloc(sizeof(struct message) + i_size);
+
+    if (ps_message != NULL)
+    {
+        ps_message->i_refs = 1;
+        ps_message->i_len = 0;
+    }
+
+    return ps_message;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Add references to a message.  Only someone who already holds one may do    */
+/* this, so the count cannot be on its way to zero:                           */
+/*                                                                            */
+void message_hold
+(
+    struct message *ps_message, /* both - Message                             */
+    int              i_count    /* in   - References to add                   */
+)
+{
+    __atomic_add_fetch(&ps_message->i_refs, i_count, __ATOMIC_RELAXED);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Drop a reference to a message and free it if it was the last one:          */
+/*                                                                            */
+void message_release
+(
+    struct message *ps_message /* both - Message                              */
+)
+{
+    if (__atomic_sub_fetch(&ps_message->i_refs, 1, __ATOMIC_ACQ_REL) == 0)
+    {
+        free(ps_message);
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* The monotonic clock in nanoseconds, for timing loop passes and batches:    */
+/*                                                                            */
+uint64_t metrics_clock
+(
+    void
+)
+{
+    struct timespec s_now;
+
+    clock_gettime(CLOCK_MONOTONIC, &s_now);
+
+    return (uint64_t)s_now.tv_sec * 1000000000 + (uint64_t)s_now.tv_nsec;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Count one loop pass in the reactor's histogram.  Bucket k holds passes of  */
+/* under 2^k microseconds and at least half that; the last one the rest.      */
+/* Only the reactor writes its histogram, so this is two relaxed adds:        */
+/*                                                                            */
+void metrics_loop
+(
+    struct reactor *ps_reactor, /* both - Reactor that finished a pass        */
+    uint64_t         u64_woke   /* in   - metrics_clock when it woke          */
+)
+{
+    uint64_t u64_usec;
+    int      i_bucket;
+
+    u64_usec = (metrics_clock() - u64_woke) / 1000;
+    i_bucket = u64_usec == 0 ? 0 : 64 - __builtin_clzll(u64_usec);
+
+    if (i_bucket > METRICS_BUCKETS - 1)
+    {
+        i_bucket = METRICS_BUCKETS - 1;
+    }
+
+    COUNTER_ADD(ps_reactor->al_loop_hist[i_bucket], 1);
+    COUNTER_ADD(ps_reactor->l_loop_usec, (long)u64_usec);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* The loop a metrics series is for.  With -w each reactor is followed by its */
+/* workers, so index i is reactor i / (1 + workers) and, if i % (1 + workers) */
+/* is not 0, one of its workers.  Fills in the series' labels:                */
+/*                                                                            */
+struct reactor *metrics_reactor
+(
+    struct reactor *ns_reactors, /* in   - The reactors                       */
+    int              i_index,    /* in   - Which loop                         */
+    char            *nc_label    /* out  - Its labels, 32 bytes               */
+)
+{
+    int i_reactor;
+    int i_worker;
+
+    i_reactor = i_index / (1 + ns_reactors[0].i_workers);
+    i_worker = i_index % (1 + ns_reactors[0].i_workers) - 1;
+
+    if (i_worker == -1)
+    {
+        sprintf(nc_label, "reactor=\"%d\"", i_reactor);
+
+        return &ns_reactors[i_reactor];
+    }
+
+    sprintf(nc_label, "reactor=\"%d\",worker=\"%d\"", i_reactor, i_worker);
+
+    return &ns_reactors[i_reactor].ns_workers[i_worker];
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Serve the metrics port (-S).  Each connection gets the current numbers in  */
+/* the Prometheus text format and is closed.  A request that starts with GET  */
+/* gets an HTTP response, so curl and a Prometheus scraper work as well as    */
+/* nc.  The reactors are never stopped or locked: every number is a relaxed   */
+/* load of a counter only its reactor writes.  main shuts the listener down   */
+/* to stop the thread:                                                        */
+/*                                                                            */
+void *metrics_thread
+(
+    void *p_arg /* in   - The reactors                                        */
+)
+{
+    char             ac_header[128];
+    char             ac_request[1024];
+    struct timeval   s_timeout;
+    struct reactor *ns_reactors;
+    FILE           *ps_text;
+    char           *nc_text;
+    size_t           st_text;
+    int              i_errno;
+    int              i_header;
+    int              i_request;
+    int              i_sockfd;
+    long             l_accepts;
+    uint64_t         u64_last;
+
+    ns_reactors = p_arg;
+    l_accepts = 0;
+    u64_last = metrics_clock();
+
+    for (;;)
+    {
+        errno = 0;
+        i_sockfd = accept4(gi_metrics_listener, NULL, NULL, SOCK_CLOEXEC);
+        i_errno = errno;
+
+        if (i_sockfd == -1)
+        {
+            if (__atomic_load_n(&gi_stop, __ATOMIC_ACQUIRE) &&
+                i_errno != EINTR)
+            {
+                return NULL;
+            }
+
+            if (i_errno != EINTR && i_errno != ECONNABORTED)
+            {
+                report_error("accept4", i_errno);
+                sleep(1); // Out of descriptors, say; do not spin
+            }
+
+            continue;
+        }
+/*                                                                            */
+/* A scraper that never sends or never reads must not hold the port:          */
+/*                                                                            */
+        s_timeout.tv_sec = 1;
+        s_timeout.tv_usec = 0;
+
+        setsockopt(i_sockfd, SOL_SOCKET, SO_RCVTIMEO, &s_timeout,
+            sizeof(s_timeout));
+        setsockopt(i_sockfd, SOL_SOCKET, SO_SNDTIMEO, &s_timeout,
+            sizeof(s_timeout));
+
+        i_request = (int)recv(i_sockfd, ac_request, sizeof(ac_request), 0);
+
+        nc_text = NULL;
+        st_text = 0;
+        ps_text = open_memstream(&nc_text, &st_text);
+
+        if (ps_text == NULL)
+        {
+            report_error("open_memstream", errno);
+            close(i_sockfd);
+
+            continue;
+        }
+
+        metrics_write(ps_text, ns_reactors, &l_accepts, &u64_last);
+        fclose(ps_text);
+
+        if (i_request >= 4 && memcmp(ac_request, "GET ", 4) == 0)
+        {
+            i_header = snprintf(ac_header, sizeof(ac_header),
+                "HTTP/1.0 200 OK\r\nContent-Type: text/plain; "
+                "version=0.0.4\r\nContent-Length: %zu\r\n\r\n", st_text);
+            send(i_sockfd, ac_header, i_header, MSG_NOSIGNAL);
+        }
+
+        send(i_sockfd, nc_text, st_text, MSG_NOSIGNAL);
+
+        free(nc_text);
+        close(i_sockfd);
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Write every metric, one line per reactor.  Accepts a second are worked out */
+/* over the time since the last scrape, or since the server started:          */
+/*                                                                            */
+void metrics_write
+(
+    FILE           *ps_text,     /* out  - Where the text goes                */
+    struct reactor *ns_reactors, /* in   - The reactors                       */
+    long           *pl_accepts,  /* both - Accepts at the last scrape         */
+    uint64_t       *pu64_last    /* both - metrics_clock at the last scrape   */
+)
+{
+    struct reactor *ps_loop;
+    long             l_accepts;
+    long             l_count;
+    uint64_t         u64_now;
+    int              i_bucket;
+    int              i_field;
+    int              i_lc;
+    int              i_loops;
+    int              i_reactors;
+    char             ac_label[32];
+
+    i_reactors = ns_reactors[0].i_reactors;
+    i_loops = i_reactors * (1 + ns_reactors[0].i_workers);
+
+    fprintf(ps_text, "# HELP chat_connections Clients connected now\n"
+        "# TYPE chat_connections gauge\n");
+
+    for (i_lc = 0; i_lc < i_reactors; i_lc++)
+    {
+        fprintf(ps_text, "chat_connections{reactor=\"%d\"} %d\n", i_lc,
+            COUNTER_GET(ns_reactors[i_lc].i_clients));
+    }
+
+    for (i_field = 0; i_field < (int)(sizeof(gas_metric_fields) /
+        sizeof(gas_metric_fields[0])); i_field++)
+    {
+        fprintf(ps_text, "# HELP %s %s\n# TYPE %s %s\n",
+            gas_metric_fields[i_field].nc_name,
+            gas_metric_fields[i_field].nc_help,
+            gas_metric_fields[i_field].nc_name,
+            gas_metric_fields[i_field].nc_type);
+
+        for (i_lc = 0; i_lc < i_loops; i_lc++)
+        {
+            ps_loop = metrics_reactor(ns_reactors, i_lc, ac_label);
+
+            fprintf(ps_text, "%s{%s} %ld\n",
+                gas_metric_fields[i_field].nc_name, ac_label,
+                COUNTER_GET(*(long*)((char*)ps_loop +
+                gas_metric_fields[i_field].st_offset)));
+        }
+    }
+/*                                                                            */
+/* Accepts a second across the whole server:                                  */
+/*                                                                            */
+    l_accepts = 0;
+
+    for (i_lc = 0; i_lc < i_reactors; i_lc++)
+    {
+        l_accepts += COUNTER_GET(ns_reactors[i_lc].l_accepts);
+    }
+
+    u64_now = metrics_clock();
+
+    fprintf(ps_text, "# HELP chat_accepts_per_second Connections accepted a "
+        "second since the last scrape\n"
+        "# TYPE chat_accepts_per_second gauge\n"
+        "chat_accepts_per_second %.1f\n", u64_now > *pu64_last ?
+        (double)(l_accepts - *pl_accepts) * 1e9 / (u64_now - *pu64_last) :
+        0.0);
+
+    *pl_accepts = l_accepts;
+    *pu64_last = u64_now;
+/*                                                                            */
+/* The loop pass histogram.  Prometheus buckets count everything at or under  */
+/* their bound, so the counts add up as they go:                              */
+/*                                                                            */
+    fprintf(ps_text, "# HELP chat_loop_seconds Time from a loop waking to it "
+        "waiting again\n# TYPE chat_loop_seconds histogram\n");
+
+    for (i_lc = 0; i_lc < i_loops; i_lc++)
+    {
+        ps_loop = metrics_reactor(ns_reactors, i_lc, ac_label);
+        l_count = 0;
+
+        for (i_bucket = 0; i_bucket < METRICS_BUCKETS - 1; i_bucket++)
+        {
+            l_count += COUNTER_GET(ps_loop->al_loop_hist[i_bucket]);
+            fprintf(ps_text, "chat_loop_seconds_bucket{%s,le=\"%.7g\"} %ld\n",
+                ac_label, (double)(1L << i_bucket) / 1e6, l_count);
+        }
+
+        l_count += COUNTER_GET(ps_loop->al_loop_hist[METRICS_BUCKETS - 1]);
+
+        fprintf(ps_text, "chat_loop_seconds_bucket{%s,le=\"+Inf\"} %ld\n",
+            ac_label, l_count);
+        fprintf(ps_text, "chat_loop_seconds_sum{%s} %.6f\n", ac_label,
+            COUNTER_GET(ps_loop->l_loop_usec) / 1e6);
+        fprintf(ps_text, "chat_loop_seconds_count{%s} %ld\n", ac_label,
+            l_count);
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Hold the server to its watermarks (-C, -Q), once a loop pass.  Past either */
+/* high watermark the reactors stop watching their listeners, so new clients  */
+/* wait in the listen queue instead of taking loop time from the ones already */
+/* connected; they watch them again once both counts are down to their low    */
+/* watermarks.  Past -Q the slowest clients are shed as well.  A fan-out      */
+/* worker has no listener and only sheds:                                     */
+/*                                                                            */
+void overload_check
+(
+    struct reactor *ps_reactor /* both - Reactor or worker ending a pass      */
+)
+{
+    int  i_overloaded;
+    long l_clients;
+    long l_queued;
+
+    if (ps_reactor->l_clients_high == 0 && ps_reactor->l_queued_high == 0)
+    {
+        return;
+    }
+
+    overload_totals(ps_reactor, &l_clients, &l_queued);
+
+    if (ps_reactor->l_queued_high > 0 && l_queued > ps_reactor->l_queued_high)
+    {
+        overload_shed(ps_reactor, l_queued);
+    }
+
+    if (ps_reactor->ps_owner != NULL)
+    {
+        return;
+    }
+
+    i_overloaded = __atomic_load_n(&gi_overloaded, __ATOMIC_ACQUIRE);
+
+    if (!i_overloaded &&
+        ((ps_reactor->l_clients_high > 0 &&
+        l_clients >= ps_reactor->l_clients_high) ||
+        (ps_reactor->l_queued_high > 0 &&
+        l_queued >= ps_reactor->l_queued_high)))
+    {
+        overload_signal(ps_reactor, 1);
+    }
+    else if (i_overloaded &&
+        (ps_reactor->l_clients_high == 0 ||
+        l_clients <= ps_reactor->l_clients_low) &&
+        (ps_reactor->l_queued_high == 0 ||
+        l_queued <= ps_reactor->l_queued_low))
+    {
+        overload_signal(ps_reactor, 0);
+    }
+/*                                                                            */
+/* This reactor may have been woken to follow another's decision:             */
+/*                                                                            */
+    i_overloaded = __atomic_load_n(&gi_overloaded, __ATOMIC_ACQUIRE);
+
+    if (ps_reactor->l_paused != i_overloaded)
+    {
+        overload_listen(ps_reactor, !i_overloaded);
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* qsort comparison for overload_shed: the client with more bytes queued      */
+/* comes first:                                                               */
+/*                                                                            */
+int overload_compare
+(
+    const void *p_left, /* in   - A struct connection pointer                 */
+    const void *p_right /* in   - Another                                     */
+)
+{
+    long l_left;
+    long l_right;
+
+    l_left = (*(struct connection* const*)p_left)->l_queued;
+    l_right = (*(struct connection* const*)p_right)->l_queued;
+
+    return l_left < l_right ? 1 : l_left > l_right ? -1 : 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Stop or start watching a reactor's listeners, TCP and Unix (-l).  poll     */
+/* skips a pollfd that asks for no events.  epoll has them taken out and put  */
+/* back, since the Unix listener is EPOLLEXCLUSIVE and cannot be modified.    */
+/* io_uring cancels its multishot accepts and arms new ones:                  */
+/*                                                                            */
+void overload_listen
+(
+    struct reactor *ps_reactor, /* both - Reactor that owns the listeners     */
+    int              i_on       /* in   - 1 to watch them, 0 to stop          */
+)
+{
+    struct epoll_event   s_event;
+    struct io_uring_sqe *ps_sqe;
+    int                   i_errno;
+    int                   i_slot;
+
+    COUNTER_ADD(ps_reactor->l_paused, !i_on - ps_reactor->l_paused);
+
+    if (ps_reactor->i_engine == ENGINE_URING && i_on)
+    {
+        ps_reactor->ps_uring->u_accept_gen++;
+    }
+
+    for (i_slot = 0; i_slot < FIRST_CLIENT; i_slot += 2)
+    {
+        if (ps_reactor->ns_pfds[i_slot].fd == -1)
+        {
+            continue;
+        }
+
+        if (ps_reactor->i_engine == ENGINE_POLL)
+        {
+            ps_reactor->ns_pfds[i_slot].events = i_on ? POLLIN : 0;
+        }
+        else if (ps_reactor->i_engine == ENGINE_EPOLL)
+        {
+            memset(&s_event, 0, sizeof(s_event));
+            s_event.events = i_slot == 2 ? EPOLLIN | EPOLLEXCLUSIVE : EPOLLIN;
+            s_event.data.u64 = HANDLE_MAKE(ps_reactor->ns_slots[i_slot].u_gen,
+                i_slot);
+
+            errno = 0;
+            if (epoll_ctl(ps_reactor->i_epfd, i_on ? EPOLL_CTL_ADD :
+                EPOLL_CTL_DEL, ps_reactor->ns_pfds[i_slot].fd, &s_event) == -1)
+            {
+                i_errno = errno;
+                report_error("epoll_ctl", i_errno);
+            }
+
+            COUNTER_ADD(ps_reactor->l_syscalls, 1);
+        }
+        else if (i_on)
+        {
+            uring_arm_accept(ps_reactor, i_slot);
+        }
+        else
+        {
+            ps_sqe = uring_get_sqe(ps_reactor);
+
+            ps_sqe->opcode = IORING_OP_ASYNC_CANCEL;
+            ps_sqe->addr = HANDLE_MAKE(ps_reactor->ps_uring->u_accept_gen,
+                i_slot) | URING_OP_ACCEPT;
+            ps_sqe->user_data = URING_OP_CANCEL;
+        }
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Read a watermark option (-C, -Q), "high" or "high:low".  Without a low     */
+/* watermark it is three quarters of the high one.  pl_high and pl_low may be */
+/* NULL to only check it.  Returns 0, or -1 if it makes no sense:             */
+/*                                                                            */
+int overload_parse
+(
+    char *nc_arg,  /* in   - The option's argument                            */
+    long *pl_high, /* out  - High watermark, or NULL                          */
+    long *pl_low   /* out  - Low watermark, or NULL                           */
+)
+{
+    char *nc_end;
+    long  l_high;
+    long  l_low;
+
+    errno = 0;
+    l_high = strtol(nc_arg, &nc_end, 10);
+    l_low = l_high / 4 * 3 + l_high % 4 * 3 / 4;
+
+    if (*nc_end == ':' && nc_end[1] != '\0')
+    {
+        l_low = strtol(nc_end + 1, &nc_end, 10);
+    }
+
+    if (errno != 0 || nc_end == nc_arg || *nc_end != '\0' || l_high <= 0 ||
+        l_low < 0 || l_low >= l_high)
+    {
+        return -1;
+    }
+
+    if (pl_high != NULL)
+    {
+        *pl_high = l_high;
+        *pl_low = l_low;
+    }
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Tell every reactor the server has gone over its watermarks, or come back   */
+/* under them.  SO_REUSEPORT hashes each connection to one reactor's listen   */
+/* queue, so they have to pause and resume together or a queue could be left  */
+/* unwatched while the others accept.  The reactor that changes the state     */
+/* pokes the others' eventfds so that one asleep follows it:                  */
+/*                                                                            */
+void overload_signal
+(
+    struct reactor *ps_reactor,   /* both - Reactor that saw it               */
+    int              i_overloaded /* in   - 1 over, 0 back under              */
+)
+{
+    int      i_expected;
+    int      i_lc;
+    uint64_t u64_one;
+
+    i_expected = !i_overloaded;
+
+    if (!__atomic_compare_exchange_n(&gi_overloaded, &i_expected,
+        i_overloaded, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+        return; // Another reactor got there first
+    }
+
+    printf("pollserver: %s\n", i_overloaded ?
+        "over the watermarks, not accepting" : "accepting again");
+
+    u64_one = 1;
+
+    for (i_lc = 0; i_lc < ps_reactor->i_reactors; i_lc++)
+    {
+        if (i_lc != ps_reactor->i_id)
+        {
+            COUNTER_ADD(ps_reactor->l_syscalls, 1);
+
+            if (write(ps_reactor->ns_reactors[i_lc].i_wake_fd, &u64_one,
+                sizeof(u64_one)) == -1)
+            {
+                report_error("write", errno);
+            }
+        }
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* The server is over -Q.  Shed this reactor's or worker's share of the bytes */
+/* above the low watermark, in proportion to what it holds, deepest queue     */
+/* first: those clients are the slowest readers and what they are owed is     */
+/* what holds the memory.  This is the only scan of the table for a limit,    */
+/* and it only runs while the server is over:                                 */
+/*                                                                            */
+void overload_shed
+(
+    struct reactor *ps_reactor, /* both - Reactor or worker to shed from      */
+    long             l_total    /* in   - Bytes queued in the whole server    */
+)
+{
+    struct connection **nps_conns;
+    struct connection  *ps_conn;
+    int                  i_count;
+    int                  i_lc;
+    long                 l_excess;
+    long                 l_own;
+
+    l_own = ps_reactor->l_queued;
+
+    if (l_own <= 0)
+    {
+        return;
+    }
+
+    l_excess = (long)((double)(l_total - ps_reactor->l_queued_low) * l_own /
+        l_total);
+
+    nps_conns = malloc(sizeof(struct connection*) * ps_reactor->i_slot_high);
+
+    if (nps_conns == NULL)
+    {
+        fprintf(stderr, "pollserver: no memory to shed clients\n");
+
+        return;
+    }
+/*                                                                            */
+/* Clients already on their way out hold nothing that shedding would free:    */
+/*                                                                            */
+    i_count = 0;
+
+    for (i_lc = FIRST_CLIENT; i_lc < ps_reactor->i_slot_high; i_lc++)
+    {
+        ps_conn = &ps_reactor->ns_slots[i_lc];
+
+        if (ps_conn->l_queued > 0 && !ps_conn->i_evicted && !ps_conn->i_closed)
+        {
+            nps_conns[i_count++] = ps_conn;
+        }
+    }
+
+    qsort(nps_conns, i_count, sizeof(struct connection*), overload_compare);
+
+    for (i_lc = 0; i_lc < i_count && l_excess > 0; i_lc++)
+    {
+        ps_conn = nps_conns[i_lc];
+
+        fprintf(stderr, "pollserver: socket %d has %ld bytes queued and the "
+            "server is over -Q; dropped\n", ps_conn->i_fd, ps_conn->l_queued);
+
+        l_excess -= ps_conn->l_queued;
+        COUNTER_ADD(ps_reactor->l_sheds, 1);
+        conn_evict(ps_reactor, ps_conn);
+    }
+
+    free(nps_conns);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Add up the clients and queued bytes of the whole server, every reactor and */
+/* worker.  Each only counts its own, so these are relaxed reads of counters  */
+/* the others may be changing as they go, which is close enough for a         */
+/* watermark.  It costs a load per reactor and worker, not a lock:            */
+/*                                                                            */
+void overload_totals
+(
+    struct reactor *ps_reactor, /* in   - Any reactor or worker               */
+    long           *pl_clients, /* out  - Clients connected                   */
+    long           *pl_queued   /* out  - Bytes in output queues              */
+)
+{
+    struct reactor *ns_reactors;
+    int              i_lc;
+    int              i_worker;
+
+    ns_reactors = ps_reactor->ps_owner != NULL ?
+        ps_reactor->ps_owner->ns_reactors : ps_reactor->ns_reactors;
+
+    *pl_clients = 0;
+    *pl_queued = 0;
+
+    for (i_lc = 0; i_lc < ns_reactors[0].i_reactors; i_lc++)
+    {
+        *pl_clients += COUNTER_GET(ns_reactors[i_lc].i_clients);
+        *pl_queued += COUNTER_GET(ns_reactors[i_lc].l_queued);
+
+        for (i_worker = 0; i_worker < ns_reactors[i_lc].i_workers; i_worker++)
+        {
+            *pl_queued += COUNTER_GET(ns_reactors[i_lc].ns_workers[i_worker].
+                l_queued);
+        }
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Close everything a reactor owns.  Safe on a partly initialized reactor:    */
+/*                                                                            */
+void reactor_close
+(
+    struct reactor *ps_reactor /* both - Reactor to tear down                 */
+)
+{
+    struct shard_backlog *ps_entry;
+    struct shard_ring    *ps_ring;
+    struct room          *ps_room;
+    int                    i_lc;
+    unsigned               u_lc;
+
+    if (ps_reactor->ns_workers != NULL)
+    {
+        for (i_lc = 0; i_lc < ps_reactor->i_workers; i_lc++)
+        {
+            reactor_close(&ps_reactor->ns_workers[i_lc]);
+        }
+
+        free(ps_reactor->ns_workers);
+    }
+
+    free(ps_reactor->nc_fanout_wake);
+
+    if (ps_reactor->ps_jobs != NULL)
+    {
+        fanout_close(ps_reactor);
+        free(ps_reactor->ps_jobs);
+    }
+
+    for (i_lc = FIRST_CLIENT; i_lc < ps_reactor->i_slot_high; i_lc++)
+    {
+        if (ps_reactor->ns_pfds[i_lc].fd != -1)
+        {
+            close(ps_reactor->ns_pfds[i_lc].fd);
+        }
+
+        conn_release(ps_reactor, &ps_reactor->ns_slots[i_lc]);
+    }
+
+    if (ps_reactor->i_epfd != -1)
+    {
+        close(ps_reactor->i_epfd);
+    }
+
+    if (ps_reactor->i_wake_fd != -1)
+    {
+        close(ps_reactor->i_wake_fd);
+    }
+
+    if (ps_reactor->i_listener != -1)
+    {
+        close(ps_reactor->i_listener);
+    }
+
+    for (i_lc = 0; i_lc < ps_reactor->i_reactors; i_lc++)
+    {
+        if (ps_reactor->ns_inbound != NULL &&
+            (ps_ring = ps_reactor->ns_inbound[i_lc]) != NULL)
+        {
+            for (u_lc = ps_ring->u_head; u_lc != ps_ring->u_tail; u_lc++)
+            {
+                message_release(ps_ring->as_slots[u_lc % SHARD_RING_SLOTS]);
+            }
+
+            free(ps_ring);
+        }
+
+        while ((ps_entry = ps_reactor->as_backlog_head[i_lc]) != NULL)
+        {
+            ps_reactor->as_backlog_head[i_lc] = ps_entry->ps_next;
+            message_release(ps_entry->ps_message);
+            free(ps_entry);
+        }
+    }
+
+    free(ps_reactor->ns_inbound);
+    free(ps_reactor->nu64_dirty);
+
+    if (ps_reactor->ps_keepalive != NULL)
+    {
+        message_release(ps_reactor->ps_keepalive);
+    }
+
+    for (u_lc = 0; u_lc < ps_reactor->u_room_buckets; u_lc++)
+    {
+        while ((ps_room = ps_reactor->ns_rooms[u_lc]) != NULL)
+        {
+            ps_reactor->ns_rooms[u_lc] = ps_room->ps_next;
+
+            if (ps_room->ps_history != NULL)
+            {
+                munmap(ps_room->ps_history, HISTORY_DATA + HISTORY_BYTES);
+            }
+
+            free(ps_room->ns_members);
+            free(ps_room);
+        }
+    }
+
+    free(ps_reactor->ns_rooms);
+
+    if (ps_reactor->ns_pfds != NULL)
+    {
+        munmap(ps_reactor->ns_pfds,
+            sizeof(struct pollfd) * ps_reactor->i_slot_max);
+    }
+
+    if (ps_reactor->ns_slots != NULL)
+    {
+        munmap(ps_reactor->ns_slots,
+            sizeof(struct connection) * ps_reactor->i_slot_max);
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Set up a reactor: its listener, its wake-up eventfd and, for the epoll     */
+/* engine, the epoll instance.  i_id, i_engine, the frame and timer settings, */
+/* ns_reactors and i_reactors must already be filled in, and i_listener set   */
+/* to a listener handed over by an old server or -1.  Returns 0 or -1:        */
+/*                                                                            */
+int reactor_init
+(
+    struct reactor *ps_reactor /* both - Reactor to set up                    */
+)
+{
+    int                i_errno;
+    int                i_lc;
+    void              *p_pfds;
+    void              *p_slots;
+    struct rlimit      s_limit;
+    struct epoll_event s_event;
+
+    ps_reactor->i_wake_fd = -1;
+    ps_reactor->i_epfd = -1;
+/*                                                                            */
+/* Reserve the connection table.  It can never need more slots than the       */
+/* process can have descriptors.  The pages are only committed as slots are   */
+/* first used, so a large reservation costs address space, not memory:        */
+/*                                                                            */
+    ps_reactor->i_slot_max = SLOT_MAX_LIMIT;
+
+    if (getrlimit(RLIMIT_NOFILE, &s_limit) == 0 &&
+        s_limit.rlim_cur < (rlim_t)ps_reactor->i_slot_max)
+    {
+        ps_reactor->i_slot_max = (int)s_limit.rlim_cur;
+    }
+
+    if (ps_reactor->i_slot_max <= FIRST_CLIENT)
+    {
+        ps_reactor->i_slot_max = FIRST_CLIENT + 1;
+    }
+/*                                                                            */
+/* A fan-out worker (-w) only needs room for its share of its reactor's:      */
+/*                                                                            */
+    if (ps_reactor->ps_owner != NULL)
+    {
+        ps_reactor->i_slot_max = FANOUT_SLOT(ps_reactor->ps_owner->i_slot_max -
+            1, ps_reactor->ps_owner->i_workers) + 1;
+    }
+
+    ps_reactor->i_slot_high = 0;
+    ps_reactor->i_free = -1;
+    ps_reactor->i_clients = 0;
+
+    p_pfds = mmap(NULL, sizeof(struct pollfd) * ps_reactor->i_slot_max,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1, 0);
+    p_slots = mmap(NULL, sizeof(struct connection) * ps_reactor->i_slot_max,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+        -1, 0);
+
+    ps_reactor->ns_pfds = p_pfds == MAP_FAILED ? NULL : p_pfds;
+    ps_reactor->ns_slots = p_slots == MAP_FAILED ? NULL : p_slots;
+    ps_reactor->ns_inbound = calloc(ps_reactor->i_reactors,
+        sizeof(struct shard_ring*));
+
+    if (ps_reactor->ns_pfds == NULL || ps_reactor->ns_slots == NULL ||
+        ps_reactor->ns_inbound == NULL)
+    {
+        fprintf(stderr, "Unable to allocate the connection table.\n");
+        reactor_close(ps_reactor);
+
+        return -1;
+    }
+/*                                                                            */
+/* Start the timer wheel at the current time.  Heartbeats all share one       */
+/* empty frame:                                                               */
+/*                                                                            */
+    ps_reactor->s_wheel.u64_now = timer_clock() / TIMER_TICK_MS;
+
+    if (ps_reactor->u64_beat > 0)
+    {
+        ps_reactor->ps_keepalive = message_alloc(FRAME_HEADER);
+
+        if (ps_reactor->ps_keepalive == NULL)
+        {
+            fprintf(stderr, "Unable to allocate the heartbeat frame.\n");
+            reactor_close(ps_reactor);
+
+            return -1;
+        }
+
+        memset(ps_reactor->ps_keepalive->ac_data, 0, FRAME_HEADER);
+        ps_reactor->ps_keepalive->i_len = FRAME_HEADER;
+    }
+/*                                                                            */
+/* Set up a listening socket, unless an old server handed one over or this is */
+/* a fan-out worker, and the eventfd the other reactors write to when they    */
+/* have handed this one a message:                                            */
+/*                                                                            */
+    if (ps_reactor->i_listener == -1 && ps_reactor->ps_owner == NULL)
+    {
+        ps_reactor->i_listener =
+            get_listener_socket(NULL, PORT, ps_reactor->i_reactors > 1);
+    }
+
+    if (ps_reactor->i_listener == -1 && ps_reactor->ps_owner == NULL)
+    {
+        reactor_close(ps_reactor);
+
+        return -1;
+    }
+/*                                                                            */
+/* The poll and epoll loops accept until the queue is empty, which needs a    */
+/* listener that says so instead of blocking.  io_uring waits for it itself:  */
+/*                                                                            */
+    if (ps_reactor->i_engine != ENGINE_URING && ps_reactor->ps_owner == NULL &&
+        fcntl(ps_reactor->i_listener, F_SETFL, O_NONBLOCK) == -1)
+    {
+        report_error("fcntl", errno);
+        reactor_close(ps_reactor);
+
+        return -1;
+    }
+
+    errno = 0;
+    ps_reactor->i_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    i_errno = errno;
+
+    if (ps_reactor->i_wake_fd == -1)
+    {
+        report_error("eventfd", i_errno);
+        reactor_close(ps_reactor);
+
+        return -1;
+    }
+/*                                                                            */
+/* Add them to the table, with the Unix listener, if any, after them.  They   */
+/* are always slots 0, 1 and 2:                                               */
+/*                                                                            */
+    if (add_to_pfds(ps_reactor, ps_reactor->i_listener) == -1 ||
+        add_to_pfds(ps_reactor, ps_reactor->i_wake_fd) == -1 ||
+        add_to_pfds(ps_reactor, ps_reactor->i_local) == -1)
+    {
+        reactor_close(ps_reactor);
+
+        return -1;
+    }
+/*                                                                            */
+/* The epoll engine registers them with the kernel once, up front.  Only one  */
+/* of the reactors sharing the Unix listener is woken for a connection:       */
+/*                                                                            */
+    if (ps_reactor->i_engine == ENGINE_EPOLL)
+    {
+        errno = 0;
+        ps_reactor->i_epfd = epoll_create1(EPOLL_CLOEXEC);
+        i_errno = errno;
+
+        if (ps_reactor->i_epfd == -1)
+        {
+            report_error("epoll_create1", i_errno);
+            reactor_close(ps_reactor);
+
+            return -1;
+        }
+
+        for (i_lc = 0; i_lc < FIRST_CLIENT; i_lc++)
+        {
+            if (ps_reactor->ns_pfds[i_lc].fd == -1)
+            {
+                continue;
+            }
+
+            memset(&s_event, 0, sizeof(s_event));
+            s_event.events = i_lc == 2 ? EPOLLIN | EPOLLEXCLUSIVE : EPOLLIN;
+            s_event.data.u64 = HANDLE_MAKE(ps_reactor->ns_slots[i_lc].u_gen,
+                i_lc);
+
+            errno = 0;
+            if (epoll_ctl(ps_reactor->i_epfd, EPOLL_CTL_ADD,
+                ps_reactor->ns_pfds[i_lc].fd, &s_event) == -1)
+            {
+                i_errno = errno;
+                report_error("epoll_ctl", i_errno);
+                reactor_close(ps_reactor);
+
+                return -1;
+            }
+        }
+    }
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Thread function: run one reactor's main loop:                              */
+/*                                                                            */
+void *reactor_thread
+(
+    void *p_arg /* in   - struct reactor to run                               */
+)
+{
+    struct reactor *ps_reactor;
+
+    ps_reactor = (struct reactor*)p_arg;
+
+    if (ps_reactor->ps_owner != NULL)
+    {
+        ps_reactor->i_status = run_fanout_loop(ps_reactor);
+    }
+    else if (ps_reactor->i_engine == ENGINE_URING)
+    {
+        ps_reactor->i_status = run_uring_loop(ps_reactor);
+    }
+    else if (ps_reactor->i_engine == ENGINE_EPOLL)
+    {
+        ps_reactor->i_status = run_epoll_loop(ps_reactor);
+    }
+    else
+    {
+        ps_reactor->i_status = run_poll_loop(ps_reactor);
+    }
+/*                                                                            */
+/* A loop that failed takes the whole server down with it:                    */
+/*                                                                            */
+    if (ps_reactor->i_status != 0)
+    {
+        kill(getpid(), SIGTERM);
+    }
+
+    return NULL;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Print the message for an errno value:                                      */
+/*                                                                            */
+void report_error
+(
+    char *nc_function, /* in   - Function that failed                         */
+    int    i_errno     /* in   - errno it left behind                         */
+)
+{
+    fprintf(stderr, "%s failed with code %d.\n", nc_function, i_errno);
+    fprintf(stderr, "%s\n", strerror(i_errno));
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Print the output queue counters of every reactor.  The reactors keep       */
+/* running while this reads them, so each number is only a snapshot:          */
+/*                                                                            */
+void report_queues
+(
+    struct reactor *ns_reactors, /* in   - The reactors                       */
+    int              i_reactors  /* in   - How many there are                 */
+)
+{
+    struct reactor *ps_worker;
+    int              i_lc;
+    int              i_worker;
+
+    for (i_lc = 0; i_lc < i_reactors; i_lc++)
+    {
+        printf("pollserver: reactor %d: %ld bytes queued for %ld clients, "
+            "deepest queue %ld bytes, %ld stalled writes\n", i_lc,
+            COUNTER_GET(ns_reactors[i_lc].l_queued),
+            COUNTER_GET(ns_reactors[i_lc].l_backlogged),
+            COUNTER_GET(ns_reactors[i_lc].l_queue_peak),
+            COUNTER_GET(ns_reactors[i_lc].l_stalls));
+        printf("pollserver: reactor %d: %ld timers armed, %ld idle and %ld "
+            "slow clients dropped\n", i_lc,
+            COUNTER_GET(ns_reactors[i_lc].s_wheel.l_timers),
+            COUNTER_GET(ns_reactors[i_lc].l_idle_drops),
+            COUNTER_GET(ns_reactors[i_lc].l_slow_drops));
+
+        printf("pollserver: reactor %d: %ld connections accepted",
+            i_lc, COUNTER_GET(ns_reactors[i_lc].l_accepts));
+
+        if (COUNTER_GET(ns_reactors[i_lc].l_accept_wakes) > 0)
+        {
+            printf(" in %ld listener wakeups",
+                COUNTER_GET(ns_reactors[i_lc].l_accept_wakes));
+        }
+
+        printf("\n");
+
+        if (ns_reactors[i_lc].u64_burst > 0 ||
+            ns_reactors[i_lc].l_queue_max > 0)
+        {
+            printf("pollserver: reactor %d: %ld messages over the rate limit, "
+                "%ld clients over the queue limit\n", i_lc,
+                COUNTER_GET(ns_reactors[i_lc].l_rate_drops),
+                COUNTER_GET(ns_reactors[i_lc].l_evictions));
+        }
+
+        if (ns_reactors[i_lc].l_clients_high > 0 ||
+            ns_reactors[i_lc].l_queued_high > 0)
+        {
+            printf("pollserver: reactor %d: %s, %ld clients shed\n", i_lc,
+                COUNTER_GET(ns_reactors[i_lc].l_paused) ? "not accepting" :
+                "accepting", COUNTER_GET(ns_reactors[i_lc].l_sheds));
+        }
+
+        if (ns_reactors[i_lc].i_room_mode)
+        {
+            printf("pollserver: reactor %d: %ld rooms, %ld rings mapped by "
+                "clients\n", i_lc, COUNTER_GET(ns_reactors[i_lc].l_rooms),
+                COUNTER_GET(ns_reactors[i_lc].l_maps));
+        }
+
+        if (ns_reactors[i_lc].i_zerocopy > 0)
+        {
+            printf("pollserver: reactor %d: %ld zero-copy writes, %ld copied "
+                "by the kernel anyway\n", i_lc,
+                COUNTER_GET(ns_reactors[i_lc].l_zc_sends),
+                COUNTER_GET(ns_reactors[i_lc].l_zc_copied));
+        }
+/*                                                                            */
+/* With -w the output queues are the workers':                                */
+/*                                                                            */
+        for (i_worker = 0; i_worker < ns_reactors[i_lc].i_workers; i_worker++)
+        {
+            ps_worker = &ns_reactors[i_lc].ns_workers[i_worker];
+
+            printf("pollserver: worker %d.%d: %ld bytes queued for %ld "
+                "clients, deepest queue %ld bytes, %ld stalled writes\n",
+                i_lc, i_worker, COUNTER_GET(ps_worker->l_queued),
+                COUNTER_GET(ps_worker->l_backlogged),
+                COUNTER_GET(ps_worker->l_queue_peak),
+                COUNTER_GET(ps_worker->l_stalls));
+            printf("pollserver: worker %d.%d: %d clients, %ld deliveries, "
+                "%ld slow, %ld over the queue limit and %ld shed\n", i_lc,
+                i_worker, COUNTER_GET(ps_worker->i_clients),
+                COUNTER_GET(ps_worker->l_deliveries),
+                COUNTER_GET(ps_worker->l_slow_drops),
+                COUNTER_GET(ps_worker->l_evictions),
+                COUNTER_GET(ps_worker->l_sheds));
+        }
+    }
+
+    fflush(stdout);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Act on a frame from a client in room mode.  JOIN, LEAVE and MAP are done   */
+/* here; PUBLISH is left to the caller, which sends the frame as it is to the */
+/* room.  Returns 1 for a PUBLISH, 0 for anything else:                       */
+/*                                                                            */
+int room_command
+(
+    struct reactor *ps_reactor, /* both - Event loop that owns the client     */
+    int              i,         /* in   - Slot of the client                  */
+    char           *nc_payload, /* in   - Frame payload                       */
+    int              i_len      /* in   - Bytes in nc_payload                 */
+)
+{
+    struct connection *ps_conn;
+    struct room       *ps_room;
+    char              *nc_end;
+    char              *nc_name;
+    int                 i_name_len;
+    int                 i_ref;
+    int                 i_word;
+
+    ps_conn = &ps_reactor->ns_slots[i];
+/*                                                                            */
+/* The command, a space and the room name.  The name runs to the next space   */
+/* or the end of the frame; only PUBLISH has anything after it:               */
+/*                                                                            */
+    if (i_len > 8 && memcmp(nc_payload, "PUBLISH ", 8) == 0)
+    {
+        i_word = 8;
+    }
+    else if (i_len > 5 && memcmp(nc_payload, "JOIN ", 5) == 0)
+    {
+        i_word = 5;
+    }
+    else if (i_len > 6 && memcmp(nc_payload, "LEAVE ", 6) == 0)
+    {
+        i_word = 6;
+    }
+    else if (i_len > 4 && memcmp(nc_payload, "MAP ", 4) == 0)
+    {
+        i_word = 4;
+    }
+    else
+    {
+        i_word = 0;
+    }
+
+    nc_name = nc_payload + i_word;
+    nc_end = memchr(nc_name, ' ', i_len - i_word);
+    i_name_len = nc_end == NULL ? i_len - i_word : (int)(nc_end - nc_name);
+
+    if (i_word == 0 || i_name_len == 0 || i_name_len > ROOM_NAME_MAX ||
+        (i_word != 8 && nc_end != NULL))
+    {
+        fprintf(stderr, "pollserver: socket %d sent a frame that is not a "
+            "room command, dropped\n", ps_conn->i_fd);
+
+        return 0;
+    }
+
+    if (i_word == 8)
+    {
+        return 1;
+    }
+
+    if (i_word == 4)
+    {
+        room_map(ps_reactor, i, nc_name, i_name_len);
+
+        return 0;
+    }
+
+    ps_room = room_find(ps_reactor, nc_name, i_name_len, i_word == 5);
+
+    if (i_word == 5)
+    {
+        if (ps_room == NULL)
+        {
+            fprintf(stderr, "pollserver: no memory, socket %d not added to "
+                "a room\n", ps_conn->i_fd);
+        }
+        else if (room_join(ps_reactor, i, ps_room) == 1 &&
+            ps_room->ps_history != NULL && ps_reactor->i_replay > 0)
+        {
+            history_replay(ps_reactor, i, ps_room->ps_history);
+        }
+
+        return 0;
+    }
+/*                                                                            */
+/* LEAVE.  Leaving a room the client is not in is not an error:               */
+/*                                                                            */
+    for (i_ref = 0; ps_room != NULL && i_ref < ps_conn->i_rooms; i_ref++)
+    {
+        if (ps_conn->ns_rooms[i_ref].ps_room == ps_room)
+        {
+            room_leave(ps_reactor, i, i_ref);
+
+            break;
+        }
+    }
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Queue a PUBLISH frame for the members of its room on this reactor.  Only   */
+/* the room's own members are visited, however many other clients there are:  */
+/*                                                                            */
+void room_deliver
+(
+    struct reactor *ps_reactor, /* both - Event loop holding the members      */
+    int              i_sender,  /* in   - Slot the message came from or -1    */
+    struct message *ps_message  /* in   - PUBLISH frame                       */
+)
+{
+    struct room *ps_room;
+    char        *nc_end;
+    char        *nc_name;
+    int           i_len;
+    int           i_owner;
+    int           j;
+/*                                                                            */
+/* The reactor that read the frame has already checked it:                    */
+/*                                                                            */
+    nc_name = ps_message->ac_data + FRAME_HEADER + 8;
+    i_len = ps_message->i_len - FRAME_HEADER - 8;
+    nc_end = memchr(nc_name, ' ', i_len);
+
+    if (nc_end != NULL)
+    {
+        i_len = (int)(nc_end - nc_name);
+    }
+
+/*                                                                            */
+/* Every reactor sees every PUBLISH, and the one the room name hashes to      */
+/* keeps the history, so each frame is appended once and each history has a   */
+/* single writer.  That reactor holds the room even with no members here:     */
+/*                                                                            */
+    i_owner = ps_reactor->i_rings &&
+        room_hash(nc_name, i_len) % ps_reactor->i_reactors ==
+        (uint32_t)ps_reactor->i_id;
+
+    ps_room = room_find(ps_reactor, nc_name, i_len, i_owner);
+
+    if (ps_room == NULL)
+    {
+        return;
+    }
+
+    if (i_owner && ps_room->ps_history != NULL)
+    {
+        history_append(ps_room->ps_history, ps_message);
+    }
+
+    if (ps_reactor->i_workers > 0)
+    {
+        fanout_room(ps_reactor, ps_room, i_sender, ps_message);
+
+        return;
+    }
+/*                                                                            */
+/* As in deliver_to_clients, hold every queue's reference up front.  The      */
+/* sender gets its reference back if it is in the room.  Queueing never       */
+/* closes a client, so the member array cannot change under the loop:         */
+/*                                                                            */
+    message_hold(ps_message, ps_room->i_members);
+
+    for (j = 0; j < ps_room->i_members; j++)
+    {
+        if (ps_room->ns_members[j].i_slot == i_sender)
+        {
+            message_release(ps_message);
+        }
+        else
+        {
+            conn_enqueue(ps_reactor,
+                &ps_reactor->ns_slots[ps_room->ns_members[j].i_slot],
+                ps_message);
+        }
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Look a room up by name, creating it if asked to.  Returns the room, or     */
+/* NULL if there is no such room or no memory for a new one:                  */
+/*                                                                            */
+struct room *room_find
+(
+    struct reactor *ps_reactor, /* both - Reactor holding the rooms           */
+    char           *nc_name,    /* in   - Room name, not terminated           */
+    int              i_len,     /* in   - Bytes in nc_name                    */
+    int              i_create   /* in   - Create the room if it is not there  */
+)
+{
+    struct room **ns_buckets;
+    struct room  *ps_next;
+    struct room  *ps_room;
+    uint32_t       u32_hash;
+    unsigned       u_lc;
+    unsigned       u_new_buckets;
+
+    u32_hash = room_hash(nc_name, i_len);
+
+    if (ps_reactor->ns_rooms != NULL)
+    {
+        for (ps_room = ps_reactor->ns_rooms[u32_hash &
+                (ps_reactor->u_room_buckets - 1)];
+            ps_room != NULL;
+            ps_room = ps_room->ps_next)
+        {
+            if (ps_room->u32_hash == u32_hash &&
+                ps_room->i_name_len == i_len &&
+                memcmp(ps_room->ac_name, nc_name, i_len) == 0)
+            {
+                return ps_room;
+            }
+        }
+    }
+
+    if (!i_create)
+    {
+        return NULL;
+    }
+/*                                                                            */
+/* Keep about one room per bucket.  If the bigger table cannot be had, the    */
+/* old one still works, just with longer chains:                              */
+/*                                                                            */
+    if (ps_reactor->ns_rooms == NULL ||
+        ps_reactor->l_rooms >= (long)ps_reactor->u_room_buckets)
+    {
+        u_new_buckets = ps_reactor->ns_rooms == NULL ? ROOM_BUCKETS :
+            ps_reactor->u_room_buckets * 2;
+        ns_buckets = calloc(u_new_buckets, sizeof(struct room*));
+
+        if (ns_buckets == NULL && ps_reactor->ns_rooms == NULL)
+        {
+            return NULL;
+        }
+
+        if (ns_buckets != NULL)
+        {
+            for (u_lc = 0; u_lc < ps_reactor->u_room_buckets; u_lc++)
+            {
+                for (ps_room = ps_reactor->ns_rooms[u_lc];
+                    ps_room != NULL;
+                    ps_room = ps_next)
+                {
+                    ps_next = ps_room->ps_next;
+                    ps_room->ps_next = ns_buckets[ps_room->u32_hash &
+                        (u_new_buckets - 1)];
+                    ns_buckets[ps_room->u32_hash & (u_new_buckets - 1)] =
+                        ps_room;
+                }
+            }
+
+            free(ps_reactor->ns_rooms);
+            ps_reactor->ns_rooms = ns_buckets;
+            ps_reactor->u_room_buckets = u_new_buckets;
+        }
+    }
+
+    ps_room = malloc(sizeof(struct room) + i_len);
+
+    if (ps_room == NULL)
+    {
+        return NULL;
+    }
+
+    ps_room->u32_hash = u32_hash;
+    ps_room->ps_history = NULL;
+    ps_room->ns_members = NULL;
+    ps_room->i_members = 0;
+    ps_room->i_size = 0;
+    ps_room->i_name_len = i_len;
+    memcpy(ps_room->ac_name, nc_name, i_len);
+
+    if (ps_reactor->i_rings)
+    {
+        ps_room->ps_history = history_open(ps_reactor, nc_name, i_len);
+    }
+
+    ps_room->ps_next = ps_reactor->ns_rooms[u32_hash &
+        (ps_reactor->u_room_buckets - 1)];
+    ps_reactor->ns_rooms[u32_hash & (ps_reactor->u_room_buckets - 1)] =
+        ps_room;
+
+    COUNTER_ADD(ps_reactor->l_rooms, 1);
+
+    return ps_room;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* FNV-1a hash of a room name:                                                */
+/*                                                                            */
+uint32_t room_hash
+(
+    char *nc_name, /* in   - Room name, not terminated                        */
+    int    i_len   /* in   - Bytes in nc_name                                 */
+)
+{
+    uint32_t u32_hash;
+    int      i_lc;
+
+    u32_hash = 2166136261u;
+
+    for (i_lc = 0; i_lc < i_len; i_lc++)
+    {
+        u32_hash = (u32_hash ^ (unsigned char)nc_name[i_lc]) * 16777619u;
+    }
+
+    return u32_hash;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Add a client to a room.  Joining a room twice does nothing.  A room that   */
+/* was created for the client and cannot take it is removed again, unless     */
+/* rooms keep a history, in which case rooms are never removed.  Returns      */
+/* 1 if the client joined, 0 if it was already in the room or -1:             */
+/*                                                                            */
+int room_join
+(
+    struct reactor *ps_reactor, /* both - Event loop that owns the client     */
+    int              i,         /* in   - Slot of the client                  */
+    struct room    *ps_room     /* both - Room to join                        */
+)
+{
+    struct connection  *ps_conn;
+    struct room_member *ns_members;
+    struct room_ref    *ns_rooms;
+    int                  i_ref;
+    int                  i_size;
+
+    ps_conn = &ps_reactor->ns_slots[i];
+
+    for (i_ref = 0; i_ref < ps_conn->i_rooms; i_ref++)
+    {
+        if (ps_conn->ns_rooms[i_ref].ps_room == ps_room)
+        {
+            return 0;
+        }
+    }
+
+    if (ps_conn->i_rooms == ROOM_JOIN_MAX)
+    {
+        fprintf(stderr, "pollserver: socket %d is already in %d rooms\n",
+            ps_conn->i_fd, ROOM_JOIN_MAX);
+    }
+    else
+    {
+/*                                                                            */
+/* Grow both sides first so nothing has to be undone halfway:                 */
+/*                                                                            */
+        if (ps_conn->i_rooms == ps_conn->i_rooms_size)
+        {
+            i_size = ps_conn->i_rooms_size == 0 ? 4 :
+                ps_conn->i_rooms_size * 2;
+            ns_rooms = realloc(ps_conn->ns_rooms,
+                sizeof(struct room_ref) * i_size);
+
+            if (ns_rooms != NULL)
+            {
+                ps_conn->ns_rooms = ns_rooms;
+                ps_conn->i_rooms_size = i_size;
+            }
+        }
+
+        if (ps_room->i_members == ps_room->i_size)
+        {
+            i_size = ps_room->i_size == 0 ? 4 : ps_room->i_size * 2;
+            ns_members = realloc(ps_room->ns_members,
+                sizeof(struct room_member) * i_size);
+
+            if (ns_members != NULL)
+            {
+                ps_room->ns_members = ns_members;
+                ps_room->i_size = i_size;
+            }
+        }
+
+        if (ps_conn->i_rooms < ps_conn->i_rooms_size &&
+            ps_room->i_members < ps_room->i_size)
+        {
+            ps_room->ns_members[ps_room->i_members].i_slot = i;
+            ps_room->ns_members[ps_room->i_members].i_ref = ps_conn->i_rooms;
+            ps_conn->ns_rooms[ps_conn->i_rooms].ps_room = ps_room;
+            ps_conn->ns_rooms[ps_conn->i_rooms].i_pos = ps_room->i_members;
+            ps_room->i_members++;
+            ps_conn->i_rooms++;
+
+            return 1;
+        }
+
+        fprintf(stderr, "pollserver: no memory, socket %d not added to a "
+            "room\n", ps_conn->i_fd);
+    }
+
+    if (ps_room->i_members == 0 && !ps_reactor->i_rings)
+    {
+        room_remove(ps_reactor, ps_room);
+    }
+
+    return -1;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Take a client out of one of its rooms.  The last member of the room and    */
+/* the last room of the client fill the holes, and whoever moved is told its  */
+/* new position.  An empty room is removed unless rooms keep a history:       */
+/*                                                                            */
+void room_leave
+(
+    struct reactor *ps_reactor, /* both - Event loop that owns the client     */
+    int              i,         /* in   - Slot of the client                  */
+    int              i_ref      /* in   - Index of the room in its ns_rooms   */
+)
+{
+    struct connection  *ps_conn;
+    struct room_member *ps_moved;
+    struct room_ref    *ps_ref;
+    struct room        *ps_room;
+    int                  i_pos;
+
+    ps_conn = &ps_reactor->ns_slots[i];
+    ps_room = ps_conn->ns_rooms[i_ref].ps_room;
+    i_pos = ps_conn->ns_rooms[i_ref].i_pos;
+
+    ps_room->i_members--;
+
+    if (i_pos != ps_room->i_members)
+    {
+        ps_room->ns_members[i_pos] = ps_room->ns_members[ps_room->i_members];
+        ps_moved = &ps_room->ns_members[i_pos];
+        ps_reactor->ns_slots[ps_moved->i_slot].ns_rooms[ps_moved->i_ref].i_pos =
+            i_pos;
+    }
+
+    ps_conn->i_rooms--;
+
+    if (i_ref != ps_conn->i_rooms)
+    {
+        ps_conn->ns_rooms[i_ref] = ps_conn->ns_rooms[ps_conn->i_rooms];
+        ps_ref = &ps_conn->ns_rooms[i_ref];
+        ps_ref->ps_room->ns_members[ps_ref->i_pos].i_ref = i_ref;
+    }
+
+    if (ps_room->i_members == 0 && !ps_reactor->i_rings)
+    {
+        room_remove(ps_reactor, ps_room);
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Take a closing client out of every room it is in:                          */
+/*                                                                            */
+void room_leave_all
+(
+    struct reactor *ps_reactor, /* both - Event loop that owns the client     */
+    int              i          /* in   - Slot of the client                  */
+)
+{
+    while (ps_reactor->ns_slots[i].i_rooms > 0)
+    {
+        room_leave(ps_reactor, i, ps_reactor->ns_slots[i].i_rooms - 1);
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* MAP: hand a client on the Unix socket a read-only descriptor for a room's  */
+/* ring (-M), so it can read the room's messages from shared memory without   */
+/* joining it.  The reply is the frame "MAPPED room" with the descriptor      */
+/* attached, or "NOMAP room" when there is no ring, the client is on TCP or   */
+/* it already has a queue (the descriptor has to go with bytes the socket     */
+/* takes now, not ones queued for later).  Whatever the socket does not take  */
+/* of the reply is queued:                                                    */
+/*                                                                            */
+void room_map
+(
+    struct reactor *ps_reactor, /* both - Event loop that owns the client     */
+    int              i,         /* in   - Slot of the client                  */
+    char           *nc_name,    /* in   - Room name, not terminated           */
+    int              i_len      /* in   - Bytes in nc_name                    */
+)
+{
+    union
+    {
+        char            ac_buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr s_align;
+    }                   u_control;
+    char                ac_frame[FRAME_HEADER + 7 + ROOM_NAME_MAX];
+    struct iovec        s_iov;
+    struct msghdr       s_msg;
+    struct cmsghdr    *ps_cmsg;
+    struct connection *ps_conn;
+    struct message    *ps_message;
+    struct room       *ps_room;
+    struct sockaddr     s_local;
+    socklen_t           i_local_len;
+    int                 i_errno;
+    int                 i_fd;
+    int                 i_frame;
+    long                l_written;
+
+    ps_conn = &ps_reactor->ns_slots[i];
+    ps_room = room_find(ps_reactor, nc_name, i_len, ps_reactor->i_rings);
+    i_fd = -1;
+    l_written = 0;
+/*                                                                            */
+/* TCP would take the descriptor and quietly drop it, so ask the socket:      */
+/*                                                                            */
+    i_local_len = sizeof(s_local);
+
+    if (ps_room != NULL && ps_room->ps_history != NULL &&
+        ps_reactor->i_workers == 0 &&
+        ps_conn->u_head == ps_conn->u_tail && !ps_conn->i_writing &&
+        getsockname(ps_conn->i_fd, &s_local, &i_local_len) == 0 &&
+        s_local.sa_family == AF_UNIX)
+    {
+        i_fd = history_file(ps_reactor, nc_name, i_len, 0);
+    }
+
+    if (i_fd != -1)
+    {
+        i_frame = FRAME_HEADER + 7 + i_len;
+        ac_frame[0] = (char)((i_frame - FRAME_HEADER) >> 24);
+        ac_frame[1] = (char)((i_frame - FRAME_HEADER) >> 16);
+        ac_frame[2] = (char)((i_frame - FRAME_HEADER) >> 8);
+        ac_frame[3] = (char)(i_frame - FRAME_HEADER);
+        memcpy(ac_frame + FRAME_HEADER, "MAPPED ", 7);
+        memcpy(ac_frame + FRAME_HEADER + 7, nc_name, i_len);
+
+        memset(&s_msg, 0, sizeof(s_msg));
+        memset(&u_control, 0, sizeof(u_control));
+        s_iov.iov_base = ac_frame;
+        s_iov.iov_len = i_frame;
+        s_msg.msg_iov = &s_iov;
+        s_msg.msg_iovlen = 1;
+        s_msg.msg_control = u_control.ac_buf;
+        s_msg.msg_controllen = sizeof(u_control.ac_buf);
+        ps_cmsg = CMSG_FIRSTHDR(&s_msg);
+        ps_cmsg->cmsg_level = SOL_SOCKET;
+        ps_cmsg->cmsg_type = SCM_RIGHTS;
+        ps_cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(ps_cmsg), &i_fd, sizeof(int));
+/*                                                                            */
+/* The mapping in this reactor is the same memory as the owner's, so setting  */
+/* u32_mapped here turns on the owner's wakeups:                              */
+/*                                                                            */
+        __atomic_store_n(&ps_room->ps_history->u32_mapped, 1,
+            __ATOMIC_RELAXED);
+
+        COUNTER_ADD(ps_reactor->l_syscalls, 1);
+
+        errno = 0;
+        l_written = sendmsg(ps_conn->i_fd, &s_msg,
+            MSG_NOSIGNAL | MSG_DONTWAIT);
+        i_errno = errno;
+        close(i_fd); // The client has its own copy
+
+        if (l_written > 0)
+        {
+            ps_conn->u64_sent = ps_reactor->s_wheel.u64_now;
+            COUNTER_ADD(ps_reactor->l_bytes_out, l_written);
+            COUNTER_ADD(ps_reactor->l_maps, 1);
+        }
+        else if (i_errno != EAGAIN)
+        {
+            return; // Left for the read side to notice
+        }
+        else
+        {
+            l_written = 0; // No room in the socket
+        }
+    }
+
+    if (l_written == 0)
+    {
+        i_frame = FRAME_HEADER + 6 + i_len;
+        ac_frame[0] = (char)((i_frame - FRAME_HEADER) >> 24);
+        ac_frame[1] = (char)((i_frame - FRAME_HEADER) >> 16);
+        ac_frame[2] = (char)((i_frame - FRAME_HEADER) >> 8);
+        ac_frame[3] = (char)(i_frame - FRAME_HEADER);
+        memcpy(ac_frame + FRAME_HEADER, "NOMAP ", 6);
+        memcpy(ac_frame + FRAME_HEADER + 6, nc_name, i_len);
+    }
+    else if (l_written == i_frame)
+    {
+        return;
+    }
+/*                                                                            */
+/* Queue the rest:                                                            */
+/*                                                                            */
+    ps_message = message_alloc(i_frame - (int)l_written);
+
+    if (ps_message == NULL)
+    {
+        fprintf(stderr, "pollserver: no memory, reply to MAP for socket %d "
+            "dropped\n", ps_conn->i_fd);
+
+        return;
+    }
+
+    ps_message->i_len = i_frame - (int)l_written;
+    memcpy(ps_message->ac_data, ac_frame + l_written, ps_message->i_len);
+    conn_enqueue(ps_reactor, ps_conn, ps_message);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Unlink an empty room from the hash table and free it:                      */
+/*                                                                            */
+void room_remove
+(
+    struct reactor *ps_reactor, /* both - Reactor holding the rooms           */
+    struct room    *ps_room     /* in   - Room to remove                      */
+)
+{
+    struct room **pps_link;
+
+    pps_link = &ps_reactor->ns_rooms[ps_room->u32_hash &
+        (ps_reactor->u_room_buckets - 1)];
+
+    while (*pps_link != ps_room)
+    {
+        pps_link = &(*pps_link)->ps_next;
+    }
+
+    *pps_link = ps_room->ps_next;
+
+    free(ps_room->ns_members);
+    free(ps_room);
+
+    COUNTER_ADD(ps_reactor->l_rooms, -1);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* epoll main loop.  Only descriptors the kernel reports as ready are         */
+/* visited, so an idle connection costs nothing per wakeup:                   */
+/*                                                                            */
+int run_epoll_loop
+(
+    struct reactor *ps_reactor /* both - Event loop to run                    */
+)
+{
+    struct epoll_event as_events[MAX_EVENTS];
+    int                 i_errno;
+    int                 i_ready;
+    int                 i_slot;
+    int                 i_timeout;
+    int                 i;
+    struct timespec     s_wait;
+    uint64_t            u64_woke;
+
+    while (!__atomic_load_n(&gi_stop, __ATOMIC_ACQUIRE))
+    {
+/*                                                                            */
+/* Sleep until the next timer is due, or a lingering batch (-L).  Messages    */
+/* stuck behind a full shard ring are retried every millisecond:              */
+/*                                                                            */
+        i_timeout = timer_timeout(&ps_reactor->s_wheel);
+
+        if (ps_reactor->i_backlog > 0)
+        {
+            i_timeout = 1;
+        }
+
+        errno = 0;
+
+        if (coalesce_wait(ps_reactor, i_timeout, &s_wait))
+        {
+            i_ready = epoll_pwait2(ps_reactor->i_epfd, as_events, MAX_EVENTS,
+                &s_wait, NULL);
+        }
+        else
+        {
+            i_ready = epoll_wait(ps_reactor->i_epfd, as_events, MAX_EVENTS,
+                i_timeout);
+        }
+
+        i_errno = errno;
+        COUNTER_ADD(ps_reactor->l_syscalls, 1);
+
+        if (i_ready == -1)
+        {
+            if (i_errno == EINTR)
+            {
+                continue;
+            }
+
+            report_error("epoll_wait", i_errno);
+
+            return 6;
+        }
+
+        u64_woke = ps_reactor->i_metrics ? metrics_clock() : 0;
+/*                                                                            */
+/* Fire the timers that are due.  This also moves the wheel's clock on, which */
+/* everything handled below stamps its activity with:                         */
+/*                                                                            */
+        timer_advance(ps_reactor);
+
+        for (i = 0; i < i_ready; i++)
+        {
+/*                                                                            */
+/* An event for a slot that has since been closed (and perhaps reused) has a  */
+/* stale generation and is dropped:                                           */
+/*                                                                            */
+            i_slot = slot_lookup(ps_reactor, as_events[i].data.u64);
+
+            if (i_slot == -1)
+            {
+                continue;
+            }
+/*                                                                            */
+/* If a listener is ready to read, handle new connection:                     */
+/*                                                                            */
+            if (i_slot == 0 || i_slot == 2)
+            {
+                accept_new_connection(ps_reactor,
+                    ps_reactor->ns_pfds[i_slot].fd);
+            }
+/*                                                                            */
+/* Another reactor handed us messages for our clients:                        */
+/*                                                                            */
+            else if (i_slot == 1)
+            {
+                shard_drain(ps_reactor);
+            }
+/*                                                                            */
+/* Otherwise we're just a regular client.  Room to write drains the output    */
+/* queue first.  EPOLLHUP and EPOLLERR are always reported and recv will tell */
+/* us what happened, unless EPOLLERR only meant zero-copy completions:        */
+/*                                                                            */
+            else
+            {
+                if (as_events[i].events & EPOLLOUT)
+                {
+                    conn_flush(ps_reactor, &ps_reactor->ns_slots[i_slot]);
+                }
+
+                if ((as_events[i].events & (EPOLLIN | EPOLLHUP)) ||
+                    ((as_events[i].events & EPOLLERR) &&
+                    conn_reap(ps_reactor,
+                    &ps_reactor->ns_slots[i_slot]) == 0))
+                {
+                    handle_client_data(ps_reactor, i_slot);
+                }
+            }
+        }
+
+        coalesce_flush(ps_reactor);
+        shard_flush(ps_reactor);
+        overload_check(ps_reactor);
+
+        if (u64_woke != 0)
+        {
+            metrics_loop(ps_reactor, u64_woke);
+        }
+    } // END while--and you thought it would never end!
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Fan-out worker main loop (-w).  It sleeps on its eventfd and on the        */
+/* clients that have filled their sockets, with poll or epoll as the          */
+/* reactors do, and never reads from a client: the reactor that owns it sees  */
+/* it go and says so with a job:                                              */
+/*                                                                            */
+int run_fanout_loop
+(
+    struct reactor *ps_worker /* both - Worker to run                         */
+)
+{
+    struct epoll_event as_events[MAX_EVENTS];
+    int                 i_errno;
+    int                 i_ready;
+    int                 i_slot;
+    int                 i;
+    int                 i_lingering;
+    int                 i_timeout;
+    struct timespec     s_wait;
+    uint64_t            u64_woke;
+
+    while (!__atomic_load_n(&gi_stop, __ATOMIC_ACQUIRE))
+    {
+        i_timeout = timer_timeout(&ps_worker->s_wheel);
+        i_lingering = coalesce_wait(ps_worker, i_timeout, &s_wait);
+
+        errno = 0;
+
+        if (ps_worker->i_engine == ENGINE_EPOLL && i_lingering)
+        {
+            i_ready = epoll_pwait2(ps_worker->i_epfd, as_events, MAX_EVENTS,
+                &s_wait, NULL);
+        }
+        else if (ps_worker->i_engine == ENGINE_EPOLL)
+        {
+            i_ready = epoll_wait(ps_worker->i_epfd, as_events, MAX_EVENTS,
+                i_timeout);
+        }
+        else if (i_lingering)
+        {
+            i_ready = ppoll(ps_worker->ns_pfds, ps_worker->i_slot_high,
+                &s_wait, NULL);
+        }
+        else
+        {
+            i_ready = poll(ps_worker->ns_pfds, ps_worker->i_slot_high,
+                i_timeout);
+        }
+
+        i_errno = errno;
+        COUNTER_ADD(ps_worker->l_syscalls, 1);
+
+        if (i_ready == -1)
+        {
+            if (i_errno == EINTR)
+            {
+                continue;
+            }
+
+            report_error(ps_worker->i_engine == ENGINE_EPOLL ? "epoll_wait" :
+                "poll", i_errno);
+
+            return 6;
+        }
+
+        u64_woke = ps_worker->i_metrics ? metrics_clock() : 0;
+
+        timer_advance(ps_worker);
+/*                                                                            */
+/* Room to write, or the socket is gone and conn_flush finds that out.  Slot  */
+/* 1 is the eventfd, poked when there are jobs:                               */
+/*                                                                            */
+        if (ps_worker->i_engine == ENGINE_EPOLL)
+        {
+            for (i = 0; i < i_ready; i++)
+            {
+                i_slot = slot_lookup(ps_worker, as_events[i].data.u64);
+
+                if (i_slot == 1)
+                {
+                    fanout_drain(ps_worker);
+                }
+                else if (i_slot >= FIRST_CLIENT)
+                {
+                    conn_flush(ps_worker, &ps_worker->ns_slots[i_slot]);
+                }
+            }
+        }
+        else
+        {
+            for (i = 1; i < ps_worker->i_slot_high; i++)
+            {
+                if (ps_worker->ns_pfds[i].revents == 0)
+                {
+                    continue;
+                }
+
+                if (i == 1)
+                {
+                    fanout_drain(ps_worker);
+                }
+                else if (i >= FIRST_CLIENT)
+                {
+                    conn_flush(ps_worker, &ps_worker->ns_slots[i]);
+                }
+            }
+        }
+
+        coalesce_flush(ps_worker);
+        overload_check(ps_worker);
+
+        if (u64_woke != 0)
+        {
+            metrics_loop(ps_worker, u64_woke);
+        }
+    } // END while--and you thought it would never end!
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* poll main loop.  This is the loop from the Windows version: every wakeup   */
+/* runs through the whole list looking for the entries that are ready:        */
+/*                                                                            */
+int run_poll_loop
+(
+    struct reactor *ps_reactor /* both - Event loop to run                    */
+)
+{
+    int             i_errno;
+    int             i_poll_count;
+    int             i_timeout;
+    int             i;
+    struct timespec s_wait;
+    uint64_t        u64_woke;
+
+    while (!__atomic_load_n(&gi_stop, __ATOMIC_ACQUIRE))
+    {
+/*                                                                            */
+/* Sleep until the next timer or lingering batch (-L) is due or, if the shard */
+/* backlog is not empty, for a millisecond:                                   */
+/*                                                                            */
+        i_timeout = timer_timeout(&ps_reactor->s_wheel);
+
+        if (ps_reactor->i_backlog > 0)
+        {
+            i_timeout = 1;
+        }
+
+        errno = 0;
+
+        if (coalesce_wait(ps_reactor, i_timeout, &s_wait))
+        {
+            i_poll_count = ppoll(ps_reactor->ns_pfds, ps_reactor->i_slot_high,
+                &s_wait, NULL);
+        }
+        else
+        {
+            i_poll_count = poll(ps_reactor->ns_pfds, ps_reactor->i_slot_high,
+                i_timeout);
+        }
+
+        i_errno = errno;
+        COUNTER_ADD(ps_reactor->l_syscalls, 1);
+
+        if (i_poll_count == -1)
+        {
+            if (i_errno == EINTR)
+            {
+                continue;
+            }
+
+            report_error("poll", i_errno);
+
+            return 6;
+        }
+
+        u64_woke = ps_reactor->i_metrics ? metrics_clock() : 0;
+
+        timer_advance(ps_reactor);
+/*                                                                            */
+/* Run through the existing connections looking for room to write and data    */
+/* to read:                                                                   */
+/*                                                                            */
+        for (i = 0; i < ps_reactor->i_slot_high; i++)
+        {
+            if (ps_reactor->ns_pfds[i].revents & POLLOUT)
+            {
+                conn_flush(ps_reactor, &ps_reactor->ns_slots[i]);
+            }
+
+            if (ps_reactor->ns_pfds[i].revents & (POLLIN | POLLHUP | POLLERR))
+            {
+                if (i == 0 || i == 2)
+                {
+                    accept_new_connection(ps_reactor,
+                        ps_reactor->ns_pfds[i].fd);
+                }
+                else if (ps_reactor->ns_pfds[i].fd == ps_reactor->i_wake_fd)
+                {
+                    shard_drain(ps_reactor);
+                }
+/*                                                                            */
+/* POLLERR on its own may only be zero-copy completions.  If it is not, recv  */
+/* will say what went wrong:                                                  */
+/*                                                                            */
+                else if ((ps_reactor->ns_pfds[i].revents &
+                    (POLLIN | POLLHUP)) ||
+                    conn_reap(ps_reactor, &ps_reactor->ns_slots[i]) == 0)
+                {
+                    handle_client_data(ps_reactor, i);
+                }
+            }
+        }
+
+        coalesce_flush(ps_reactor);
+        shard_flush(ps_reactor);
+        overload_check(ps_reactor);
+
+        if (u64_woke != 0)
+        {
+            metrics_loop(ps_reactor, u64_woke);
+        }
+    } // END while--and you thought it would never end!
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* io_uring main loop.  Accepts and receives are multishot requests that stay */
+/* armed, receives land in buffers provided up front, and every send queued   */
+/* while handling one batch of completions goes to the kernel in the same     */
+/* io_uring_enter that waits for the next batch:                              */
+/*                                                                            */
+int run_uring_loop
+(
+    struct reactor *ps_reactor /* both - Event loop to run                    */
+)
+{
+    struct io_uring_cqe *ps_cqe;
+    struct io_uring_sqe *ps_sqe;
+    struct uring          s_uring;
+    unsigned              u_head;
+    unsigned              u_tail;
+    uint64_t              u64_woke;
+
+    if (uring_setup(&s_uring) == -1)
+    {
+        return 6;
+    }
+
+    ps_reactor->ps_uring = &s_uring;
+
+    uring_arm_accept(ps_reactor, 0);
+    uring_arm_wake(ps_reactor);
+
+    if (ps_reactor->i_local != -1)
+    {
+        uring_arm_accept(ps_reactor, 2);
+    }
+
+    while (!__atomic_load_n(&gi_stop, __ATOMIC_ACQUIRE))
+    {
+/*                                                                            */
+/* Messages stuck behind a full shard ring are retried every millisecond:     */
+/*                                                                            */
+        if (ps_reactor->i_backlog > 0 && !s_uring.i_timeout_armed)
+        {
+            ps_sqe = uring_get_sqe(ps_reactor);
+
+            ps_sqe->opcode = IORING_OP_TIMEOUT;
+            ps_sqe->addr = (uintptr_t)&s_uring.s_retry;
+            ps_sqe->len = 1;
+            ps_sqe->user_data = URING_OP_TIMEOUT;
+
+            s_uring.i_timeout_armed = 1;
+        }
+/*                                                                            */
+/* Submit everything queued so far and wait for at least one completion or    */
+/* the next timer:                                                            */
+/*                                                                            */
+        if (uring_submit(ps_reactor, 1, timer_timeout(&ps_reactor->s_wheel))
+            == -1)
+        {
+            uring_close(&s_uring);
+            ps_reactor->ps_uring = NULL;
+
+            return 6;
+        }
+
+        u64_woke = ps_reactor->i_metrics ? metrics_clock() : 0;
+
+        timer_advance(ps_reactor);
+/*                                                                            */
+/* Handle every completion that is waiting:                                   */
+/*                                                                            */
+        u_head = *s_uring.pu_cq_head;
+        u_tail = __atomic_load_n(s_uring.pu_cq_tail, __ATOMIC_ACQUIRE);
+
+        while (u_head != u_tail)
+        {
+            ps_cqe = &s_uring.ns_cqes[u_head & s_uring.u_cq_mask];
+
+            uring_handle_cqe(ps_reactor, ps_cqe);
+
+            u_head++;
+        }
+
+        __atomic_store_n(s_uring.pu_cq_head, u_head, __ATOMIC_RELEASE);
+
+        coalesce_flush(ps_reactor);
+        shard_flush(ps_reactor);
+        overload_check(ps_reactor);
+
+        if (u64_woke != 0)
+        {
+            metrics_loop(ps_reactor, u64_woke);
+        }
+    } // END while--and you thought it would never end!
+
+    uring_close(&s_uring);
+    ps_reactor->ps_uring = NULL;
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Send every message the other reactors have handed this one to its          */
+/* clients.  The eventfd is reset first so a message added while the rings    */
+/* are being drained always comes with another wake-up:                       */
+/*                                                                            */
+void shard_drain
+(
+    struct reactor *ps_reactor /* both - Reactor the messages are for         */
+)
+{
+    int                 i_from;
+    struct message    *ps_message;
+    struct shard_ring *ps_ring;
+    unsigned            u_head;
+    unsigned            u_tail;
+    uint64_t            u64_count;
+/*                                                                            */
+/* io_uring has already read the eventfd:                                     */
+/*                                                                            */
+    if (ps_reactor->i_engine != ENGINE_URING)
+    {
+        COUNTER_ADD(ps_reactor->l_syscalls, 1);
+
+        if (read(ps_reactor->i_wake_fd, &u64_count, sizeof(u64_count)) == -1 &&
+            errno != EAGAIN)
+        {
+            report_error("read", errno);
+        }
+    }
+
+    for (i_from = 0; i_from < ps_reactor->i_reactors; i_from++)
+    {
+        ps_ring = ps_reactor->ns_inbound[i_from];
+
+        if (ps_ring == NULL) // No ring from ourselves
+        {
+            continue;
+        }
+
+        u_head = ps_ring->u_head;
+        u_tail = __atomic_load_n(&ps_ring->u_tail, __ATOMIC_ACQUIRE);
+
+        while (u_head != u_tail)
+        {
+            ps_message = ps_ring->as_slots[u_head % SHARD_RING_SLOTS];
+
+            deliver_to_clients(ps_reactor, -1, ps_message);
+            message_release(ps_message); // The ring's reference
+
+            u_head++;
+        }
+/*                                                                            */
+/* Hand the slots back to the producer:                                       */
+/*                                                                            */
+        __atomic_store_n(&ps_ring->u_head, u_head, __ATOMIC_RELEASE);
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* End of a loop pass: move what we can out of the backlogs and poke the      */
+/* eventfd of every reactor that was handed something.  Poking once per pass  */
+/* rather than once per message keeps the cost down when a burst is being     */
+/* forwarded:                                                                 */
+/*                                                                            */
+void shard_flush
+(
+    struct reactor *ps_reactor /* both - Reactor sending the messages         */
+)
+{
+    struct shard_backlog *ps_entry;
+    struct reactor       *ps_to;
+    struct io_uring_sqe  *ps_sqe;
+    int                    i_to;
+    static const uint64_t  u64_one = 1;
+
+    for (i_to = 0; i_to < ps_reactor->i_reactors; i_to++)
+    {
+        ps_to = &ps_reactor->ns_reactors[i_to];
+/*                                                                            */
+/* Retry the backlog, oldest first:                                           */
+/*                                                                            */
+        while ((ps_entry = ps_reactor->as_backlog_head[i_to]) != NULL &&
+            shard_push(ps_to->ns_inbound[ps_reactor->i_id],
+                ps_entry->ps_message) == 0)
+        {
+            ps_reactor->as_backlog_head[i_to] = ps_entry->ps_next;
+            ps_reactor->i_backlog--;
+            ps_reactor->ac_wake[i_to] = 1;
+            free(ps_entry);
+        }
+
+        if (!ps_reactor->ac_wake[i_to])
+        {
+            continue;
+        }
+/*                                                                            */
+/* Wake the other reactor.  io_uring sends the write with the next submit:    */
+/*                                                                            */
+        ps_reactor->ac_wake[i_to] = 0;
+
+        if (ps_reactor->i_engine == ENGINE_URING)
+        {
+            ps_sqe = uring_get_sqe(ps_reactor);
+
+            ps_sqe->opcode = IORING_OP_WRITE;
+            ps_sqe->fd = ps_to->i_wake_fd;
+            ps_sqe->addr = (uintptr_t)&u64_one;
+            ps_sqe->len = sizeof(u64_one);
+            ps_sqe->off = (uint64_t)-1;
+            ps_sqe->user_data = URING_OP_NOTIFY;
+        }
+        else
+        {
+            COUNTER_ADD(ps_reactor->l_syscalls, 1);
+
+            if (write(ps_to->i_wake_fd, &u64_one, sizeof(u64_one)) == -1 &&
+                errno != EAGAIN)
+            {
+                report_error("write", errno);
+            }
+        }
+    }
+
+    if (ps_reactor->i_workers > 0)
+    {
+        fanout_flush(ps_reactor);
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Hand a message from one of our clients to every other reactor.  Each ring  */
+/* gets a reference, not a copy.  If the ring to a reactor is full (or        */
+/* already has a backlog, to keep the order) the message waits in the         */
+/* backlog for that reactor:                                                  */
+/*                                                                            */
+void shard_forward
+(
+    struct reactor *ps_reactor, /* both - Reactor the message arrived on      */
+    struct message *ps_message  /* in   - Message                             */
+)
+{
+    struct shard_backlog *ps_entry;
+    struct shard_ring    *ps_ring;
+    int                    i_to;
+
+    message_hold(ps_message, ps_reactor->i_reactors - 1);
+
+    for (i_to = 0; i_to < ps_reactor->i_reactors; i_to++)
+    {
+        if (i_to == ps_reactor->i_id)
+        {
+            continue;
+        }
+
+        ps_ring = ps_reactor->ns_reactors[i_to].ns_inbound[ps_reactor->i_id];
+
+        if (ps_reactor->as_backlog_head[i_to] == NULL &&
+            shard_push(ps_ring, ps_message) == 0)
+        {
+            ps_reactor->ac_wake[i_to] = 1;
+
+            continue;
+        }
+
+        ps_entry = malloc(sizeof(struct shard_backlog));
+
+        if (ps_entry == NULL)
+        {
+            fprintf(stderr, "pollserver: no memory, message to reactor %d "
+                "dropped\n", i_to);
+            message_release(ps_message);
+
+            continue;
+        }
+
+        ps_entry->ps_next = NULL;
+        ps_entry->ps_message = ps_message;
+
+        if (ps_reactor->as_backlog_head[i_to] == NULL)
+        {
+            ps_reactor->as_backlog_head[i_to] = ps_entry;
+        }
+        else
+        {
+            ps_reactor->as_backlog_tail[i_to]->ps_next = ps_entry;
+        }
+
+        ps_reactor->as_backlog_tail[i_to] = ps_entry;
+        ps_reactor->i_backlog++;
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Put a message in a shard ring, along with a reference the caller holds.    */
+/* Only the reactor that owns the sending side calls this.  Returns 0 or -1   */
+/* if the ring is full:                                                       */
+/*                                                                            */
+int shard_push
+(
+    struct shard_ring *ps_ring,   /* both - Ring to the receiving reactor     */
+    struct message    *ps_message /* in   - Message                           */
+)
+{
+    unsigned u_head;
+    unsigned u_tail;
+
+    u_tail = ps_ring->u_tail;
+    u_head = __atomic_load_n(&ps_ring->u_head, __ATOMIC_ACQUIRE);
+
+    if (u_tail - u_head == SHARD_RING_SLOTS)
+    {
+        return -1;
+    }
+
+    ps_ring->as_slots[u_tail % SHARD_RING_SLOTS] = ps_message;
+/*                                                                            */
+/* Publish the slot to the consumer:                                          */
+/*                                                                            */
+    __atomic_store_n(&ps_ring->u_tail, u_tail + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Give a slot back to the free list and empty its connection.  The table's   */
+/* high-water mark drops past any free slots at the top so poll has less to   */
+/* scan:                                                                      */
+/*                                                                            */
+void slot_free
+(
+    struct reactor *ps_reactor, /* both - Event loop that owns the table      */
+    int              i_slot     /* in   - Slot to free                        */
+)
+{
+    struct connection *ps_conn;
+
+    ps_conn = &ps_reactor->ns_slots[i_slot];
+
+    conn_release(ps_reactor, ps_conn);
+    ps_conn->i_closed = 0;
+    ps_conn->i_fd = -1;
+    ps_conn->i_next_free = ps_reactor->i_free;
+    ps_reactor->i_free = i_slot;
+
+    while (ps_reactor->i_slot_high > FIRST_CLIENT &&
+        ps_reactor->ns_pfds[ps_reactor->i_slot_high - 1].fd == -1 &&
+        !ps_reactor->ns_slots[ps_reactor->i_slot_high - 1].i_closed)
+    {
+        ps_reactor->i_slot_high--;
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Turn a handle from epoll or io_uring back into a slot.  Returns -1 if the  */
+/* slot has been closed since the handle was made, even if it is in use again */
+/* by a newer connection:                                                     */
+/*                                                                            */
+int slot_lookup
+(
+    struct reactor *ps_reactor, /* in   - Event loop that owns the table      */
+    uint64_t         u64_handle /* in   - Handle to look up                   */
+)
+{
+    int i_slot;
+
+    i_slot = HANDLE_SLOT(u64_handle);
+
+    if (i_slot >= ps_reactor->i_slot_high ||
+        ps_reactor->ns_pfds[i_slot].fd == -1 ||
+        ps_reactor->ns_slots[i_slot].u_gen != HANDLE_GEN(u64_handle))
+    {
+        return -1;
+    }
+
+    return i_slot;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Bring the timer wheel up to the current time and fire every timer that is  */
+/* due.  The wheel goes straight from one tick with work to the next, so a    */
+/* long sleep costs nothing extra:                                            */
+/*                                                                            */
+void timer_advance
+(
+    struct reactor *ps_reactor /* both - Reactor whose timers are due         */
+)
+{
+    struct timer        *ps_list;
+    struct timer        *ps_timer;
+    struct timer_wheel *ps_wheel;
+    uint64_t              u64_next;
+    uint64_t              u64_target;
+    int                   i_index;
+    int                   i_level;
+
+    ps_wheel = &ps_reactor->s_wheel;
+    u64_target = timer_clock() / TIMER_TICK_MS;
+
+    while ((u64_next = timer_next(ps_wheel)) <= u64_target)
+    {
+        ps_wheel->u64_now = u64_next;
+/*                                                                            */
+/* Move the timers of every higher-level slot that starts at this tick down,  */
+/* the highest level first so they can fall through more than one level.  A   */
+/* timer due on this very tick lands on the next one:                         */
+/*                                                                            */
+        for (i_level = WHEEL_LEVELS - 1; i_level > 0; i_level--)
+        {
+            if ((u64_next & (((uint64_t)1 << (WHEEL_BITS * i_level)) - 1)) != 0)
+            {
+                continue;
+            }
+
+            i_index = (int)(u64_next >> (WHEEL_BITS * i_level)) &
+                (WHEEL_SLOTS - 1);
+            ps_list = ps_wheel->aaps_slots[i_level][i_index];
+
+            ps_wheel->aaps_slots[i_level][i_index] = NULL;
+            ps_wheel->aau64_used[i_level][i_index / 64] &=
+                ~((uint64_t)1 << (i_index % 64));
+
+            while ((ps_timer = ps_list) != NULL)
+            {
+                ps_list = ps_timer->ps_next;
+                ps_timer->pps_prev = NULL;
+                COUNTER_ADD(ps_wheel->l_timers, -1);
+
+                timer_schedule(ps_wheel, ps_timer, ps_timer->u64_expires);
+            }
+        }
+/*                                                                            */
+/* Fire everything in this tick's level 0 slot.  A timer that fires can       */
+/* cancel or schedule others, so take them off one at a time:                 */
+/*                                                                            */
+        i_index = (int)(u64_next & (WHEEL_SLOTS - 1));
+
+        while ((ps_timer = ps_wheel->aaps_slots[0][i_index]) != NULL)
+        {
+            timer_cancel(ps_wheel, ps_timer);
+            timer_fire(ps_reactor, ps_timer);
+        }
+    }
+
+    if (u64_target > ps_wheel->u64_now)
+    {
+        ps_wheel->u64_now = u64_target;
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Take a timer out of the wheel.  Nothing happens if it is not armed:        */
+/*                                                                            */
+void timer_cancel
+(
+    struct timer_wheel *ps_wheel, /* both - Wheel the timer is in             */
+    struct timer       *ps_timer  /* both - Timer to cancel                   */
+)
+{
+    int i_index;
+    int i_level;
+
+    if (ps_timer->pps_prev == NULL)
+    {
+        return;
+    }
+
+    *ps_timer->pps_prev = ps_timer->ps_next;
+
+    if (ps_timer->ps_next != NULL)
+    {
+        ps_timer->ps_next->pps_prev = ps_timer->pps_prev;
+    }
+/*                                                                            */
+/* If that emptied the slot, clear its bit.  pps_prev points into the slot    */
+/* array exactly when the timer was first in its list:                        */
+/*                                                                            */
+    if (ps_timer->pps_prev >= &ps_wheel->aaps_slots[0][0] &&
+        ps_timer->pps_prev <=
+            &ps_wheel->aaps_slots[WHEEL_LEVELS - 1][WHEEL_SLOTS - 1] &&
+        *ps_timer->pps_prev == NULL)
+    {
+        i_level = (int)(ps_timer->pps_prev - &ps_wheel->aaps_slots[0][0]) /
+            WHEEL_SLOTS;
+        i_index = (int)(ps_timer->pps_prev - &ps_wheel->aaps_slots[0][0]) %
+            WHEEL_SLOTS;
+
+        ps_wheel->aau64_used[i_level][i_index / 64] &=
+            ~((uint64_t)1 << (i_index % 64));
+    }
+
+    ps_timer->ps_next = NULL;
+    ps_timer->pps_prev = NULL;
+    COUNTER_ADD(ps_wheel->l_timers, -1);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Milliseconds on the monotonic clock:                                       */
+/*                                                                            */
+uint64_t timer_clock
+(
+    void
+)
+{
+    struct timespec s_now;
+
+    clock_gettime(CLOCK_MONOTONIC, &s_now);
+
+    return (uint64_t)s_now.tv_sec * 1000 + s_now.tv_nsec / 1000000;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* A client's timer went off.  Activity since it was set only moves the       */
+/* deadline, so an idle or heartbeat timer whose client has been busy is just */
+/* set again for the new deadline instead of being rescheduled on every       */
+/* message:                                                                   */
+/*                                                                            */
+void timer_fire
+(
+    struct reactor *ps_reactor, /* both - Reactor that owns the client        */
+    struct timer   *ps_timer    /* in   - Timer that is due                   */
+)
+{
+    struct connection *ps_conn;
+    uint64_t            u64_due;
+
+    ps_conn = &ps_reactor->ns_slots[ps_timer->i_slot];
+
+    switch (ps_timer->i_kind)
+    {
+/*                                                                            */
+/* Nothing heard for -i seconds.  A peer that vanished without closing the    */
+/* connection is never going to say anything, so reap it:                     */
+/*                                                                            */
+    case TIMER_IDLE:
+        u64_due = ps_conn->u64_heard + ps_reactor->u64_idle;
+
+        if (u64_due > ps_reactor->s_wheel.u64_now)
+        {
+            timer_schedule(&ps_reactor->s_wheel, ps_timer, u64_due);
+
+            break;
+        }
+
+        fprintf(stderr, "pollserver: socket %d idle, closing\n",
+            ps_conn->i_fd);
+        COUNTER_ADD(ps_reactor->l_idle_drops, 1);
+        close_connection(ps_reactor, ps_timer->i_slot);
+
+        break;
+/*                                                                            */
+/* Nothing sent for -k seconds.  Send an empty frame so the client knows the  */
+/* server is still there, and so a dead peer shows up as a failed write:      */
+/*                                                                            */
+    case TIMER_BEAT:
+        u64_due = ps_conn->u64_sent + ps_reactor->u64_beat;
+
+        if (u64_due <= ps_reactor->s_wheel.u64_now)
+        {
+            message_hold(ps_reactor->ps_keepalive, 1);
+            conn_enqueue(ps_reactor, ps_conn, ps_reactor->ps_keepalive);
+
+            u64_due = ps_reactor->s_wheel.u64_now + ps_reactor->u64_beat;
+        }
+
+        timer_schedule(&ps_reactor->s_wheel, ps_timer, u64_due);
+
+        break;
+/*                                                                            */
+/* The output queue has been backed up for -s seconds.  A client that cannot  */
+/* keep up would otherwise hold more and more memory:                         */
+/*                                                                            */
+    case TIMER_SLOW:
+        fprintf(stderr, "pollserver: socket %d too slow (%ld bytes queued), "
+            "closing\n", ps_conn->i_fd, ps_conn->l_queued);
+        COUNTER_ADD(ps_reactor->l_slow_drops, 1);
+/*                                                                            */
+/* A fan-out worker does not own the client.  Shutting the socket down has    */
+/* its reactor read the end of it and close it:                               */
+/*                                                                            */
+        if (ps_reactor->ps_owner != NULL)
+        {
+            ps_conn->i_evicted = 1;
+            conn_discard(ps_reactor, ps_conn);
+            conn_want_write(ps_reactor, ps_conn, 0);
+
+            COUNTER_ADD(ps_reactor->l_syscalls, 1);
+            shutdown(ps_conn->i_fd, SHUT_RDWR);
+
+            break;
+        }
+
+        close_connection(ps_reactor, ps_timer->i_slot);
+
+        break;
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Find the first used slot at or after i_from in one level's bitmap.         */
+/* Returns -1 if there is none:                                               */
+/*                                                                            */
+int timer_first_used
+(
+    uint64_t *au64_used, /* in   - Bitmap of one level                        */
+    int        i_from    /* in   - First slot to look at                      */
+)
+{
+    int      i_word;
+    uint64_t u64_bits;
+
+    for (i_word = i_from / 64; i_word < WHEEL_SLOTS / 64; i_word++)
+    {
+        u64_bits = au64_used[i_word];
+
+        if (i_word == i_from / 64)
+        {
+            u64_bits &= ~(uint64_t)0 << (i_from % 64);
+        }
+
+        if (u64_bits != 0)
+        {
+            return i_word * 64 + __builtin_ctzll(u64_bits);
+        }
+    }
+
+    return -1;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* The next tick at which the wheel has something to do: a level 0 slot with  */
+/* timers in it, or the start of a higher-level slot whose timers have to be  */
+/* moved down.  Each level only holds timers later than every timer in the    */
+/* levels below it, so the first level with anything in it has the answer.    */
+/* Returns UINT64_MAX if no timer is armed:                                   */
+/*                                                                            */
+uint64_t timer_next
+(
+    struct timer_wheel *ps_wheel /* in   - Wheel to look at                   */
+)
+{
+    int i_index;
+    int i_level;
+    int i_shift;
+
+    if (ps_wheel->l_timers == 0)
+    {
+        return UINT64_MAX;
+    }
+
+    for (i_level = 0; i_level < WHEEL_LEVELS; i_level++)
+    {
+        i_shift = WHEEL_BITS * i_level;
+        i_index = (int)(ps_wheel->u64_now >> i_shift) & (WHEEL_SLOTS - 1);
+
+        if (i_index == WHEEL_SLOTS - 1)
+        {
+            continue;
+        }
+
+        i_index = timer_first_used(ps_wheel->aau64_used[i_level], i_index + 1);
+
+        if (i_index != -1)
+        {
+            return (ps_wheel->u64_now >> (i_shift + WHEEL_BITS) <<
+                (i_shift + WHEEL_BITS)) | ((uint64_t)i_index << i_shift);
+        }
+    }
+
+    return UINT64_MAX;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Arm (or re-arm) a timer for a tick.  It goes in the lowest level whose     */
+/* current span, the slots still to come before that level wraps, holds the   */
+/* tick.  A tick that has already gone fires on the next one:                 */
+/*                                                                            */
+void timer_schedule
+(
+    struct timer_wheel *ps_wheel,    /* both - Wheel to put the timer in      */
+    struct timer       *ps_timer,    /* both - Timer to arm                   */
+    uint64_t             u64_expires /* in   - Tick it is due                 */
+)
+{
+    struct timer **pps_slot;
+    int             i_index;
+    int             i_level;
+    int             i_shift;
+
+    timer_cancel(ps_wheel, ps_timer);
+
+    if (u64_expires <= ps_wheel->u64_now)
+    {
+        u64_expires = ps_wheel->u64_now + 1;
+    }
+/*                                                                            */
+/* Past the top level's span (over a year out) is as far as the wheel goes:   */
+/*                                                                            */
+    if (u64_expires >> (WHEEL_BITS * WHEEL_LEVELS) !=
+        ps_wheel->u64_now >> (WHEEL_BITS * WHEEL_LEVELS))
+    {
+        u64_expires = ps_wheel->u64_now |
+            (((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1);
+    }
+
+    for (i_level = 0; i_level < WHEEL_LEVELS - 1; i_level++)
+    {
+        i_shift = WHEEL_BITS * (i_level + 1);
+
+        if (u64_expires >> i_shift == ps_wheel->u64_now >> i_shift)
+        {
+            break;
+        }
+    }
+
+    i_index = (int)(u64_expires >> (WHEEL_BITS * i_level)) & (WHEEL_SLOTS - 1);
+    pps_slot = &ps_wheel->aaps_slots[i_level][i_index];
+
+    ps_timer->u64_expires = u64_expires;
+    ps_timer->ps_next = *pps_slot;
+    ps_timer->pps_prev = pps_slot;
+
+    if (*pps_slot != NULL)
+    {
+        (*pps_slot)->pps_prev = &ps_timer->ps_next;
+    }
+
+    *pps_slot = ps_timer;
+    ps_wheel->aau64_used[i_level][i_index / 64] |=
+        (uint64_t)1 << (i_index % 64);
+    COUNTER_ADD(ps_wheel->l_timers, 1);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Milliseconds poll can sleep before the wheel has something to do, 0 if it  */
+/* already has, or -1 if no timer is armed:                                   */
+/*                                                                            */
+int timer_timeout
+(
+    struct timer_wheel *ps_wheel /* in   - Wheel to look at                   */
+)
+{
+    uint64_t u64_next;
+    uint64_t u64_now;
+
+    u64_next = timer_next(ps_wheel);
+
+    if (u64_next == UINT64_MAX)
+    {
+        return -1;
+    }
+
+    u64_now = timer_clock();
+
+    if (u64_next * TIMER_TICK_MS <= u64_now)
+    {
+        return 0;
+    }
+
+    if (u64_next * TIMER_TICK_MS - u64_now > INT32_MAX)
+    {
+        return INT32_MAX;
+    }
+
+    return (int)(u64_next * TIMER_TICK_MS - u64_now);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Queue a multishot accept on a listener.  It posts one completion per new   */
+/* connection until the kernel drops it (no IORING_CQE_F_MORE).  The user     */
+/* data carries the listener's slot so it can be armed again, and a           */
+/* generation so a pause (-C, -Q) cancels this accept and not a later one:    */
+/*                                                                            */
+void uring_arm_accept
+(
+    struct reactor *ps_reactor, /* both - Event loop that owns the listener   */
+    int              i_slot     /* in   - Listener's slot, 0 or 2 (-l)        */
+)
+{
+    struct io_uring_sqe *ps_sqe;
+
+    ps_sqe = uring_get_sqe(ps_reactor);
+
+    ps_sqe->opcode = IORING_OP_ACCEPT;
+    ps_sqe->fd = ps_reactor->ns_pfds[i_slot].fd;
+    ps_sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    ps_sqe->accept_flags = SOCK_CLOEXEC | SOCK_NONBLOCK;
+    ps_sqe->user_data = HANDLE_MAKE(ps_reactor->ps_uring->u_accept_gen,
+        i_slot) | URING_OP_ACCEPT;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Queue a multishot receive on a client.  The kernel picks a buffer from the */
+/* provided buffer ring for each completion:                                  */
+/*                                                                            */
+void uring_arm_recv
+(
+    struct reactor *ps_reactor, /* both - Event loop that owns the client     */
+    int              i_slot     /* in   - Client's slot                       */
+)
+{
+    struct io_uring_sqe *ps_sqe;
+    struct connection   *ps_conn;
+
+    ps_conn = &ps_reactor->ns_slots[i_slot];
+    ps_sqe = uring_get_sqe(ps_reactor);
+
+    ps_sqe->opcode = IORING_OP_RECV;
+    ps_sqe->fd = ps_conn->i_fd;
+    ps_sqe->ioprio = IORING_RECV_MULTISHOT;
+    ps_sqe->flags = IOSQE_BUFFER_SELECT;
+    ps_sqe->buf_group = URING_BUFFER_GROUP;
+    ps_sqe->user_data = HANDLE_MAKE(ps_conn->u_gen, i_slot) | URING_OP_RECV;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Queue a read of the wake-up eventfd.  It completes when another reactor    */
+/* has put messages in our shard rings:                                       */
+/*                                                                            */
+void uring_arm_wake
+(
+    struct reactor *ps_reactor /* both - Event loop that owns the eventfd     */
+)
+{
+    struct io_uring_sqe *ps_sqe;
+
+    ps_sqe = uring_get_sqe(ps_reactor);
+
+    ps_sqe->opcode = IORING_OP_READ;
+    ps_sqe->fd = ps_reactor->i_wake_fd;
+    ps_sqe->addr = (uintptr_t)&ps_reactor->ps_uring->u64_wake;
+    ps_sqe->len = sizeof(ps_reactor->ps_uring->u64_wake);
+    ps_sqe->off = (uint64_t)-1;
+    ps_sqe->user_data = URING_OP_WAKE;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Release the rings and the receive buffers:                                 */
+/*                                                                            */
+void uring_close
+(
+    struct uring *ps_uring /* both - Rings to release                         */
+)
+{
+    munmap(ps_uring->ps_buf_ring,
+        sizeof(struct io_uring_buf) * URING_BUFFER_COUNT);
+    free(ps_uring->nc_buffers);
+    munmap(ps_uring->ns_sqes, ps_uring->st_sqes);
+
+    if (ps_uring->p_cq_ring != ps_uring->p_sq_ring)
+    {
+        munmap(ps_uring->p_cq_ring, ps_uring->st_cq_ring);
+    }
+
+    munmap(ps_uring->p_sq_ring, ps_uring->st_sq_ring);
+    close(ps_uring->i_ring_fd);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Get the next free submission queue entry, cleared.  If the queue is full   */
+/* what is in it is submitted first:                                          */
+/*                                                                            */
+struct io_uring_sqe *uring_get_sqe
+(
+    struct reactor *ps_reactor /* both - Event loop that owns the rings       */
+)
+{
+    struct io_uring_sqe *ps_sqe;
+    struct uring        *ps_uring;
+    unsigned              u_head;
+    unsigned              u_tail;
+
+    ps_uring = ps_reactor->ps_uring;
+
+    for (;;)
+    {
+        u_head = __atomic_load_n(ps_uring->pu_sq_head, __ATOMIC_ACQUIRE);
+        u_tail = *ps_uring->pu_sq_tail;
+
+        if (u_tail - u_head < ps_uring->u_sq_entries)
+        {
+            break;
+        }
+
+        uring_submit(ps_reactor, 0, -1);
+    }
+
+    ps_sqe = &ps_uring->ns_sqes[u_tail & ps_uring->u_sq_mask];
+    memset(ps_sqe, 0, sizeof(*ps_sqe));
+
+    __atomic_store_n(ps_uring->pu_sq_tail, u_tail + 1, __ATOMIC_RELEASE);
+    ps_uring->u_to_submit++;
+
+    return ps_sqe;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Handle one completion:                                                     */
+/*                                                                            */
+void uring_handle_cqe
+(
+    struct reactor      *ps_reactor, /* both - Event loop that owns the rings */
+    struct io_uring_cqe *ps_cqe      /* in   - Completion to handle           */
+)
+{
+    unsigned short          us_bid;
+    int                     i_slot;
+    long                    l_clients;
+    long                    l_queued;
+    struct connection     *ps_conn;
+    struct message        *ps_message;
+    char                    ac_remoteIP[INET6_ADDRSTRLEN];
+    struct sockaddr_storage s_remoteaddr;
+    socklen_t               sl_addrlen;
+    struct uring          *ps_uring;
+
+    ps_uring = ps_reactor->ps_uring;
+
+    switch (ps_cqe->user_data & URING_OP_MASK)
+    {
+/*                                                                            */
+/* New connection.  Add it to the set and start receiving from it.  At -C the */
+/* accepts are cancelled, and a connection the kernel took before that is     */
+/* the newest client and is shed.  A cancelled accept is armed again when     */
+/* the listeners are watched again, not here:                                 */
+/*                                                                            */
+    case URING_OP_ACCEPT:
+        if (ps_cqe->res >= 0 && ps_reactor->l_clients_high > 0 &&
+            !ps_reactor->l_paused)
+        {
+            overload_totals(ps_reactor, &l_clients, &l_queued);
+
+            if (l_clients >= ps_reactor->l_clients_high)
+            {
+                overload_signal(ps_reactor, 1);
+                overload_listen(ps_reactor, 0);
+            }
+        }
+
+        if (ps_cqe->res == -ECANCELED)
+        {
+            break;
+        }
+
+        if (ps_cqe->res < 0)
+        {
+            report_error("accept", -ps_cqe->res);
+        }
+        else if (ps_reactor->l_paused)
+        {
+            fprintf(stderr, "pollserver: not accepting, socket %d dropped\n",
+                ps_cqe->res);
+
+            COUNTER_ADD(ps_reactor->l_sheds, 1);
+            close(ps_cqe->res);
+        }
+        else if ((i_slot = add_to_pfds(ps_reactor, ps_cqe->res)) == -1)
+        {
+            close(ps_cqe->res);
+        }
+        else
+        {
+            COUNTER_ADD(ps_reactor->l_accepts, 1);
+            uring_arm_recv(ps_reactor, i_slot);
+
+            sl_addrlen = sizeof(s_remoteaddr);
+            COUNTER_ADD(ps_reactor->l_syscalls, 1);
+
+            if (getpeername(ps_cqe->res, (struct sockaddr*)&s_remoteaddr,
+                &sl_addrlen) == 0)
+            {
+                if (s_remoteaddr.ss_family == AF_UNIX)
+                {
+                    strcpy(ac_remoteIP, "the Unix socket");
+                }
+                else
+                {
+                    inet_ntop(s_remoteaddr.ss_family,
+                        get_in_addr((struct sockaddr*)&s_remoteaddr),
+                        ac_remoteIP, INET6_ADDRSTRLEN);
+                }
+
+                printf("pollserver: new connection from %s on socket %d\n",
+                    ac_remoteIP, ps_cqe->res);
+            }
+        }
+
+        if (!(ps_cqe->flags & IORING_CQE_F_MORE) && !ps_reactor->l_paused)
+        {
+            uring_arm_accept(ps_reactor, HANDLE_SLOT(ps_cqe->user_data));
+        }
+
+        break;
+/*                                                                            */
+/* Data, a hang up or an error from a client:                                 */
+/*                                                                            */
+    case URING_OP_RECV:
+        i_slot = slot_lookup(ps_reactor,
+            ps_cqe->user_data & ~(uint64_t)URING_OP_MASK);
+
+        if (ps_cqe->res > 0)
+        {
+            us_bid = ps_cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            COUNTER_ADD(ps_reactor->l_bytes_in, ps_cqe->res);
+
+            if (i_slot != -1)
+            {
+                ps_reactor->ns_slots[i_slot].u64_heard =
+                    ps_reactor->s_wheel.u64_now;
+            }
+/*                                                                            */
+/* Copy the data out once so the buffer can go straight back to the kernel.   */
+/* Framed mode copies it onto the end of the client's input buffer instead.   */
+/* The kernel has already taken these bytes off the socket, so a client they  */
+/* cannot be kept for is closed rather than read on from the middle of a      */
+/* frame:                                                                     */
+/*                                                                            */
+            if (i_slot != -1 && ps_reactor->i_frame_max > 0)
+            {
+                ps_conn = &ps_reactor->ns_slots[i_slot];
+
+                if (conn_reserve(ps_conn,
+                    ps_conn->i_in_len + ps_cqe->res) == -1)
+                {
+                    uring_provide_buffer(ps_uring, us_bid);
+                    close_connection(ps_reactor, i_slot);
+
+                    break;
+                }
+
+                memcpy(ps_conn->nc_in + ps_conn->i_in_len,
+                    ps_uring->nc_buffers + us_bid * URING_BUFFER_SIZE,
+                    ps_cqe->res);
+                ps_conn->i_in_len += ps_cqe->res;
+
+                if (conn_reassemble(ps_reactor, i_slot) == -1)
+                {
+                    uring_provide_buffer(ps_uring, us_bid);
+                    close_connection(ps_reactor, i_slot);
+
+                    break;
+                }
+            }
+            else if (i_slot != -1 &&
+                (ps_message = message_alloc(ps_cqe->res)) != NULL)
+            {
+                ps_message->i_len = ps_cqe->res;
+                memcpy(ps_message->ac_data,
+                    ps_uring->nc_buffers + us_bid * URING_BUFFER_SIZE,
+                    ps_cqe->res);
+
+                broadcast_message(ps_reactor, i_slot, ps_message);
+                message_release(ps_message);
+            }
+
+            uring_provide_buffer(ps_uring, us_bid);
+
+            if (!(ps_cqe->flags & IORING_CQE_F_MORE) && i_slot != -1)
+            {
+                uring_arm_recv(ps_reactor, i_slot);
+            }
+        }
+        else if (ps_cqe->res == -ENOBUFS && i_slot != -1)
+        {
+            uring_arm_recv(ps_reactor, i_slot); // Buffers have been given back
+        }
+        else if (i_slot != -1)
+        {
+            if (ps_cqe->res == 0) // Connection closed
+            {
+                fprintf(stderr, "pollserver: socket %d hung up\n",
+                    ps_reactor->ns_slots[i_slot].i_fd);
+            }
+            else
+            {
+                report_error("recv", -ps_cqe->res);
+            }
+
+            close_connection(ps_reactor, i_slot);
+        }
+
+        break;
+/*                                                                            */
+/* A writev from a client's output queue finished.  If the client went away   */
+/* meanwhile the slot was left for us to free:                                */
+/*                                                                            */
+    case URING_OP_WRITE:
+        i_slot = HANDLE_SLOT(ps_cqe->user_data);
+        ps_conn = &ps_reactor->ns_slots[i_slot];
+
+        if (ps_conn->i_closed)
+        {
+            slot_free(ps_reactor, i_slot);
+
+            break;
+        }
+
+        ps_conn->i_writing = 0;
+
+        if (ps_cqe->res < 0)
+        {
+            conn_fail(ps_reactor, ps_conn, -ps_cqe->res);
+
+            break;
+        }
+
+        if (ps_cqe->res < ps_conn->l_inflight) // Socket buffer was full
+        {
+            COUNTER_ADD(ps_reactor->l_stalls, 1);
+        }
+
+        conn_consume(ps_reactor, ps_conn, ps_cqe->res);
+/*                                                                            */
+/* Anything still queued has to be gone before the slow-consumer deadline:    */
+/*                                                                            */
+        if (ps_conn->u_head == ps_conn->u_tail)
+        {
+            timer_cancel(&ps_reactor->s_wheel, &ps_conn->s_slow);
+        }
+        else if (ps_reactor->u64_slow > 0 && ps_conn->s_slow.pps_prev == NULL)
+        {
+            timer_schedule(&ps_reactor->s_wheel, &ps_conn->s_slow,
+                ps_reactor->s_wheel.u64_now + ps_reactor->u64_slow);
+        }
+
+        conn_flush(ps_reactor, ps_conn);
+
+        break;
+/*                                                                            */
+/* Another reactor handed us messages:                                        */
+/*                                                                            */
+    case URING_OP_WAKE:
+        if (ps_cqe->res < 0 && ps_cqe->res != -EAGAIN)
+        {
+            report_error("read", -ps_cqe->res);
+        }
+
+        shard_drain(ps_reactor);
+        uring_arm_wake(ps_reactor);
+
+        break;
+/*                                                                            */
+/* Time to retry the shard backlog (shard_flush does that every pass):        */
+/*                                                                            */
+    case URING_OP_TIMEOUT:
+        ps_uring->i_timeout_armed = 0;
+
+        break;
+/*                                                                            */
+/* Nothing to do when a wake-up write to another reactor finishes, or when an */
+/* accept has been cancelled (its own completion says so):                    */
+/*                                                                            */
+    case URING_OP_NOTIFY:
+    case URING_OP_CANCEL:
+        break;
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Give a receive buffer (back) to the kernel:                                */
+/*                                                                            */
+void uring_provide_buffer
+(
+    struct uring   *ps_uring, /* both - Rings that own the buffer ring        */
+    unsigned short  us_bid    /* in   - Buffer to hand over                   */
+)
+{
+    struct io_uring_buf *ps_buf;
+
+    ps_buf = &ps_uring->ps_buf_ring->bufs[ps_uring->us_buf_tail &
+        (URING_BUFFER_COUNT - 1)];
+
+    ps_buf->addr = (uintptr_t)(ps_uring->nc_buffers +
+        us_bid * URING_BUFFER_SIZE);
+    ps_buf->len = URING_BUFFER_SIZE;
+    ps_buf->bid = us_bid;
+
+    ps_uring->us_buf_tail++;
+
+    __atomic_store_n(&ps_uring->ps_buf_ring->tail, ps_uring->us_buf_tail,
+        __ATOMIC_RELEASE);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Create the rings, map them and register the receive buffers.  Returns 0    */
+/* or -1 if this kernel cannot do it:                                         */
+/*                                                                            */
+int uring_setup
+(
+    struct uring *ps_uring /* out  - Rings ready to use                       */
+)
+{
+    struct io_uring_buf_reg s_reg;
+    int                     i_errno;
+    unsigned                u_lc;
+    struct io_uring_params  s_params;
+    unsigned               *pu_sq_array;
+
+    memset(ps_uring, 0, sizeof(*ps_uring));
+    memset(&s_params, 0, sizeof(s_params));
+
+    ps_uring->s_retry.tv_nsec = 1000000; // 1 ms
+
+    s_params.flags = IORING_SETUP_CQSIZE;
+    s_params.cq_entries = URING_CQ_ENTRIES;
+
+    errno = 0;
+    ps_uring->i_ring_fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES,
+        &s_params);
+    i_errno = errno;
+
+    if (ps_uring->i_ring_fd == -1)
+    {
+        report_error("io_uring_setup", i_errno);
+
+        return -1;
+    }
+/*                                                                            */
+/* Map the submission and completion rings (one mapping on newer kernels):    */
+/*                                                                            */
+    ps_uring->st_sq_ring = s_params.sq_off.array +
+        s_params.sq_entries * sizeof(unsigned);
+    ps_uring->st_cq_ring = s_params.cq_off.cqes +
+        s_params.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (s_params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        if (ps_uring->st_cq_ring > ps_uring->st_sq_ring)
+        {
+            ps_uring->st_sq_ring = ps_uring->st_cq_ring;
+        }
+
+        ps_uring->st_cq_ring = ps_uring->st_sq_ring;
+    }
+
+    ps_uring->p_sq_ring = mmap(NULL, ps_uring->st_sq_ring,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+        ps_uring->i_ring_fd, IORING_OFF_SQ_RING);
+
+    if (ps_uring->p_sq_ring == MAP_FAILED)
+    {
+        report_error("mmap", errno);
+        close(ps_uring->i_ring_fd);
+
+        return -1;
+    }
+
+    if (s_params.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        ps_uring->p_cq_ring = ps_uring->p_sq_ring;
+    }
+    else
+    {
+        ps_uring->p_cq_ring = mmap(NULL, ps_uring->st_cq_ring,
+            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+            ps_uring->i_ring_fd, IORING_OFF_CQ_RING);
+
+        if (ps_uring->p_cq_ring == MAP_FAILED)
+        {
+            report_error("mmap", errno);
+            munmap(ps_uring->p_sq_ring, ps_uring->st_sq_ring);
+            close(ps_uring->i_ring_fd);
+
+            return -1;
+        }
+    }
+
+    ps_uring->st_sqes = s_params.sq_entries * sizeof(struct io_uring_sqe);
+    ps_uring->ns_sqes = mmap(NULL, ps_uring->st_sqes, PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE, ps_uring->i_ring_fd, IORING_OFF_SQES);
+
+    if (ps_uring->ns_sqes == MAP_FAILED)
+    {
+        report_error("mmap", errno);
+
+        if (ps_uring->p_cq_ring != ps_uring->p_sq_ring)
+        {
+            munmap(ps_uring->p_cq_ring, ps_uring->st_cq_ring);
+        }
+
+        munmap(ps_uring->p_sq_ring, ps_uring->st_sq_ring);
+        close(ps_uring->i_ring_fd);
+
+        return -1;
+    }
+
+    ps_uring->pu_sq_head = (unsigned*)((char*)ps_uring->p_sq_ring +
+        s_params.sq_off.head);
+    ps_uring->pu_sq_tail = (unsigned*)((char*)ps_uring->p_sq_ring +
+        s_params.sq_off.tail);
+    ps_uring->u_sq_mask = *(unsigned*)((char*)ps_uring->p_sq_ring +
+        s_params.sq_off.ring_mask);
+    ps_uring->u_sq_entries = s_params.sq_entries;
+    pu_sq_array = (unsigned*)((char*)ps_uring->p_sq_ring +
+        s_params.sq_off.array);
+
+    ps_uring->pu_cq_head = (unsigned*)((char*)ps_uring->p_cq_ring +
+        s_params.cq_off.head);
+    ps_uring->pu_cq_tail = (unsigned*)((char*)ps_uring->p_cq_ring +
+        s_params.cq_off.tail);
+    ps_uring->u_cq_mask = *(unsigned*)((char*)ps_uring->p_cq_ring +
+        s_params.cq_off.ring_mask);
+    ps_uring->ns_cqes = (struct io_uring_cqe*)((char*)ps_uring->p_cq_ring +
+        s_params.cq_off.cqes);
+/*                                                                            */
+/* Submission queue entry i always lives in slot i:                           */
+/*                                                                            */
+    for (u_lc = 0; u_lc < s_params.sq_entries; u_lc++)
+    {
+        pu_sq_array[u_lc] = u_lc;
+    }
+/*                                                                            */
+/* Register the provided buffer ring and fill it with every buffer:           */
+/*                                                                            */
+    ps_uring->nc_buffers = malloc(URING_BUFFER_COUNT * URING_BUFFER_SIZE);
+    ps_uring->ps_buf_ring = mmap(NULL,
+        sizeof(struct io_uring_buf) * URING_BUFFER_COUNT,
+        PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+    if (ps_uring->nc_buffers == NULL || ps_uring->ps_buf_ring == MAP_FAILED)
+    {
+        fprintf(stderr, "pollserver: no memory for the receive buffers\n");
+        ps_uring->ps_buf_ring = MAP_FAILED;
+        uring_close(ps_uring);
+
+        return -1;
+    }
+
+    memset(&s_reg, 0, sizeof(s_reg));
+    s_reg.ring_addr = (uintptr_t)ps_uring->ps_buf_ring;
+    s_reg.ring_entries = URING_BUFFER_COUNT;
+    s_reg.bgid = URING_BUFFER_GROUP;
+
+    errno = 0;
+    if (syscall(__NR_io_uring_register, ps_uring->i_ring_fd,
+        IORING_REGISTER_PBUF_RING, &s_reg, 1) == -1)
+    {
+        i_errno = errno;
+        report_error("io_uring_register", i_errno);
+        uring_close(ps_uring);
+
+        return -1;
+    }
+
+    for (u_lc = 0; u_lc < URING_BUFFER_COUNT; u_lc++)
+    {
+        uring_provide_buffer(ps_uring, (unsigned short)u_lc);
+    }
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Hand the queued entries to the kernel and optionally wait for              */
+/* completions, for at most i_timeout milliseconds unless it is -1.  This is  */
+/* the only system call the io_uring loop makes for accepts, receives and     */
+/* sends.  Returns 0 or -1 on a real failure:                                 */
+/*                                                                            */
+int uring_submit
+(
+    struct reactor *ps_reactor, /* both - Event loop that owns the rings      */
+    unsigned         u_wait,    /* in   - Completions to wait for             */
+    int              i_timeout  /* in   - Longest wait in ms, -1 = no limit   */
+)
+{
+    int                            i_errno;
+    int                            i_status;
+    unsigned                       u_flags;
+    struct uring                 *ps_uring;
+    struct io_uring_getevents_arg  s_arg;
+    struct __kernel_timespec       s_wait;
+
+    ps_uring = ps_reactor->ps_uring;
+    u_flags = u_wait > 0 ? IORING_ENTER_GETEVENTS : 0;
+/*                                                                            */
+/* A wait with a time limit passes it in the extended argument:               */
+/*                                                                            */
+    memset(&s_arg, 0, sizeof(s_arg));
+
+    if (u_wait > 0 && i_timeout >= 0)
+    {
+        s_wait.tv_sec = i_timeout / 1000;
+        s_wait.tv_nsec = (long long)(i_timeout % 1000) * 1000000;
+        s_arg.ts = (uintptr_t)&s_wait;
+        u_flags |= IORING_ENTER_EXT_ARG;
+    }
+
+    errno = 0;
+    i_status = (int)syscall(__NR_io_uring_enter, ps_uring->i_ring_fd,
+        ps_uring->u_to_submit, u_wait, u_flags,
+        (u_flags & IORING_ENTER_EXT_ARG) ? (void*)&s_arg : NULL,
+        (u_flags & IORING_ENTER_EXT_ARG) ? sizeof(s_arg) : 0);
+    i_errno = errno;
+    COUNTER_ADD(ps_reactor->l_syscalls, 1);
+
+    if (i_status == -1)
+    {
+        if (i_errno == EINTR || i_errno == EAGAIN || i_errno == EBUSY ||
+            i_errno == ETIME)
+        {
+            return 0;
+        }
+
+        report_error("io_uring_enter", i_errno);
+
+        return -1;
+    }
+
+    ps_uring->u_to_submit -= i_status;
+
+    return 0;
+}
@@ -0,0 +1,2574 @@
+/******************************************************************************/
+/*                                                                            */
+/* Application: selectserver                                                  */
+/*                                                                            */
+/* File:        unix_main.c                                                   */
+/*                                                                            */
+/* Purpose:     Implement a crude, multi-person chat server to demonstrate    */
+/*              using select on multiple servers.  This is the Unix/Linux     */
+/*              build of WSselectserver.                                      */
+/*                                                                            */
+/*              By default whatever one recv returns is sent on to everyone   */
+/*              else, the same as the Windows version.  With -f every message */
+/*              is a frame: a 4-byte big-endian length and that many bytes.   */
+/*              Frames are reassembled from however the reads split them and  */
+/*              forwarded whole; larger than the -f limit drops the client.   */
+/*                                                                            */
+/*              A hierarchical timer wheel closes clients that have been      */
+/*              silent for -i seconds and sends framed clients an empty frame */
+/*              after -k seconds without traffic.  The loop sleeps until the  */
+/*              nearest timer is due.                                         */
+/*                                                                            */
+/*              The listener is non-blocking and each wakeup accepts a batch  */
+/*              of connections with accept4, so a reconnect storm does not    */
+/*              cost a wait per client.                                       */
+/*                                                                            */
+/*              Client sockets are non-blocking too.  What a send cannot get  */
+/*              out goes into the client's output queue and the backend       */
+/*              watches that client for writing until the queue drains, so a  */
+/*              client that stops reading holds up nobody else.  -s drops a   */
+/*              client whose queue has not drained for that many seconds and  */
+/*              -q one whose queue would grow past that many bytes.           */
+/*                                                                            */
+/*              -e picks how the loop waits for sockets: select (the          */
+/*              default), poll or epoll, behind one backend interface, so the */
+/*              three can be compared under the same load.  All three go up   */
+/*              to the descriptor limit: select is handed a bitmap sized for  */
+/*              it instead of an fd_set, and the ready sockets are found 64   */
+/*              bits at a time.  Broadcasts go to a dense list of the         */
+/*              connected clients.                                            */
+/*                                                                            */
+/*              -S serves metrics on that TCP port in the Prometheus text     */
+/*              format, the same names PollServer uses: connections, accepts, */
+/*              bytes, messages, send errors, bytes in the clients' output    */
+/*              queues and a histogram of loop pass times.  The port is one   */
+/*              more descriptor for the backend to watch.                     */
+/*                                                                            */
+/*              -C and -Q set high and low watermarks on clients connected    */
+/*              and bytes held for clients, partial frames and output queues. */
+/*              Past a high one the listener is no longer watched, and past   */
+/*              -Q the clients holding the most are shed; it comes back once  */
+/*              both are down to their low watermarks.                        */
+/*                                                                            */
+/* Reference:   This function is based on selectserver.c in Brian "Beej       */
+/*              Jorgensen" Hall's excellent socket programming guide:         */
+/*                 Hall, B. (2019). "Beej's Guide to Network Programming      */
+/*                 Using Internet Sockets"                                    */
+/*                 https://beej.us/guide/bgnet/                               */
+/*                                                                            */
+/* Usage:       selectserver [-C clients_high[:low]] [-e select|poll|epoll]   */
+/*                           [-f max_frame] [-i idle_secs]                    */
+/*                           [-k heartbeat_secs] [-Q buffered_high[:low]]     */
+/*                           [-q queue_max] [-S metrics_port] [-s slow_secs]  */
+/*                                                                            */
+/* Modifications:                                                             */
+/*                                                                            */
+/*           Name           Date                     Reason                   */
+/*    ------------------ ---------- ----------------------------------------- */
+/*    Steven C. Mitchell 2026-10-17 Linux build with length-prefixed framing  */
+/*    Steven C. Mitchell 2026-10-17 Timer wheel: idle, heartbeat, slow reader */
+/*    Steven C. Mitchell 2026-10-17 Batched accept4 for reconnect storms      */
+/*    Steven C. Mitchell 2026-10-17 Metrics port (-S)                         */
+/*    Steven C. Mitchell 2026-10-17 Overload watermarks (-C, -Q)              */
+/*    Steven C. Mitchell 2026-10-17 Event backends: select, poll, epoll (-e)  */
+/*    Steven C. Mitchell 2026-10-17 select past FD_SETSIZE, dense member list */
+/*    Steven C. Mitchell 2026-10-17 Output queues flushed on write readiness  */
+/*                                                                            */
+/******************************************************************************/
+#define _GNU_SOURCE // accept4
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/time.h>
+#include <time.h>
+
+#define PORT "9034"        // port we're listening on
+#define BACKLOG SOMAXCONN  // how many pending connections queue will hold
+#define ACCEPT_BATCH 64    // Most connections accepted per pass of the loop
+#define EPOLL_BATCH  256   // Most events one epoll_wait returns
+#define CLIENT_MAX_LIMIT (1 << 20) // Most descriptors the client table covers
+
+#define MESSAGE_MAX     256       // Largest read when not framed
+#define FRAME_HEADER    4         // Big-endian payload length before a frame
+#define FRAME_MAX_LIMIT (16 << 20) // Largest payload -f accepts
+#define FRAME_KEEP      65536     // Input or output buffer kept when empty
+
+#define TIMER_TICK_MS  10       // Resolution of the timer wheel
+#define WHEEL_BITS     8        // Each level has 1 << WHEEL_BITS slots
+#define WHEEL_SLOTS    (1 << WHEEL_BITS)
+#define WHEEL_LEVELS   4        // 2^32 ticks, well over a year at 10 ms
+#define TIMER_MAX_SECS 31536000 // Longest -i, -k or -s (a year)
+
+#define TIMER_IDLE 0 // Nothing received from the client for -i seconds
+#define TIMER_BEAT 1 // Nothing sent to the client for -k seconds
+#define TIMER_SLOW 2 // Output queued for -s seconds without draining
+
+#define METRICS_BUCKETS 22  // Loop pass times: < 1 us, < 2 us ... < 1 s, more
+#define METRICS_WAIT_MS 100 // Longest wait for a scraper's request
+/*                                                                            */
+/* A timer.  It sits in a doubly linked list in one slot of the timer wheel;  */
+/* pps_prev points at whatever points at it, so it can be taken out without   */
+/* knowing which slot it is in.  pps_prev is NULL while the timer is not      */
+/* armed:                                                                     */
+/*                                                                            */
+struct timer
+{
+    struct timer  *ps_next;
+    struct timer **pps_prev;
+    uint64_t        u64_expires; // Tick it is due
+    int             i_fd;        // Client it belongs to
+    int             i_kind;      // TIMER_IDLE, TIMER_BEAT or TIMER_SLOW
+};
+/*                                                                            */
+/* A hierarchical timer wheel, the same as PollServer's.  Level 0 has a slot  */
+/* per tick for the current WHEEL_SLOTS ticks, level 1 a slot per WHEEL_SLOTS */
+/* ticks and so on; a higher-level slot is moved down when the wheel reaches  */
+/* it.  Scheduling and cancelling are O(1) and the bitmaps of used slots let  */
+/* the wheel find the next tick with work without stepping through empty      */
+/* ones:                                                                      */
+/*                                                                            */
+struct timer_wheel
+{
+    uint64_t      u64_now;  // Last tick processed
+    long          l_timers; // Timers armed
+    uint64_t      aau64_used[WHEEL_LEVELS][WHEEL_SLOTS / 64];
+    struct timer *aaps_slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+/*                                                                            */
+/* What the server keeps for each client, indexed by its descriptor.  nc_out  */
+/* holds what the client's socket would not take yet; the bytes still to go   */
+/* start at i_out_off:                                                        */
+/*                                                                            */
+struct client
+{
+    char        *nc_in;      // Partial frame (framed mode)
+    int           i_in_len;   // Bytes in nc_in
+    int           i_in_size;  // Bytes allocated for nc_in
+    char        *nc_out;     // Output waiting for the socket to be writable
+    int           i_out_off;  // First unsent byte in nc_out
+    int           i_out_len;  // Unsent bytes from there
+    int           i_out_size; // Bytes allocated for nc_out
+    uint64_t      u64_heard;  // Tick of the last receive
+    uint64_t      u64_sent;   // Tick of the last send
+    struct timer  s_idle;     // Idle timeout (-i)
+    struct timer  s_beat;     // Heartbeat (-k)
+    struct timer  s_slow;     // Backlog timeout (-s)
+    int           i_open;     // A connected client, not a free descriptor
+    int           i_member;   // Index in ni_members
+};
+
+/*                                                                            */
+/* The whole server.  The counters are only read by metrics_serve (-S), in    */
+/* the same thread, so they are plain longs:                                  */
+/*                                                                            */
+struct server
+{
+    int                i_listener;  // Listening socket descriptor
+    int                i_metrics;   // Metrics listener (-S) or -1
+    int                i_fdmax;     // Maximum file descriptor number
+    int                i_fd_limit;  // Descriptors the client table covers
+    struct backend    *ps_backend;  // How the loop waits (-e)
+    int               *ni_ready;    // Descriptors the last wait found readable
+    int                i_ready;     // ...how many
+    int               *ni_writable; // Descriptors it found writable
+    int                i_writable;  // ...how many
+    int                i_frame_max; // Largest frame payload, 0 = not framed
+    uint64_t           u64_idle;    // Idle timeout in ticks, 0 = off
+    uint64_t           u64_beat;    // Heartbeat interval in ticks, 0 = off
+    uint64_t           u64_slow;    // Longest backlog in ticks, 0 = off
+    long               l_queue_max; // Most bytes queued per client, 0 = any
+    uint64_t           u64_tick;    // Time of this pass through the loop
+    uint64_t          *nu64_master; // Descriptors select watches, a bit each
+    uint64_t          *nu64_read;   // ...the copy select overwrites
+    uint64_t          *nu64_write_master; // Descriptors it watches for writing
+    uint64_t          *nu64_write;  // ...the copy select overwrites
+    int                i_writers;   // Bits set in nu64_write_master
+    int                i_words;     // 64-bit words in each
+    struct pollfd     *ns_pollfds;  // Descriptors poll watches
+    int                i_npollfds;  // ...how many
+    int               *ni_pollslot; // Index in ns_pollfds by descriptor or -1
+    int                i_epfd;      // epoll instance or -1
+    struct epoll_event *ns_events;  // What epoll_wait hands back
+    struct timer_wheel s_wheel;     // Idle, heartbeat and backlog timers
+    int                i_clients;   // Clients connected
+    int               *ni_members;  // Their descriptors, densely packed
+    long               l_clients_high; // Stop accepting at this many (-C)
+    long               l_clients_low;  // ...start again at this many
+    long               l_buffered;  // Bytes allocated for input and output
+    long               l_buffered_high; // Bytes of them that shed (-Q)
+    long               l_buffered_low;  // ...and that accepting resumes at
+    int                i_paused;    // Listener not watched
+    long               l_sheds;     // Clients dropped for overload
+    long               l_accepts;   // Connections accepted
+    long               l_bytes_in;  // Bytes received from clients
+    long               l_bytes_out; // Bytes sent to clients
+    long               l_messages;  // Messages received (frames with -f)
+    long               l_deliveries; // Copies sent to other clients
+    long               l_send_errors; // Sends that failed or backed up
+    long               l_loop_usec; // Time spent in loop passes
+    long               al_loop_hist[METRICS_BUCKETS]; // Passes by time
+    long               l_last_accepts; // l_accepts at the last scrape
+    uint64_t           u64_last_scrape; // metrics_clock then
+    struct client     *ns_clients;  // A client per descriptor
+};
+/*                                                                            */
+/* An event backend: how the loop waits for sockets.  select, poll and epoll  */
+/* each have one (-e) and the loop only sees this interface.  watch and       */
+/* unwatch add and remove a descriptor (-1 if it cannot be watched), writing  */
+/* turns watching a watched descriptor for writing on or off, and wait sleeps */
+/* up to a timeout in milliseconds, or for ever at -1, then fills ni_ready    */
+/* with the descriptors that can be read and ni_writable with the ones that   */
+/* can be written:                                                            */
+/*                                                                            */
+struct backend
+{
+    char *nc_name;
+    int  (*pf_init)(struct server*);
+    int  (*pf_watch)(struct server*, int);
+    void (*pf_unwatch)(struct server*, int);
+    void (*pf_writing)(struct server*, int, int);
+    int  (*pf_wait)(struct server*, int);
+};
+
+void  accept_new_connection(struct server*);
+int   backend_epoll_init(struct server*);
+void  backend_epoll_unwatch(struct server*, int);
+int   backend_epoll_wait(struct server*, int);
+int   backend_epoll_watch(struct server*, int);
+void  backend_epoll_writing(struct server*, int, int);
+struct backend *backend_find(char*);
+int   backend_poll_init(struct server*);
+void  backend_poll_unwatch(struct server*, int);
+int   backend_poll_wait(struct server*, int);
+int   backend_poll_watch(struct server*, int);
+void  backend_poll_writing(struct server*, int, int);
+int   backend_select_init(struct server*);
+void  backend_select_unwatch(struct server*, int);
+int   backend_select_wait(struct server*, int);
+int   backend_select_watch(struct server*, int);
+void  backend_select_writing(struct server*, int, int);
+void  broadcast_message(struct server*, int, char*, int);
+int   client_reassemble(struct server*, int);
+int   client_flush(struct server*, int);
+int   client_reserve(struct server*, char**, int*, int);
+int   client_send(struct server*, int, char*, int);
+void  close_client(struct server*, int);
+void *get_in_addr(struct sockaddr*);
+void  handle_client_data(struct server*, int);
+uint64_t metrics_clock(void);
+void  metrics_loop(struct server*, uint64_t);
+void  metrics_serve(struct server*);
+void  metrics_write(FILE*, struct server*);
+int   open_a_socket(char*, int);
+void  overload_check(struct server*);
+int   overload_compare(const void*, const void*);
+int   overload_parse(char*, long*, long*);
+void  report_error(char*, int);
+void  server_close(struct server*);
+void  timer_advance(struct server*);
+void  timer_cancel(struct timer_wheel*, struct timer*);
+uint64_t timer_clock(void);
+void  timer_fire(struct server*, struct timer*);
+int   timer_first_used(uint64_t*, int);
+uint64_t timer_next(struct timer_wheel*);
+void  timer_schedule(struct timer_wheel*, struct timer*, uint64_t);
+int   timer_timeout(struct timer_wheel*);
+/*                                                                            */
+/* The backends -e chooses from, the default first:                           */
+/*                                                                            */
+static struct backend gas_backends[] =
+{
+    { "select", backend_select_init, backend_select_watch,
+        backend_select_unwatch, backend_select_writing, backend_select_wait },
+    { "poll", backend_poll_init, backend_poll_watch, backend_poll_unwatch,
+        backend_poll_writing, backend_poll_wait },
+    { "epoll", backend_epoll_init, backend_epoll_watch,
+        backend_epoll_unwatch, backend_epoll_writing, backend_epoll_wait }
+};
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+int main
+(
+    int    argc,
+    char  *argv[]
+)
+{
+    int              i;          // loop counter
+    int              i_accept;   // The listener was ready this pass
+    int              i_errno;
+    int              i_fd;
+    int              i_opt;
+    int              i_rv;       // Value returned by a function
+    int              i_timeout;  // Milliseconds to the next timer
+    char            *nc_metrics; // Metrics port (-S) or NULL
+    struct rlimit    s_limit;
+    struct server   *ps_server;
+    uint64_t         u64_woke;   // metrics_clock when the wait returned
+/*                                                                            */
+/* The server state is too big for the stack (a timer wheel, select's set):   */
+/*                                                                            */
+    ps_server = calloc(1, sizeof(struct server));
+
+    if (ps_server == NULL)
+    {
+        fprintf(stderr, "Unable to allocate the server.\n");
+
+        return 1;
+    }
+
+    nc_metrics = NULL;
+    ps_server->i_listener = -1;
+    ps_server->i_metrics = -1;
+    ps_server->i_epfd = -1;
+    ps_server->ps_backend = &gas_backends[0];
+/*                                                                            */
+/* Decide how to wait for sockets, whether clients send length-prefixed       */
+/* frames, which timeouts and queue limits apply, whether to serve metrics    */
+/* and where the watermarks are:                                              */
+/*                                                                            */
+    while ((i_opt = getopt(argc, argv, "C:e:f:i:k:Q:q:S:s:")) != -1)
+    {
+        if (i_opt == 'C' && overload_parse(optarg, NULL, NULL) == 0)
+        {
+            overload_parse(optarg, &ps_server->l_clients_high,
+                &ps_server->l_clients_low);
+        }
+        else if (i_opt == 'e' && backend_find(optarg) != NULL)
+        {
+            ps_server->ps_backend = backend_find(optarg);
+        }
+        else if (i_opt == 'f' && atoi(optarg) > 0 &&
+            atoi(optarg) <= FRAME_MAX_LIMIT)
+        {
+            ps_server->i_frame_max = atoi(optarg);
+        }
+        else if (i_opt == 'i' && atoi(optarg) > 0 &&
+            atoi(optarg) <= TIMER_MAX_SECS)
+        {
+            ps_server->u64_idle = (uint64_t)atoi(optarg) * 1000 /
+                TIMER_TICK_MS;
+        }
+        else if (i_opt == 'k' && atoi(optarg) > 0 &&
+            atoi(optarg) <= TIMER_MAX_SECS)
+        {
+            ps_server->u64_beat = (uint64_t)atoi(optarg) * 1000 /
+                TIMER_TICK_MS;
+        }
+        else if (i_opt == 'Q' && overload_parse(optarg, NULL, NULL) == 0)
+        {
+            overload_parse(optarg, &ps_server->l_buffered_high,
+                &ps_server->l_buffered_low);
+        }
+        else if (i_opt == 'q' && atol(optarg) > 0)
+        {
+            ps_server->l_queue_max = atol(optarg);
+        }
+        else if (i_opt == 'S' && atoi(optarg) > 0)
+        {
+            nc_metrics = optarg;
+        }
+        else if (i_opt == 's' && atoi(optarg) > 0 &&
+            atoi(optarg) <= TIMER_MAX_SECS)
+        {
+            ps_server->u64_slow = (uint64_t)atoi(optarg) * 1000 /
+                TIMER_TICK_MS;
+        }
+        else
+        {
+            fprintf(stderr, "usage: selectserver [-C clients_high[:low]] "
+                "[-e select|poll|epoll]\n"
+                "                    [-f max_frame] [-i idle_secs] "
+                "[-k heartbeat_secs]\n"
+                "                    [-Q buffered_high[:low]] "
+                "[-q queue_max] [-S metrics_port]\n"
+                "                    [-s slow_secs]\n");
+            free(ps_server);
+
+            return 1;
+        }
+    }
+/*                                                                            */
+/* A heartbeat is an empty frame, which only means something to framed        */
+/* clients:                                                                   */
+/*                                                                            */
+    if (ps_server->u64_beat > 0 && ps_server->i_frame_max == 0)
+    {
+        fprintf(stderr, "selectserver: -k needs -f\n");
+        free(ps_server);
+
+        return 1;
+    }
+
+    ps_server->s_wheel.u64_now = timer_clock() / TIMER_TICK_MS;
+    ps_server->u64_tick = ps_server->s_wheel.u64_now;
+/*                                                                            */
+/* Size the client table, the member list and the ready lists for every       */
+/* descriptor the process can have, whichever backend waits:                  */
+/*                                                                            */
+    ps_server->i_fd_limit = CLIENT_MAX_LIMIT;
+
+    if (getrlimit(RLIMIT_NOFILE, &s_limit) == 0 &&
+        s_limit.rlim_cur < (rlim_t)ps_server->i_fd_limit)
+    {
+        ps_server->i_fd_limit = (int)s_limit.rlim_cur;
+    }
+
+    ps_server->ns_clients = calloc(ps_server->i_fd_limit,
+        sizeof(struct client));
+    ps_server->ni_members = malloc(sizeof(int) * ps_server->i_fd_limit);
+    ps_server->ni_ready = malloc(sizeof(int) * ps_server->i_fd_limit);
+    ps_server->ni_writable = malloc(sizeof(int) * ps_server->i_fd_limit);
+
+    if (ps_server->ns_clients == NULL || ps_server->ni_members == NULL ||
+        ps_server->ni_ready == NULL || ps_server->ni_writable == NULL ||
+        ps_server->ps_backend->pf_init(ps_server) == -1)
+    {
+        fprintf(stderr, "selectserver: unable to set up %s for %d "
+            "descriptors\n", ps_server->ps_backend->nc_name,
+            ps_server->i_fd_limit);
+        server_close(ps_server);
+
+        return 2;
+    }
+/*                                                                            */
+/* Get a socket and bind to it, and have the backend watch it:                */
+/*                                                                            */
+    ps_server->i_listener = open_a_socket(PORT, BACKLOG);
+
+    if (ps_server->i_listener == -1 ||
+        ps_server->ps_backend->pf_watch(ps_server, ps_server->i_listener) == -1)
+    {
+        server_close(ps_server);
+
+        return 2;
+    }
+/*                                                                            */
+/* Keep track of the biggest file descriptor:                                 */
+/*                                                                            */
+    ps_server->i_fdmax = ps_server->i_listener; // so far, it's this one
+/*                                                                            */
+/* The metrics port is one more descriptor for the backend to watch:          */
+/*                                                                            */
+    if (nc_metrics != NULL)
+    {
+        ps_server->i_metrics = open_a_socket(nc_metrics, BACKLOG);
+
+        if (ps_server->i_metrics == -1 ||
+            ps_server->ps_backend->pf_watch(ps_server,
+            ps_server->i_metrics) == -1)
+        {
+            server_close(ps_server);
+
+            return 2;
+        }
+
+        if (ps_server->i_metrics > ps_server->i_fdmax)
+        {
+            ps_server->i_fdmax = ps_server->i_metrics;
+        }
+
+        ps_server->u64_last_scrape = metrics_clock();
+    }
+
+    printf("selectserver: waiting for connections on port %s with %s%s\n",
+        PORT, ps_server->ps_backend->nc_name,
+        ps_server->i_frame_max > 0 ? " (framed)" : "");
+
+    if (nc_metrics != NULL)
+    {
+        printf("selectserver: metrics on port %s\n", nc_metrics);
+    }
+
+    if (ps_server->l_clients_high > 0)
+    {
+        printf("selectserver: stops accepting at %ld clients, starts again "
+            "at %ld\n", ps_server->l_clients_high, ps_server->l_clients_low);
+    }
+
+    if (ps_server->l_buffered_high > 0)
+    {
+        printf("selectserver: sheds clients over %ld buffered bytes, down to "
+            "%ld\n", ps_server->l_buffered_high, ps_server->l_buffered_low);
+    }
+
+    fflush(stdout);
+/*                                                                            */
+/* Main loop:                                                                 */
+/*                                                                            */
+    for (;;)
+    {
+/*                                                                            */
+/* Wait for sockets to read or, with output queued, to write, no longer than  */
+/* the next timer:                                                            */
+/*                                                                            */
+        i_timeout = timer_timeout(&ps_server->s_wheel);
+
+        errno = 0;
+        i_rv = ps_server->ps_backend->pf_wait(ps_server, i_timeout);
+        i_errno = errno;
+
+        if (i_rv == -1)
+        {
+            if (i_errno == EINTR)
+            {
+                continue;
+            }
+
+            report_error(ps_server->ps_backend->nc_name, i_errno);
+
+            break;
+        }
+
+        ps_server->u64_tick = timer_clock() / TIMER_TICK_MS;
+        u64_woke = ps_server->i_metrics != -1 ? metrics_clock() : 0;
+        i_accept = 0;
+/*                                                                            */
+/* Send what the writable clients have queued first, so their socket buffers  */
+/* have room for what the reads below broadcast:                              */
+/*                                                                            */
+        for (i = 0; i < ps_server->i_writable; i++)
+        {
+            i_fd = ps_server->ni_writable[i];
+
+            if (ps_server->ns_clients[i_fd].i_open)
+            {
+                client_flush(ps_server, i_fd);
+            }
+        }
+/*                                                                            */
+/* Run through the readable sockets.  A client that was dropped earlier in    */
+/* the pass, by a failed flush or a failed send, is no longer open, and new   */
+/* connections are only accepted after the pass, so a descriptor closed in it */
+/* cannot come back as a new client that the ready list still names:          */
+/*                                                                            */
+        for (i = 0; i < ps_server->i_ready; i++)
+        {
+            i_fd = ps_server->ni_ready[i];
+
+            if (i_fd == ps_server->i_listener)
+            {
+                i_accept = 1;
+            }
+            else if (i_fd == ps_server->i_metrics)
+            {
+                metrics_serve(ps_server);
+            }
+            else if (ps_server->ns_clients[i_fd].i_open) // we got one!!
+            {
+                handle_client_data(ps_server, i_fd);
+            }
+        }
+
+        if (i_accept)
+        {
+            accept_new_connection(ps_server);
+        }
+/*                                                                            */
+/* Fire the timers that are due and hold the server to its watermarks:        */
+/*                                                                            */
+        timer_advance(ps_server);
+        overload_check(ps_server);
+
+        if (u64_woke != 0)
+        {
+            metrics_loop(ps_server, u64_woke);
+        }
+    } // END for(;;)--and you thought it would never end!
+/*                                                                            */
+/* Cleanup and exit:                                                          */
+/*                                                                            */
+    while (ps_server->i_clients > 0)
+    {
+        close_client(ps_server, ps_server->ni_members[0]);
+    }
+
+    server_close(ps_server);
+
+    return 3;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Handle the new connections on the listener.  After a restart thousands of  */
+/* clients can be queued on it; each pass of the loop takes up to             */
+/* ACCEPT_BATCH of them instead of one, so a storm costs a wait per batch     */
+/* rather than a wait per connection.  At -C the rest are left in the listen  */
+/* queue and the backend stops watching the listener:                         */
+/*                                                                            */
+void accept_new_connection
+(
+    struct server *ps_server /* both - Server to add the client to            */
+)
+{
+    char                    ac_remoteIP[INET6_ADDRSTRLEN];
+    int                      i_errno;
+    int                      i_lc;
+    int                      i_newfd;      // newly accept()ed socket
+    struct client          *ps_client;
+    struct sockaddr_storage s_remoteaddr; // client address
+    socklen_t               sl_addrlen;
+
+    for (i_lc = 0; i_lc < ACCEPT_BATCH; i_lc++)
+    {
+        if (ps_server->l_clients_high > 0 &&
+            ps_server->i_clients >= ps_server->l_clients_high)
+        {
+            break; // overload_check takes the listener out after the pass
+        }
+
+        sl_addrlen = sizeof(s_remoteaddr);
+/*                                                                            */
+/* Client sockets are non-blocking too: what a send cannot get out now waits  */
+/* in the client's output queue:                                              */
+/*                                                                            */
+        errno = 0;
+        i_newfd = accept4(ps_server->i_listener,
+            (struct sockaddr*)&s_remoteaddr, &sl_addrlen,
+            SOCK_CLOEXEC | SOCK_NONBLOCK);
+        i_errno = errno;
+
+        if (i_newfd == -1 && (i_errno == EAGAIN || i_errno == EWOULDBLOCK))
+        {
+            break; // the queue is empty
+        }
+
+        if (i_newfd == -1 && (i_errno == ECONNABORTED || i_errno == EINTR))
+        {
+            continue;
+        }
+
+        if (i_newfd == -1)
+        {
+            report_error("accept4", i_errno);
+
+            break;
+        }
+
+        ps_server->l_accepts++;
+/*                                                                            */
+/* The client table stops at CLIENT_MAX_LIMIT:                                */
+/*                                                                            */
+        if (i_newfd >= ps_server->i_fd_limit ||
+            ps_server->ps_backend->pf_watch(ps_server, i_newfd) == -1)
+        {
+            fprintf(stderr, "selectserver: %s cannot watch socket %d\n",
+                ps_server->ps_backend->nc_name, i_newfd);
+            close(i_newfd);
+
+            continue;
+        }
+
+        ps_server->ns_clients[i_newfd].i_open = 1;
+        ps_server->ns_clients[i_newfd].i_member = ps_server->i_clients;
+        ps_server->ni_members[ps_server->i_clients++] = i_newfd;
+
+        if (i_newfd > ps_server->i_fdmax) // keep track of the max
+        {
+            ps_server->i_fdmax = i_newfd;
+        }
+/*                                                                            */
+/* Start the client's idle and heartbeat clocks:                              */
+/*                                                                            */
+        ps_client = &ps_server->ns_clients[i_newfd];
+        ps_client->u64_heard = ps_server->u64_tick;
+        ps_client->u64_sent = ps_server->u64_tick;
+        ps_client->s_idle.i_fd = i_newfd;
+        ps_client->s_idle.i_kind = TIMER_IDLE;
+        ps_client->s_beat.i_fd = i_newfd;
+        ps_client->s_beat.i_kind = TIMER_BEAT;
+        ps_client->s_slow.i_fd = i_newfd;
+        ps_client->s_slow.i_kind = TIMER_SLOW;
+
+        if (ps_server->u64_idle > 0)
+        {
+            timer_schedule(&ps_server->s_wheel, &ps_client->s_idle,
+                ps_server->u64_tick + ps_server->u64_idle);
+        }
+
+        if (ps_server->u64_beat > 0)
+        {
+            timer_schedule(&ps_server->s_wheel, &ps_client->s_beat,
+                ps_server->u64_tick + ps_server->u64_beat);
+        }
+
+        printf("selectserver: new connection from %s on socket %d\n",
+            inet_ntop(s_remoteaddr.ss_family,
+                get_in_addr((struct sockaddr*)&s_remoteaddr),
+                ac_remoteIP, INET6_ADDRSTRLEN),
+            i_newfd);
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* epoll backend: an epoll instance the kernel keeps the watched descriptors  */
+/* in, so a wait costs the ready sockets rather than all of them:             */
+/*                                                                            */
+int backend_epoll_init
+(
+    struct server *ps_server /* both - Server to set the backend up for       */
+)
+{
+    ps_server->ns_events = malloc(sizeof(struct epoll_event) * EPOLL_BATCH);
+
+    if (ps_server->ns_events == NULL)
+    {
+        return -1;
+    }
+
+    errno = 0;
+    ps_server->i_epfd = epoll_create1(EPOLL_CLOEXEC);
+
+    if (ps_server->i_epfd == -1)
+    {
+        report_error("epoll_create1", errno);
+
+        return -1;
+    }
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* epoll backend: stop watching a descriptor.  It must still be open:         */
+/*                                                                            */
+void backend_epoll_unwatch
+(
+    struct server *ps_server, /* both - Server watching the descriptor        */
+    int             i_fd      /* in   - Descriptor to stop watching           */
+)
+{
+    epoll_ctl(ps_server->i_epfd, EPOLL_CTL_DEL, i_fd, NULL);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* epoll backend: wait for sockets to read or write.  Up to EPOLL_BATCH come  */
+/* back at once; the watch is level-triggered, so any more are there next     */
+/* pass.  A hang-up or an error counts as readable:                           */
+/*                                                                            */
+int backend_epoll_wait
+(
+    struct server *ps_server, /* both - Server to wait for                    */
+    int             i_timeout /* in   - Longest wait in milliseconds or -1    */
+)
+{
+    uint32_t u32_events;
+    int      i_lc;
+    int      i_rv;
+
+    ps_server->i_ready = 0;
+    ps_server->i_writable = 0;
+
+    i_rv = epoll_wait(ps_server->i_epfd, ps_server->ns_events, EPOLL_BATCH,
+        i_timeout);
+
+    for (i_lc = 0; i_lc < i_rv; i_lc++)
+    {
+        u32_events = ps_server->ns_events[i_lc].events;
+
+        if (u32_events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+        {
+            ps_server->ni_ready[ps_server->i_ready++] =
+                ps_server->ns_events[i_lc].data.fd;
+        }
+
+        if (u32_events & EPOLLOUT)
+        {
+            ps_server->ni_writable[ps_server->i_writable++] =
+                ps_server->ns_events[i_lc].data.fd;
+        }
+    }
+
+    return i_rv;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* epoll backend: watch a descriptor for reading.  Returns 0 or -1:           */
+/*                                                                            */
+int backend_epoll_watch
+(
+    struct server *ps_server, /* both - Server to watch the descriptor for    */
+    int             i_fd      /* in   - Descriptor to watch                   */
+)
+{
+    struct epoll_event s_event;
+
+    memset(&s_event, 0, sizeof(s_event));
+    s_event.events = EPOLLIN;
+    s_event.data.fd = i_fd;
+
+    errno = 0;
+
+    if (epoll_ctl(ps_server->i_epfd, EPOLL_CTL_ADD, i_fd, &s_event) == -1)
+    {
+        report_error("epoll_ctl", errno);
+
+        return -1;
+    }
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* epoll backend: watch a client for writing as well as reading, or stop:     */
+/*                                                                            */
+void backend_epoll_writing
+(
+    struct server *ps_server, /* both - Server watching the descriptor        */
+    int             i_fd,     /* in   - Client with output queued or not      */
+    int             i_on      /* in   - 1 to watch for writing, 0 to stop     */
+)
+{
+    struct epoll_event s_event;
+
+    memset(&s_event, 0, sizeof(s_event));
+    s_event.events = EPOLLIN | (i_on ? EPOLLOUT : 0);
+    s_event.data.fd = i_fd;
+
+    errno = 0;
+
+    if (epoll_ctl(ps_server->i_epfd, EPOLL_CTL_MOD, i_fd, &s_event) == -1)
+    {
+        report_error("epoll_ctl", errno);
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Find the backend -e names.  Returns it, or NULL if there is none:          */
+/*                                                                            */
+struct backend *backend_find
+(
+    char *nc_name /* in   - select, poll or epoll                             */
+)
+{
+    int i_lc;
+
+    for (i_lc = 0; i_lc < (int)(sizeof(gas_backends) /
+        sizeof(gas_backends[0])); i_lc++)
+    {
+        if (strcmp(nc_name, gas_backends[i_lc].nc_name) == 0)
+        {
+            return &gas_backends[i_lc];
+        }
+    }
+
+    return NULL;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* poll backend: a dense array of pollfds, one per watched descriptor, and    */
+/* each descriptor's index in it so one can be taken out without a search:    */
+/*                                                                            */
+int backend_poll_init
+(
+    struct server *ps_server /* both - Server to set the backend up for       */
+)
+{
+    int i_lc;
+
+    ps_server->ns_pollfds = malloc(sizeof(struct pollfd) *
+        ps_server->i_fd_limit);
+    ps_server->ni_pollslot = malloc(sizeof(int) * ps_server->i_fd_limit);
+
+    if (ps_server->ns_pollfds == NULL || ps_server->ni_pollslot == NULL)
+    {
+        return -1;
+    }
+
+    for (i_lc = 0; i_lc < ps_server->i_fd_limit; i_lc++)
+    {
+        ps_server->ni_pollslot[i_lc] = -1;
+    }
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* poll backend: stop watching a descriptor.  The last pollfd moves into its  */
+/* place, so the array stays dense:                                           */
+/*                                                                            */
+void backend_poll_unwatch
+(
+    struct server *ps_server, /* both - Server watching the descriptor        */
+    int             i_fd      /* in   - Descriptor to stop watching           */
+)
+{
+    int i_last;
+    int i_slot;
+
+    i_slot = ps_server->ni_pollslot[i_fd];
+
+    if (i_slot == -1)
+    {
+        return;
+    }
+
+    i_last = --ps_server->i_npollfds;
+    ps_server->ns_pollfds[i_slot] = ps_server->ns_pollfds[i_last];
+    ps_server->ni_pollslot[ps_server->ns_pollfds[i_slot].fd] = i_slot;
+    ps_server->ni_pollslot[i_fd] = -1;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* poll backend: wait for sockets to read or write.  A hang-up or an error    */
+/* counts as readable; the read that follows finds out which:                 */
+/*                                                                            */
+int backend_poll_wait
+(
+    struct server *ps_server, /* both - Server to wait for                    */
+    int             i_timeout /* in   - Longest wait in milliseconds or -1    */
+)
+{
+    short s_revents;
+    int   i_found;    // pollfds with revents set so far
+    int   i_lc;
+    int   i_rv;
+
+    ps_server->i_ready = 0;
+    ps_server->i_writable = 0;
+    i_found = 0;
+
+    i_rv = poll(ps_server->ns_pollfds, ps_server->i_npollfds, i_timeout);
+
+    for (i_lc = 0; i_lc < ps_server->i_npollfds && i_found < i_rv; i_lc++)
+    {
+        s_revents = ps_server->ns_pollfds[i_lc].revents;
+
+        if (s_revents == 0)
+        {
+            continue;
+        }
+
+        i_found++;
+
+        if (s_revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL))
+        {
+            ps_server->ni_ready[ps_server->i_ready++] =
+                ps_server->ns_pollfds[i_lc].fd;
+        }
+
+        if (s_revents & POLLOUT)
+        {
+            ps_server->ni_writable[ps_server->i_writable++] =
+                ps_server->ns_pollfds[i_lc].fd;
+        }
+    }
+
+    return i_rv;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* poll backend: watch a descriptor for reading.  Returns 0:                  */
+/*                                                                            */
+int backend_poll_watch
+(
+    struct server *ps_server, /* both - Server to watch the descriptor for    */
+    int             i_fd      /* in   - Descriptor to watch                   */
+)
+{
+    int i_slot;
+
+    i_slot = ps_server->i_npollfds++;
+    ps_server->ns_pollfds[i_slot].fd = i_fd;
+    ps_server->ns_pollfds[i_slot].events = POLLIN;
+    ps_server->ns_pollfds[i_slot].revents = 0;
+    ps_server->ni_pollslot[i_fd] = i_slot;
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* poll backend: watch a client for writing as well as reading, or stop:      */
+/*                                                                            */
+void backend_poll_writing
+(
+    struct server *ps_server, /* both - Server watching the descriptor        */
+    int             i_fd,     /* in   - Client with output queued or not      */
+    int             i_on      /* in   - 1 to watch for writing, 0 to stop     */
+)
+{
+    struct pollfd *ps_pollfd;
+
+    ps_pollfd = &ps_server->ns_pollfds[ps_server->ni_pollslot[i_fd]];
+    ps_pollfd->events = POLLIN | (i_on ? POLLOUT : 0);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* select backend: master bitmaps of the descriptors watched for reading and  */
+/* for writing, copied for each wait.  They are sized for every descriptor    */
+/* the process can have rather than FD_SETSIZE; the kernel takes any nfds, it */
+/* is only the fd_set type that stops at 1024.  The words have the same       */
+/* layout as fd_set's longs on 64-bit Linux, bit fd % 64 of word fd / 64:     */
+/*                                                                            */
+int backend_select_init
+(
+    struct server *ps_server /* both - Server to set the backend up for       */
+)
+{
+    ps_server->i_words = (ps_server->i_fd_limit + 63) / 64;
+    ps_server->nu64_master = calloc(ps_server->i_words, sizeof(uint64_t));
+    ps_server->nu64_read = calloc(ps_server->i_words, sizeof(uint64_t));
+    ps_server->nu64_write_master = calloc(ps_server->i_words,
+        sizeof(uint64_t));
+    ps_server->nu64_write = calloc(ps_server->i_words, sizeof(uint64_t));
+
+    if (ps_server->nu64_master == NULL || ps_server->nu64_read == NULL ||
+        ps_server->nu64_write_master == NULL || ps_server->nu64_write == NULL)
+    {
+        return -1;
+    }
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* select backend: stop watching a descriptor, for writing too:               */
+/*                                                                            */
+void backend_select_unwatch
+(
+    struct server *ps_server, /* both - Server watching the descriptor        */
+    int             i_fd      /* in   - Descriptor to stop watching           */
+)
+{
+    ps_server->nu64_master[i_fd / 64] &= ~(1ULL << (i_fd % 64));
+    backend_select_writing(ps_server, i_fd, 0);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* select backend: copy the words of the master bitmaps up to i_fdmax to the  */
+/* working ones and select on those, the write set only while some client has */
+/* output queued.  The ready descriptors are found a word at a time: empty    */
+/* words are skipped whole and count-trailing-zeros takes each set bit in     */
+/* turn, so the scan costs the ready sockets plus one test per 64 descriptors */
+/* instead of a test per descriptor:                                          */
+/*                                                                            */
+int backend_select_wait
+(
+    struct server *ps_server, /* both - Server to wait for                    */
+    int             i_timeout /* in   - Longest wait in milliseconds or -1    */
+)
+{
+    struct timeval s_tv;
+    uint64_t       u64_word;
+    int            i_used;     // Words up to i_fdmax
+    int            i_lc;
+    int            i_rv;
+
+    ps_server->i_ready = 0;
+    ps_server->i_writable = 0;
+    i_used = ps_server->i_fdmax / 64 + 1;
+    memcpy(ps_server->nu64_read, ps_server->nu64_master,
+        sizeof(uint64_t) * i_used);
+
+    if (ps_server->i_writers > 0)
+    {
+        memcpy(ps_server->nu64_write, ps_server->nu64_write_master,
+            sizeof(uint64_t) * i_used);
+    }
+
+    if (i_timeout != -1)
+    {
+        s_tv.tv_sec = i_timeout / 1000;
+        s_tv.tv_usec = (i_timeout % 1000) * 1000;
+    }
+
+    i_rv = select(ps_server->i_fdmax + 1, (fd_set*)ps_server->nu64_read,
+        ps_server->i_writers > 0 ? (fd_set*)ps_server->nu64_write : NULL,
+        NULL, i_timeout == -1 ? NULL : &s_tv);
+
+    for (i_lc = 0; i_lc < i_used &&
+        ps_server->i_ready + ps_server->i_writable < i_rv; i_lc++)
+    {
+        u64_word = ps_server->nu64_read[i_lc];
+
+        while (u64_word != 0)
+        {
+            ps_server->ni_ready[ps_server->i_ready++] = i_lc * 64 +
+                __builtin_ctzll(u64_word);
+            u64_word &= u64_word - 1; // clear the lowest set bit
+        }
+
+        if (ps_server->i_writers == 0)
+        {
+            continue;
+        }
+
+        u64_word = ps_server->nu64_write[i_lc];
+
+        while (u64_word != 0)
+        {
+            ps_server->ni_writable[ps_server->i_writable++] = i_lc * 64 +
+                __builtin_ctzll(u64_word);
+            u64_word &= u64_word - 1;
+        }
+    }
+
+    return i_rv;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* select backend: watch a descriptor for reading.  Returns 0:                */
+/*                                                                            */
+int backend_select_watch
+(
+    struct server *ps_server, /* both - Server to watch the descriptor for    */
+    int             i_fd      /* in   - Descriptor to watch                   */
+)
+{
+    ps_server->nu64_master[i_fd / 64] |= 1ULL << (i_fd % 64);
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* select backend: watch a client for writing as well as reading, or stop.    */
+/* i_writers counts the bits set, so a wait with no output queued anywhere    */
+/* leaves the write set out:                                                  */
+/*                                                                            */
+void backend_select_writing
+(
+    struct server *ps_server, /* both - Server watching the descriptor        */
+    int             i_fd,     /* in   - Client with output queued or not      */
+    int             i_on      /* in   - 1 to watch for writing, 0 to stop     */
+)
+{
+    uint64_t *pu64_word;
+    uint64_t   u64_bit;
+
+    pu64_word = &ps_server->nu64_write_master[i_fd / 64];
+    u64_bit = 1ULL << (i_fd % 64);
+
+    if (i_on && !(*pu64_word & u64_bit))
+    {
+        *pu64_word |= u64_bit;
+        ps_server->i_writers++;
+    }
+    else if (!i_on && (*pu64_word & u64_bit))
+    {
+        *pu64_word &= ~u64_bit;
+        ps_server->i_writers--;
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Send a message to every client except the sender.  The recipients come     */
+/* from the dense member list, not a scan of every descriptor.  It is walked  */
+/* from the end: a client that fails its send is closed and the last member   */
+/* takes its place, and that one has already had the message:                 */
+/*                                                                            */
+void broadcast_message
+(
+    struct server *ps_server, /* both - Server holding the clients            */
+    int             i_sender, /* in   - Socket the message came from          */
+    char          *nc_buf,    /* in   - Message                               */
+    int             i_nbytes  /* in   - Length of the message                 */
+)
+{
+    int i_fd;
+    int j;
+
+    for (j = ps_server->i_clients - 1; j >= 0; j--) // send to everyone!
+    {
+        i_fd = ps_server->ni_members[j];
+
+        if (i_fd != i_sender)
+        {
+            client_send(ps_server, i_fd, nc_buf, i_nbytes);
+            ps_server->l_deliveries++;
+        }
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Send what a writable client has queued.  Once the queue is empty the       */
+/* backend stops watching it for writing, the slow-reader clock stops and a   */
+/* buffer that grew for a backlog is given back.  Returns 0, or -1 if the     */
+/* send failed and the client was closed:                                     */
+/*                                                                            */
+int client_flush
+(
+    struct server *ps_server, /* both - Server holding the client             */
+    int             i_fd      /* in   - Client whose socket can be written    */
+)
+{
+    struct client *ps_client;
+    int             i_errno;
+    int             i_rv;
+
+    ps_client = &ps_server->ns_clients[i_fd];
+
+    errno = 0;
+    i_rv = send(i_fd, ps_client->nc_out + ps_client->i_out_off,
+        ps_client->i_out_len, MSG_NOSIGNAL);
+    i_errno = errno;
+
+    if (i_rv == -1 && (i_errno == EAGAIN || i_errno == EWOULDBLOCK))
+    {
+        return 0;
+    }
+
+    if (i_rv == -1)
+    {
+        ps_server->l_send_errors++;
+        report_error("send", i_errno);
+        close_client(ps_server, i_fd);
+
+        return -1;
+    }
+
+    ps_server->l_bytes_out += i_rv;
+    ps_client->i_out_off += i_rv;
+    ps_client->i_out_len -= i_rv;
+
+    if (ps_client->i_out_len > 0)
+    {
+        return 0;
+    }
+
+    ps_client->i_out_off = 0;
+    ps_server->ps_backend->pf_writing(ps_server, i_fd, 0);
+    timer_cancel(&ps_server->s_wheel, &ps_client->s_slow);
+
+    if (ps_client->i_out_size > FRAME_KEEP)
+    {
+        ps_server->l_buffered -= ps_client->i_out_size;
+        free(ps_client->nc_out);
+        ps_client->nc_out = NULL;
+        ps_client->i_out_size = 0;
+    }
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Framed mode: broadcast every complete frame in a client's input buffer and */
+/* keep the partial one at the end for the next read.  Each frame goes out    */
+/* whole, header included; empty frames are keep-alives and go nowhere.       */
+/* Returns 0, or -1 if the client sent a frame larger than i_frame_max:       */
+/*                                                                            */
+int client_reassemble
+(
+    struct server *ps_server, /* both - Server holding the clients            */
+    int             i_fd      /* in   - Client whose input is complete        */
+)
+{
+    struct client *ps_client;
+    unsigned char *nuc_header;
+    int             i_frame;
+    int             i_pos;
+    uint32_t        u32_len;
+
+    ps_client = &ps_server->ns_clients[i_fd];
+    i_pos = 0;
+
+    while (ps_client->i_in_len - i_pos >= FRAME_HEADER)
+    {
+        nuc_header = (unsigned char*)ps_client->nc_in + i_pos;
+        u32_len = (uint32_t)nuc_header[0] << 24 |
+            (uint32_t)nuc_header[1] << 16 |
+            (uint32_t)nuc_header[2] << 8 | (uint32_t)nuc_header[3];
+
+        if (u32_len > (uint32_t)ps_server->i_frame_max)
+        {
+            fprintf(stderr, "selectserver: socket %d sent a %u byte frame, "
+                "limit is %d\n", i_fd, u32_len, ps_server->i_frame_max);
+
+            return -1;
+        }
+
+        i_frame = FRAME_HEADER + (int)u32_len;
+
+        if (ps_client->i_in_len - i_pos < i_frame)
+        {
+            break; // The rest has not arrived yet
+        }
+
+        if (u32_len > 0)
+        {
+            ps_server->l_messages++;
+            broadcast_message(ps_server, i_fd, ps_client->nc_in + i_pos,
+                i_frame);
+        }
+
+        i_pos += i_frame;
+    }
+/*                                                                            */
+/* Move the partial frame to the front.  A buffer that grew for a big frame   */
+/* is given back once it is empty:                                            */
+/*                                                                            */
+    ps_client->i_in_len -= i_pos;
+
+    if (ps_client->i_in_len > 0 && i_pos > 0)
+    {
+        memmove(ps_client->nc_in, ps_client->nc_in + i_pos,
+            ps_client->i_in_len);
+    }
+    else if (ps_client->i_in_len == 0 && ps_client->i_in_size > FRAME_KEEP)
+    {
+        ps_server->l_buffered -= ps_client->i_in_size;
+        free(ps_client->nc_in);
+        ps_client->nc_in = NULL;
+        ps_client->i_in_size = 0;
+    }
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Make sure one of a client's buffers, input or output, holds at least       */
+/* i_size bytes.  Returns 0 or -1 if there is no memory:                      */
+/*                                                                            */
+int client_reserve
+(
+    struct server *ps_server, /* both - Server that counts the bytes (-Q)     */
+    char        **pnc_buf,    /* both - Buffer that may grow                  */
+    int           *pi_size,   /* both - Bytes allocated for it                */
+    int             i_size    /* in   - Bytes needed                          */
+)
+{
+    char *nc_buf;
+    int    i_new_size;
+
+    if (*pi_size >= i_size)
+    {
+        return 0;
+    }
+
+    i_new_size = *pi_size > 0 ? *pi_size : MESSAGE_MAX;
+
+    while (i_new_size < i_size)
+    {
+        i_new_size *= 2;
+    }
+
+    nc_buf = realloc(*pnc_buf, i_new_size);
+
+    if (nc_buf == NULL)
+    {
+        fprintf(stderr, "selectserver: no memory for a client's buffer\n");
+
+        return -1;
+    }
+
+    ps_server->l_buffered += i_new_size - *pi_size;
+    *pnc_buf = nc_buf;
+    *pi_size = i_new_size;
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Send to one client without blocking.  A client with nothing queued gets    */
+/* the message straight away; whatever its socket will not take, or all of it */
+/* if earlier output is still queued, goes on the end of its output queue and */
+/* the backend watches it for writing.  A client already behind that the      */
+/* message would take past -q is not reading; it is closed.  Returns 0, or -1 */
+/* if the client is gone:                                                     */
+/*                                                                            */
+int client_send
+(
+    struct server *ps_server, /* both - Server holding the client             */
+    int             i_fd,     /* in   - Client to send to                     */
+    char          *nc_buf,    /* in   - Message                               */
+    int             i_nbytes  /* in   - Length of the message                 */
+)
+{
+    struct client *ps_client;
+    int             i_errno;
+    int             i_rv;
+
+    ps_client = &ps_server->ns_clients[i_fd];
+    ps_client->u64_sent = ps_server->u64_tick;
+    i_rv = 0;
+
+    if (ps_client->i_out_len == 0)
+    {
+        errno = 0;
+        i_rv = send(i_fd, nc_buf, i_nbytes, MSG_NOSIGNAL);
+        i_errno = errno;
+
+        if (i_rv == -1 && i_errno != EAGAIN && i_errno != EWOULDBLOCK)
+        {
+            ps_server->l_send_errors++;
+            report_error("send", i_errno);
+
+            return 0; // the read that follows finds out what happened
+        }
+
+        if (i_rv == -1)
+        {
+            i_rv = 0;
+        }
+
+        ps_server->l_bytes_out += i_rv;
+
+        if (i_rv == i_nbytes)
+        {
+            return 0;
+        }
+    }
+
+    if (ps_server->l_queue_max > 0 && ps_client->i_out_len > 0 &&
+        (long)ps_client->i_out_len + i_nbytes > ps_server->l_queue_max)
+    {
+        printf("selectserver: socket %d has %d bytes queued, over -q, "
+            "closing\n", i_fd, ps_client->i_out_len);
+        ps_server->l_send_errors++;
+        close_client(ps_server, i_fd);
+
+        return -1;
+    }
+/*                                                                            */
+/* Queue the rest.  The unsent bytes are moved to the front first if that     */
+/* makes room, so the buffer only grows when the queue does:                  */
+/*                                                                            */
+    if (ps_client->i_out_off + ps_client->i_out_len + i_nbytes - i_rv >
+        ps_client->i_out_size && ps_client->i_out_off > 0)
+    {
+        memmove(ps_client->nc_out, ps_client->nc_out + ps_client->i_out_off,
+            ps_client->i_out_len);
+        ps_client->i_out_off = 0;
+    }
+
+    if (client_reserve(ps_server, &ps_client->nc_out, &ps_client->i_out_size,
+        ps_client->i_out_off + ps_client->i_out_len + i_nbytes - i_rv) == -1)
+    {
+        ps_server->l_send_errors++;
+        close_client(ps_server, i_fd);
+
+        return -1;
+    }
+
+    memcpy(ps_client->nc_out + ps_client->i_out_off + ps_client->i_out_len,
+        nc_buf + i_rv, i_nbytes - i_rv);
+/*                                                                            */
+/* The queue was empty: start watching for the socket to drain and start the  */
+/* slow-reader clock:                                                         */
+/*                                                                            */
+    if (ps_client->i_out_len == 0)
+    {
+        ps_server->ps_backend->pf_writing(ps_server, i_fd, 1);
+
+        if (ps_server->u64_slow > 0)
+        {
+            timer_schedule(&ps_server->s_wheel, &ps_client->s_slow,
+                ps_server->u64_tick + ps_server->u64_slow);
+        }
+    }
+
+    ps_client->i_out_len += i_nbytes - i_rv;
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Close a client and forget everything about it.  The last member moves into */
+/* its place in the member list:                                              */
+/*                                                                            */
+void close_client
+(
+    struct server *ps_server, /* both - Server holding the client             */
+    int             i_fd      /* in   - Client to close                       */
+)
+{
+    struct client *ps_client;
+    int             i_last;
+
+    ps_client = &ps_server->ns_clients[i_fd];
+
+    i_last = ps_server->ni_members[--ps_server->i_clients];
+    ps_server->ni_members[ps_client->i_member] = i_last;
+    ps_server->ns_clients[i_last].i_member = ps_client->i_member;
+
+    timer_cancel(&ps_server->s_wheel, &ps_client->s_idle);
+    timer_cancel(&ps_server->s_wheel, &ps_client->s_beat);
+    timer_cancel(&ps_server->s_wheel, &ps_client->s_slow);
+    ps_server->l_buffered -= ps_client->i_in_size + ps_client->i_out_size;
+    free(ps_client->nc_in);
+    free(ps_client->nc_out);
+    memset(ps_client, 0, sizeof(*ps_client));
+
+    ps_server->ps_backend->pf_unwatch(ps_server, i_fd);
+    close(i_fd); // bye!
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* get sockaddr, IPv4 or IPv6:                                                */
+/*                                                                            */
+void *get_in_addr
+(
+    struct sockaddr *sa
+)
+{
+    if (sa->sa_family == AF_INET)
+    {
+        return &(((struct sockaddr_in*)sa)->sin_addr);
+    }
+
+    return &(((struct sockaddr_in6*)sa)->sin6_addr);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Read from a client and pass what arrived on to everyone else:              */
+/*                                                                            */
+void handle_client_data
+(
+    struct server *ps_server, /* both - Server holding the client             */
+    int             i_fd      /* in   - Client with data to read              */
+)
+{
+    char            ac_buf[MESSAGE_MAX]; // buffer for client data
+    char          *nc_buf;
+    int             i_errno;
+    int             i_nbytes;
+    int             i_size;
+    struct client *ps_client;
+
+    ps_client = &ps_server->ns_clients[i_fd];
+/*                                                                            */
+/* Framed mode reads onto the end of the client's input buffer:               */
+/*                                                                            */
+    if (ps_server->i_frame_max > 0)
+    {
+        if (client_reserve(ps_server, &ps_client->nc_in,
+            &ps_client->i_in_size, ps_client->i_in_len + MESSAGE_MAX) == -1)
+        {
+            return;
+        }
+
+        nc_buf = ps_client->nc_in + ps_client->i_in_len;
+        i_size = ps_client->i_in_size - ps_client->i_in_len;
+    }
+    else
+    {
+        nc_buf = ac_buf;
+        i_size = sizeof(ac_buf);
+    }
+
+    errno = 0;
+    i_nbytes = recv(i_fd, nc_buf, i_size, 0);
+    i_errno = errno;
+
+    if (i_nbytes == -1 && (i_errno == EAGAIN || i_errno == EWOULDBLOCK))
+    {
+        return; // nothing to read after all
+    }
+
+    if (i_nbytes <= 0) // got error or connection closed by client
+    {
+        if (i_nbytes == 0) // connection closed
+        {
+            printf("selectserver: socket %d hung up\n", i_fd);
+        }
+        else
+        {
+            report_error("recv", i_errno);
+        }
+
+        close_client(ps_server, i_fd);
+
+        return;
+    }
+
+    ps_client->u64_heard = ps_server->u64_tick;
+    ps_server->l_bytes_in += i_nbytes;
+
+    if (ps_server->i_frame_max == 0) // we got some data from a client
+    {
+        ps_server->l_messages++;
+        broadcast_message(ps_server, i_fd, ac_buf, i_nbytes);
+
+        return;
+    }
+
+    ps_client->i_in_len += i_nbytes;
+
+    if (client_reassemble(ps_server, i_fd) == -1)
+    {
+        close_client(ps_server, i_fd);
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* The monotonic clock in nanoseconds, for timing loop passes:                */
+/*                                                                            */
+uint64_t metrics_clock
+(
+    void
+)
+{
+    struct timespec s_now;
+
+    clock_gettime(CLOCK_MONOTONIC, &s_now);
+
+    return (uint64_t)s_now.tv_sec * 1000000000 + (uint64_t)s_now.tv_nsec;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Count one loop pass in the histogram.  Bucket k holds passes of under 2^k  */
+/* microseconds and at least half that; the last one the rest:                */
+/*                                                                            */
+void metrics_loop
+(
+    struct server *ps_server, /* both - Server that finished a pass           */
+    uint64_t       u64_woke   /* in   - metrics_clock when the wait returned  */
+)
+{
+    uint64_t u64_usec;
+    int      i_bucket;
+
+    u64_usec = (metrics_clock() - u64_woke) / 1000;
+    i_bucket = u64_usec == 0 ? 0 : 64 - __builtin_clzll(u64_usec);
+
+    if (i_bucket > METRICS_BUCKETS - 1)
+    {
+        i_bucket = METRICS_BUCKETS - 1;
+    }
+
+    ps_server->al_loop_hist[i_bucket]++;
+    ps_server->l_loop_usec += (long)u64_usec;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Answer a connection on the metrics port (-S) with the current numbers in   */
+/* the Prometheus text format and close it.  A request that starts with GET   */
+/* gets an HTTP response, so curl and a Prometheus scraper work as well as    */
+/* nc.  This runs in the loop, between clients, so a scraper only gets        */
+/* METRICS_WAIT_MS to send its request and the answer must fit in the socket  */
+/* buffer; it is a few kilobytes:                                             */
+/*                                                                            */
+void metrics_serve
+(
+    struct server *ps_server /* both - Server to report on                    */
+)
+{
+    char            ac_header[128];
+    char            ac_request[1024];
+    struct pollfd   s_pfd;
+    FILE           *ps_text;
+    char           *nc_text;
+    size_t          st_text;
+    int             i_errno;
+    int             i_header;
+    int             i_request;
+    int             i_sockfd;
+
+    errno = 0;
+    i_sockfd = accept4(ps_server->i_metrics, NULL, NULL,
+        SOCK_CLOEXEC | SOCK_NONBLOCK);
+    i_errno = errno;
+
+    if (i_sockfd == -1)
+    {
+        if (i_errno != EAGAIN && i_errno != EWOULDBLOCK &&
+            i_errno != ECONNABORTED && i_errno != EINTR)
+        {
+            report_error("accept4", i_errno);
+        }
+
+        return;
+    }
+/*                                                                            */
+/* nc may send nothing at all, so a scraper that stays quiet still gets the   */
+/* numbers once the wait is up:                                               */
+/*                                                                            */
+    s_pfd.fd = i_sockfd;
+    s_pfd.events = POLLIN;
+    i_request = 0;
+
+    if (poll(&s_pfd, 1, METRICS_WAIT_MS) == 1)
+    {
+        i_request = (int)recv(i_sockfd, ac_request, sizeof(ac_request), 0);
+    }
+
+    nc_text = NULL;
+    st_text = 0;
+    ps_text = open_memstream(&nc_text, &st_text);
+
+    if (ps_text == NULL)
+    {
+        report_error("open_memstream", errno);
+        close(i_sockfd);
+
+        return;
+    }
+
+    metrics_write(ps_text, ps_server);
+    fclose(ps_text);
+
+    if (i_request >= 4 && memcmp(ac_request, "GET ", 4) == 0)
+    {
+        i_header = snprintf(ac_header, sizeof(ac_header),
+            "HTTP/1.0 200 OK\r\nContent-Type: text/plain; "
+            "version=0.0.4\r\nContent-Length: %zu\r\n\r\n", st_text);
+        send(i_sockfd, ac_header, i_header, MSG_NOSIGNAL);
+    }
+
+    send(i_sockfd, nc_text, st_text, MSG_NOSIGNAL);
+
+    free(nc_text);
+    close(i_sockfd);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Write every metric, with the names PollServer uses.  The queue depth is    */
+/* what the clients' output queues hold, not what the kernel has yet to send. */
+/* Accepts a second are worked out over the time since the last scrape, or    */
+/* since the server started:                                                  */
+/*                                                                            */
+void metrics_write
+(
+    FILE          *ps_text,  /* out  - Where the text goes                    */
+    struct server *ps_server /* both - Server to report on                    */
+)
+{
+    long     l_count;
+    long     l_queued;
+    uint64_t u64_now;
+    int      i_bucket;
+    int      i_lc;
+    int      i_queued_clients;
+    int      i_unsent;
+
+    l_queued = 0;
+    i_queued_clients = 0;
+
+    for (i_lc = 0; i_lc < ps_server->i_clients; i_lc++)
+    {
+        i_unsent = ps_server->ns_clients[ps_server->ni_members[i_lc]].i_out_len;
+
+        if (i_unsent > 0)
+        {
+            l_queued += i_unsent;
+            i_queued_clients++;
+        }
+    }
+
+    fprintf(ps_text,
+        "# HELP chat_connections Clients connected now\n"
+        "# TYPE chat_connections gauge\n"
+        "chat_connections %d\n"
+        "# HELP chat_accepts_total Connections accepted\n"
+        "# TYPE chat_accepts_total counter\n"
+        "chat_accepts_total %ld\n"
+        "# HELP chat_bytes_in_total Bytes received from clients\n"
+        "# TYPE chat_bytes_in_total counter\n"
+        "chat_bytes_in_total %ld\n"
+        "# HELP chat_bytes_out_total Bytes sent to clients\n"
+        "# TYPE chat_bytes_out_total counter\n"
+        "chat_bytes_out_total %ld\n"
+        "# HELP chat_messages_total Messages received from clients\n"
+        "# TYPE chat_messages_total counter\n"
+        "chat_messages_total %ld\n"
+        "# HELP chat_deliveries_total Copies of messages sent to clients\n"
+        "# TYPE chat_deliveries_total counter\n"
+        "chat_deliveries_total %ld\n"
+        "# HELP chat_send_errors_total Sends that failed or timed out\n"
+        "# TYPE chat_send_errors_total counter\n"
+        "chat_send_errors_total %ld\n"
+        "# HELP chat_queued_bytes Bytes waiting to go out to clients\n"
+        "# TYPE chat_queued_bytes gauge\n"
+        "chat_queued_bytes %ld\n"
+        "# HELP chat_queued_clients Clients with bytes waiting to go out\n"
+        "# TYPE chat_queued_clients gauge\n"
+        "chat_queued_clients %d\n"
+        "# HELP chat_buffered_bytes Bytes held in partial frames and output "
+        "queues\n"
+        "# TYPE chat_buffered_bytes gauge\n"
+        "chat_buffered_bytes %ld\n"
+        "# HELP chat_shed_clients_total Clients dropped to get under -Q\n"
+        "# TYPE chat_shed_clients_total counter\n"
+        "chat_shed_clients_total %ld\n"
+        "# HELP chat_accept_paused 1 while the listener is not watched\n"
+        "# TYPE chat_accept_paused gauge\n"
+        "chat_accept_paused %d\n",
+        ps_server->i_clients, ps_server->l_accepts, ps_server->l_bytes_in,
+        ps_server->l_bytes_out, ps_server->l_messages,
+        ps_server->l_deliveries, ps_server->l_send_errors, l_queued,
+        i_queued_clients, ps_server->l_buffered, ps_server->l_sheds,
+        ps_server->i_paused);
+
+    u64_now = metrics_clock();
+
+    fprintf(ps_text, "# HELP chat_accepts_per_second Connections accepted a "
+        "second since the last scrape\n"
+        "# TYPE chat_accepts_per_second gauge\n"
+        "chat_accepts_per_second %.1f\n", u64_now > ps_server->u64_last_scrape ?
+        (double)(ps_server->l_accepts - ps_server->l_last_accepts) * 1e9 /
+        (u64_now - ps_server->u64_last_scrape) : 0.0);
+
+    ps_server->l_last_accepts = ps_server->l_accepts;
+    ps_server->u64_last_scrape = u64_now;
+/*                                                                            */
+/* The loop pass histogram.  Prometheus buckets count everything at or under  */
+/* their bound, so the counts add up as they go:                              */
+/*                                                                            */
+    fprintf(ps_text, "# HELP chat_loop_seconds Time from the wait returning "
+        "to it being called again\n# TYPE chat_loop_seconds histogram\n");
+
+    l_count = 0;
+
+    for (i_bucket = 0; i_bucket < METRICS_BUCKETS - 1; i_bucket++)
+    {
+        l_count += ps_server->al_loop_hist[i_bucket];
+        fprintf(ps_text, "chat_loop_seconds_bucket{le=\"%.7g\"} %ld\n",
+            (double)(1L << i_bucket) / 1e6, l_count);
+    }
+
+    l_count += ps_server->al_loop_hist[METRICS_BUCKETS - 1];
+
+    fprintf(ps_text, "chat_loop_seconds_bucket{le=\"+Inf\"} %ld\n"
+        "chat_loop_seconds_sum %.6f\nchat_loop_seconds_count %ld\n", l_count,
+        ps_server->l_loop_usec / 1e6, l_count);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Open a listening socket on the specified port:                             */
+/*                                                                            */
+int open_a_socket
+(
+    char *nc_port,   /* in   - Port to use for connection                     */
+    int    i_backlog /* in   - Number of pending connections queue will hold  */
+)
+{
+    struct addrinfo *ps_address;
+    int               i_errno;
+    struct addrinfo   s_hints;
+    int               i_rv;
+    struct addrinfo *ps_servinfo;
+    int               i_sockfd;
+    int               i_yes;
+/*                                                                            */
+/* Get a list of possible connections:                                        */
+/*                                                                            */
+    memset(&s_hints, 0, sizeof(s_hints));
+    s_hints.ai_family = AF_UNSPEC;
+    s_hints.ai_socktype = SOCK_STREAM;
+    s_hints.ai_flags = AI_PASSIVE; // use my IP
+
+    i_rv = getaddrinfo(NULL, nc_port, &s_hints, &ps_servinfo);
+
+    if (i_rv != 0)
+    {
+        fprintf(stderr, "getaddrinfo failed with code %d.\n", i_rv);
+        fprintf(stderr, "%s\n", gai_strerror(i_rv));
+
+        return -1;
+    }
+/*                                                                            */
+/* Loop through all the results and bind to the first we can:                 */
+/*                                                                            */
+    i_sockfd = -1;
+
+    for (ps_address = ps_servinfo;
+        ps_address != NULL;
+        ps_address = ps_address->ai_next)
+    {
+        /* Attempt to open the socket:                                                */
+        i_sockfd = socket(ps_address->ai_family, ps_address->ai_socktype,
+            ps_address->ai_protocol);
+
+        if (i_sockfd == -1)
+        {
+            continue;
+        }
+        /* Allow reuse of the socket:                                                 */
+        i_yes = 1;
+        errno = 0;
+        i_rv = setsockopt(i_sockfd, SOL_SOCKET, SO_REUSEADDR, &i_yes,
+            sizeof(int));
+        i_errno = errno;
+
+        if (i_rv == -1)
+        {
+            report_error("setsockopt", i_errno);
+            close(i_sockfd);
+            freeaddrinfo(ps_servinfo);
+
+            return -1;
+        }
+        /* Bind to the socket:                                                        */
+        i_rv = bind(i_sockfd, ps_address->ai_addr, ps_address->ai_addrlen);
+
+        if (i_rv == -1)
+        {
+            close(i_sockfd);
+
+            continue;
+        }
+
+        break;
+    }
+/*                                                                            */
+/* All done with this structure:                                              */
+/*                                                                            */
+    freeaddrinfo(ps_servinfo);
+/*                                                                            */
+/* Check for a connection:                                                    */
+/*                                                                            */
+    if (ps_address == NULL)
+    {
+        fprintf(stderr, "selectserver failed to bind to a socket.\n");
+
+        return -1;
+    }
+/*                                                                            */
+/* accept_new_connection takes connections until the listener has none left,  */
+/* so it must say so rather than block:                                       */
+/*                                                                            */
+    if (fcntl(i_sockfd, F_SETFL, O_NONBLOCK) == -1)
+    {
+        report_error("fcntl", errno);
+        close(i_sockfd);
+
+        return -1;
+    }
+/*                                                                            */
+/* Tell the connection to listen for incoming traffic:                        */
+/*                                                                            */
+    errno = 0;
+    i_rv = listen(i_sockfd, i_backlog);
+    i_errno = errno;
+
+    if (i_rv == -1)
+    {
+        report_error("listen", i_errno);
+        close(i_sockfd);
+
+        return -1;
+    }
+/*                                                                            */
+/* Successful so return the socket:                                           */
+/*                                                                            */
+    return i_sockfd;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Hold the server to its watermarks (-C, -Q), once a pass of the loop.  Past */
+/* either high watermark the backend stops watching the listener, so new      */
+/* clients wait in the listen queue instead of taking time from the ones      */
+/* connected; it is watched again once both counts are down to their low      */
+/* watermarks.  Past -Q the clients holding the biggest partial frames are    */
+/* shed until the bytes are down to the low watermark.  A client that         */
+/* trickles in a large frame holds its buffer the longest, so those are the   */
+/* slowest senders:                                                           */
+/*                                                                            */
+void overload_check
+(
+    struct server *ps_server /* both - Server at the end of a pass            */
+)
+{
+    struct client **nps_clients;
+    int              i_count;
+    int              i_fd;
+    int              i_lc;
+
+    if (ps_server->l_buffered_high > 0 &&
+        ps_server->l_buffered > ps_server->l_buffered_high)
+    {
+        nps_clients = malloc(sizeof(struct client*) * ps_server->i_clients);
+
+        if (nps_clients == NULL)
+        {
+            fprintf(stderr, "selectserver: no memory to shed clients\n");
+
+            return;
+        }
+
+        i_count = 0;
+
+        for (i_lc = 0; i_lc < ps_server->i_clients; i_lc++)
+        {
+            i_fd = ps_server->ni_members[i_lc];
+
+            if (ps_server->ns_clients[i_fd].i_in_size +
+                ps_server->ns_clients[i_fd].i_out_size > 0)
+            {
+                nps_clients[i_count++] = &ps_server->ns_clients[i_fd];
+            }
+        }
+
+        qsort(nps_clients, i_count, sizeof(struct client*), overload_compare);
+
+        for (i_lc = 0; i_lc < i_count &&
+            ps_server->l_buffered > ps_server->l_buffered_low; i_lc++)
+        {
+            i_fd = (int)(nps_clients[i_lc] - ps_server->ns_clients);
+
+            printf("selectserver: socket %d holds %d bytes and the server is "
+                "over -Q, closing\n", i_fd, nps_clients[i_lc]->i_in_size +
+                nps_clients[i_lc]->i_out_size);
+
+            ps_server->l_sheds++;
+            close_client(ps_server, i_fd);
+        }
+
+        free(nps_clients);
+    }
+
+    if (!ps_server->i_paused &&
+        ((ps_server->l_clients_high > 0 &&
+        ps_server->i_clients >= ps_server->l_clients_high) ||
+        (ps_server->l_buffered_high > 0 &&
+        ps_server->l_buffered >= ps_server->l_buffered_high)))
+    {
+        printf("selectserver: over the watermarks, not accepting\n");
+
+        ps_server->ps_backend->pf_unwatch(ps_server, ps_server->i_listener);
+        ps_server->i_paused = 1;
+    }
+    else if (ps_server->i_paused &&
+        (ps_server->l_clients_high == 0 ||
+        ps_server->i_clients <= ps_server->l_clients_low) &&
+        (ps_server->l_buffered_high == 0 ||
+        ps_server->l_buffered <= ps_server->l_buffered_low))
+    {
+        if (ps_server->ps_backend->pf_watch(ps_server,
+            ps_server->i_listener) == 0)
+        {
+            printf("selectserver: accepting again\n");
+
+            ps_server->i_paused = 0;
+        }
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* qsort comparison for overload_check: the client holding more bytes comes   */
+/* first:                                                                     */
+/*                                                                            */
+int overload_compare
+(
+    const void *p_left, /* in   - A struct client pointer                     */
+    const void *p_right /* in   - Another                                     */
+)
+{
+    int i_left;
+    int i_right;
+
+    i_left = (*(struct client* const*)p_left)->i_in_size +
+        (*(struct client* const*)p_left)->i_out_size;
+    i_right = (*(struct client* const*)p_right)->i_in_size +
+        (*(struct client* const*)p_right)->i_out_size;
+
+    return i_left < i_right ? 1 : i_left > i_right ? -1 : 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Read a watermark option (-C, -Q), "high" or "high:low".  Without a low     */
+/* watermark it is three quarters of the high one.  pl_high and pl_low may be */
+/* NULL to only check it.  Returns 0, or -1 if it makes no sense:             */
+/*                                                                            */
+int overload_parse
+(
+    char *nc_arg,  /* in   - The option's argument                            */
+    long *pl_high, /* out  - High watermark, or NULL                          */
+    long *pl_low   /* out  - Low watermark, or NULL                           */
+)
+{
+    char *nc_end;
+    long  l_high;
+    long  l_low;
+
+    errno = 0;
+    l_high = strtol(nc_arg, &nc_end, 10);
+    l_low = l_high / 4 * 3 + l_high % 4 * 3 / 4;
+
+    if (*nc_end == ':' && nc_end[1] != '\0')
+    {
+        l_low = strtol(nc_end + 1, &nc_end, 10);
+    }
+
+    if (errno != 0 || nc_end == nc_arg || *nc_end != '\0' || l_high <= 0 ||
+        l_low < 0 || l_low >= l_high)
+    {
+        return -1;
+    }
+
+    if (pl_high != NULL)
+    {
+        *pl_high = l_high;
+        *pl_low = l_low;
+    }
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Print the message for an errno value:                                      */
+/*                                                                            */
+void report_error
+(
+    char *nc_function, /* in   - Function that failed                         */
+    int    i_errno     /* in   - errno it left behind                         */
+)
+{
+    fprintf(stderr, "%s failed with code %d.\n", nc_function, i_errno);
+    fprintf(stderr, "%s\n", strerror(i_errno));
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Close the listeners and the backend and free the server.  The clients must */
+/* already be closed:                                                         */
+/*                                                                            */
+void server_close
+(
+    struct server *ps_server /* both - Server to free                         */
+)
+{
+    if (ps_server->i_metrics != -1)
+    {
+        close(ps_server->i_metrics);
+    }
+
+    if (ps_server->i_listener != -1)
+    {
+        close(ps_server->i_listener);
+    }
+
+    if (ps_server->i_epfd != -1)
+    {
+        close(ps_server->i_epfd);
+    }
+
+    free(ps_server->nu64_write);
+    free(ps_server->nu64_write_master);
+    free(ps_server->nu64_read);
+    free(ps_server->nu64_master);
+    free(ps_server->ns_events);
+    free(ps_server->ni_pollslot);
+    free(ps_server->ns_pollfds);
+    free(ps_server->ni_members);
+    free(ps_server->ni_writable);
+    free(ps_server->ni_ready);
+    free(ps_server->ns_clients);
+    free(ps_server);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Bring the timer wheel up to the current time and fire every timer that is  */
+/* due.  The wheel goes straight from one tick with work to the next, so a    */
+/* long sleep costs nothing extra:                                            */
+/*                                                                            */
+void timer_advance
+(
+    struct server *ps_server /* both - Server whose timers are due            */
+)
+{
+    struct timer        *ps_list;
+    struct timer        *ps_timer;
+    struct timer_wheel *ps_wheel;
+    uint64_t              u64_next;
+    uint64_t              u64_target;
+    int                   i_index;
+    int                   i_level;
+
+    ps_wheel = &ps_server->s_wheel;
+    u64_target = timer_clock() / TIMER_TICK_MS;
+
+    while ((u64_next = timer_next(ps_wheel)) <= u64_target)
+    {
+        ps_wheel->u64_now = u64_next;
+/*                                                                            */
+/* Move the timers of every higher-level slot that starts at this tick down,  */
+/* the highest level first so they can fall through more than one level.  A   */
+/* timer due on this very tick lands on the next one:                         */
+/*                                                                            */
+        for (i_level = WHEEL_LEVELS - 1; i_level > 0; i_level--)
+        {
+            if ((u64_next & (((uint64_t)1 << (WHEEL_BITS * i_level)) - 1)) != 0)
+            {
+                continue;
+            }
+
+            i_index = (int)(u64_next >> (WHEEL_BITS * i_level)) &
+                (WHEEL_SLOTS - 1);
+            ps_list = ps_wheel->aaps_slots[i_level][i_index];
+
+            ps_wheel->aaps_slots[i_level][i_index] = NULL;
+            ps_wheel->aau64_used[i_level][i_index / 64] &=
+                ~((uint64_t)1 << (i_index % 64));
+
+            while ((ps_timer = ps_list) != NULL)
+            {
+                ps_list = ps_timer->ps_next;
+                ps_timer->pps_prev = NULL;
+                ps_wheel->l_timers--;
+
+                timer_schedule(ps_wheel, ps_timer, ps_timer->u64_expires);
+            }
+        }
+/*                                                                            */
+/* Fire everything in this tick's level 0 slot.  A timer that fires can       */
+/* cancel or schedule others, so take them off one at a time:                 */
+/*                                                                            */
+        i_index = (int)(u64_next & (WHEEL_SLOTS - 1));
+
+        while ((ps_timer = ps_wheel->aaps_slots[0][i_index]) != NULL)
+        {
+            timer_cancel(ps_wheel, ps_timer);
+            timer_fire(ps_server, ps_timer);
+        }
+    }
+
+    if (u64_target > ps_wheel->u64_now)
+    {
+        ps_wheel->u64_now = u64_target;
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Take a timer out of the wheel.  Nothing happens if it is not armed:        */
+/*                                                                            */
+void timer_cancel
+(
+    struct timer_wheel *ps_wheel, /* both - Wheel the timer is in             */
+    struct timer       *ps_timer  /* both - Timer to cancel                   */
+)
+{
+    int i_index;
+    int i_level;
+
+    if (ps_timer->pps_prev == NULL)
+    {
+        return;
+    }
+
+    *ps_timer->pps_prev = ps_timer->ps_next;
+
+    if (ps_timer->ps_next != NULL)
+    {
+        ps_timer->ps_next->pps_prev = ps_timer->pps_prev;
+    }
+/*                                                                            */
+/* If that emptied the slot, clear its bit.  pps_prev points into the slot    */
+/* array exactly when the timer was first in its list:                        */
+/*                                                                            */
+    if (ps_timer->pps_prev >= &ps_wheel->aaps_slots[0][0] &&
+        ps_timer->pps_prev <=
+            &ps_wheel->aaps_slots[WHEEL_LEVELS - 1][WHEEL_SLOTS - 1] &&
+        *ps_timer->pps_prev == NULL)
+    {
+        i_level = (int)(ps_timer->pps_prev - &ps_wheel->aaps_slots[0][0]) /
+            WHEEL_SLOTS;
+        i_index = (int)(ps_timer->pps_prev - &ps_wheel->aaps_slots[0][0]) %
+            WHEEL_SLOTS;
+
+        ps_wheel->aau64_used[i_level][i_index / 64] &=
+            ~((uint64_t)1 << (i_index % 64));
+    }
+
+    ps_timer->ps_next = NULL;
+    ps_timer->pps_prev = NULL;
+    ps_wheel->l_timers--;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Milliseconds on the monotonic clock:                                       */
+/*                                                                            */
+uint64_t timer_clock
+(
+    void
+)
+{
+    struct timespec s_now;
+
+    clock_gettime(CLOCK_MONOTONIC, &s_now);
+
+    return (uint64_t)s_now.tv_sec * 1000 + s_now.tv_nsec / 1000000;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* A client's timer went off.  Activity since it was set only moves the       */
+/* deadline, so a timer whose client has been busy is just set again for the  */
+/* new deadline instead of being rescheduled on every message:                */
+/*                                                                            */
+void timer_fire
+(
+    struct server *ps_server, /* both - Server holding the client             */
+    struct timer  *ps_timer   /* in   - Timer that is due                     */
+)
+{
+    static char    ac_keepalive[FRAME_HEADER]; // An empty frame
+    struct client *ps_client;
+    uint64_t        u64_due;
+
+    ps_client = &ps_server->ns_clients[ps_timer->i_fd];
+
+    switch (ps_timer->i_kind)
+    {
+/*                                                                            */
+/* Nothing heard for -i seconds.  A peer that vanished without closing the    */
+/* connection is never going to say anything, so reap it:                     */
+/*                                                                            */
+    case TIMER_IDLE:
+        u64_due = ps_client->u64_heard + ps_server->u64_idle;
+
+        if (u64_due > ps_server->s_wheel.u64_now)
+        {
+            timer_schedule(&ps_server->s_wheel, ps_timer, u64_due);
+
+            break;
+        }
+
+        printf("selectserver: socket %d idle, closing\n", ps_timer->i_fd);
+        close_client(ps_server, ps_timer->i_fd);
+
+        break;
+/*                                                                            */
+/* Nothing sent for -k seconds.  Send an empty frame so the client knows the  */
+/* server is still there, and so a dead peer shows up as a failed send:       */
+/*                                                                            */
+    case TIMER_BEAT:
+        u64_due = ps_client->u64_sent + ps_server->u64_beat;
+
+        if (u64_due <= ps_server->s_wheel.u64_now)
+        {
+            if (client_send(ps_server, ps_timer->i_fd, ac_keepalive,
+                FRAME_HEADER) == -1)
+            {
+                break;
+            }
+
+            u64_due = ps_server->s_wheel.u64_now + ps_server->u64_beat;
+        }
+
+        timer_schedule(&ps_server->s_wheel, ps_timer, u64_due);
+
+        break;
+/*                                                                            */
+/* Output has sat in the queue for -s seconds without draining.  The client   */
+/* is not reading; drop it before its backlog grows any further:              */
+/*                                                                            */
+    case TIMER_SLOW:
+        printf("selectserver: socket %d too slow, closing\n", ps_timer->i_fd);
+        ps_server->l_send_errors++;
+        close_client(ps_server, ps_timer->i_fd);
+
+        break;
+    }
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Find the first used slot at or after i_from in one level's bitmap.         */
+/* Returns -1 if there is none:                                               */
+/*                                                                            */
+int timer_first_used
+(
+    uint64_t *au64_used, /* in   - Bitmap of one level                        */
+    int        i_from    /* in   - First slot to look at                      */
+)
+{
+    int      i_word;
+    uint64_t u64_bits;
+
+    for (i_word = i_from / 64; i_word < WHEEL_SLOTS / 64; i_word++)
+    {
+        u64_bits = au64_used[i_word];
+
+        if (i_word == i_from / 64)
+        {
+            u64_bits &= ~(uint64_t)0 << (i_from % 64);
+        }
+
+        if (u64_bits != 0)
+        {
+            return i_word * 64 + __builtin_ctzll(u64_bits);
+        }
+    }
+
+    return -1;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* The next tick at which the wheel has something to do: a level 0 slot with  */
+/* timers in it, or the start of a higher-level slot whose timers have to be  */
+/* moved down.  Each level only holds timers later than every timer in the    */
+/* levels below it, so the first level with anything in it has the answer.    */
+/* Returns UINT64_MAX if no timer is armed:                                   */
+/*                                                                            */
+uint64_t timer_next
+(
+    struct timer_wheel *ps_wheel /* in   - Wheel to look at                   */
+)
+{
+    int i_index;
+    int i_level;
+    int i_shift;
+
+    if (ps_wheel->l_timers == 0)
+    {
+        return UINT64_MAX;
+    }
+
+    for (i_level = 0; i_level < WHEEL_LEVELS; i_level++)
+    {
+        i_shift = WHEEL_BITS * i_level;
+        i_index = (int)(ps_wheel->u64_now >> i_shift) & (WHEEL_SLOTS - 1);
+
+        if (i_index == WHEEL_SLOTS - 1)
+        {
+            continue;
+        }
+
+        i_index = timer_first_used(ps_wheel->aau64_used[i_level], i_index + 1);
+
+        if (i_index != -1)
+        {
+            return (ps_wheel->u64_now >> (i_shift + WHEEL_BITS) <<
+                (i_shift + WHEEL_BITS)) | ((uint64_t)i_index << i_shift);
+        }
+    }
+
+    return UINT64_MAX;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Arm (or re-arm) a timer for a tick.  It goes in the lowest level whose     */
+/* current span, the slots still to come before that level wraps, holds the   */
+/* tick.  A tick that has already gone fires on the next one:                 */
+/*                                                                            */
+void timer_schedule
+(
+    struct timer_wheel *ps_wheel,    /* both - Wheel to put the timer in      */
+    struct timer       *ps_timer,    /* both - Timer to arm                   */
+    uint64_t             u64_expires /* in   - Tick it is due                 */
+)
+{
+    struct timer **pps_slot;
+    int             i_index;
+    int             i_level;
+    int             i_shift;
+
+    timer_cancel(ps_wheel, ps_timer);
+
+    if (u64_expires <= ps_wheel->u64_now)
+    {
+        u64_expires = ps_wheel->u64_now + 1;
+    }
+/*                                                                            */
+/* Past the top level's span (over a year out) is as far as the wheel goes:   */
+/*                                                                            */
+    if (u64_expires >> (WHEEL_BITS * WHEEL_LEVELS) !=
+        ps_wheel->u64_now >> (WHEEL_BITS * WHEEL_LEVELS))
+    {
+        u64_expires = ps_wheel->u64_now |
+            (((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS)) - 1);
+    }
+
+    for (i_level = 0; i_level < WHEEL_LEVELS - 1; i_level++)
+    {
+        i_shift = WHEEL_BITS * (i_level + 1);
+
+        if (u64_expires >> i_shift == ps_wheel->u64_now >> i_shift)
+        {
+            break;
+        }
+    }
+
+    i_index = (int)(u64_expires >> (WHEEL_BITS * i_level)) & (WHEEL_SLOTS - 1);
+    pps_slot = &ps_wheel->aaps_slots[i_level][i_index];
+
+    ps_timer->u64_expires = u64_expires;
+    ps_timer->ps_next = *pps_slot;
+    ps_timer->pps_prev = pps_slot;
+
+    if (*pps_slot != NULL)
+    {
+        (*pps_slot)->pps_prev = &ps_timer->ps_next;
+    }
+
+    *pps_slot = ps_timer;
+    ps_wheel->aau64_used[i_level][i_index / 64] |=
+        (uint64_t)1 << (i_index % 64);
+    ps_wheel->l_timers++;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Milliseconds the loop can sleep before the wheel has something to do, 0    */
+/* if it already has, or -1 if no timer is armed:                             */
+/*                                                                            */
+int timer_timeout
+(
+    struct timer_wheel *ps_wheel /* in   - Wheel to look at                   */
+)
+{
+    uint64_t u64_next;
+    uint64_t u64_now;
+
+    u64_next = timer_next(ps_wheel);
+
+    if (u64_next == UINT64_MAX)
+    {
+        return -1;
+    }
+
+    u64_now = timer_clock();
+
+    if (u64_next * TIMER_TICK_MS <= u64_now)
+    {
+        return 0;
+    }
+
+    if (u64_next * TIMER_TICK_MS - u64_now > INT32_MAX)
+    {
+        return INT32_MAX;
+    }
+
+    return (int)(u64_next * TIMER_TICK_MS - u64_now);
+}
@@ -0,0 +1,1307 @@
+/******************************************************************************/
+/*                                                                            */
+/* Application: server                                                        */
+/*                                                                            */
+/* File:        main_unix.c                                                   */
+/*                                                                            */
+/* Purpose:     Listen for a client to connect to port 3490.  Send the string */
+/*              "Hello, world!" to the client.  This is the Unix/Linux build  */
+/*              of WSserver.                                                  */
+/*                                                                            */
+/*              WSserver starts a thread for every connection and stops       */
+/*              accepting once BACKLOG of them are running.  Here a fixed     */
+/*              pool of worker threads, one per core unless -w says           */
+/*              otherwise, is started once and each connection is a task      */
+/*              that runs on it: thread_function answers the client.  -s      */
+/*              picks how tasks reach the workers.                            */
+/*                                                                            */
+/*              -s shared: an acceptor thread puts each accepted socket on    */
+/*              one bounded ring and the workers take them off it, so the     */
+/*              accept path never creates a thread.  When the ring is full    */
+/*              (-c) the acceptor waits for a free slot and new connections   */
+/*              wait in the kernel's listen queue.                            */
+/*                                                                            */
+/*              -s steal: every worker has a Chase-Lev deque of its own.  A   */
+/*              worker with nothing to do steals from the others, then        */
+/*              accepts a batch of connections onto its deque, then sleeps    */
+/*              until the listener is readable or a busy worker has work to   */
+/*              spare.  It sleeps in an epoll set of its own that holds both  */
+/*              with EPOLLEXCLUSIVE, so each event wakes one sleeper, not all */
+/*              of them.  The owner pushes and pops at one end without a      */
+/*              lock; thieves take the oldest task from the other end.        */
+/*                                                                            */
+/*              -d makes one connection in so many slow, a handler that waits */
+/*              before it answers, so the two can be compared when handler    */
+/*              costs vary.                                                   */
+/*                                                                            */
+/*              SIGINT or SIGTERM stops accepting, lets the workers finish    */
+/*              what is queued and prints how many connections were served.   */
+/*                                                                            */
+/* Reference:   This function is based on server.c in Brian "Beej Jorgensen"  */
+/*              Hall's excellent socket programming guide:                    */
+/*                 Hall, B. (2019). "Beej's Guide to Network Programming      */
+/*                 Using Internet Sockets"                                    */
+/*                 https://beej.us/guide/bgnet/                               */
+/*                                                                            */
+/* Reference:   The deque is the one in Le, N. M., Pop, A., Cohen, A. and     */
+/*              Zappa Nardelli, F. (2013). "Correct and Efficient             */
+/*              Work-Stealing for Weak Memory Models", PPoPP '13, after       */
+/*              Chase, D. and Lev, Y. (2005). "Dynamic Circular Work-Stealing */
+/*              Deque", SPAA '05.  It does not grow: -c bounds it.            */
+/*                                                                            */
+/* Usage:       server [-c queue_slots] [-d slow_usec:one_in] [-q]            */
+/*                     [-s shared|steal] [-w workers]                         */
+/*                                                                            */
+/* Modifications:                                                             */
+/*                                                                            */
+/*           Name           Date                     Reason                   */
+/*    ------------------ ---------- ----------------------------------------- */
+/*    Steven C. Mitchell 2026-10-17 Linux build with a fixed worker pool      */
+/*    Steven C. Mitchell 2026-10-17 Work-stealing scheduler (-s), slow tasks  */
+/*                                                                            */
+/******************************************************************************/
+#define _GNU_SOURCE // accept4
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <netinet/in.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+
+#define PORT "3490"        // The port to which client will be connecting
+#define BACKLOG SOMAXCONN  // how many pending connections queue will hold
+#define QUEUE_SLOTS 1024   // Sockets waiting for a worker (each, stealing)
+#define WORKER_MAX  1024   // Most workers -w accepts
+#define ACCEPT_BATCH 64    // Most connections a stealing worker takes at once
+#define STEAL_RETRY ((struct task*)1) // deque_steal lost a race, try again
+/*                                                                            */
+/* A connection waiting to be served.  pf_run is thread_function:             */
+/*                                                                            */
+struct task
+{
+    int           (*pf_run)(struct task*); // Serve the connection
+    struct server *ps_server; // Server that accepted it
+    int             i_fd;     // The client's socket
+    int             i_slow;   // One of the -d connections
+};
+/*                                                                            */
+/* A Chase-Lev deque.  Only its owner pushes and pops, at l_bottom; thieves   */
+/* take from l_top with a compare-and-swap.  The two ends are on cache lines  */
+/* of their own so a thief does not slow the owner down:                      */
+/*                                                                            */
+struct deque
+{
+    long           l_top __attribute__((aligned(64)));    // Oldest task
+    long           l_bottom __attribute__((aligned(64))); // Past the newest
+    long           l_mask __attribute__((aligned(64)));   // Slots - 1
+    struct task  **nps_tasks; // Slots, a power of two of them
+};
+/*                                                                            */
+/* A worker of the stealing scheduler:                                        */
+/*                                                                            */
+struct worker
+{
+    struct deque    s_deque;   // Tasks this worker accepted
+    struct server  *ps_server; // Server it works for
+    pthread_t       t_thread;  // Its thread
+    int             i_index;   // Its place in ns_workers
+    int             i_epfd;    // epoll set it sleeps in
+    unsigned        u_seed;    // Picks the first worker to steal from
+    long            l_run;     // Tasks it ran
+    long            l_stolen;  // Of those, taken from other workers
+};
+/*                                                                            */
+/* Everything the threads share.  With -s shared the ring and its counters    */
+/* are only touched with s_lock held; with -s steal i_sleeping and the wake   */
+/* descriptor tell a worker with work to spare whether anyone is idle.  Only  */
+/* what the chosen mode uses is allocated:                                    */
+/*                                                                            */
+struct server
+{
+    int              i_listener;   // Listening socket
+    int              i_quiet;      // -q: no line for each connection
+    int              i_steal;      // -s steal
+    int              i_workers;    // Threads in the pool (-w)
+    pthread_t       *nt_workers;   // The pool (-s shared)
+    struct worker   *ns_workers;   // The pool (-s steal)
+    long             l_slow_usec;  // How long a slow handler waits (-d)
+    int              i_slow_every; // One connection in so many is slow
+    long             l_accepted;   // Connections accepted, counts for -d
+    int              i_wake_fd;    // eventfd that wakes an idle stealing worker
+    int              i_sleeping;   // Stealing workers asleep in epoll_wait
+    struct task    **nps_queue;    // Tasks waiting for a worker (-s shared)
+    int              i_queue_size; // Slots in nps_queue or each deque (-c)
+    int              i_head;       // Slot the next worker takes from
+    int              i_count;      // Tasks in the ring
+    int              i_stop;       // Set at shutdown
+    long             l_served;     // Tasks handed to a worker
+    long             l_full;       // Times the acceptor waited for a slot
+    pthread_mutex_t  s_lock;       // Guards the ring and its counters
+    pthread_cond_t   s_not_empty;  // Signalled when a task is queued
+    pthread_cond_t   s_not_full;   // Signalled when a slot is freed
+};
+
+void *accept_thread(void*);
+struct task *deque_pop(struct deque*);
+int   deque_push(struct deque*, struct task*);
+struct task *deque_steal(struct deque*);
+void *get_in_addr(struct sockaddr*);
+int   open_a_socket(char*, int);
+struct task *queue_pop(struct server*);
+int   queue_push(struct server*, struct task*);
+void  report_error(char*, int);
+void  server_close(struct server*);
+int   steal_open(struct server*);
+void *steal_thread(void*);
+struct task *task_new(struct server*, int, struct sockaddr_storage*);
+int   thread_function(struct task*);
+int   worker_accept(struct worker*);
+void  worker_sleep(struct worker*);
+struct task *worker_steal(struct worker*);
+void *worker_thread(void*);
+void  worker_wake(struct server*);
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Main:                                                                      */
+/*                                                                            */
+int main
+(
+    int    argc,
+    char  *argv[]
+)
+{
+    char            *nc_colon;
+    int              i_lc;
+    int              i_opt;
+    int              i_signal;
+    int              i_status;
+    int              i_started;  // Workers running
+    long             l_stolen;
+    struct server    s_server;
+    sigset_t         s_signals;
+    pthread_t        t_acceptor;
+/*                                                                            */
+/* Read the options: how many workers, how many tasks may wait for one, how   */
+/* they reach the workers, which handlers are slow and whether to print each  */
+/* connection:                                                                */
+/*                                                                            */
+    memset(&s_server, 0, sizeof(s_server));
+    s_server.i_workers = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    s_server.i_queue_size = QUEUE_SLOTS;
+    s_server.i_listener = -1;
+    s_server.i_wake_fd = -1;
+    i_status = 0;
+
+    while ((i_opt = getopt(argc, argv, "c:d:qs:w:")) != -1)
+    {
+        switch (i_opt)
+        {
+        case 'c': s_server.i_queue_size = atoi(optarg); break;
+        case 'd':
+            s_server.l_slow_usec = atol(optarg);
+            nc_colon = strchr(optarg, ':');
+            s_server.i_slow_every = nc_colon != NULL ? atoi(nc_colon + 1) : 0;
+
+            if (s_server.l_slow_usec <= 0 || s_server.i_slow_every <= 0)
+            {
+                i_status = -1;
+            }
+
+            break;
+        case 'q': s_server.i_quiet = 1; break;
+        case 's':
+            s_server.i_steal = strcmp(optarg, "steal") == 0;
+
+            if (!s_server.i_steal && strcmp(optarg, "shared") != 0)
+            {
+                i_status = -1;
+            }
+
+            break;
+        case 'w': s_server.i_workers = atoi(optarg); break;
+        default: i_status = -1; break;
+        }
+    }
+
+    if (i_status == -1 || optind != argc || s_server.i_queue_size < 1 ||
+        s_server.i_queue_size > (1 << 24) ||
+        s_server.i_workers < 1 || s_server.i_workers > WORKER_MAX)
+    {
+        fprintf(stderr, "usage: server [-c queue_slots] "
+            "[-d slow_usec:one_in] [-q]\n"
+            "              [-s shared|steal] [-w workers]\n");
+
+        return 1;
+    }
+
+    pthread_mutex_init(&s_server.s_lock, NULL);
+    pthread_cond_init(&s_server.s_not_empty, NULL);
+    pthread_cond_init(&s_server.s_not_full, NULL);
+/*                                                                            */
+/* SIGINT and SIGTERM are only taken by this thread, in sigwait below.  The   */
+/* other threads inherit the blocked mask.  A client that hangs up first must */
+/* fail the send, not kill the server:                                        */
+/*                                                                            */
+    sigemptyset(&s_signals);
+    sigaddset(&s_signals, SIGINT);
+    sigaddset(&s_signals, SIGTERM);
+
+    if (pthread_sigmask(SIG_BLOCK, &s_signals, NULL) != 0)
+    {
+        fprintf(stderr, "pthread_sigmask failed.\n");
+        server_close(&s_server);
+
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    s_server.i_listener = open_a_socket(PORT, BACKLOG);
+
+    if (s_server.i_listener == -1)
+    {
+        server_close(&s_server);
+
+        return 2;
+    }
+/*                                                                            */
+/* -s shared needs the ring and a thread handle for each worker; -s steal     */
+/* needs the workers' deques and epoll sets:                                  */
+/*                                                                            */
+    if (!s_server.i_steal)
+    {
+        s_server.nps_queue = malloc(sizeof(struct task*) *
+            s_server.i_queue_size);
+        s_server.nt_workers = malloc(sizeof(pthread_t) * s_server.i_workers);
+
+        if (s_server.nps_queue == NULL || s_server.nt_workers == NULL)
+        {
+            fprintf(stderr, "server: out of memory.\n");
+            server_close(&s_server);
+
+            return 1;
+        }
+    }
+    else if (steal_open(&s_server) == -1)
+    {
+        server_close(&s_server);
+
+        return 2;
+    }
+/*                                                                            */
+/* Start the pool, then, for the shared ring, the acceptor that feeds it:     */
+/*                                                                            */
+    for (i_started = 0; i_started < s_server.i_workers; i_started++)
+    {
+        i_status = s_server.i_steal ?
+            pthread_create(&s_server.ns_workers[i_started].t_thread, NULL,
+                steal_thread, &s_server.ns_workers[i_started]) :
+            pthread_create(&s_server.nt_workers[i_started], NULL,
+                worker_thread, &s_server);
+
+        if (i_status != 0)
+        {
+            report_error("pthread_create", i_status);
+
+            break;
+        }
+    }
+
+    if (i_started == s_server.i_workers && !s_server.i_steal)
+    {
+        i_status = pthread_create(&t_acceptor, NULL, accept_thread,
+            &s_server);
+
+        if (i_status != 0)
+        {
+            report_error("pthread_create", i_status);
+        }
+    }
+
+    if (i_status == 0)
+    {
+        printf("server: waiting for connections on port %s, %d workers, "
+            "%s\n", PORT, s_server.i_workers,
+            s_server.i_steal ? "work stealing" : "shared queue");
+        fflush(stdout);
+
+        sigwait(&s_signals, &i_signal);
+    }
+/*                                                                            */
+/* Shut down.  Shutting the listener down wakes an acceptor blocked in        */
+/* accept and every stealing worker asleep on it, and leaves it readable for  */
+/* any that go to sleep later; an acceptor waiting for a slot is woken by the */
+/* broadcast.  The workers finish what is still queued before they see        */
+/* i_stop:                                                                    */
+/*                                                                            */
+    pthread_mutex_lock(&s_server.s_lock);
+    __atomic_store_n(&s_server.i_stop, 1, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&s_server.s_not_full);
+    pthread_cond_broadcast(&s_server.s_not_empty);
+    pthread_mutex_unlock(&s_server.s_lock);
+
+    shutdown(s_server.i_listener, SHUT_RDWR);
+
+    if (!s_server.i_steal && i_status == 0)
+    {
+        pthread_join(t_acceptor, NULL);
+    }
+
+    l_stolen = 0;
+
+    for (i_lc = 0; i_lc < i_started; i_lc++)
+    {
+        if (s_server.i_steal)
+        {
+            pthread_join(s_server.ns_workers[i_lc].t_thread, NULL);
+            s_server.l_served += s_server.ns_workers[i_lc].l_run;
+            l_stolen += s_server.ns_workers[i_lc].l_stolen;
+        }
+        else
+        {
+            pthread_join(s_server.nt_workers[i_lc], NULL);
+        }
+    }
+
+    if (s_server.i_steal)
+    {
+        printf("server: %ld connections served, %ld of them stolen\n",
+            s_server.l_served, l_stolen);
+    }
+    else
+    {
+        printf("server: %ld connections served, the queue was full %ld "
+            "times\n", s_server.l_served, s_server.l_full);
+    }
+
+    server_close(&s_server);
+
+    return i_status == 0 ? 0 : 3;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Acceptor thread (-s shared): accept connections and queue them for the     */
+/* workers until the server is stopped.  Accepting never waits for a thread   */
+/* to start:                                                                  */
+/*                                                                            */
+void *accept_thread
+(
+    void *p_arg /* both - The server                                          */
+)
+{
+    int                      i_errno;
+    int                      i_new_fd;
+    struct sockaddr_storage  s_client; // client's address information
+    struct server          *ps_server;
+    struct task            *ps_task;
+    socklen_t                sl_size;
+
+    ps_server = (struct server*)p_arg;
+
+    for (;;)
+    {
+        sl_size = sizeof(s_client);
+        errno = 0;
+        i_new_fd = accept4(ps_server->i_listener, (struct sockaddr*)&s_client,
+            &sl_size, SOCK_CLOEXEC);
+        i_errno = errno;
+
+        if (i_new_fd == -1)
+        {
+            if (__atomic_load_n(&ps_server->i_stop, __ATOMIC_ACQUIRE))
+            {
+                break;
+            }
+
+            if (i_errno != EINTR && i_errno != ECONNABORTED)
+            {
+                report_error("accept", i_errno);
+            }
+
+            continue;
+        }
+
+        ps_task = task_new(ps_server, i_new_fd, &s_client);
+
+        if (ps_task == NULL)
+        {
+            continue;
+        }
+/*                                                                            */
+/* The server is stopping and no worker will take it:                         */
+/*                                                                            */
+        if (queue_push(ps_server, ps_task) == -1)
+        {
+            close(i_new_fd);
+            free(ps_task);
+
+            break;
+        }
+    }
+
+    return NULL;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Take the newest task off the owner's end of a deque.  Only the owner calls */
+/* it.  l_bottom is lowered first so a thief cannot take the same task; when  */
+/* only one is left the owner and the thieves race for it on l_top.  Returns  */
+/* the task, or NULL if the deque is empty:                                   */
+/*                                                                            */
+struct task *deque_pop
+(
+    struct deque *ps_deque /* both - The owner's deque                        */
+)
+{
+    struct task *ps_task;
+    long          l_bottom;
+    long          l_top;
+
+    l_bottom = __atomic_load_n(&ps_deque->l_bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&ps_deque->l_bottom, l_bottom, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    l_top = __atomic_load_n(&ps_deque->l_top, __ATOMIC_RELAXED);
+
+    if (l_top > l_bottom)
+    {
+        __atomic_store_n(&ps_deque->l_bottom, l_bottom + 1, __ATOMIC_RELAXED);
+
+        return NULL;
+    }
+
+    ps_task = __atomic_load_n(&ps_deque->nps_tasks[l_bottom &
+        ps_deque->l_mask], __ATOMIC_RELAXED);
+
+    if (l_top == l_bottom)
+    {
+        if (!__atomic_compare_exchange_n(&ps_deque->l_top, &l_top, l_top + 1,
+            0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        {
+            ps_task = NULL; // a thief got it
+        }
+
+        __atomic_store_n(&ps_deque->l_bottom, l_bottom + 1, __ATOMIC_RELAXED);
+    }
+
+    return ps_task;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Push a task on the owner's end of a deque.  Only the owner calls it.  The  */
+/* release store makes the task visible before the new l_bottom is.  Returns  */
+/* 0, or -1 if the deque is full:                                             */
+/*                                                                            */
+int deque_push
+(
+    struct deque *ps_deque, /* both - The owner's deque                       */
+    struct task  *ps_task   /* in   - Task to push                            */
+)
+{
+    long l_bottom;
+    long l_top;
+
+    l_bottom = __atomic_load_n(&ps_deque->l_bottom, __ATOMIC_RELAXED);
+    l_top = __atomic_load_n(&ps_deque->l_top, __ATOMIC_ACQUIRE);
+
+    if (l_bottom - l_top > ps_deque->l_mask)
+    {
+        return -1;
+    }
+
+    __atomic_store_n(&ps_deque->nps_tasks[l_bottom & ps_deque->l_mask],
+        ps_task, __ATOMIC_RELAXED);
+    __atomic_store_n(&ps_deque->l_bottom, l_bottom + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Take the oldest task off the thieves' end of another worker's deque.       */
+/* Returns the task, NULL if the deque is empty, or STEAL_RETRY if the owner  */
+/* or another thief took it first:                                            */
+/*                                                                            */
+struct task *deque_steal
+(
+    struct deque *ps_deque /* both - Deque to steal from                      */
+)
+{
+    struct task *ps_task;
+    long          l_bottom;
+    long          l_top;
+
+    l_top = __atomic_load_n(&ps_deque->l_top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    l_bottom = __atomic_load_n(&ps_deque->l_bottom, __ATOMIC_ACQUIRE);
+
+    if (l_top >= l_bottom)
+    {
+        return NULL;
+    }
+
+    ps_task = __atomic_load_n(&ps_deque->nps_tasks[l_top & ps_deque->l_mask],
+        __ATOMIC_RELAXED);
+
+    if (!__atomic_compare_exchange_n(&ps_deque->l_top, &l_top, l_top + 1, 0,
+        __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+    {
+        return STEAL_RETRY;
+    }
+
+    return ps_task;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Get sockaddr, IPv4 or IPv6:                                                */
+/*                                                                            */
+void *get_in_addr
+(
+    struct sockaddr *sa
+)
+{
+    if (sa->sa_family == AF_INET)
+    {
+        return &(((struct sockaddr_in*)sa)->sin_addr);
+    }
+
+    return &(((struct sockaddr_in6*)sa)->sin6_addr);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Open a listening socket on the specified port:                             */
+/*                                                                            */
+int open_a_socket
+(
+    char *nc_port,   /* in   - Port to use for connection                     */
+    int    i_backlog /* in   - Number of pending connections queue will hold  */
+)
+{
+    struct addrinfo *ps_address;
+    int               i_errno;
+    struct addrinfo   s_hints;
+    int               i_rv;
+    struct addrinfo *ps_servinfo;
+    int               i_sockfd;
+    int               i_yes;
+/*                                                                            */
+/* Get a list of possible connections:                                        */
+/*                                                                            */
+    memset(&s_hints, 0, sizeof(s_hints));
+    s_hints.ai_family = AF_UNSPEC;
+    s_hints.ai_socktype = SOCK_STREAM;
+    s_hints.ai_flags = AI_PASSIVE; // use my IP
+
+    i_rv = getaddrinfo(NULL, nc_port, &s_hints, &ps_servinfo);
+
+    if (i_rv != 0)
+    {
+        fprintf(stderr, "getaddrinfo failed with code %d.\n", i_rv);
+        fprintf(stderr, "%s\n", gai_strerror(i_rv));
+
+        return -1;
+    }
+/*                                                                            */
+/* Loop through all the results and bind to the first we can:                 */
+/*                                                                            */
+    i_sockfd = -1;
+
+    for (ps_address = ps_servinfo;
+        ps_address != NULL;
+        ps_address = ps_address->ai_next)
+    {
+        /* Attempt to open the socket:                                                */
+        i_sockfd = socket(ps_address->ai_family, ps_address->ai_socktype,
+            ps_address->ai_protocol);
+
+        if (i_sockfd == -1)
+        {
+            continue;
+        }
+        /* Allow reuse of the socket:                                                 */
+        i_yes = 1;
+        errno = 0;
+        i_rv = setsockopt(i_sockfd, SOL_SOCKET, SO_REUSEADDR, &i_yes,
+            sizeof(int));
+        i_errno = errno;
+
+        if (i_rv == -1)
+        {
+            report_error("setsockopt", i_errno);
+            close(i_sockfd);
+            freeaddrinfo(ps_servinfo);
+
+            return -1;
+        }
+        /* Bind to the socket:                                                        */
+        i_rv = bind(i_sockfd, ps_address->ai_addr, ps_address->ai_addrlen);
+
+        if (i_rv == -1)
+        {
+            close(i_sockfd);
+
+            continue;
+        }
+
+        break;
+    }
+/*                                                                            */
+/* All done with this structure:                                              */
+/*                                                                            */
+    freeaddrinfo(ps_servinfo);
+/*                                                                            */
+/* Check for a connection:                                                    */
+/*                                                                            */
+    if (ps_address == NULL)
+    {
+        fprintf(stderr, "server failed to bind to a socket.\n");
+
+        return -1;
+    }
+/*                                                                            */
+/* Tell the connection to listen for incoming traffic:                        */
+/*                                                                            */
+    errno = 0;
+    i_rv = listen(i_sockfd, i_backlog);
+    i_errno = errno;
+
+    if (i_rv == -1)
+    {
+        report_error("listen", i_errno);
+        close(i_sockfd);
+
+        return -1;
+    }
+/*                                                                            */
+/* Successful so return the socket:                                           */
+/*                                                                            */
+    return i_sockfd;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Take the oldest queued task, waiting for one if the ring is empty.         */
+/* Returns it, or NULL once the server is stopping and the ring is empty:     */
+/*                                                                            */
+struct task *queue_pop
+(
+    struct server *ps_server /* both - Server holding the ring                */
+)
+{
+    struct task *ps_task;
+
+    pthread_mutex_lock(&ps_server->s_lock);
+
+    while (ps_server->i_count == 0 && !ps_server->i_stop)
+    {
+        pthread_cond_wait(&ps_server->s_not_empty, &ps_server->s_lock);
+    }
+
+    if (ps_server->i_count == 0)
+    {
+        pthread_mutex_unlock(&ps_server->s_lock);
+
+        return NULL;
+    }
+
+    ps_task = ps_server->nps_queue[ps_server->i_head];
+    ps_server->i_head = (ps_server->i_head + 1) % ps_server->i_queue_size;
+    ps_server->i_count--;
+    ps_server->l_served++;
+
+    pthread_cond_signal(&ps_server->s_not_full);
+    pthread_mutex_unlock(&ps_server->s_lock);
+
+    return ps_task;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Queue an accepted connection for the workers, waiting for a slot if the    */
+/* ring is full.  Returns 0, or -1 if the server is stopping:                 */
+/*                                                                            */
+int queue_push
+(
+    struct server *ps_server, /* both - Server holding the ring               */
+    struct task   *ps_task    /* in   - Task a worker should run              */
+)
+{
+    pthread_mutex_lock(&ps_server->s_lock);
+
+    if (ps_server->i_count == ps_server->i_queue_size)
+    {
+        ps_server->l_full++;
+    }
+
+    while (ps_server->i_count == ps_server->i_queue_size &&
+        !ps_server->i_stop)
+    {
+        pthread_cond_wait(&ps_server->s_not_full, &ps_server->s_lock);
+    }
+
+    if (ps_server->i_stop)
+    {
+        pthread_mutex_unlock(&ps_server->s_lock);
+
+        return -1;
+    }
+
+    ps_server->nps_queue[(ps_server->i_head + ps_server->i_count) %
+        ps_server->i_queue_size] = ps_task;
+    ps_server->i_count++;
+
+    pthread_cond_signal(&ps_server->s_not_empty);
+    pthread_mutex_unlock(&ps_server->s_lock);
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Report a failed call and the message for its errno:                        */
+/*                                                                            */
+void report_error
+(
+    char *nc_function, /* in   - Function that failed                         */
+    int    i_errno     /* in   - errno it left behind                         */
+)
+{
+    fprintf(stderr, "%s failed with code %d.\n", nc_function, i_errno);
+    fprintf(stderr, "%s\n", strerror(i_errno));
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Release what main and steal_open set up, however far they got:             */
+/*                                                                            */
+void server_close
+(
+    struct server *ps_server /* both - Server to tear down                    */
+)
+{
+    int i_lc;
+
+    for (i_lc = 0; ps_server->ns_workers != NULL &&
+        i_lc < ps_server->i_workers; i_lc++)
+    {
+        free(ps_server->ns_workers[i_lc].s_deque.nps_tasks);
+
+        if (ps_server->ns_workers[i_lc].i_epfd != -1)
+        {
+            close(ps_server->ns_workers[i_lc].i_epfd);
+        }
+    }
+
+    if (ps_server->i_wake_fd != -1)
+    {
+        close(ps_server->i_wake_fd);
+    }
+
+    if (ps_server->i_listener != -1)
+    {
+        close(ps_server->i_listener);
+    }
+
+    free(ps_server->nps_queue);
+    free(ps_server->nt_workers);
+    free(ps_server->ns_workers);
+
+    pthread_cond_destroy(&ps_server->s_not_full);
+    pthread_cond_destroy(&ps_server->s_not_empty);
+    pthread_mutex_destroy(&ps_server->s_lock);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Set up -s steal: the wake descriptor, a non-blocking listener, since the   */
+/* workers accept for themselves and must not block doing it, and for each    */
+/* worker a deque and an epoll set to sleep in.  A deque indexes its slots    */
+/* with a mask, so it has a power of two of them.  The listener and the wake  */
+/* descriptor go into every epoll set with EPOLLEXCLUSIVE, so a connection or */
+/* a wakeup rouses one sleeping worker, not all of them.  Returns 0, or -1    */
+/* with what was set up left for server_close:                                */
+/*                                                                            */
+int steal_open
+(
+    struct server *ps_server /* both - Server to set up                       */
+)
+{
+    struct epoll_event  s_event;
+    struct worker      *ps_worker;
+    int                  i_lc;
+    int                  i_slots;
+    int                  i_status;
+
+    for (i_slots = 1; i_slots < ps_server->i_queue_size; i_slots *= 2)
+    {
+        ;
+    }
+
+    ps_server->ns_workers = aligned_alloc(64,
+        sizeof(struct worker) * ps_server->i_workers);
+
+    if (ps_server->ns_workers == NULL)
+    {
+        fprintf(stderr, "server: out of memory.\n");
+
+        return -1;
+    }
+
+    memset(ps_server->ns_workers, 0,
+        sizeof(struct worker) * ps_server->i_workers);
+
+    for (i_lc = 0; i_lc < ps_server->i_workers; i_lc++)
+    {
+        ps_worker = &ps_server->ns_workers[i_lc];
+        ps_worker->ps_server = ps_server;
+        ps_worker->i_index = i_lc;
+        ps_worker->i_epfd = -1;
+        ps_worker->u_seed = i_lc + 1;
+        ps_worker->s_deque.l_mask = i_slots - 1;
+    }
+
+    ps_server->i_wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK |
+        EFD_SEMAPHORE);
+
+    if (ps_server->i_wake_fd == -1)
+    {
+        report_error("eventfd", errno);
+
+        return -1;
+    }
+
+    if (fcntl(ps_server->i_listener, F_SETFL, O_NONBLOCK) == -1)
+    {
+        report_error("fcntl", errno);
+
+        return -1;
+    }
+
+    for (i_lc = 0; i_lc < ps_server->i_workers; i_lc++)
+    {
+        ps_worker = &ps_server->ns_workers[i_lc];
+        ps_worker->s_deque.nps_tasks = malloc(sizeof(struct task*) * i_slots);
+
+        if (ps_worker->s_deque.nps_tasks == NULL)
+        {
+            fprintf(stderr, "server: out of memory.\n");
+
+            return -1;
+        }
+
+        ps_worker->i_epfd = epoll_create1(EPOLL_CLOEXEC);
+
+        if (ps_worker->i_epfd == -1)
+        {
+            report_error("epoll_create1", errno);
+
+            return -1;
+        }
+
+        memset(&s_event, 0, sizeof(s_event));
+        s_event.events = EPOLLIN | EPOLLEXCLUSIVE;
+        s_event.data.fd = ps_server->i_listener;
+        i_status = epoll_ctl(ps_worker->i_epfd, EPOLL_CTL_ADD,
+            ps_server->i_listener, &s_event);
+
+        if (i_status == 0)
+        {
+            s_event.data.fd = ps_server->i_wake_fd;
+            i_status = epoll_ctl(ps_worker->i_epfd, EPOLL_CTL_ADD,
+                ps_server->i_wake_fd, &s_event);
+        }
+
+        if (i_status == -1)
+        {
+            report_error("epoll_ctl", errno);
+
+            return -1;
+        }
+    }
+
+    return 0;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Stealing worker thread (-s steal).  Run the worker's own tasks newest      */
+/* first, then steal the oldest from the others, then accept more, and sleep  */
+/* only when all three come up empty.  Once the server is stopping it runs    */
+/* what is left and exits:                                                    */
+/*                                                                            */
+void *steal_thread
+(
+    void *p_arg /* both - The worker                                          */
+)
+{
+    struct task   *ps_task;
+    struct worker *ps_worker;
+
+    ps_worker = (struct worker*)p_arg;
+
+    for (;;)
+    {
+        ps_task = deque_pop(&ps_worker->s_deque);
+
+        if (ps_task == NULL)
+        {
+            ps_task = worker_steal(ps_worker);
+        }
+
+        if (ps_task != NULL)
+        {
+            ps_worker->l_run++;
+            ps_task->pf_run(ps_task);
+            free(ps_task);
+
+            continue;
+        }
+
+        if (__atomic_load_n(&ps_worker->ps_server->i_stop, __ATOMIC_SEQ_CST))
+        {
+            break;
+        }
+
+        if (worker_accept(ps_worker) == 0)
+        {
+            worker_sleep(ps_worker);
+        }
+    }
+
+    return NULL;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Make a task for an accepted connection and say where it came from.         */
+/* Returns the task, or NULL if there is no memory and the socket is closed:  */
+/*                                                                            */
+struct task *task_new
+(
+    struct server           *ps_server, /* both - Server that accepted it     */
+    int                       i_fd,     /* in   - The client's socket         */
+    struct sockaddr_storage *ps_client  /* in   - The client's address        */
+)
+{
+    char         ac_client[INET6_ADDRSTRLEN];
+    struct task *ps_task;
+
+    if (!ps_server->i_quiet)
+    {
+        printf("Got connection from %s\n",
+            inet_ntop(ps_client->ss_family,
+                get_in_addr((struct sockaddr*)ps_client),
+                ac_client, sizeof(ac_client)));
+    }
+
+    ps_task = malloc(sizeof(struct task));
+
+    if (ps_task == NULL)
+    {
+        fprintf(stderr, "server: no memory for a connection.\n");
+        close(i_fd);
+
+        return NULL;
+    }
+
+    ps_task->pf_run = thread_function;
+    ps_task->ps_server = ps_server;
+    ps_task->i_fd = i_fd;
+    ps_task->i_slow = ps_server->i_slow_every > 0 &&
+        __atomic_add_fetch(&ps_server->l_accepted, 1, __ATOMIC_RELAXED) %
+        ps_server->i_slow_every == 0;
+
+    return ps_task;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* The task for a connection: send the response to the client and close its   */
+/* socket.  A slow one (-d) first waits, as a handler blocked on something    */
+/* else would.  Returns 0, or 1 if the send failed:                           */
+/*                                                                            */
+int thread_function
+(
+    struct task *ps_task /* in   - Connection to serve                        */
+)
+{
+    int              i_exit_code;
+    int              i_status;
+    struct timespec  s_delay;
+/*                                                                            */
+/* A slow handler:                                                            */
+/*                                                                            */
+    if (ps_task->i_slow)
+    {
+        s_delay.tv_sec = ps_task->ps_server->l_slow_usec / 1000000;
+        s_delay.tv_nsec = ps_task->ps_server->l_slow_usec % 1000000 * 1000;
+        nanosleep(&s_delay, NULL);
+    }
+/*                                                                            */
+/* Send the message to the client:                                            */
+/*                                                                            */
+    i_exit_code = 0;
+    errno = 0;
+    i_status = send(ps_task->i_fd, "Hello, world!", 13, MSG_NOSIGNAL);
+
+    if (i_status == -1)
+    {
+        report_error("send", errno);
+
+        i_exit_code = 1;
+    }
+/*                                                                            */
+/* Close the client's socket:                                                 */
+/*                                                                            */
+    close(ps_task->i_fd); // No longer needed
+
+    return i_exit_code;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Accept up to ACCEPT_BATCH connections onto a stealing worker's own deque,  */
+/* as many as it has room for.  If it took more than it can run at once, an   */
+/* idle worker is woken to steal some.  Returns how many it took:             */
+/*                                                                            */
+int worker_accept
+(
+    struct worker *ps_worker /* both - Worker doing the accepting             */
+)
+{
+    struct deque            *ps_deque;
+    struct server           *ps_server;
+    struct task             *ps_task;
+    struct sockaddr_storage  s_client; // client's address information
+    socklen_t                sl_size;
+    int                      i_count;
+    int                      i_errno;
+    int                      i_new_fd;
+
+    ps_deque = &ps_worker->s_deque;
+    ps_server = ps_worker->ps_server;
+    i_count = 0;
+
+    while (i_count < ACCEPT_BATCH &&
+        ps_deque->l_bottom - __atomic_load_n(&ps_deque->l_top,
+        __ATOMIC_ACQUIRE) <= ps_deque->l_mask)
+    {
+        sl_size = sizeof(s_client);
+        errno = 0;
+        i_new_fd = accept4(ps_server->i_listener, (struct sockaddr*)&s_client,
+            &sl_size, SOCK_CLOEXEC);
+        i_errno = errno;
+
+        if (i_new_fd == -1)
+        {
+            if (i_errno == ECONNABORTED || i_errno == EINTR)
+            {
+                continue;
+            }
+
+            if (i_errno != EAGAIN && i_errno != EWOULDBLOCK &&
+                !__atomic_load_n(&ps_server->i_stop, __ATOMIC_SEQ_CST))
+            {
+                report_error("accept", i_errno);
+            }
+
+            break;
+        }
+
+        ps_task = task_new(ps_server, i_new_fd, &s_client);
+
+        if (ps_task != NULL)
+        {
+            deque_push(ps_deque, ps_task); // there is room, checked above
+            i_count++;
+        }
+    }
+
+    if (i_count > 1)
+    {
+        worker_wake(ps_server);
+    }
+
+    return i_count;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Put an idle stealing worker to sleep until the listener is readable or a   */
+/* worker with tasks to spare writes the wake descriptor.  It waits in its    */
+/* own epoll set, where both are EPOLLEXCLUSIVE, so each connection or wakeup */
+/* rouses one sleeper.  i_sleeping goes up before the last look at the deques */
+/* and a pusher looks at i_sleeping after its push, both sequentially         */
+/* consistent, so one of the two always sees the other and a task is never    */
+/* left waiting for the next connection:                                      */
+/*                                                                            */
+void worker_sleep
+(
+    struct worker *ps_worker /* both - Worker with nothing to do              */
+)
+{
+    struct epoll_event  as_events[2];
+    struct server      *ps_server;
+    struct deque       *ps_deque;
+    int                  i_event;
+    int                  i_events;
+    int                  i_lc;
+    uint64_t             u64_wake;
+
+    ps_server = ps_worker->ps_server;
+
+    __atomic_add_fetch(&ps_server->i_sleeping, 1, __ATOMIC_SEQ_CST);
+
+    for (i_lc = 0; i_lc < ps_server->i_workers; i_lc++)
+    {
+        ps_deque = &ps_server->ns_workers[i_lc].s_deque;
+
+        if (__atomic_load_n(&ps_deque->l_bottom, __ATOMIC_SEQ_CST) >
+            __atomic_load_n(&ps_deque->l_top, __ATOMIC_SEQ_CST))
+        {
+            break;
+        }
+    }
+
+    if (i_lc == ps_server->i_workers &&
+        !__atomic_load_n(&ps_server->i_stop, __ATOMIC_SEQ_CST))
+    {
+        i_events = epoll_wait(ps_worker->i_epfd, as_events, 2, -1);
+
+        for (i_event = 0; i_event < i_events; i_event++)
+        {
+            if (as_events[i_event].data.fd == ps_server->i_wake_fd &&
+                read(ps_server->i_wake_fd, &u64_wake, sizeof(u64_wake)) == -1)
+            {
+                ; // another sleeper took the wakeup; look for work anyway
+            }
+        }
+    }
+
+    __atomic_sub_fetch(&ps_server->i_sleeping, 1, __ATOMIC_SEQ_CST);
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Steal a task for an idle worker, trying every other worker once from a     */
+/* random one on, and again while a steal lost a race.  A thief that leaves   */
+/* the victim with more wakes another idle worker, so a busy worker's backlog */
+/* is spread out one wakeup at a time.  Returns the task or NULL:             */
+/*                                                                            */
+struct task *worker_steal
+(
+    struct worker *ps_worker /* both - Worker looking for work                */
+)
+{
+    struct deque  *ps_victim;
+    struct server *ps_server;
+    struct task   *ps_task;
+    int             i_first;
+    int             i_lc;
+    int             i_retry;
+
+    ps_server = ps_worker->ps_server;
+
+    do
+    {
+        i_retry = 0;
+        ps_worker->u_seed = ps_worker->u_seed * 1103515245 + 12345;
+        i_first = (int)((ps_worker->u_seed >> 16) % ps_server->i_workers);
+
+        for (i_lc = 0; i_lc < ps_server->i_workers; i_lc++)
+        {
+            ps_victim = &ps_server->ns_workers[(i_first + i_lc) %
+                ps_server->i_workers].s_deque;
+
+            if (ps_victim == &ps_worker->s_deque)
+            {
+                continue;
+            }
+
+            ps_task = deque_steal(ps_victim);
+
+            if (ps_task == STEAL_RETRY)
+            {
+                i_retry = 1;
+            }
+            else if (ps_task != NULL)
+            {
+                ps_worker->l_stolen++;
+
+                if (__atomic_load_n(&ps_victim->l_bottom, __ATOMIC_ACQUIRE) >
+                    __atomic_load_n(&ps_victim->l_top, __ATOMIC_ACQUIRE))
+                {
+                    worker_wake(ps_server);
+                }
+
+                return ps_task;
+            }
+        }
+    } while (i_retry);
+
+    return NULL;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Worker thread (-s shared): run queued tasks until the server stops and the */
+/* ring is empty:                                                             */
+/*                                                                            */
+void *worker_thread
+(
+    void *p_arg /* both - The server                                          */
+)
+{
+    struct server *ps_server;
+    struct task   *ps_task;
+
+    ps_server = (struct server*)p_arg;
+
+    while ((ps_task = queue_pop(ps_server)) != NULL)
+    {
+        ps_task->pf_run(ps_task);
+        free(ps_task);
+    }
+
+    return NULL;
+}
+/*                                                                            */
+/******************************************************************************/
+/*                                                                            */
+/* Wake one sleeping stealing worker, if there is one:                        */
+/*                                                                            */
+void worker_wake
+(
+    struct server *ps_server /* both - Server whose workers may be asleep     */
+)
+{
+    uint64_t u64_one;
+
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&ps_server->i_sleeping, __ATOMIC_SEQ_CST) > 0)
+    {
+        u64_one = 1;
+
+        if (write(ps_server->i_wake_fd, &u64_one, sizeof(u64_one)) == -1)
+        {
+            report_error("write", errno);
+        }
+    }
+}